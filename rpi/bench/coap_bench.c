@@ -0,0 +1,255 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  coap_bench.c
+ *    Description:  CoAP endpoint throughput over loopback with the pipeline stubbed.
+ *                  用法：coap_bench [请求数] [batch]
+ *                  直接包含 coap_server.c，服务线程收发真实的 UDP 报文，pipeline_submit 只计数。
+ *                  客户端每次 sendmmsg 64 个 POST /t/node1（"HR:72,SpO2:98"）：CON 等齐这一组
+ *                  ACK 再发下一组，NON 只发送，收到的报文数取自服务端统计。
+ *                  去重缓存只能容纳 COAP_DEDUP_BUCKETS * COAP_DEDUP_WAYS 个 EXCHANGE_LIFETIME 内
+ *                  的请求，超出后回复 5.03；客户端每发半个缓存的请求就把服务端时钟拨快一个
+ *                  EXCHANGE_LIFETIME，让旧条目过期，测得的是正常处理的吞吐量。
+ *                  依次测 batch 为参数值（默认 COAP_BATCH_MAX）和 1，对比 recvmmsg 批量接收的效果。
+ *
+ *        Version:  1.0.0(2025年09月16日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月16日 15时20分33秒"
+ *
+ ********************************************************************************/
+
+#define _GNU_SOURCE     //recvmmsg / sendmmsg，须在所有系统头文件之前
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static volatile long long	clock_skip_ms;     //服务端时钟拨快的毫秒数
+
+static int bench_clock_gettime(clockid_t clk, struct timespec *ts)
+{
+	long long	skip = __atomic_load_n(&clock_skip_ms, __ATOMIC_RELAXED);
+	int			rv;
+
+	rv = clock_gettime(clk, ts);
+	ts->tv_sec += skip / 1000;
+	return rv;
+}
+
+#define clock_gettime	bench_clock_gettime
+#include "../src/coap_server.c"
+#undef clock_gettime
+
+
+#define BENCH_PORT			56830
+#define BENCH_NODE			"node1"
+#define BENCH_SAMPLE		"HR:72,SpO2:98"
+#define BENCH_GROUP			64
+#define BENCH_ROUND			(COAP_DEDUP_BUCKETS * COAP_DEDUP_WAYS / 2)
+#define BENCH_ACK_TIMEOUT	1          //秒，CON 等 ACK 的最长时间
+
+volatile int	keep_running = 1;
+
+static unsigned long	submitted;
+
+
+//流水线只计数
+int pipeline_submit(const char *path, const char *raw, size_t len)
+{
+	__atomic_add_fetch(&submitted, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+
+int subdev_add_node(const char *device_id)
+{
+	return SUBDEV_MAX;
+}
+
+
+int subdev_is_node(int index)
+{
+	return 1;
+}
+
+
+static double now_sec(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+//POST /t/node1，负载一个采样
+static int build_post(uint8_t *p, int con, uint16_t mid)
+{
+	int		off = 0;
+
+	p[off++] = (COAP_VERSION << 6) | ((con ? COAP_CON : COAP_NON) << 4) | 2;
+	p[off++] = CODE_POST;
+	p[off++] = mid >> 8;
+	p[off++] = mid & 0xff;
+	p[off++] = 't';
+	p[off++] = 'k';
+	p[off++] = (OPT_URI_PATH << 4) | 1;
+	p[off++] = 't';
+	p[off++] = (0 << 4) | (sizeof(BENCH_NODE) - 1);
+	memcpy(p + off, BENCH_NODE, sizeof(BENCH_NODE) - 1);
+	off += sizeof(BENCH_NODE) - 1;
+	p[off++] = 0xff;
+	memcpy(p + off, BENCH_SAMPLE, sizeof(BENCH_SAMPLE) - 1);
+	off += sizeof(BENCH_SAMPLE) - 1;
+	return off;
+}
+
+
+//等服务端把已到达的报文处理完：统计 20ms 内不再变化
+static void wait_idle(coap_server_stats_t *st)
+{
+	uint64_t	last;
+
+	coap_server_get_stats(st);
+	do {
+		last = st->datagrams;
+		usleep(20000);
+		coap_server_get_stats(st);
+	} while(st->datagrams != last);
+}
+
+
+static int run(int fd, long count, int con, int batch)
+{
+	static uint8_t		out[BENCH_GROUP][64];
+	static uint8_t		in[BENCH_GROUP][COAP_RESP_MAX];
+	struct mmsghdr		out_msgs[BENCH_GROUP], in_msgs[BENCH_GROUP];
+	struct iovec		out_iov[BENCH_GROUP], in_iov[BENCH_GROUP];
+	struct timespec		timeout = { BENCH_ACK_TIMEOUT, 0 };
+	coap_server_stats_t	before, after;
+	static uint16_t		mid;
+	double				t0, elapsed;
+	long				sent = 0, changed = 0, since_skip = 0;
+	int					n, k, r, want;
+	int					i;
+
+	pthread_mutex_lock(&C.lock);
+	C.config.batch = batch;
+	pthread_mutex_unlock(&C.lock);
+	wait_idle(&before);
+
+	t0 = now_sec();
+	while(sent < count)
+	{
+		n = count - sent < BENCH_GROUP ? count - sent : BENCH_GROUP;
+		memset(out_msgs, 0, sizeof(out_msgs));
+		for(i = 0; i < n; i++)
+		{
+			out_iov[i].iov_base = out[i];
+			out_iov[i].iov_len = build_post(out[i], con, mid++);
+			out_msgs[i].msg_hdr.msg_iov = &out_iov[i];
+			out_msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		if((k = sendmmsg(fd, out_msgs, n, 0)) <= 0)
+		{
+			perror("sendmmsg");
+			return -1;
+		}
+		sent += k;
+
+		if(con)
+		{
+			for(want = k; want > 0; want -= r)
+			{
+				memset(in_msgs, 0, sizeof(in_msgs));
+				for(i = 0; i < BENCH_GROUP; i++)
+				{
+					in_iov[i].iov_base = in[i];
+					in_iov[i].iov_len = sizeof(in[i]);
+					in_msgs[i].msg_hdr.msg_iov = &in_iov[i];
+					in_msgs[i].msg_hdr.msg_iovlen = 1;
+				}
+				if((r = recvmmsg(fd, in_msgs, BENCH_GROUP, MSG_WAITFORONE, &timeout)) <= 0)
+					break;
+				for(i = 0; i < r; i++)
+				{
+					if(((in[i][0] >> 4) & 0x03) == COAP_ACK && in[i][1] == CODE_CHANGED)
+						changed++;
+				}
+			}
+		}
+		else if((sent / BENCH_GROUP) % 16 == 0)
+		{
+			usleep(50);   //轻微限速，不让套接字缓冲区成为唯一的瓶颈
+		}
+
+		//半个去重缓存的请求之后拨快服务端时钟，之前的条目全部过期
+		if((since_skip += k) >= BENCH_ROUND)
+		{
+			__atomic_add_fetch(&clock_skip_ms, COAP_DEDUP_MS, __ATOMIC_RELAXED);
+			since_skip = 0;
+		}
+	}
+	elapsed = now_sec() - t0;
+	wait_idle(&after);
+
+	printf("%-4s %6d %12.0f %11.1f %10lu %10llu %9llu %9llu\n", con ? "CON" : "NON", batch, sent / elapsed,
+			after.batches > before.batches ? (double)(after.datagrams - before.datagrams) / (after.batches - before.batches) : 0,
+			changed, (unsigned long long)(after.samples - before.samples),
+			(unsigned long long)(after.deferred - before.deferred),
+			(unsigned long long)(sent - (long)(after.datagrams - before.datagrams)));
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	coap_server_config_t	config = { .enabled = 1, .port = BENCH_PORT, .batch = COAP_BATCH_MAX };
+	struct sockaddr_in		addr;
+	pthread_t				tid;
+	long					count = 500000;
+	int						rcvbuf = 4 << 20;
+	int						fd;
+	int						con;
+
+	if(argc > 1)
+		count = atol(argv[1]);
+	if(argc > 2)
+		config.batch = atoi(argv[2]);
+	if(count <= 0 || config.batch <= 0 || config.batch > COAP_BATCH_MAX)
+	{
+		fprintf(stderr, "usage: %s [requests] [batch 1-%d]\n", argv[0], COAP_BATCH_MAX);
+		return 1;
+	}
+
+	if(coap_server_init(&config) != 0 || pthread_create(&tid, NULL, coap_server_thread_func, NULL) != 0)
+		return 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(BENCH_PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		perror("socket");
+		return 1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	printf("%ld request(s) per run, %d per sendmmsg\n", count, BENCH_GROUP);
+	printf("%-4s %6s %12s %11s %10s %10s %9s %9s\n", "type", "batch", "req/s", "dgram/recv", "2.04", "samples", "deferred", "lost");
+	for(con = 1; con >= 0; con--)
+	{
+		if(run(fd, count, con, config.batch) != 0 || run(fd, count, con, 1) != 0)
+			return 1;
+	}
+
+	keep_running = 0;
+	pthread_join(tid, NULL);
+	coap_server_cleanup();
+	close(fd);
+	printf("pipeline_submit called %lu time(s)\n", submitted);
+	return 0;
+}
@@ -0,0 +1,210 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  command_bench.c
+ *    Description:  Downlink command dispatch benchmark: commands/s through the routing step.
+ *                  用法：command_bench [每种命令的条数]
+ *                  "json-c" 一列是改造前 on_message_cb 的做法：strstr 找 request_id，
+ *                  json_tokener_parse 整个负载后取 paras.report；另一列是 topic_router_dispatch
+ *                  分发到处理函数，处理函数用 json_scan_get 原地取 paras.report 和 object_device_id。
+ *                  两种做法都只取出命令内容，不写 BLE、不发布响应；计时前先比较取出的内容。
+ *
+ *        Version:  1.0.0(2025年09月11日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月11日 15时02分26秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <json-c/json.h>
+
+#include "topic_router.h"
+#include "json_scan.h"
+
+
+#define DEVICE_ID			"68a5c3_gateway01"
+#define CMD_MAX				128
+#define ROUNDS				5
+
+typedef struct {
+	const char	*name;
+	const char	*topic_fmt;     //%d 为 request_id 序号
+	const char	*payload;
+} bench_command_t;
+
+//与 IoTDA 下发的格式相同
+static const bench_command_t	commands[] = {
+	{ "command", "$oc/devices/" DEVICE_ID "/sys/commands/request_id=5f1c2a9e-%08d",
+	  "{\"object_device_id\":\"" DEVICE_ID "\",\"command_name\":\"report\",\"service_id\":\"mqtt\",\"paras\":{\"report\":\"LED:ON\"}}" },
+	{ "message", "$oc/devices/" DEVICE_ID "/sys/messages/down#%d",
+	  "{\"object_device_id\":\"" DEVICE_ID "\",\"services\":null,\"paras\":{\"report\":\"RATE:5\"}}" },
+	{ "large", "$oc/devices/" DEVICE_ID "/sys/commands/request_id=9b7d0c31-%08d",
+	  "{\"object_device_id\":\"" DEVICE_ID "\",\"command_name\":\"config\",\"service_id\":\"mqtt\","
+	  "\"paras\":{\"mode\":\"auto\",\"thresholds\":{\"hr\":[50,120],\"spo2\":[90,100]},\"tags\":[\"ward3\",\"bed12\",\"night\"],"
+	  "\"note\":\"escaped \\\"quote\\\" and \\u00e9\",\"report\":\"CFG:HR=120;SPO2=90\"},\"expire_time\":3600}" },
+};
+
+//一次分发取出的内容
+typedef struct {
+	char	request_id[64];
+	char	object_device_id[64];
+	char	cmd[CMD_MAX];
+	int		cmd_len;
+} extracted_t;
+
+
+static double now_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+//改造前：strstr + json_tokener_parse
+static void extract_jsonc(const char *topic, const char *payload, extracted_t *out)
+{
+	json_object		*json_obj;
+	json_object		*paras_obj = NULL;
+	json_object		*report_obj = NULL;
+	json_object		*id_obj = NULL;
+	const char		*p;
+
+	out->request_id[0] = '\0';
+	out->object_device_id[0] = '\0';
+	out->cmd_len = -1;
+
+	if(strstr(topic, "/sys/commands/request_id=") && (p = strstr(topic, "request_id=")))
+		snprintf(out->request_id, sizeof(out->request_id), "%s", p + strlen("request_id="));
+
+	if(!(json_obj = json_tokener_parse(payload)))
+		return ;
+	if(json_object_object_get_ex(json_obj, "object_device_id", &id_obj))
+		snprintf(out->object_device_id, sizeof(out->object_device_id), "%s", json_object_get_string(id_obj));
+	if(json_object_object_get_ex(json_obj, "paras", &paras_obj) && json_object_object_get_ex(paras_obj, "report", &report_obj))
+		out->cmd_len = snprintf(out->cmd, sizeof(out->cmd), "%s", json_object_get_string(report_obj));
+	json_object_put(json_obj);
+}
+
+
+//改造后：路由表分发，处理函数原地取值
+static void scan_fields(const void *payload, int payloadlen, extracted_t *out)
+{
+	json_scan_value_t	val;
+
+	out->object_device_id[0] = '\0';
+	out->cmd_len = -1;
+	if(json_scan_get(payload, payloadlen, "object_device_id", &val) == JSON_SCAN_OK && val.type == JSON_SCAN_STRING)
+		json_scan_unescape(&val, out->object_device_id, sizeof(out->object_device_id));
+	if(json_scan_get(payload, payloadlen, "paras.report", &val) == JSON_SCAN_OK && val.type == JSON_SCAN_STRING)
+		out->cmd_len = json_scan_unescape(&val, out->cmd, sizeof(out->cmd));
+}
+
+
+static void handle_command(const topic_match_t *match, const void *payload, int payloadlen, void *arg)
+{
+	extracted_t	*out = (extracted_t *)arg;
+	int			id_len;
+
+	out->request_id[0] = '\0';
+	id_len = match->len[0] - (int)strlen("request_id=");
+	if(id_len > 0 && id_len < (int)sizeof(out->request_id) &&
+	   strncmp(match->level[0], "request_id=", strlen("request_id=")) == 0)
+	{
+		memcpy(out->request_id, match->level[0] + strlen("request_id="), id_len);
+		out->request_id[id_len] = '\0';
+	}
+	scan_fields(payload, payloadlen, out);
+}
+
+
+static void handle_message(const topic_match_t *match, const void *payload, int payloadlen, void *arg)
+{
+	extracted_t	*out = (extracted_t *)arg;
+
+	out->request_id[0] = '\0';
+	scan_fields(payload, payloadlen, out);
+}
+
+
+static void handle_ignored(const topic_match_t *match, const void *payload, int payloadlen, void *arg)
+{
+}
+
+
+int main(int argc, char **argv)
+{
+	topic_router_t	router;
+	extracted_t		a, b;
+	char			(*topics)[160];
+	double			t0, elapsed[2];
+	int				count = 100000;
+	int				len;
+	int				c, i, r;
+
+	if(argc > 1)
+		count = atoi(argv[1]);
+	if(count <= 0 || !(topics = calloc(count, sizeof(*topics))))
+		return 1;
+
+	//与 mqtt_gateway_init_routes 相同的四条路由
+	topic_router_init(&router);
+	topic_router_add(&router, "$oc/devices/" DEVICE_ID "/sys/commands/+", handle_command, &b);
+	topic_router_add(&router, "$oc/devices/" DEVICE_ID "/sys/messages/down", handle_message, &b);
+	topic_router_add(&router, "$oc/devices/" DEVICE_ID "/sys/properties/get/+", handle_ignored, NULL);
+	topic_router_add(&router, "$oc/devices/" DEVICE_ID "/sys/properties/set/+", handle_ignored, NULL);
+
+	printf("%d command(s) per type, %d round(s)\n", count, ROUNDS);
+	printf("%-8s %7s %14s %14s %9s\n", "type", "bytes", "json-c cmd/s", "router cmd/s", "speedup");
+
+	for(c = 0; c < (int)(sizeof(commands) / sizeof(commands[0])); c++)
+	{
+		//每条命令的 request_id 不同；messages/down 的主题没有 request_id，序号截在 '#' 之前
+		for(i = 0; i < count; i++)
+		{
+			snprintf(topics[i], sizeof(topics[i]), commands[c].topic_fmt, i);
+			topics[i][strcspn(topics[i], "#")] = '\0';
+		}
+		len = (int)strlen(commands[c].payload);
+
+		for(i = 0; i < count; i++)
+		{
+			extract_jsonc(topics[i], commands[c].payload, &a);
+			memset(&b, 0, sizeof(b));
+			if(topic_router_dispatch(&router, topics[i], commands[c].payload, len) <= 0 ||
+			   strcmp(a.request_id, b.request_id) || strcmp(a.object_device_id, b.object_device_id) ||
+			   a.cmd_len != b.cmd_len || a.cmd_len < 0 || strcmp(a.cmd, b.cmd))
+			{
+				fprintf(stderr, "%s: results differ: \"%s\" \"%s\"\n", commands[c].name, a.cmd, b.cmd);
+				return 1;
+			}
+		}
+
+		t0 = now_ns();
+		for(r = 0; r < ROUNDS; r++)
+		{
+			for(i = 0; i < count; i++)
+				extract_jsonc(topics[i], commands[c].payload, &a);
+		}
+		elapsed[0] = now_ns() - t0;
+
+		t0 = now_ns();
+		for(r = 0; r < ROUNDS; r++)
+		{
+			for(i = 0; i < count; i++)
+				topic_router_dispatch(&router, topics[i], commands[c].payload, len);
+		}
+		elapsed[1] = now_ns() - t0;
+
+		printf("%-8s %7d %14.0f %14.0f %8.1fx\n", commands[c].name, len,
+				count * ROUNDS / (elapsed[0] / 1e9), count * ROUNDS / (elapsed[1] / 1e9), elapsed[0] / elapsed[1]);
+	}
+
+	free(topics);
+	return 0;
+}
@@ -0,0 +1,244 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  lane_bench.c
+ *    Description:  Publish path contention benchmark: N producers, one publisher thread.
+ *                  用法：lane_bench [lockfree|mutex] [每个生产者的消息数] [发布耗时us]
+ *                  生产者调用 publish_lane_submit，下行线程调用 publish_lanes_drain，
+ *                  mqtt_publish_tracked 用忙等模拟 mosquitto_publish 的耗时。
+ *                  mutex 模式用一把全局锁包住提交和整个 drain，复现改造前 mqtt_mutex 的行为，
+ *                  两种模式在同一台机器上对比吞吐量和提交时延；生产者数依次为 1/2/4/8。
+ *                  单核上吞吐量只受发布线程限制，结论需要在多核的目标板上运行得到。
+ *
+ *        Version:  1.0.0(2025年09月08日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月08日 11时20分07秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "mqtt_gateway.h"
+#include "publish_lane.h"
+
+
+#define PRODUCERS_MAX		8
+#define LAT_BUCKETS			24        //提交时延直方图：第 i 个桶为 [2^(i-1), 2^i) 微秒
+
+//publish_lane.c 依赖的网关符号
+volatile int	mqtt_connected_flag = 1;
+volatile int	keep_running = 1;
+
+static int				use_mutex;
+static int				publish_us = 5;
+static long				per_producer = 20000;
+static pthread_mutex_t	big_lock = PTHREAD_MUTEX_INITIALIZER;   //模拟 mqtt_mutex
+static volatile int		producers_done;
+static long				published;
+
+typedef struct {
+	int			id;
+	long		full;                 //队列已满被拒绝的次数
+	uint64_t	hist[LAT_BUCKETS];
+	double		max_us;
+} producer_t;
+
+
+static double now_us(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+const char *mqtt_traffic_class_name(int traffic_class)
+{
+	return "telemetry";
+}
+
+
+const char *mosquitto_strerror(int mosq_errno)
+{
+	return "stub";
+}
+
+
+//忙等 publish_us 微秒，模拟 mosquitto_publish 的耗时
+int mqtt_publish_tracked(const char *topic, const void *payload, int payloadlen, int qos, int traffic_class)
+{
+	double	start = now_us();
+
+	while(now_us() - start < publish_us)
+		;
+	published++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static void *producer_func(void *arg)
+{
+	producer_t	*p = (producer_t *)arg;
+	char		payload[48];
+	double		t0, dt;
+	long		sent = 0;
+	int			bucket;
+	int			rc;
+
+	memset(payload, 'x', sizeof(payload));
+	while(sent < per_producer)
+	{
+		t0 = now_us();
+		if(use_mutex)
+			pthread_mutex_lock(&big_lock);
+		rc = publish_lane_submit(MQTT_TRAFFIC_TELEMETRY, "$oc/devices/bench/sys/properties/report", payload, sizeof(payload), 1);
+		if(use_mutex)
+			pthread_mutex_unlock(&big_lock);
+		dt = now_us() - t0;
+
+		for(bucket = 0; bucket < LAT_BUCKETS - 1 && dt >= (double)(1u << bucket); bucket++)
+			;
+		p->hist[bucket]++;
+		if(dt > p->max_us)
+			p->max_us = dt;
+
+		if(rc == MOSQ_ERR_SUCCESS)
+		{
+			sent++;
+		}
+		else
+		{
+			p->full++;
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+
+static void *publisher_func(void *arg)
+{
+	int		n;
+
+	while(!producers_done)
+	{
+		if(use_mutex)
+			pthread_mutex_lock(&big_lock);
+		n = publish_lanes_drain();
+		if(use_mutex)
+			pthread_mutex_unlock(&big_lock);
+		if(!n)
+			sched_yield();
+	}
+	while(publish_lanes_drain())
+		;
+	return NULL;
+}
+
+
+//直方图中第 q 分位所在桶的上界（微秒）
+static unsigned percentile_us(const uint64_t *hist, uint64_t total, double q)
+{
+	uint64_t	acc = 0;
+	int			i;
+
+	for(i = 0; i < LAT_BUCKETS; i++)
+	{
+		acc += hist[i];
+		if(acc >= total * q)
+			return 1u << i;
+	}
+	return 1u << (LAT_BUCKETS - 1);
+}
+
+
+static void run(int nproducers)
+{
+	producer_t	producers[PRODUCERS_MAX];
+	pthread_t	tids[PRODUCERS_MAX];
+	pthread_t	publisher;
+	uint64_t	hist[LAT_BUCKETS];
+	uint64_t	total = 0;
+	double		t0, elapsed, max_us = 0;
+	long		full = 0;
+	int			i, k;
+
+	memset(producers, 0, sizeof(producers));
+	producers_done = 0;
+	published = 0;
+
+	t0 = now_us();
+	pthread_create(&publisher, NULL, publisher_func, NULL);
+	for(i = 0; i < nproducers; i++)
+	{
+		producers[i].id = i;
+		pthread_create(&tids[i], NULL, producer_func, &producers[i]);
+	}
+	for(i = 0; i < nproducers; i++)
+		pthread_join(tids[i], NULL);
+	producers_done = 1;
+	pthread_join(publisher, NULL);
+	elapsed = now_us() - t0;
+
+	memset(hist, 0, sizeof(hist));
+	for(i = 0; i < nproducers; i++)
+	{
+		for(k = 0; k < LAT_BUCKETS; k++)
+		{
+			hist[k] += producers[i].hist[k];
+			total += producers[i].hist[k];
+		}
+		full += producers[i].full;
+		if(producers[i].max_us > max_us)
+			max_us = producers[i].max_us;
+	}
+
+	printf("%-8s %9d %12.3f %9ld %8u %8u %10.0f %9ld\n", use_mutex ? "mutex" : "lockfree", nproducers,
+			published / elapsed, published,
+			percentile_us(hist, total, 0.50), percentile_us(hist, total, 0.99), max_us, full);
+}
+
+
+int main(int argc, char **argv)
+{
+	publish_lanes_config_t	cfg;
+	int						n;
+	int						i;
+
+	if(argc > 1)
+		use_mutex = strcmp(argv[1], "mutex") == 0;
+	if(argc > 2)
+		per_producer = atol(argv[2]);
+	if(argc > 3)
+		publish_us = atoi(argv[3]);
+
+	memset(&cfg, 0, sizeof(cfg));
+	for(i = 0; i < MQTT_TRAFFIC_CLASS_COUNT; i++)
+	{
+		cfg.lanes[i].depth = 64;
+		cfg.lanes[i].weight = 1;
+	}
+	if(publish_lanes_init(&cfg) != 0)
+	{
+		fprintf(stderr, "Failed to initialise publish lanes.\n");
+		return 1;
+	}
+
+	printf("%ld CPU(s) online, %ld message(s) per producer, publish %d us\n",
+			sysconf(_SC_NPROCESSORS_ONLN), per_producer, publish_us);
+	printf("%-8s %9s %12s %9s %8s %8s %10s %9s\n", "mode", "producers", "Mmsg/s", "published",
+			"p50_us", "p99_us", "max_us", "full");
+
+	for(n = 1; n <= PRODUCERS_MAX; n *= 2)
+		run(n);
+
+	return 0;
+}
@@ -0,0 +1,402 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  lite_bench.c
+ *    Description:  Direct-mode publish benchmark: mqtt_lite against libmosquitto over loopback.
+ *                  用法：lite_bench [消息数] [qos]
+ *                  程序内置一个最小的 MQTT 3.1.1 代理线程（只回 CONNACK / PUBACK / PINGRESP），
+ *                  监听 127.0.0.1 的临时端口；客户端与 mqtt_mux 一样用外部 poll 循环驱动
+ *                  read / write / misc，QoS1 在途窗口都是 MQTT_LITE_INFLIGHT_MAX。
+ *                  mqtt_lite 分立即发送和延迟发送（deferred，mux 的用法）两种模式；
+ *                  用 -DWITH_MOSQUITTO 编译并链接 libmosquitto 时再加一行 libmosquitto 的结果
+ *                  （makefile 在找到 mosquitto.h 时生成 bench/lite_bench_mosq）。
+ *
+ *        Version:  1.0.0(2025年09月16日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月16日 10时41分18秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifdef WITH_MOSQUITTO
+#include <mosquitto.h>
+#endif
+
+#include "mqtt_lite.h"
+
+
+#define BROKER_BUF_SIZE		65536
+#define BENCH_TOPIC			"$oc/devices/band01/sys/properties/report"
+#define BENCH_PAYLOAD		"{\"services\":[{\"service_id\":\"band\",\"properties\":{\"hr\":72,\"spo2\":98,\"steps\":1234}}]}"
+#define BENCH_TIMEOUT_MS	30000
+
+typedef struct {
+	const char	*engine;
+	const char	*mode;
+	double		rate;          // msg/s
+	double		per_write;     // 每次 writev 发出的消息数，未知时为 0
+} bench_result_t;
+
+static int		connected;
+static long		acked;
+
+
+static double now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+
+//代理的一个连接：按报文类型回复，PUBLISH 只在 QoS1 时回 PUBACK
+static void *broker_conn(void *arg)
+{
+	int					fd = (int)(long)arg;
+	unsigned char		*in, *out;
+	unsigned char		type, byte, *var;
+	int					len = 0, off, olen;
+	int					remaining, mul, hdr, topic_len;
+	int					n;
+
+	in = malloc(BROKER_BUF_SIZE);
+	out = malloc(BROKER_BUF_SIZE);
+	while(in && out && (n = read(fd, in + len, BROKER_BUF_SIZE - len)) > 0)
+	{
+		len += n;
+		off = 0;
+		olen = 0;
+		while(len - off >= 2)
+		{
+			remaining = 0;
+			mul = 1;
+			hdr = 1;
+			do {
+				if(off + hdr >= len)
+					goto partial;
+				byte = in[off + hdr++];
+				remaining += (byte & 127) * mul;
+				mul *= 128;
+			} while(byte & 128);
+			if(len - off < hdr + remaining)
+				break;
+
+			type = in[off] >> 4;
+			var = in + off + hdr;
+			if(type == 1)                    //CONNECT
+			{
+				memcpy(out + olen, "\x20\x02\x00\x00", 4);
+				olen += 4;
+			}
+			else if(type == 3 && (in[off] >> 1) & 3)   //QoS1 PUBLISH
+			{
+				topic_len = (var[0] << 8) | var[1];
+				out[olen++] = 0x40;
+				out[olen++] = 2;
+				out[olen++] = var[2 + topic_len];
+				out[olen++] = var[3 + topic_len];
+			}
+			else if(type == 12)              //PINGREQ
+			{
+				out[olen++] = 0xd0;
+				out[olen++] = 0;
+			}
+			else if(type == 14)              //DISCONNECT
+			{
+				goto done;
+			}
+			off += hdr + remaining;
+		}
+partial:
+		if(olen > 0 && write(fd, out, olen) != olen)
+			break;
+		memmove(in, in + off, len - off);
+		len -= off;
+	}
+
+done:
+	free(in);
+	free(out);
+	close(fd);
+	return NULL;
+}
+
+
+static void *broker_thread(void *arg)
+{
+	int			listen_fd = (int)(long)arg;
+	pthread_t	tid;
+	int			fd;
+
+	while((fd = accept(listen_fd, NULL, NULL)) >= 0)
+	{
+		if(pthread_create(&tid, NULL, broker_conn, (void *)(long)fd) != 0)
+		{
+			close(fd);
+			continue;
+		}
+		pthread_detach(tid);
+	}
+	return NULL;
+}
+
+
+//在 127.0.0.1 的临时端口上启动代理，返回端口号
+static int broker_start(void)
+{
+	struct sockaddr_in	addr;
+	socklen_t			addrlen = sizeof(addr);
+	pthread_t			tid;
+	int					fd;
+
+	if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0 ||
+	   getsockname(fd, (struct sockaddr *)&addr, &addrlen) < 0 ||
+	   pthread_create(&tid, NULL, broker_thread, (void *)(long)fd) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	pthread_detach(tid);
+	return ntohs(addr.sin_port);
+}
+
+
+static void lite_on_connect(mqtt_lite_t *c, void *userdata, int rc)
+{
+	if(rc == 0)
+		connected = 1;
+}
+
+
+static void lite_on_disconnect(mqtt_lite_t *c, void *userdata, int rc)
+{
+	connected = 0;
+}
+
+
+static void lite_on_publish(mqtt_lite_t *c, void *userdata, int mid)
+{
+	acked++;
+}
+
+
+//mqtt_lite：发布被 WINDOW_FULL 拒绝时等 poll，与 mqtt_mux 的处理相同
+static int run_lite(int port, long count, int qos, int deferred, bench_result_t *res)
+{
+	mqtt_lite_callbacks_t	cb = { lite_on_connect, lite_on_disconnect, NULL, lite_on_publish };
+	mqtt_lite_stats_t		stats;
+	mqtt_lite_t				*c;
+	struct pollfd			pfd;
+	double					t0 = 0, deadline, elapsed;
+	long					sent = 0;
+	int						mid;
+
+	connected = 0;
+	acked = 0;
+	if(!(c = mqtt_lite_new("bench_lite", MQTT_LITE_INFLIGHT_MAX, &cb, NULL)))
+		return -1;
+	mqtt_lite_set_deferred(c, deferred);
+	if(mqtt_lite_connect(c, "127.0.0.1", port, 60) != MQTT_LITE_OK)
+	{
+		mqtt_lite_destroy(c);
+		return -1;
+	}
+
+	deadline = now_ms() + BENCH_TIMEOUT_MS;
+	while(now_ms() < deadline)
+	{
+		if(connected)
+		{
+			if(t0 == 0)
+				t0 = now_ms();
+			while(sent < count && mqtt_lite_publish(c, &mid, BENCH_TOPIC, strlen(BENCH_PAYLOAD), BENCH_PAYLOAD, qos) == MQTT_LITE_OK)
+				sent++;
+			if(qos == 0)
+				acked = sent;
+			if(acked >= count && !mqtt_lite_want_write(c))
+				break;
+		}
+
+		pfd.fd = mqtt_lite_socket(c);
+		pfd.events = POLLIN | (mqtt_lite_want_write(c) ? POLLOUT : 0);
+		pfd.revents = 0;
+		if(pfd.fd < 0 || poll(&pfd, 1, 100) < 0)
+			break;
+		if(pfd.revents & POLLIN)
+			mqtt_lite_read(c);
+		if(pfd.revents & POLLOUT)
+			mqtt_lite_write(c);
+		mqtt_lite_misc(c);
+	}
+
+	elapsed = now_ms() - t0;
+	mqtt_lite_get_stats(c, &stats);
+	mqtt_lite_disconnect(c);
+	mqtt_lite_destroy(c);
+	if(acked < count)
+		return -1;
+
+	res->engine = "mqtt_lite";
+	res->mode = deferred ? "deferred" : "immediate";
+	res->rate = count / (elapsed / 1e3);
+	res->per_write = stats.writev_calls ? (double)count / stats.writev_calls : 0;
+	return 0;
+}
+
+
+#ifdef WITH_MOSQUITTO
+static void mosq_on_connect(struct mosquitto *mosq, void *userdata, int rc)
+{
+	if(rc == 0)
+		connected = 1;
+}
+
+
+static void mosq_on_publish(struct mosquitto *mosq, void *userdata, int mid)
+{
+	acked++;
+}
+
+
+//libmosquitto：外部循环驱动（mosquitto_loop_read / write / misc），QoS1 自己限制在途窗口
+static int run_mosquitto(int port, long count, int qos, bench_result_t *res)
+{
+	struct mosquitto	*mosq;
+	struct pollfd		pfd;
+	double				t0 = 0, deadline, elapsed;
+	long				sent = 0;
+	int					mid;
+
+	connected = 0;
+	acked = 0;
+	mosquitto_lib_init();
+	if(!(mosq = mosquitto_new("bench_mosq", true, NULL)))
+		return -1;
+	mosquitto_connect_callback_set(mosq, mosq_on_connect);
+	mosquitto_publish_callback_set(mosq, mosq_on_publish);
+	mosquitto_max_inflight_messages_set(mosq, MQTT_LITE_INFLIGHT_MAX);
+	if(mosquitto_connect(mosq, "127.0.0.1", port, 60) != MOSQ_ERR_SUCCESS)
+	{
+		mosquitto_destroy(mosq);
+		return -1;
+	}
+
+	deadline = now_ms() + BENCH_TIMEOUT_MS;
+	while(now_ms() < deadline)
+	{
+		if(connected)
+		{
+			if(t0 == 0)
+				t0 = now_ms();
+			while(sent < count && (qos == 0 || sent - acked < MQTT_LITE_INFLIGHT_MAX) &&
+				  mosquitto_publish(mosq, &mid, BENCH_TOPIC, strlen(BENCH_PAYLOAD), BENCH_PAYLOAD, qos, false) == MOSQ_ERR_SUCCESS)
+				sent++;
+			if(qos == 0)
+				acked = sent;
+			if(acked >= count && !mosquitto_want_write(mosq))
+				break;
+		}
+
+		pfd.fd = mosquitto_socket(mosq);
+		pfd.events = POLLIN | (mosquitto_want_write(mosq) ? POLLOUT : 0);
+		pfd.revents = 0;
+		if(pfd.fd < 0 || poll(&pfd, 1, 100) < 0)
+			break;
+		if(pfd.revents & POLLIN)
+			mosquitto_loop_read(mosq, 1);
+		if(pfd.revents & POLLOUT)
+			mosquitto_loop_write(mosq, 1);
+		mosquitto_loop_misc(mosq);
+	}
+
+	elapsed = now_ms() - t0;
+	mosquitto_disconnect(mosq);
+	mosquitto_destroy(mosq);
+	mosquitto_lib_cleanup();
+	if(acked < count)
+		return -1;
+
+	res->engine = "libmosquitto";
+	res->mode = "immediate";
+	res->rate = count / (elapsed / 1e3);
+	res->per_write = 0;
+	return 0;
+}
+#endif
+
+
+static void print_result(const bench_result_t *res)
+{
+	if(res->per_write > 0)
+		printf("%-13s %-10s %12.0f %10.2f\n", res->engine, res->mode, res->rate, res->per_write);
+	else
+		printf("%-13s %-10s %12.0f %10s\n", res->engine, res->mode, res->rate, "-");
+}
+
+
+int main(int argc, char **argv)
+{
+	bench_result_t	res;
+	long			count = 200000;
+	int				qos = 1;
+	int				port;
+	int				deferred;
+
+	if(argc > 1)
+		count = atol(argv[1]);
+	if(argc > 2)
+		qos = atoi(argv[2]);
+	if(count <= 0 || (qos != 0 && qos != 1))
+	{
+		fprintf(stderr, "usage: %s [messages] [0|1]\n", argv[0]);
+		return 1;
+	}
+
+	if((port = broker_start()) < 0)
+	{
+		fprintf(stderr, "Broker start failed.\n");
+		return 1;
+	}
+
+	printf("%ld x %d-byte publish(es), qos %d, loopback broker on port %d\n", count, (int)strlen(BENCH_PAYLOAD), qos, port);
+	printf("%-13s %-10s %12s %10s\n", "engine", "mode", "msg/s", "msg/write");
+
+#ifdef WITH_MOSQUITTO
+	if(run_mosquitto(port, count, qos, &res) != 0)
+	{
+		fprintf(stderr, "libmosquitto run failed.\n");
+		return 1;
+	}
+	print_result(&res);
+#endif
+
+	for(deferred = 0; deferred <= 1; deferred++)
+	{
+		if(run_lite(port, count, qos, deferred, &res) != 0)
+		{
+			fprintf(stderr, "mqtt_lite run failed.\n");
+			return 1;
+		}
+		print_result(&res);
+	}
+
+	return 0;
+}
@@ -0,0 +1,189 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  rate_sim.c
+ *    Description:  Adaptive sampling rate simulation: backlog and BLE samples with and
+ *                  without rate_ctl, on a simulated clock.
+ *                  用法：rate_sim [运行秒数]
+ *                  直接包含 rate_ctl.c，用模拟时钟替换 clock_gettime；速率命令在下一秒写入成功
+ *                  （设备链路断开时失败），写入成功后设备才按新间隔采样。
+ *                  场景：8 个手环，默认 1 秒采样，上行能力 10 条/秒；t=600~1500 MQTT 断开，
+ *                  t=2400~2700 上行降到 6 条/秒，手环 3 在 t=1000~1060 告警，
+ *                  手环 5 在 t=1200~1260 离开范围并重启（恢复默认间隔）。
+ *
+ *        Version:  1.0.0(2025年09月10日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月10日 14时36分52秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static long long	sim_ms;
+
+static int sim_clock_gettime(clockid_t clk, struct timespec *ts)
+{
+	ts->tv_sec = sim_ms / 1000;
+	ts->tv_nsec = (sim_ms % 1000) * 1000000;
+	return 0;
+}
+
+#define clock_gettime	sim_clock_gettime
+#include "../src/rate_ctl.c"
+#undef clock_gettime
+
+
+#define BANDS				8
+#define DEFAULT_INTERVAL	1       //手环启动后的采样间隔
+#define UPLINK_RATE			10      //上行能力（条/秒）
+#define ALERT_BAND			3
+#define REBOOT_BAND			5
+
+static struct {
+	int		interval;     //手环实际的采样间隔
+	int		link_up;
+	int		cmd;          //等待写入的速率命令，0 表示没有
+} bands[BANDS];
+
+static int	commands;
+
+
+//速率命令进入命令队列，下一秒写入
+int cmd_job_submit_property(const char *device_path, int kind, const char *request_id, const char *ble_cmd, size_t len, uint32_t mask, int ttl_ms)
+{
+	bands[atoi(device_path + 1)].cmd = (int)mask;
+	commands++;
+	return 0;
+}
+
+
+void link_watch_set_interval(const char *device_path, int interval_ms)
+{
+}
+
+
+static void set_link(int band, int up)
+{
+	char	path[8];
+
+	snprintf(path, sizeof(path), "/%d", band);
+	bands[band].link_up = up;
+	rate_ctl_set_link(path, up);
+}
+
+
+static void run(int adaptive, int seconds)
+{
+	rate_ctl_config_t	cfg = { adaptive, 1, 5, 1, 200, 50, 30, 60, 120, "RATE:%d" };
+	rate_ctl_input_t	in;
+	rate_ctl_stats_t	st;
+	char				path[8];
+	long				backlog = 0, peak = 0, samples = 0;
+	int					drained = -1;
+	int					restored = -1;
+	int					state = RATE_CTL_NORMAL, changes = 0;
+	int					connected, uplink;
+	int					interval, ok;
+	int					t, i;
+
+	memset(bands, 0, sizeof(bands));
+	commands = 0;
+	sim_ms = 0;
+	rate_ctl_init(&cfg);
+	for(i = 0; i < BANDS; i++)
+	{
+		snprintf(path, sizeof(path), "/%d", i);
+		rate_ctl_add_device(path);
+		bands[i].interval = DEFAULT_INTERVAL;
+		set_link(i, 1);
+	}
+
+	for(t = 0; t < seconds; t++)
+	{
+		sim_ms = (long long)t * 1000;
+
+		//上一秒提交的速率命令写入设备
+		for(i = 0; i < BANDS; i++)
+		{
+			if(!(interval = bands[i].cmd))
+				continue;
+			bands[i].cmd = 0;
+			ok = bands[i].link_up;
+			if(ok)
+				bands[i].interval = interval;
+			snprintf(path, sizeof(path), "/%d", i);
+			rate_ctl_done(path, interval, ok);
+		}
+
+		//手环 5 离开范围后重启，恢复默认间隔
+		if(t == 1200)
+			set_link(REBOOT_BAND, 0);
+		if(t == 1260)
+		{
+			bands[REBOOT_BAND].interval = DEFAULT_INTERVAL;
+			set_link(REBOOT_BAND, 1);
+		}
+		if(restored < 0 && t > 1260 && bands[REBOOT_BAND].interval == bands[0].interval)
+			restored = t - 1260;
+
+		connected = !(t >= 600 && t < 1500);
+		uplink = connected ? UPLINK_RATE : 0;
+		if(t >= 2400 && t < 2700)
+			uplink = UPLINK_RATE * 6 / 10;
+
+		for(i = 0; i < BANDS; i++)
+		{
+			if(!bands[i].link_up || t % bands[i].interval)
+				continue;
+			backlog++;
+			samples++;
+			if(adaptive && i == ALERT_BAND && t >= 1000 && t < 1060)
+			{
+				snprintf(path, sizeof(path), "/%d", i);
+				rate_ctl_alert(path);
+			}
+		}
+
+		backlog -= backlog < uplink ? backlog : uplink;
+		if(backlog > peak)
+			peak = backlog;
+		if(t > 1500 && !backlog && drained < 0)
+			drained = t - 1500;
+
+		in.backlog = (int)backlog;
+		in.connected = connected;
+		rate_ctl_tick(&in);
+
+		if(adaptive && t == 1030)
+			printf("  t=1030 alerting band %d at %ds, band 0 at %ds\n", ALERT_BAND, bands[ALERT_BAND].interval, bands[0].interval);
+		if(R.state != state)
+		{
+			state = R.state;
+			changes++;
+		}
+	}
+
+	rate_ctl_get_stats(&st);
+	printf("%-9s samples=%ld peak_backlog=%ld drained=%ds after reconnect commands=%d acked=%llu state_changes=%d\n",
+			adaptive ? "adaptive" : "fixed", samples, peak, drained, commands,
+			(unsigned long long)st.acked, changes);
+	if(adaptive)
+		printf("  band %d rebooted at t=1260, back at band 0's interval after %ds\n", REBOOT_BAND, restored);
+}
+
+
+int main(int argc, char **argv)
+{
+	int		seconds = 7200;
+
+	if(argc > 1)
+		seconds = atoi(argv[1]);
+
+	run(0, seconds);
+	run(1, seconds);
+	return 0;
+}
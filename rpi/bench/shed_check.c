@@ -0,0 +1,124 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  shed_check.c
+ *    Description:  Overload check: an alert sample must survive a full intake queue.
+ *                  用法：shed_check [队列容量]
+ *                  对每种过载策略，先用普通采样把 intake 队列灌满，再提交一条告警通知，
+ *                  优先级按 pipeline_submit 的方式由 telemetry_alert_band 决定，然后取空队列
+ *                  检查告警是否还在；"prio=0" 一列是不区分优先级时的结果，用于对照。
+ *                  任何策略下告警丢失时返回 1。
+ *
+ *        Version:  1.0.0(2025年09月10日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月10日 09时42分18秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stage_queue.h"
+#include "telemetry.h"
+
+
+#define HR_THRESHOLD		120
+#define SPO2_THRESHOLD		90
+#define RAW_MAX				128
+
+static const char	*normal_raw = "HR:72,SpO2:98";
+static const char	*alert_raw = "HR:150,SpO2:97";
+
+
+static int priority_of(const char *raw)
+{
+	telemetry_record_t	rec;
+
+	return telemetry_parse_ble(raw, strlen(raw), &rec) == TELEMETRY_OK &&
+		   telemetry_alert_band(&rec, HR_THRESHOLD, SPO2_THRESHOLD);
+}
+
+
+/* 灌满队列后提交告警，返回告警是否被取出；dropped 返回被拒绝入队的普通采样数（drop-oldest 挤掉的不计）
+ * classify 为 0 时所有采样都以普通优先级入队
+ */
+static int run(int policy, int capacity, int classify, int *dropped)
+{
+	stage_queue_config_t	cfg;
+	stage_queue_t			*q;
+	char					item[RAW_MAX];
+	int						fill;
+	int						found = 0;
+	int						i;
+
+	cfg.capacity = capacity;
+	cfg.policy = policy;
+	cfg.decimate = 4;
+	q = stage_queue_create("intake", sizeof(item), &cfg);
+	if(!q)
+		return 0;
+
+	//block 策略下没有消费者，只灌到恰好满；其他策略灌入足够多的采样，抽稀后队列也是满的
+	fill = policy == STAGE_POLICY_BLOCK ? capacity : capacity * 8;
+	*dropped = 0;
+	for(i = 0; i < fill; i++)
+	{
+		snprintf(item, sizeof(item), "%s", normal_raw);
+		if(stage_queue_push(q, item, 1, classify ? priority_of(item) : 0) != STAGE_OK)
+			(*dropped)++;
+	}
+
+	snprintf(item, sizeof(item), "%s", alert_raw);
+	if(policy == STAGE_POLICY_BLOCK && !(classify && priority_of(item)))
+	{
+		//普通优先级会一直阻塞，视为丢失
+		stage_queue_destroy(q);
+		return 0;
+	}
+	stage_queue_push(q, item, 1, classify ? priority_of(item) : 0);
+
+	while(stage_queue_pop(q, item, 0) == STAGE_OK)
+	{
+		if(strcmp(item, alert_raw) == 0)
+			found = 1;
+	}
+
+	stage_queue_destroy(q);
+	return found;
+}
+
+
+int main(int argc, char **argv)
+{
+	static const int	policies[] = {
+		STAGE_POLICY_BLOCK,
+		STAGE_POLICY_DROP_OLDEST,
+		STAGE_POLICY_DROP_NEWEST,
+		STAGE_POLICY_DECIMATE,
+	};
+	int					capacity = 16;
+	int					dropped;
+	int					survived, legacy;
+	int					failed = 0;
+	int					i;
+
+	if(argc > 1)
+		capacity = atoi(argv[1]);
+
+	printf("capacity %d, alert \"%s\" classified as priority %d\n", capacity, alert_raw, priority_of(alert_raw));
+	printf("%-12s %8s %10s %10s\n", "policy", "dropped", "alert", "prio=0");
+
+	for(i = 0; i < (int)(sizeof(policies) / sizeof(policies[0])); i++)
+	{
+		legacy = run(policies[i], capacity, 0, &dropped);
+		survived = run(policies[i], capacity, 1, &dropped);
+		printf("%-12s %8d %10s %10s\n", stage_queue_policy_name(policies[i]), dropped,
+				survived ? "delivered" : "LOST", legacy ? "delivered" : "lost");
+		if(!survived)
+			failed = 1;
+	}
+
+	return failed;
+}
@@ -0,0 +1,220 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  telemetry_bench.c
+ *    Description:  Telemetry serializer benchmark: generated serializer against snprintf.
+ *                  用法：telemetry_bench [每轮采样数]
+ *                  "snprintf" 一列是属性表之前的写法：sscanf 解析通知，build_huawei_property_json
+ *                  （以及带 event_time 的 _at 版本，gmtime_r + strftime）用 snprintf 拼接 JSON；
+ *                  另一列是 telemetry_parse_ble / telemetry_serialize_json。
+ *                  计时前先逐条比较两种写法的输出，不一致时返回 1。
+ *
+ *        Version:  1.0.0(2025年09月11日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月11日 10时12分40秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "telemetry.h"
+
+
+#define ROUNDS				5         //每种写法重复处理整个序列的次数，取平均
+#define RAW_MAX				32
+
+
+static double now_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+//改造前 mqtt_gateway.c 中的实现，原样保留用于对照
+static void build_huawei_property_json(char *buffer, size_t size, int hr_value, int spo2_value)
+{
+	snprintf(buffer, size,
+			"{\"services\":[{\"service_id\":\"mqtt\",\"properties\":{\"HR\":%d,\"Spo2\":%d}}]}",
+			hr_value, spo2_value);
+}
+
+
+static void build_huawei_property_json_at(char *buffer, size_t size, int hr_value, int spo2_value, time_t event_time)
+{
+	struct tm	tm;
+	char		time_str[32];
+
+	gmtime_r(&event_time, &tm);
+	strftime(time_str, sizeof(time_str), "%Y%m%dT%H%M%SZ", &tm);
+
+	snprintf(buffer, size,
+			"{\"services\":[{\"service_id\":\"mqtt\",\"properties\":{\"HR\":%d,\"Spo2\":%d},\"event_time\":\"%s\"}]}",
+			hr_value, spo2_value, time_str);
+}
+
+
+//合成的 BLE 通知序列：心率缓慢漂移、血氧基本不变
+static char (*synthetic_raw(int count))[RAW_MAX]
+{
+	char	(*raw)[RAW_MAX];
+	int		i;
+
+	if(!(raw = calloc(count, RAW_MAX)))
+		return NULL;
+
+	for(i = 0; i < count; i++)
+		snprintf(raw[i], RAW_MAX, "HR:%d,SpO2:%d", 60 + (i / 7) % 60, 90 + (i / 40) % 10);
+	return raw;
+}
+
+
+//两种写法的输出必须逐字节相同，否则对比没有意义
+static int check_same(char (*raw)[RAW_MAX], int count)
+{
+	telemetry_record_t	rec;
+	char				old_buf[256];
+	char				new_buf[TELEMETRY_JSON_MAX];
+	int					hr, spo2;
+	int					i;
+
+	for(i = 0; i < count; i++)
+	{
+		if(sscanf(raw[i], "HR:%d,SpO2:%d", &hr, &spo2) != 2 ||
+		   telemetry_parse_ble(raw[i], strlen(raw[i]), &rec) != TELEMETRY_OK)
+		{
+			fprintf(stderr, "parse mismatch on \"%s\"\n", raw[i]);
+			return -1;
+		}
+		rec.timestamp = 1756000000 + i;
+
+		build_huawei_property_json(old_buf, sizeof(old_buf), hr, spo2);
+		if(telemetry_serialize_json(&rec, 0, new_buf, sizeof(new_buf)) < 0 || strcmp(old_buf, new_buf) != 0)
+		{
+			fprintf(stderr, "output mismatch:\n  %s\n  %s\n", old_buf, new_buf);
+			return -1;
+		}
+
+		build_huawei_property_json_at(old_buf, sizeof(old_buf), hr, spo2, rec.timestamp);
+		if(telemetry_serialize_json(&rec, 1, new_buf, sizeof(new_buf)) < 0 || strcmp(old_buf, new_buf) != 0)
+		{
+			fprintf(stderr, "output mismatch:\n  %s\n  %s\n", old_buf, new_buf);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	telemetry_record_t	rec;
+	char				(*raw)[RAW_MAX];
+	char				buf[256];
+	double				t0;
+	double				ns[3][2];               //[解析 / 序列化 / 带 event_time 序列化][snprintf / 生成]
+	volatile int		sink = 0;
+	int					count = 200000;
+	int					hr, spo2;
+	int					i, r;
+
+	if(argc > 1)
+		count = atoi(argv[1]);
+	if(count <= 0 || !(raw = synthetic_raw(count)))
+	{
+		fprintf(stderr, "No samples.\n");
+		return 1;
+	}
+
+	if(check_same(raw, count) != 0)
+		return 1;
+
+	//解析：sscanf 与 telemetry_parse_ble
+	t0 = now_ns();
+	for(r = 0; r < ROUNDS; r++)
+	{
+		for(i = 0; i < count; i++)
+		{
+			sscanf(raw[i], "HR:%d,SpO2:%d", &hr, &spo2);
+			sink += hr + spo2;
+		}
+	}
+	ns[0][0] = (now_ns() - t0) / ((double)count * ROUNDS);
+
+	t0 = now_ns();
+	for(r = 0; r < ROUNDS; r++)
+	{
+		for(i = 0; i < count; i++)
+		{
+			telemetry_parse_ble(raw[i], strlen(raw[i]), &rec);
+			sink += rec.hr + rec.spo2;
+		}
+	}
+	ns[0][1] = (now_ns() - t0) / ((double)count * ROUNDS);
+
+	//序列化：实时上报（无 event_time）和 spool / 批量上报（带 event_time）
+	memset(&rec, 0, sizeof(rec));
+	rec.present = TELEMETRY_ALL_PRESENT;
+
+	t0 = now_ns();
+	for(r = 0; r < ROUNDS; r++)
+	{
+		for(i = 0; i < count; i++)
+		{
+			build_huawei_property_json(buf, sizeof(buf), 60 + i % 60, 90 + i % 10);
+			sink += buf[40];
+		}
+	}
+	ns[1][0] = (now_ns() - t0) / ((double)count * ROUNDS);
+
+	t0 = now_ns();
+	for(r = 0; r < ROUNDS; r++)
+	{
+		for(i = 0; i < count; i++)
+		{
+			rec.hr = 60 + i % 60;
+			rec.spo2 = 90 + i % 10;
+			sink += telemetry_serialize_json(&rec, 0, buf, sizeof(buf));
+		}
+	}
+	ns[1][1] = (now_ns() - t0) / ((double)count * ROUNDS);
+
+	t0 = now_ns();
+	for(r = 0; r < ROUNDS; r++)
+	{
+		for(i = 0; i < count; i++)
+		{
+			build_huawei_property_json_at(buf, sizeof(buf), 60 + i % 60, 90 + i % 10, 1756000000 + i);
+			sink += buf[40];
+		}
+	}
+	ns[2][0] = (now_ns() - t0) / ((double)count * ROUNDS);
+
+	t0 = now_ns();
+	for(r = 0; r < ROUNDS; r++)
+	{
+		for(i = 0; i < count; i++)
+		{
+			rec.hr = 60 + i % 60;
+			rec.spo2 = 90 + i % 10;
+			rec.timestamp = 1756000000 + i;
+			sink += telemetry_serialize_json(&rec, 1, buf, sizeof(buf));
+		}
+	}
+	ns[2][1] = (now_ns() - t0) / ((double)count * ROUNDS);
+
+	printf("%d sample(s), %d round(s), outputs identical\n", count, ROUNDS);
+	printf("%-22s %14s %14s %9s\n", "operation", "snprintf ns", "generated ns", "speedup");
+	printf("%-22s %14.1f %14.1f %8.1fx\n", "parse notification", ns[0][0], ns[0][1], ns[0][0] / ns[0][1]);
+	printf("%-22s %14.1f %14.1f %8.1fx\n", "serialize", ns[1][0], ns[1][1], ns[1][0] / ns[1][1]);
+	printf("%-22s %14.1f %14.1f %8.1fx\n", "serialize event_time", ns[2][0], ns[2][1], ns[2][0] / ns[2][1]);
+
+	free(raw);
+	return 0;
+}
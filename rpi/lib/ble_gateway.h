@@ -24,6 +24,9 @@ extern int HR_THRESHOLD;
 extern int SPO2_THRESHOLD;
 extern char WARNING_CMD[128];
 
+/* --- BLE 写入返回值 --- */
+#define BLE_WRITE_TIMEOUT	-2  // WriteValue 在超时时间内没有应答
+
 extern DBusConnection 	*global_dbus_conn;
 extern struct 			mosquitto *global_mosq;
 extern volatile int 	mqtt_connected_flag;
@@ -35,6 +38,8 @@ int call_method(DBusConnection *conn, const char *path, const char *interface, c
 void print_notify_value(DBusMessageIter *variant_iter);
 void handle_properties_changed(DBusMessage *msg);
 int write_characteristic_value(DBusConnection *conn, const char* char_path, const char* cmd_str);
+int write_characteristic_value_timeout(DBusConnection *conn, const char* char_path, const char* cmd_str, int timeout_ms);
+int read_characteristic_value_timeout(DBusConnection *conn, const char *char_path, char *buf, size_t size, int timeout_ms);
 void print_notify_value(DBusMessageIter *variant_iter);
 
 #endif // __BLE_GATEWAY_H
@@ -0,0 +1,48 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  cmd_dedup.h
+ *    Description:  Recently seen command request_ids.
+ *                  QoS1 重发和云端重试会让同一个 request_id 多次到达。固定大小的 LRU 表
+ *                  记录最近的 request_id 和执行结果（带 TTL），重复的命令直接重发缓存的响应，
+ *                  不再写入 BLE。
+ *
+ *        Version:  1.0.0(2025年09月02日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月02日 10时42分15秒"
+ *
+ ********************************************************************************/
+
+#ifndef __CMD_DEDUP_H
+#define __CMD_DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CMD_DEDUP_SLOTS			64
+#define CMD_DEDUP_PARAS_MAX		192
+
+// cmd_dedup_lookup 返回值
+#define CMD_DEDUP_MISS			0   // 新命令，已登记为执行中
+#define CMD_DEDUP_PENDING		1   // 同一命令正在执行，忽略
+#define CMD_DEDUP_DONE			2   // 已执行过，返回缓存的响应
+
+typedef struct {
+	uint64_t	lookups;
+	uint64_t	hits_done;       // 重发缓存响应的次数
+	uint64_t	hits_pending;    // 执行中被忽略的重复命令
+	uint64_t	expired;         // 超过 TTL 后按新命令处理的次数
+	uint64_t	evicted;         // 表满时淘汰的最久未用条目
+	uint32_t	entries;
+} cmd_dedup_stats_t;
+
+int cmd_dedup_init(int ttl_sec);
+int cmd_dedup_lookup(const char *request_id, int *result_code, char *paras, size_t size);
+void cmd_dedup_complete(const char *request_id, int result_code, const char *paras);
+void cmd_dedup_forget(const char *request_id);
+
+void cmd_dedup_get_stats(cmd_dedup_stats_t *stats);
+void cmd_dedup_log_stats(void);
+
+#endif //__CMD_DEDUP_H
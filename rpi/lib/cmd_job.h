@@ -0,0 +1,90 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  cmd_job.h
+ *    Description:  Asynchronous downlink command jobs.
+ *                  下行命令在 MQTT 回调中只登记为任务，由独立的命令线程执行 BLE 写入，
+ *                  再按 request_id 发布带真实结果和时延的命令响应，MQTT 循环不会被 BLE 阻塞。
+ *                  命令按目标设备排队，设备 BLE 链路断开时保留，重连后按顺序执行；
+ *                  每条命令带 TTL，过期的命令直接回复超时，不会写入设备。
+ *
+ *        Version:  1.0.0(2025年08月25日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月25日 11时20分36秒"
+ *                  2, Per-device queues with TTL on "2025年09月02日 15时06分27秒"
+ *
+ ********************************************************************************/
+
+#ifndef __CMD_JOB_H
+#define __CMD_JOB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CMD_JOB_MAX				32   // 同时排队/执行的命令数（所有设备）
+#define CMD_JOB_DEVICE_MAX		32   // 目标设备数（网关自己的设备和子设备）
+#define CMD_JOB_DEVICE_QUEUE	16   // 单个设备最多排队的命令数
+#define CMD_JOB_REQUEST_ID_MAX	64
+#define CMD_JOB_PAYLOAD_MAX		512
+#define CMD_JOB_TTL_TYPES		8    // 可单独配置 TTL 的命令类型数
+
+// 命令响应 result_code
+#define CMD_RESULT_SUCCESS		0
+#define CMD_RESULT_FAILED		1    // BLE 写入失败
+#define CMD_RESULT_TIMEOUT		2    // 排队或 BLE 写入超时
+#define CMD_RESULT_BUSY			3    // 任务表已满
+
+// 任务类型，决定 BLE 操作和响应主题
+enum {
+	CMD_JOB_COMMAND = 0,      // 命令：写入 BLE，发布 commands/response
+	CMD_JOB_PROPERTY_SET,     // 属性设置：写入有变化的属性，发布 properties/set/response
+	CMD_JOB_PROPERTY_GET,     // 属性查询：读取 BLE 更新影子，发布 properties/get/response
+	CMD_JOB_RATE,             // 速率命令：写入 BLE，结果交给 rate_ctl（mask 为采样间隔），不发布响应
+};
+
+typedef struct {
+	int			timeout_ms;         // BLE 写入超时
+	int			default_ttl_sec;    // 命令未携带 TTL 且类型未单独配置时的 TTL
+	int			ttl_count;
+	struct {
+		char	command_name[32];
+		int		ttl_sec;
+	}			ttl[CMD_JOB_TTL_TYPES];
+} cmd_job_config_t;
+
+typedef struct {
+	uint64_t	submitted;
+	uint64_t	succeeded;
+	uint64_t	failed;
+	uint64_t	timed_out;
+	uint64_t	expired;          // 超过 TTL 未写入设备的命令
+	uint64_t	rejected;
+	uint32_t	queued;           // 当前排队数
+	uint32_t	latency_max_ms;   // BLE 写入最大时延
+	uint64_t	latency_sum_ms;
+} cmd_job_stats_t;
+
+typedef struct {
+	int			link_up;
+	uint32_t	queued;           // 当前排队数
+	uint64_t	held;             // 因链路断开而等待过的命令
+	uint64_t	expired;
+	uint64_t	disconnects;
+} cmd_job_device_stats_t;
+
+int cmd_job_init(const cmd_job_config_t *config);
+int cmd_job_add_device(const char *device_path, const char *char_path, const char *read_path);
+void cmd_job_set_link(const char *device_path, int up);
+int cmd_job_ttl_ms(const char *command_name);
+
+int cmd_job_submit(const char *device_path, const char *request_id, const char *ble_cmd, size_t len, int ttl_ms);
+int cmd_job_submit_property(const char *device_path, int kind, const char *request_id, const char *ble_cmd, size_t len, uint32_t mask, int ttl_ms);
+void *command_thread_func(void *arg);
+void cmd_job_stop(void);
+
+void cmd_job_get_stats(cmd_job_stats_t *stats);
+int cmd_job_get_device_stats(int device, cmd_job_device_stats_t *stats);
+void cmd_job_log_stats(void);
+
+#endif //__CMD_JOB_H
@@ -0,0 +1,61 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  coap_server.h
+ *    Description:  CoAP (RFC 7252) UDP ingestion endpoint.
+ *                  电池供电的节点不必经 ESP8266 维持 TCP 上的 MQTT 会话，一个 UDP 报文
+ *                  即可上报：POST /t/{node}，负载与 BLE 通知相同（"HR:72,SpO2:98"），
+ *                  多个采样按行分隔。支持 CON / NON 请求和 Block1 分块上传（RFC 7959），
+ *                  采样经 pipeline_submit 进入与 BLE 通知相同的处理流水线。
+ *
+ *        Version:  1.0.0(2025年09月07日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月07日 09时36分15秒"
+ *
+ ********************************************************************************/
+
+#ifndef __COAP_SERVER_H
+#define __COAP_SERVER_H
+
+#include <stdint.h>
+
+#define COAP_DEFAULT_PORT	5683
+#define COAP_BATCH_MAX		64      // 一次 recvmmsg 最多接收的报文数
+#define COAP_DATAGRAM_MAX	1152    // RFC 7252 4.6 建议的报文上限
+#define COAP_BODY_MAX		2048    // Block1 重组后的最大负载
+#define COAP_BLOCK_SLOTS	16      // 同时进行的分块上传
+#define COAP_DEDUP_BUCKETS	1024    // 去重缓存：按 (地址, 端口, Message ID) 分桶
+#define COAP_DEDUP_WAYS		8       // 每桶条目数；全部条目可容纳 EXCHANGE_LIFETIME 内约 33 个请求/秒
+
+typedef struct {
+	int		enabled;
+	char	*bind;             // 监听地址，默认 "0.0.0.0"
+	int		port;              // 默认 5683
+	int		batch;             // 每次 recvmmsg 的报文数，不超过 COAP_BATCH_MAX
+} coap_server_config_t;
+
+typedef struct {
+	uint64_t	datagrams;
+	uint64_t	batches;           // 返回了报文的 recvmmsg 调用
+	uint64_t	confirmable;
+	uint64_t	non_confirmable;
+	uint64_t	duplicates;        // 重传的请求，重发缓存的响应
+	uint64_t	deferred;          // 去重缓存的桶已满，回复 5.03 未处理，节点稍后重发
+	uint64_t	blocks;            // Block1 分块
+	uint64_t	bodies;            // 完整的请求负载（含重组后的）
+	uint64_t	samples;           // 进入流水线的采样
+	uint64_t	dropped;           // 流水线 intake 队列按过载策略丢弃
+	uint64_t	errors;            // 返回 4.xx / 5.xx 或格式错误
+	uint64_t	responses;
+	uint64_t	bytes_in;
+} coap_server_stats_t;
+
+int coap_server_init(const coap_server_config_t *config);
+void *coap_server_thread_func(void *arg);
+void coap_server_cleanup(void);
+
+void coap_server_get_stats(coap_server_stats_t *stats);
+void coap_server_log_stats(void);
+
+#endif //__COAP_SERVER_H
@@ -0,0 +1,69 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  inflight.h
+ *    Description:  QoS1 in-flight publish tracking.
+ *                  记录每个 mosquitto_publish 的 mid 和入队时间，在 PUBACK 时统计时延，
+ *                  并限制同时在途的消息数量，窗口满时向上游施加背压。
+ *
+ *        Version:  1.0.0(2025年08月14日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月14日 09时30分12秒"
+ *
+ ********************************************************************************/
+
+#ifndef __INFLIGHT_H
+#define __INFLIGHT_H
+
+#include <stdint.h>
+
+// 时延直方图桶数：第 i 个桶统计 [2^(i-1), 2^i) 毫秒，最后一个桶为溢出桶
+#define INFLIGHT_HIST_BUCKETS	16
+
+// 在途窗口上限
+#define INFLIGHT_MAX_WINDOW		256
+
+typedef struct {
+	uint64_t	published;      // 成功交给 libmosquitto 的消息数
+	uint64_t	acked;          // 收到 PUBACK 的消息数
+	uint64_t	overdue;        // 超过确认时限仍未确认的消息数（槽位保留到 PUBACK）
+	uint32_t	overdue_pending; // 当前超时未确认、仍占用槽位的消息数
+	uint64_t	expired;        // 会话重置时丢弃的未确认消息数
+	uint64_t	rejected;       // 因窗口已满被拒绝（背压）的次数
+	uint32_t	in_flight;      // 当前在途数量
+	uint32_t	peak;           // 在途数量峰值
+	uint32_t	latency_max_ms; // 最大确认时延
+	uint64_t	latency_sum_ms; // 确认时延总和（用于计算平均值）
+	uint64_t	hist[INFLIGHT_HIST_BUCKETS];
+	uint32_t	saved;          // 最近一次保存的在途消息数
+	uint32_t	restored;       // 本次启动时重新提交的消息数
+	uint32_t	restore_dropped; // 本次启动时无法重新提交而丢弃的消息数
+	uint64_t	checkpoints;    // 运行中写入状态文件的次数
+} inflight_stats_t;
+
+int inflight_init(int max_inflight, int timeout_sec);
+
+int inflight_reserve(void);
+void inflight_commit(int slot, int mid);
+void inflight_cancel(int slot);
+void inflight_ack(int mid);
+void inflight_expire(void);
+void inflight_discard_early_acks(void);
+void inflight_set_window(int limit);
+void inflight_reset(void);
+
+// 持久会话：保存在途消息的副本，运行中定期和退出时写入文件，下次启动时重新提交
+typedef int (*inflight_resubmit_t)(int traffic_class, const char *topic, const void *payload, int payloadlen, int qos);
+
+void inflight_set_retain(int enable);
+void inflight_retain(int slot, const char *topic, const void *payload, int payloadlen, int traffic_class);
+int inflight_save(const char *path);
+int inflight_checkpoint(const char *path, int interval_ms);
+int inflight_restore(const char *path, inflight_resubmit_t resubmit);
+
+int inflight_count(void);
+void inflight_get_stats(inflight_stats_t *stats);
+void inflight_log_stats(void);
+
+#endif //__INFLIGHT_H
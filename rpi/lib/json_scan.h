@@ -0,0 +1,46 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  json_scan.h
+ *    Description:  Zero-allocation JSON field extraction.
+ *                  在原始负载上就地查找 "paras.report" 这样的路径，只返回指向原缓冲区的
+ *                  指针和长度，不构建 json-c 对象树。
+ *
+ *        Version:  1.0.0(2025年08月21日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月21日 16时40分05秒"
+ *
+ ********************************************************************************/
+
+#ifndef __JSON_SCAN_H
+#define __JSON_SCAN_H
+
+#include <stddef.h>
+
+typedef enum {
+	JSON_SCAN_NONE = 0,
+	JSON_SCAN_STRING,   // ptr/len 指向引号内的原始内容（未反转义）
+	JSON_SCAN_NUMBER,
+	JSON_SCAN_BOOL,
+	JSON_SCAN_NULL,
+	JSON_SCAN_OBJECT,   // ptr/len 覆盖整个 {...}
+	JSON_SCAN_ARRAY,    // ptr/len 覆盖整个 [...]
+} json_scan_type_t;
+
+typedef struct {
+	json_scan_type_t	type;
+	const char			*ptr;
+	size_t				len;
+	int					escaped;  // 字符串中含有转义字符，需要 json_scan_unescape
+} json_scan_value_t;
+
+// 返回值
+#define JSON_SCAN_OK			0
+#define JSON_SCAN_NOT_FOUND		-1
+#define JSON_SCAN_SYNTAX		-2
+
+int json_scan_get(const char *json, size_t len, const char *path, json_scan_value_t *out);
+int json_scan_unescape(const json_scan_value_t *val, char *buf, size_t size);
+
+#endif //__JSON_SCAN_H
@@ -0,0 +1,76 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  link_watch.h
+ *    Description:  Stale BLE link detection.
+ *                  BlueZ 报告设备仍然连接、但通知已经停止（固件卡死、CCCD 丢失）时，
+ *                  上行线程不会收到任何事件。这里按设备统计通知到达间隔的 EWMA 和抖动，
+ *                  静默超过 k 倍预期间隔时先重新启用通知，仍然静默再强制断开重连，
+ *                  并统计数据中断时长的分布。
+ *
+ *        Version:  1.0.0(2025年09月05日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月05日 09时17分45秒"
+ *
+ ********************************************************************************/
+
+#ifndef __LINK_WATCH_H
+#define __LINK_WATCH_H
+
+#include <stdint.h>
+
+#include "subdev.h"
+
+#define LINK_WATCH_DEVICE_MAX	(1 + SUBDEV_MAX)
+
+// 中断时长直方图的桶上限（秒），最后一个桶收集更长的中断
+#define LINK_WATCH_GAP_BUCKETS	8
+#define LINK_WATCH_GAP_LIMITS	{ 2, 5, 10, 30, 60, 300, 1800 }
+
+// link_watch_check 返回的动作
+enum {
+	LINK_WATCH_OK = 0,
+	LINK_WATCH_RESTART_NOTIFY,   // 重新调用 StopNotify / StartNotify
+	LINK_WATCH_RECONNECT,        // 强制断开并重连
+};
+
+typedef struct {
+	int		enabled;
+	int		notify_k;          // 静默超过 notify_k 倍预期间隔时重新启用通知
+	int		reconnect_k;       // 静默超过 reconnect_k 倍预期间隔时断开重连
+	int		min_silence_ms;    // 判定静默的下限，避免高频设备的正常抖动触发
+	int		warmup;            // 至少收到多少个间隔后才开始判定
+} link_watch_config_t;
+
+typedef struct {
+	uint32_t	interval_ms;     // 到达间隔 EWMA
+	uint32_t	jitter_ms;       // 到达间隔的平均偏差
+	uint64_t	notifications;
+	uint64_t	restarts;        // 重新启用通知的次数
+	uint64_t	reconnects;      // 强制重连的次数
+	uint64_t	gaps;            // 超过预期的数据中断次数
+	uint32_t	gap_max_ms;
+} link_watch_device_stats_t;
+
+typedef struct {
+	uint64_t	restarts;
+	uint64_t	reconnects;
+	uint64_t	gaps;
+	uint64_t	gap_hist[LINK_WATCH_GAP_BUCKETS];
+} link_watch_stats_t;
+
+int link_watch_init(const link_watch_config_t *config);
+int link_watch_add(const char *device_path);
+int link_watch_find(const char *path);
+
+void link_watch_notify(int device, uint64_t now_ms);
+void link_watch_set_link(int device, int up, uint64_t now_ms);
+int link_watch_check(int device, uint64_t now_ms);
+void link_watch_set_interval(const char *device_path, int interval_ms);
+
+void link_watch_get_device_stats(int device, link_watch_device_stats_t *stats);
+void link_watch_get_stats(link_watch_stats_t *stats);
+void link_watch_log_stats(void);
+
+#endif //__LINK_WATCH_H
@@ -0,0 +1,69 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  local_broker.h
+ *    Description:  Embedded local MQTT broker for LAN nodes.
+ *                  局域网内的 Wi-Fi 节点（mcu_code 固件）连接网关而不是云端：
+ *                  支持 MQTT 3.1.1 的 CONNECT / PUBLISH / SUBSCRIBE / UNSUBSCRIBE / PING，
+ *                  QoS 0/1，订阅保存在按主题层级组织的前缀树中。
+ *                  节点按 IoTDA 主题上报的属性作为网关子设备并入批量上报，命令响应经网关
+ *                  身份转发；云端发给节点的命令转发到节点自己的主题上，所有节点共用网关的
+ *                  一个云端连接。
+ *                  节点身份取 CONNECT 的用户名（没有时为客户端 ID），只用来核对主题中的
+ *                  设备 ID；用户名由节点自己声明，密码不检查，代理不做认证，只能部署在
+ *                  可信的局域网中。
+ *
+ *        Version:  1.0.0(2025年09月06日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月06日 16时12分40秒"
+ *
+ ********************************************************************************/
+
+#ifndef __LOCAL_BROKER_H
+#define __LOCAL_BROKER_H
+
+#include <stdint.h>
+
+#define LOCAL_BROKER_CLIENTS_MAX	64      // 订阅用 64 位位图记录，不能再大
+#define LOCAL_BROKER_TRIE_NODES		256
+#define LOCAL_BROKER_LEVEL_MAX		64      // 订阅主题单个层级的最大长度
+#define LOCAL_BROKER_IN_SIZE		2048    // 输入缓冲区，也是能接收的最大报文
+#define LOCAL_BROKER_OUT_SIZE		8192
+#define LOCAL_BROKER_BIND_DEFAULT	"127.0.0.1"   // 未配置 bind 时只监听本机，局域网节点接入需显式配置
+
+typedef struct {
+	int		enabled;
+	char	*bind;             // 监听地址，默认 LOCAL_BROKER_BIND_DEFAULT，接入局域网节点时设为网关的局域网地址
+	int		port;              // 默认 1883
+	int		max_clients;       // 不超过 LOCAL_BROKER_CLIENTS_MAX
+} local_broker_config_t;
+
+typedef struct {
+	uint32_t	clients;
+	uint64_t	connects;
+	uint64_t	disconnects;
+	uint64_t	rejected;          // 连接数已满或 CONNECT 无效
+	uint64_t	published;         // 收到的 PUBLISH
+	uint64_t	delivered;         // 投递给本地订阅者的 PUBLISH
+	uint64_t	dropped;           // 订阅者输出缓冲区已满，未投递
+	uint64_t	reports;           // 并入子设备批量上报的属性上报
+	uint64_t	responses;         // 经网关身份转发的命令和属性响应
+	uint64_t	refused;           // 应当转发但未被接收（QoS1 时不回 PUBACK 并关闭连接）
+	uint64_t	spoofed;           // 主题中的设备 ID 与连接身份不符，未转发
+	uint64_t	commands;          // 转发给节点的云端命令
+	uint64_t	bytes_in;
+	uint64_t	bytes_out;
+} local_broker_stats_t;
+
+int local_broker_init(const local_broker_config_t *config, const char *gateway_id);
+void *local_broker_thread_func(void *arg);
+void local_broker_cleanup(void);
+
+int local_broker_is_node(const char *device_id);
+int local_broker_forward(const char *device_id, const char *suffix, const void *payload, int payloadlen);
+
+void local_broker_get_stats(local_broker_stats_t *stats);
+void local_broker_log_stats(void);
+
+#endif //__LOCAL_BROKER_H
@@ -0,0 +1,63 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  mqtt_conn.h
+ *    Description:  MQTT broker address cache and reconnect backoff.
+ *                  代理地址解析后按 TTL 缓存，连接失败时轮换地址并对多个地址并行探测；
+ *                  重连间隔使用去相关抖动 (decorrelated jitter)，避免整批网关同时重连。
+ *
+ *        Version:  1.0.0(2025年08月28日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月28日 15时02分37秒"
+ *
+ ********************************************************************************/
+
+#ifndef __MQTT_CONN_H
+#define __MQTT_CONN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MQTT_CONN_MAX_ADDRS		8
+#define MQTT_CONN_HOST_MAX		64   // 数字地址字符串的最大长度
+
+typedef struct {
+	int		dns_ttl_sec;          // 解析结果缓存时间
+	int		use_cached_address;   // 0: 把主机名交给 libmosquitto（TLS 需要按主机名校验证书）
+	int		base_ms;              // 重连间隔下限
+	int		max_ms;               // 重连间隔上限
+	int		probe_timeout_ms;     // 多地址并行探测的超时时间
+} mqtt_conn_config_t;
+
+typedef struct {
+	uint64_t	attempts;             // 发起的连接次数
+	uint64_t	connects;             // 连接成功次数
+	uint64_t	failures;             // 连接失败次数
+	uint64_t	disconnects;          // 已建立的连接断开次数
+	uint64_t	dns_lookups;
+	uint64_t	dns_failures;
+	uint64_t	probes;               // 多地址并行探测次数
+	uint32_t	reconnect_last_ms;    // 断开到重新连上所用的时间
+	uint32_t	reconnect_max_ms;
+	uint64_t	reconnect_sum_ms;
+	uint32_t	first_delay_min_ms;   // 断开后第一次重连的等待时间（整批网关的打散程度）
+	uint32_t	first_delay_max_ms;
+	uint64_t	first_delay_sum_ms;
+	uint64_t	first_delay_count;
+} mqtt_conn_stats_t;
+
+int mqtt_conn_init(const char *host, int port, const mqtt_conn_config_t *config);
+uint64_t mqtt_conn_now_ms(void);
+
+const char *mqtt_conn_select_host(char *buf, size_t size);
+int mqtt_conn_first_delay_ms(void);
+void mqtt_conn_attempt(void);
+void mqtt_conn_connected(void);
+int mqtt_conn_failed(void);
+int mqtt_conn_lost(void);
+
+void mqtt_conn_get_stats(mqtt_conn_stats_t *stats);
+void mqtt_conn_log_stats(void);
+
+#endif //__MQTT_CONN_H
@@ -4,10 +4,25 @@
 #include <mosquitto.h> // Include Mosquitto library for struct mosquitto
 #include <stddef.h>    // For size_t
 
+#include "telemetry.h"
+
 extern struct mosquitto *global_mosq;
 extern volatile int mqtt_connected_flag;
 extern volatile int keep_running; // For graceful shutdown
 
+// 发布流量类别，用于区分消息过期时间等发布属性，每个类别对应一条发送队列
+enum {
+    MQTT_TRAFFIC_TELEMETRY = 0,   // 属性上报
+    MQTT_TRAFFIC_RESPONSE,        // 命令响应
+    MQTT_TRAFFIC_ALERT,           // 触发告警的采样
+    MQTT_TRAFFIC_BULK,            // spool 回放等批量数据
+    MQTT_TRAFFIC_CLASS_COUNT
+};
+
+// MQTT 协议版本
+#define MQTT_PROTOCOL_311   4
+#define MQTT_PROTOCOL_50    5
+
 // MQTT Device Configuration Structure
 typedef struct {
     char		*host;
@@ -19,6 +34,26 @@ typedef struct {
     char		*subscribe_topic;
     int         keepalive_interval;
     int         publish_interval_sec;
+    int         max_inflight;         // QoS1 在途消息上限（背压窗口）
+    int         publish_timeout_sec;  // PUBACK 超时时间，超过后计为 overdue 并告警，槽位保留到 PUBACK
+    int         stats_interval_sec;   // 运行统计输出周期
+    int         command_timeout_ms;   // 下行命令 BLE 写入超时时间
+    int         command_dedup_ttl_sec; // 重复 request_id 的识别时间窗口，0 表示不去重
+
+    int         protocol_version;     // 4: MQTT v3.1.1, 5: MQTT v5
+    int         receive_maximum;      // v5: 允许代理同时下发的 QoS1 消息数，0 表示默认值
+    int         topic_alias;          // v5: 是否为高频主题使用主题别名
+    int         message_expiry_sec[MQTT_TRAFFIC_CLASS_COUNT]; // v5: 各类流量的消息过期时间，0 表示不过期
+
+    int         dns_ttl_sec;          // 代理地址解析结果缓存时间
+    int         reconnect_base_ms;    // 重连退避下限
+    int         reconnect_max_ms;     // 重连退避上限
+    int         connect_timeout_ms;   // 发起连接到收到 CONNACK 的超时时间
+
+    int         persistent_session;   // 1: 使用持久会话（clean_session=false），重连后保留订阅和排队的下行命令
+    int         session_expiry_sec;   // v5: 断开后代理保留会话的时间
+    char        *session_state_path;  // 保存未确认的上行消息，下次启动时重新发送，NULL 表示不保存
+    int         session_state_interval_ms; // 运行中保存未确认消息的最小间隔，崩溃或断电时最多丢失这段时间内的变化
 
 	char		*ca_cert;
 } mqtt_device_config_t;
@@ -26,9 +61,13 @@ typedef struct {
 
 extern mqtt_device_config_t device_config;
 
+// mqtt_publish_tracked 在途窗口已满时的返回值
+#define MQTT_PUBLISH_WINDOW_FULL   -100
+
 
 // --- Mosquitto Callbacks ---
-void on_connect_cb(struct mosquitto *mosq, void *userdata, int result);
+void on_connect_cb(struct mosquitto *mosq, void *userdata, int result, int flags);
+void on_connect_v5_cb(struct mosquitto *mosq, void *userdata, int result, int flags, const mosquitto_property *props);
 void on_message_cb(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *msg);
 void on_publish_cb(struct mosquitto *mosq, void *userdata, int mid);
 void on_subscribe_cb(struct mosquitto *mosq, void *userdata, int mid, int qos_count, const int *granted_qos);
@@ -38,6 +77,15 @@ void on_disconnect_cb(struct mosquitto *mosq, void *userdata, int result);
 void* downlink_thread_func(void* arg); // MQTT communication thread (subscribe & connection management)
 
 // --- Helper Functions ---
-void build_huawei_property_json(char *buffer, size_t size, int hr_value, int spo2_value);
+int mqtt_gateway_init_routes(void);
+int mqtt_gateway_setup_client(struct mosquitto *mosq);
+void mqtt_gateway_device_message(const char *device_path, const char *topic, const void *payload, int payloadlen);
+void mqtt_gateway_log_stats(void);
+const char *mqtt_traffic_class_name(int traffic_class);
+int mqtt_publish_tracked(const char *topic, const void *payload, int payloadlen, int qos, int traffic_class);
+int mqtt_publish_command_response(const char *request_id, int result_code, const char *paras_json);
+int mqtt_publish_command_response_to(const char *device_path, const char *request_id, int result_code, const char *paras_json);
+int mqtt_publish_property_get_response(const char *request_id, const telemetry_record_t *rec);
+int mqtt_publish_property_set_response(const char *request_id, int result_code, const char *result_desc);
 
 #endif // MQTT_GATEWAY_H
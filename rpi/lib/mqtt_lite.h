@@ -0,0 +1,87 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  mqtt_lite.h
+ *    Description:  Lightweight event-loop MQTT 3.1.1 client.
+ *                  libmosquitto 外部循环接口的精简替代：非阻塞套接字由调用者的事件循环驱动
+ *                  （read / write / misc / want_write / socket），自身不加锁、不创建线程。
+ *                  报文直接序列化到每个连接预分配的环形输出缓冲区，用 writev 一次发出
+ *                  多个排队的 PUBLISH；收到的报文在输入缓冲区中原地解析；QoS1 在途消息
+ *                  保存在固定大小的表中，重连后带 DUP 重发。
+ *                  只支持 MQTT 3.1.1、QoS 0/1、明文 TCP。
+ *
+ *        Version:  1.0.0(2025年09月06日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月06日 10时05分27秒"
+ *
+ ********************************************************************************/
+
+#ifndef __MQTT_LITE_H
+#define __MQTT_LITE_H
+
+#include <stdint.h>
+
+#define MQTT_LITE_OUT_SIZE		4096    // 输出环形缓冲区
+#define MQTT_LITE_IN_SIZE		2048    // 输入缓冲区，也是能接收的最大报文
+#define MQTT_LITE_SLOT_SIZE		512     // 每个 QoS1 在途槽位保存的最大报文
+#define MQTT_LITE_INFLIGHT_MAX	32
+
+// 返回值，取值与 libmosquitto 的 MOSQ_ERR_* 相同，上层可以统一处理
+enum {
+	MQTT_LITE_OK = 0,
+	MQTT_LITE_ERR_NOMEM = 1,
+	MQTT_LITE_ERR_PROTOCOL = 2,
+	MQTT_LITE_ERR_INVAL = 3,
+	MQTT_LITE_ERR_NO_CONN = 4,
+	MQTT_LITE_ERR_CONN_REFUSED = 5,
+	MQTT_LITE_ERR_CONN_LOST = 7,
+	MQTT_LITE_ERR_PAYLOAD_SIZE = 9,
+	MQTT_LITE_ERR_ERRNO = 14,
+	MQTT_LITE_ERR_EAI = 15,
+	MQTT_LITE_ERR_WINDOW_FULL = 100,   // 在途表或输出缓冲区已满，稍后重试
+};
+
+typedef struct mqtt_lite mqtt_lite_t;
+
+// 回调在 mqtt_lite_read / write / misc 中调用；topic 和 payload 指向输入缓冲区，只在回调期间有效
+// payload 后面总有一个 '\0'（不计入 payloadlen），文本负载可以直接按字符串解析
+typedef struct {
+	void	(*on_connect)(mqtt_lite_t *c, void *userdata, int rc);
+	void	(*on_disconnect)(mqtt_lite_t *c, void *userdata, int rc);
+	void	(*on_message)(mqtt_lite_t *c, void *userdata, const char *topic, const void *payload, int payloadlen);
+	void	(*on_publish)(mqtt_lite_t *c, void *userdata, int mid);
+} mqtt_lite_callbacks_t;
+
+typedef struct {
+	uint64_t	packets_out;
+	uint64_t	packets_in;
+	uint64_t	bytes_out;
+	uint64_t	bytes_in;
+	uint64_t	writev_calls;
+	uint64_t	read_calls;
+	uint64_t	resent;            // 重连后重发的 QoS1 消息
+	uint32_t	inflight;
+} mqtt_lite_stats_t;
+
+mqtt_lite_t *mqtt_lite_new(const char *client_id, int max_inflight, const mqtt_lite_callbacks_t *cb, void *userdata);
+void mqtt_lite_destroy(mqtt_lite_t *c);
+int mqtt_lite_set_login(mqtt_lite_t *c, const char *username, const char *password);
+void mqtt_lite_set_deferred(mqtt_lite_t *c, int deferred);
+
+int mqtt_lite_connect(mqtt_lite_t *c, const char *host, int port, int keepalive);
+int mqtt_lite_disconnect(mqtt_lite_t *c);
+
+int mqtt_lite_socket(const mqtt_lite_t *c);
+int mqtt_lite_want_write(const mqtt_lite_t *c);
+int mqtt_lite_read(mqtt_lite_t *c);
+int mqtt_lite_write(mqtt_lite_t *c);
+int mqtt_lite_misc(mqtt_lite_t *c);
+
+int mqtt_lite_publish(mqtt_lite_t *c, int *mid, const char *topic, int payloadlen, const void *payload, int qos);
+int mqtt_lite_subscribe(mqtt_lite_t *c, const char *topic, int qos);
+
+const char *mqtt_lite_strerror(int rc);
+void mqtt_lite_get_stats(const mqtt_lite_t *c, mqtt_lite_stats_t *stats);
+
+#endif //__MQTT_LITE_H
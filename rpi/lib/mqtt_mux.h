@@ -0,0 +1,87 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  mqtt_mux.h
+ *    Description:  Per-device MQTT identities on one event loop.
+ *                  直连模式下每个 BLE 手环以自己的 IoTDA 设备身份接入，网关为每个设备
+ *                  维护一个 MQTT 客户端。所有客户端由同一个线程以外部套接字方式驱动
+ *                  （epoll + read/write/misc），不为每个连接创建网络线程；客户端可以是
+ *                  libmosquitto，也可以是内置的 mqtt_lite；
+ *                  连接按 connect_stagger_ms 错开发起，TLS 共用一个 SSL_CTX，
+ *                  代理地址只解析一次。
+ *
+ *        Version:  1.0.0(2025年09月05日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月05日 15时42分08秒"
+ *
+ ********************************************************************************/
+
+#ifndef __MQTT_MUX_H
+#define __MQTT_MUX_H
+
+#include <stdint.h>
+
+#include "telemetry.h"
+
+#define MQTT_MUX_MAX		512    // 单个网关最多维护的设备连接数
+
+// 连接状态
+enum {
+	MQTT_MUX_IDLE = 0,          // 等待发起连接（启动时或退避中）
+	MQTT_MUX_CONNECTING,        // 已发起 TCP/TLS 连接，等待 CONNACK
+	MQTT_MUX_CONNECTED,
+};
+
+// 客户端引擎
+enum {
+	MQTT_MUX_ENGINE_MOSQUITTO = 0,  // libmosquitto 外部循环接口
+	MQTT_MUX_ENGINE_LITE,           // 内置的 mqtt_lite（仅明文 TCP）
+};
+
+typedef struct {
+	int		enabled;               // gateway.mode 为 "direct" 时启用
+	int		engine;                // MQTT_MUX_ENGINE_*
+	int		connect_stagger_ms;    // 相邻两次发起连接的最小间隔，避免启动或代理重启后同时握手
+	int		keepalive;
+	int		max_inflight;          // 每个连接的 QoS1 在途上限，取小值以限制每个连接的内存
+	int		reconnect_base_ms;
+	int		reconnect_max_ms;
+} mqtt_mux_config_t;
+
+typedef struct {
+	uint32_t	clients;
+	uint32_t	connected;
+	uint32_t	connecting;
+	uint64_t	connects;          // 发起的连接
+	uint64_t	connacks;          // 连接成功
+	uint64_t	failures;          // 连接失败或被拒绝
+	uint64_t	disconnects;       // 已连接后断开
+	uint64_t	published;
+	uint64_t	publish_failed;    // 未连接或发布失败
+	uint64_t	spooled;           // 未能发布、写入 spool 的采样
+	uint64_t	replayed;          // 设备重连后从 spool 回放的采样
+	uint64_t	received;          // 下行消息
+	uint64_t	wakeups;           // epoll_wait 返回次数
+	uint64_t	events;            // 处理的套接字事件
+	uint32_t	client_bytes;      // 每个连接在本模块中占用的字节数（不含 libmosquitto 和 TLS）
+} mqtt_mux_stats_t;
+
+int mqtt_mux_init(const mqtt_mux_config_t *config, const char *host, int port, const char *ca_cert);
+int mqtt_mux_add(const char *device_path, const char *device_id, const char *client_id, const char *password);
+int mqtt_mux_count(void);
+int mqtt_mux_find_path(const char *path);
+const char *mqtt_mux_device_id(int index);
+
+int mqtt_mux_publish(int index, const char *topic, const void *payload, int payloadlen, int qos);
+int mqtt_mux_report(int index, const telemetry_record_t *rec);
+int mqtt_mux_replay(const void *record, int len);
+uint64_t mqtt_mux_reconnects(void);
+
+void *mqtt_mux_thread_func(void *arg);
+void mqtt_mux_cleanup(void);
+
+void mqtt_mux_get_stats(mqtt_mux_stats_t *stats);
+void mqtt_mux_log_stats(void);
+
+#endif //__MQTT_MUX_H
@@ -0,0 +1,84 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  mqtt_sink.h
+ *    Description:  Named MQTT sinks with per-topic fan-out and endpoint failover.
+ *                  mqtt_config 中的代理是内置的 "primary" 汇点（命令下发、spool 回放仍只走它），
+ *                  "sinks" 中配置的其它代理各自拥有客户端实例、发送队列和统计，
+ *                  "routes" 规则按主题决定消息发往哪些汇点。
+ *
+ *        Version:  1.0.0(2025年08月29日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月29日 09时41分13秒"
+ *
+ ********************************************************************************/
+
+#ifndef __MQTT_SINK_H
+#define __MQTT_SINK_H
+
+#include <stdint.h>
+
+#define MQTT_SINK_MAX			4    // 不含 primary
+#define MQTT_SINK_ENDPOINT_MAX	4
+#define MQTT_SINK_ROUTE_MAX		8
+#define MQTT_SINK_PRIMARY_NAME	"primary"
+
+typedef struct {
+	char	*host;
+	int		port;
+} mqtt_endpoint_t;
+
+// 一个汇点：多个 endpoint 时按顺序优先，按连接状况和 PUBACK 时延切换
+typedef struct {
+	char			*name;
+	mqtt_endpoint_t	endpoints[MQTT_SINK_ENDPOINT_MAX];
+	int				endpoint_count;
+	char			*client_id;
+	char			*username;
+	char			*password;
+	char			*ca_cert;
+	int				keepalive;
+	int				queue_size;            // 发送队列长度，满时丢弃最旧的消息
+	int				max_inflight;
+	int				failover_latency_ms;   // PUBACK 平均时延超过该值时切换 endpoint，0 表示不按时延切换
+	int				failover_after_sec;    // 连续断开超过该时间时切换 endpoint
+} mqtt_sink_config_t;
+
+// 路由规则：主题过滤器（支持 '+' '#'）-> 汇点名列表
+typedef struct {
+	char	*topic;
+	char	*sinks[MQTT_SINK_MAX + 1];
+	int		sink_count;
+} mqtt_route_config_t;
+
+typedef struct {
+	int					sink_count;
+	mqtt_sink_config_t	sinks[MQTT_SINK_MAX];
+	int					route_count;
+	mqtt_route_config_t	routes[MQTT_SINK_ROUTE_MAX];
+} mqtt_sinks_config_t;
+
+typedef struct {
+	uint64_t	queued;
+	uint64_t	published;
+	uint64_t	acked;
+	uint64_t	dropped;        // 队列已满被丢弃的消息数
+	uint64_t	failovers;
+	uint32_t	latency_ewma_ms;
+	uint32_t	latency_max_ms;
+	uint32_t	pending;        // 当前排队数
+	int			connected;
+	int			endpoint;
+} mqtt_sink_stats_t;
+
+int mqtt_sink_init(const mqtt_sinks_config_t *config);
+void mqtt_sink_cleanup(void);
+int mqtt_sink_count(void);
+
+int mqtt_sink_publish(const char *topic, const void *payload, int payloadlen, int qos, int traffic_class);
+void *sink_thread_func(void *arg);
+
+void mqtt_sink_log_stats(void);
+
+#endif //__MQTT_SINK_H
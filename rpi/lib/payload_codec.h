@@ -0,0 +1,74 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  payload_codec.h
+ *    Description:  Pluggable telemetry payload encoders.
+ *                  上报负载的编码方式按主题配置：json（华为云 IoTDA 格式，默认）、cbor、
+ *                  proto（Sparkplug B 风格的 protobuf），并可选择只上报相对上一帧变化的属性。
+ *
+ *        Version:  1.0.0(2025年08月27日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月27日 10时12分48秒"
+ *
+ ********************************************************************************/
+
+#ifndef __PAYLOAD_CODEC_H
+#define __PAYLOAD_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "telemetry.h"
+
+#define PAYLOAD_CODEC_MAX_TOPICS	8
+
+// 编码结果的最大长度，JSON 是最长的编码
+#define PAYLOAD_CODEC_MAX			TELEMETRY_JSON_MAX
+
+// payload_encode 的 flags
+#define PAYLOAD_ENCODE_EVENT_TIME	0x01   // 附带采样时间（断线回放）
+#define PAYLOAD_ENCODE_KEYFRAME		0x02   // 强制完整帧：写入 spool 或回放期间的帧不能依赖上一帧
+
+// 单个主题的编码规则（来自配置文件 "payload_codec" 数组）
+typedef struct {
+	char	*topic;
+	char	*codec;              // "json" / "cbor" / "proto"
+	int		delta;               // 非 0 时只编码相对上一帧变化的属性
+	int		keyframe_interval;   // 每隔多少帧发送一次完整帧，0 表示使用默认值
+} payload_codec_rule_t;
+
+typedef struct {
+	int						count;
+	payload_codec_rule_t	rules[PAYLOAD_CODEC_MAX_TOPICS];
+} payload_codec_config_t;
+
+// 每一帧的编码参数
+typedef struct {
+	int			with_event_time;  // 附带采样时间（断线回放）
+	int			keyframe;         // 完整帧：包含全部属性，proto 还附带属性名
+	uint32_t	seq;              // 帧序号，接收方据此发现丢帧
+} payload_frame_t;
+
+// 编码器：返回写入 buf 的长度，失败返回 TELEMETRY_ERR_xxx
+typedef struct {
+	const char	*name;
+	int			is_text;
+	int			(*encode)(const telemetry_record_t *rec, const payload_frame_t *frame, uint8_t *buf, size_t size);
+} payload_codec_t;
+
+typedef struct payload_encoder_s payload_encoder_t;
+
+int payload_codec_init(const payload_codec_config_t *config);
+const payload_codec_t *payload_codec_find(const char *name);
+
+payload_encoder_t *payload_encoder_get(const char *topic);
+const char *payload_encoder_name(const payload_encoder_t *enc);
+int payload_encoder_is_text(const payload_encoder_t *enc);
+
+int payload_encode(payload_encoder_t *enc, const telemetry_record_t *rec, int flags, uint8_t *buf, size_t size);
+void payload_encode_commit(payload_encoder_t *enc, const telemetry_record_t *rec, int len);
+
+void payload_codec_log_stats(void);
+
+#endif //__PAYLOAD_CODEC_H
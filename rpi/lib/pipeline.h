@@ -0,0 +1,49 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  pipeline.h
+ *    Description:  Uplink processing pipeline.
+ *                  BLE 通知依次经过 intake -> decode -> analytics -> encode -> publish 各阶段，
+ *                  阶段之间是有界队列（publish 阶段的队列即 publish_lane），慢的阶段只会
+ *                  让自己的队列按过载策略丢弃或抽稀，不会把延迟一路堆积到 D-Bus。
+ *
+ *        Version:  1.0.0(2025年09月01日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月01日 16时20分44秒"
+ *
+ ********************************************************************************/
+
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+#include <stddef.h>
+
+#include "stage_queue.h"
+
+// 阶段之间的队列
+enum {
+	PIPELINE_Q_INTAKE = 0,    // D-Bus 通知 -> 解码
+	PIPELINE_Q_ANALYTICS,     // 解码后的采样 -> 告警判断
+	PIPELINE_Q_ENCODE,        // 采样 -> 上报过滤、编码和发布
+	PIPELINE_Q_COUNT
+};
+
+// 单条 BLE 通知的最大长度
+#define PIPELINE_RAW_MAX	128
+
+typedef struct {
+	stage_queue_config_t	queues[PIPELINE_Q_COUNT];
+} pipeline_config_t;
+
+int pipeline_init(const pipeline_config_t *config);
+int pipeline_start(void);
+void pipeline_stop(void);
+
+int pipeline_submit(const char *path, const char *raw, size_t len);
+int pipeline_backlog(void);
+
+const char *pipeline_queue_name(int queue);
+void pipeline_log_stats(void);
+
+#endif //__PIPELINE_H
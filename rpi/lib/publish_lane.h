@@ -0,0 +1,65 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  publish_lane.h
+ *    Description:  Priority lanes for the primary broker's publish path.
+ *                  每个流量类别一条发送队列：告警和命令响应严格优先，属性上报和 spool 回放
+ *                  按权重分享剩余带宽；各队列和整个设备各有一个令牌桶，发送速率不超过
+ *                  IoTDA 的单设备消息速率配额。任意线程都可以无锁提交，由拥有 mosquitto 实例的
+ *                  下行线程在连接正常时调度发送。
+ *
+ *        Version:  1.0.0(2025年08月30日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月30日 14时26分52秒"
+ *
+ ********************************************************************************/
+
+#ifndef __PUBLISH_LANE_H
+#define __PUBLISH_LANE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "mqtt_gateway.h"
+
+// 消息槽位大小
+#define PUBLISH_LANE_TOPIC_MAX		256
+#define PUBLISH_LANE_PAYLOAD_MAX	1024
+
+typedef struct {
+	int		rate;      // 条/秒，0 表示本队列不限速（仍受设备总速率限制）
+	int		burst;     // 令牌桶容量
+	int		weight;    // 加权队列的权重（严格优先的队列忽略）
+	int		depth;     // 队列长度
+} publish_lane_config_t;
+
+typedef struct {
+	int						device_rate;    // 整个设备的消息速率上限（条/秒），0 表示不限
+	int						device_burst;
+	publish_lane_config_t	lanes[MQTT_TRAFFIC_CLASS_COUNT];
+} publish_lanes_config_t;
+
+typedef struct {
+	uint64_t	submitted;
+	uint64_t	sent;
+	uint64_t	rejected;      // 队列已满
+	uint64_t	throttled;     // 因令牌不足被推迟发送的消息数（每条消息只计一次）
+	uint32_t	depth;         // 当前排队数
+	uint32_t	wait_max_ms;   // 最长排队时间
+	uint64_t	wait_sum_ms;
+} publish_lane_stats_t;
+
+// 退出时接收仍在排队的消息，返回 0 表示已接管（例如写入 spool）
+typedef int (*publish_lane_flush_t)(int traffic_class, const char *topic, const void *payload, int payloadlen, time_t submit_time);
+
+int publish_lanes_init(const publish_lanes_config_t *config);
+int publish_lane_submit(int traffic_class, const char *topic, const void *payload, int payloadlen, int qos);
+int publish_lane_room(int traffic_class);
+int publish_lanes_drain(void);
+int publish_lanes_flush(publish_lane_flush_t flush);
+
+void publish_lane_get_stats(int traffic_class, publish_lane_stats_t *stats);
+void publish_lanes_log_stats(void);
+
+#endif //__PUBLISH_LANE_H
@@ -0,0 +1,80 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  rate_ctl.h
+ *    Description:  Adaptive sampling rate control.
+ *                  根据网关积压（流水线队列、遥测发送队列、spool）和 MQTT 连接状况判断
+ *                  网关是否处于压力状态：压力下让病情稳定的设备降低采样频率，设备告警期间
+ *                  提高采样频率。速率命令经命令队列写入设备的可写特征值。
+ *                  进入/退出压力使用高低水位和最短保持时间，避免来回切换。
+ *
+ *        Version:  1.0.0(2025年09月04日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月04日 10时21分37秒"
+ *
+ ********************************************************************************/
+
+#ifndef __RATE_CTL_H
+#define __RATE_CTL_H
+
+#include <stdint.h>
+
+#include "subdev.h"
+
+// 网关自己的 BLE 设备和各子设备
+#define RATE_CTL_DEVICE_MAX		(1 + SUBDEV_MAX)
+#define RATE_CTL_CMD_MAX		64
+
+// 网关状态
+enum {
+	RATE_CTL_NORMAL = 0,
+	RATE_CTL_PRESSURE,
+};
+
+typedef struct {
+	int		enabled;
+	int		normal_sec;        // 正常采样间隔（设备启动时的默认值）
+	int		slow_sec;          // 压力下稳定设备的采样间隔
+	int		alert_sec;         // 告警期间的采样间隔
+	int		high_water;        // 积压达到该值进入压力状态
+	int		low_water;         // 积压回落到该值以下才退出压力状态
+	int		disconnect_sec;    // MQTT 断开超过该时间同样视为压力
+	int		hold_sec;          // 状态切换或降速后至少保持的时间
+	int		alert_hold_sec;    // 最后一次告警后维持告警速率的时间
+	char	cmd_format[RATE_CTL_CMD_MAX];   // 速率命令，%d 为采样间隔（秒），例如 "RATE:%d"
+} rate_ctl_config_t;
+
+// 每个控制周期的输入
+typedef struct {
+	int		backlog;           // 等待上报的采样数
+	int		connected;         // MQTT 是否已连接
+} rate_ctl_input_t;
+
+typedef struct {
+	int			state;
+	uint32_t	backlog;
+	uint64_t	ticks;
+	uint64_t	pressure_enter;
+	uint64_t	pressure_exit;
+	uint64_t	alerts;            // 进入告警速率的次数
+	uint64_t	commands;          // 发出的速率命令
+	uint64_t	acked;             // 设备已确认（写入成功）的速率命令
+	uint64_t	failed;            // 命令队列已满或写入失败、过期
+	uint64_t	slow_sec;          // 各设备处于降速状态的累计时间
+	uint64_t	alert_sec;         // 各设备处于告警速率的累计时间
+} rate_ctl_stats_t;
+
+int rate_ctl_init(const rate_ctl_config_t *config);
+int rate_ctl_add_device(const char *device_path);
+
+void rate_ctl_alert(const char *device_path);
+void rate_ctl_done(const char *device_path, int interval, int ok);
+void rate_ctl_set_link(const char *device_path, int up);
+void rate_ctl_tick(const rate_ctl_input_t *input);
+int rate_ctl_interval(int device);
+
+void rate_ctl_get_stats(rate_ctl_stats_t *stats);
+void rate_ctl_log_stats(void);
+
+#endif //__RATE_CTL_H
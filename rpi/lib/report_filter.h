@@ -0,0 +1,60 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  report_filter.h
+ *    Description:  Deadband and heartbeat filter for telemetry reports.
+ *                  属性取值相对上次上报的变化超过死区时才上报，取值稳定时每隔
+ *                  publish_interval_sec 上报一次心跳；告警采样和告警解除总是上报。
+ *
+ *        Version:  1.0.0(2025年08月31日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月31日 10时05分19秒"
+ *
+ ********************************************************************************/
+
+#ifndef __REPORT_FILTER_H
+#define __REPORT_FILTER_H
+
+#include <stdint.h>
+
+#include "telemetry.h"
+
+// 各属性的死区，单位与 telemetry_record_t 中缩放后的整数相同
+typedef struct {
+	int		abs;       // 绝对变化量超过该值时上报
+	int		rel_pct;   // 相对变化超过该百分比时上报，0 表示不按相对变化判断
+} report_deadband_t;
+
+typedef struct {
+	int					heartbeat_sec;   // 心跳上报周期（publish_interval_sec），0 表示不过滤，每个采样都上报
+	report_deadband_t	deadband[TELEMETRY_PROP_COUNT];
+} report_filter_config_t;
+
+// 上报原因
+enum {
+	REPORT_SUPPRESS = 0,   // 不上报
+	REPORT_FIRST,          // 启动后的第一个采样
+	REPORT_DEADBAND,       // 超出死区
+	REPORT_HEARTBEAT,      // 心跳
+	REPORT_ALERT,          // 告警采样或告警解除
+	REPORT_UNFILTERED,     // 未启用过滤
+};
+
+typedef struct {
+	uint64_t	samples;
+	uint64_t	reported;
+	uint64_t	deadband;
+	uint64_t	heartbeat;
+	uint64_t	alert;
+	uint64_t	suppressed;
+} report_filter_stats_t;
+
+int report_filter_init(const report_filter_config_t *config);
+int report_filter_check(const telemetry_record_t *rec, int alert);
+void report_filter_commit(const telemetry_record_t *rec, int alert);
+
+void report_filter_get_stats(report_filter_stats_t *stats);
+void report_filter_log_stats(void);
+
+#endif //__REPORT_FILTER_H
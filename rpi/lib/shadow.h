@@ -0,0 +1,64 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  shadow.h
+ *    Description:  Local device shadow.
+ *                  每个 BLE 设备保存最近解码出的属性值和各自的更新时间（reported），
+ *                  云端 properties/get 在数据足够新时直接用缓存回答，不经过 BLE；
+ *                  properties/set 与设备当前值和正在写入的值（desired）比较，只把有变化的
+ *                  属性写入 BLE。
+ *
+ *        Version:  1.0.0(2025年09月03日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月03日 14时12分09秒"
+ *
+ ********************************************************************************/
+
+#ifndef __SHADOW_H
+#define __SHADOW_H
+
+#include <stdint.h>
+
+#include "telemetry.h"
+#include "subdev.h"
+
+// 网关自己的 BLE 设备和各子设备
+#define SHADOW_DEVICE_MAX	(1 + SUBDEV_MAX)
+
+// shadow_get 返回值
+#define SHADOW_FRESH		0    // 全部属性都在 max_age_ms 以内
+#define SHADOW_STALE		1    // 有属性过期或缺失，返回的是现有的缓存
+#define SHADOW_EMPTY		2    // 还没有收到过数据
+
+typedef struct {
+	int		max_age_ms;     // properties/get 直接用缓存回答时允许的最大数据年龄
+} shadow_config_t;
+
+typedef struct {
+	uint64_t	updates;         // 来自通知的更新
+	uint64_t	get_hits;        // 用缓存回答的 properties/get
+	uint64_t	get_misses;      // 缓存过期，转为 BLE 读取
+	uint64_t	set_requests;
+	uint64_t	set_props;       // set 请求中的属性数
+	uint64_t	set_written;     // 实际写入 BLE 的属性数
+	uint64_t	set_collapsed;   // 与上次写入的值或正在写入的值相同，没有写入
+} shadow_stats_t;
+
+int shadow_init(const shadow_config_t *config);
+int shadow_add_device(const char *device_path);
+int shadow_find(const char *path);
+
+void shadow_update(int device, const telemetry_record_t *rec);
+int shadow_get(int device, telemetry_record_t *rec);
+int shadow_query(int device, telemetry_record_t *rec);
+
+int shadow_parse_set(const void *payload, int payloadlen, telemetry_record_t *desired);
+uint32_t shadow_set_desired(int device, const telemetry_record_t *desired);
+void shadow_set_done(int device, uint32_t mask, int ok);
+void shadow_link_down(int device);
+
+void shadow_get_stats(shadow_stats_t *stats);
+void shadow_log_stats(void);
+
+#endif //__SHADOW_H
@@ -0,0 +1,68 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  spool.h
+ *    Description:  Disk-backed, memory-mapped store-and-forward spool.
+ *                  MQTT 断线期间的遥测数据暂存在分段环形文件中，重连后按原时间戳回放。
+ *
+ *        Version:  1.0.0(2025年08月12日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月12日 10时12分40秒"
+ *
+ ********************************************************************************/
+
+#ifndef __SPOOL_H
+#define __SPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// 错误码
+#define SPOOL_OK            0
+#define SPOOL_EMPTY         1  // 没有待回放的记录
+#define SPOOL_ERR_DISABLED  -1 // spool 未启用或未打开
+#define SPOOL_ERR_IO        -2 // 文件/映射操作失败
+#define SPOOL_ERR_TOOBIG    -3 // 单条记录超过段大小
+#define SPOOL_ERR_BUFFER    -4 // 调用者缓冲区太小
+
+// 单条记录负载的最大长度
+#define SPOOL_MAX_PAYLOAD   1024
+
+// 记录所属的上报通道，回放时据此选择主题（旧文件中的记录都是 0）
+#define SPOOL_CHANNEL_GATEWAY   0  // 网关自己的属性上报（publish_topic）
+#define SPOOL_CHANNEL_SUBDEV    1  // 子设备批量上报
+#define SPOOL_CHANNEL_DIRECT    2  // 直连设备以自己的身份上报，记录以 device_id 和 '\0' 开头
+
+// Spool 配置（对应配置文件中的 "spool_config" 段）
+typedef struct {
+	int			enable;         // 是否启用
+	char		*path;          // spool 文件路径
+	size_t		max_bytes;      // 磁盘字节预算（所有段的总大小）
+	size_t		segment_size;   // 每个段的大小，写满后整段刷盘
+	int			replay_rate;    // 重连后每秒最多回放的记录数
+} spool_config_t;
+
+// Spool 统计信息
+typedef struct {
+	uint64_t	appended;       // 累计写入的记录数
+	uint64_t	replayed;       // 累计回放（确认消费）的记录数
+	uint64_t	dropped;        // 超出预算被覆盖丢弃的记录数
+	uint64_t	crc_errors;     // 恢复或读取时发现的损坏记录数
+	uint64_t	corrupt;        // 回放时因损坏被跳过（丢失）的记录数
+	uint64_t	pending;        // 当前待回放的记录数
+	size_t		pending_bytes;  // 当前待回放的字节数
+} spool_stats_t;
+
+int spool_open(const spool_config_t *cfg);
+void spool_close(void);
+int spool_is_open(void);
+
+int spool_append(int channel, time_t timestamp, const void *payload, size_t len);
+int spool_peek(void *buf, size_t size, size_t *len, time_t *timestamp, int *channel);
+void spool_consume(void);
+
+void spool_get_stats(spool_stats_t *stats);
+
+#endif //__SPOOL_H
@@ -0,0 +1,70 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  stage_queue.h
+ *    Description:  Bounded queue between two pipeline stages.
+ *                  固定容量、元素预分配的队列，满时按配置的过载策略处理：阻塞上游、
+ *                  丢弃最旧、丢弃最新，或按设备抽稀（每个设备每 N 个采样保留一个）。
+ *
+ *        Version:  1.0.0(2025年09月01日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月01日 16时20分44秒"
+ *
+ ********************************************************************************/
+
+#ifndef __STAGE_QUEUE_H
+#define __STAGE_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 过载策略（优先元素如告警采样不会被抽稀，队列满时挤掉最旧的元素而不是自己被丢弃）
+enum {
+	STAGE_POLICY_BLOCK = 0,     // 阻塞上游直到有空位
+	STAGE_POLICY_DROP_OLDEST,   // 丢弃队首最旧的元素
+	STAGE_POLICY_DROP_NEWEST,   // 丢弃新到的元素
+	STAGE_POLICY_DECIMATE,      // 队列过半后每个设备每 N 个只保留一个，满时丢弃新到的元素
+};
+
+// 返回值
+#define STAGE_OK			0
+#define STAGE_DROPPED		1   // 新元素被丢弃（drop-newest / 抽稀）
+#define STAGE_EMPTY			2   // 等待超时，队列仍为空
+#define STAGE_CLOSED		3   // 队列已关闭且已取空
+#define STAGE_ERR			-1
+
+typedef struct {
+	int		capacity;
+	int		policy;
+	int		decimate;    // 抽稀间隔 N
+} stage_queue_config_t;
+
+typedef struct {
+	uint64_t	enqueued;
+	uint64_t	dequeued;
+	uint64_t	dropped_oldest;
+	uint64_t	dropped_newest;
+	uint64_t	decimated;
+	uint64_t	blocked;         // 生产者因队列已满等待的次数
+	uint32_t	depth;
+	uint32_t	high_water;      // 队列长度峰值
+	uint32_t	wait_max_ms;     // 元素在队列中停留的最长时间
+	uint64_t	wait_sum_ms;
+} stage_queue_stats_t;
+
+typedef struct stage_queue_s stage_queue_t;
+
+stage_queue_t *stage_queue_create(const char *name, size_t item_size, const stage_queue_config_t *config);
+void stage_queue_destroy(stage_queue_t *q);
+
+int stage_queue_push(stage_queue_t *q, const void *item, uint32_t device_key, int priority);
+int stage_queue_pop(stage_queue_t *q, void *item, int timeout_ms);
+void stage_queue_close(stage_queue_t *q);
+
+int stage_queue_policy_parse(const char *name);
+const char *stage_queue_policy_name(int policy);
+void stage_queue_get_stats(stage_queue_t *q, stage_queue_stats_t *stats);
+void stage_queue_log_stats(stage_queue_t *q);
+
+#endif //__STAGE_QUEUE_H
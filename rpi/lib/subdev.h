@@ -0,0 +1,81 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  subdev.h
+ *    Description:  IoTDA gateway sub-devices.
+ *                  网关以自己的 MQTT 身份接入，每个 BLE 手环对应一个 IoTDA 子设备。
+ *                  各子设备的最新采样合并成 sys/gateway/sub_devices/properties/report
+ *                  批量上报，一条消息包含多个设备；带 object_device_id 的下行命令按子设备
+ *                  路由回对应的 BLE 设备。
+ *                  本地代理接入的 Wi-Fi 节点在运行时登记为子设备，上报的 services 原样
+ *                  放进同一批量消息；CoAP 节点同样登记，它的采样和 BLE 子设备一样合并上报。
+ *
+ *        Version:  1.0.0(2025年09月03日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月03日 09时48分31秒"
+ *
+ ********************************************************************************/
+
+#ifndef __SUBDEV_H
+#define __SUBDEV_H
+
+#include <stdint.h>
+
+#include "telemetry.h"
+
+#define SUBDEV_MAX			16      // 配置的 BLE 子设备
+#define SUBDEV_NODE_MAX		48      // 运行时登记的本地节点
+#define SUBDEV_TABLE_MAX	(SUBDEV_MAX + SUBDEV_NODE_MAX)
+#define SUBDEV_ID_MAX		64
+#define SUBDEV_SERVICES_MAX	512     // 本地节点一次上报的 services 数组
+
+// 子设备：BLE 地址（与 ble_config.device_mac 写法相同）和 IoTDA 子设备 ID
+// 直连模式下 device_id 是设备自己的 IoTDA 身份，password / client_id 用于该设备的 MQTT 连接
+typedef struct {
+	char	*mac;
+	char	*device_id;
+	char	*password;
+	char	*client_id;     // NULL 时使用 device_id
+} subdev_entry_config_t;
+
+typedef struct {
+	int						count;
+	int						batch_interval_ms;   // 采样最多等待多久与其他设备合并上报
+	int						batch_max;           // 每条消息最多包含的子设备数，0 表示只受负载长度限制
+	subdev_entry_config_t	devices[SUBDEV_MAX];
+} subdev_config_t;
+
+typedef struct {
+	uint64_t	samples;       // 收到的采样
+	uint64_t	merged;        // 上报前被同一设备的新采样覆盖
+	uint64_t	batches;       // 成功发布的批量消息
+	uint64_t	reported;      // 批量消息中的设备条目总数
+	uint64_t	failed;        // 发布失败（写入 spool，spool 未启用时保留到下一批）
+	uint64_t	spooled;       // 写入 spool 等待回放的设备条目
+	uint32_t	pending;       // 当前等待上报的设备数
+	uint32_t	nodes;         // 已登记的本地节点
+} subdev_stats_t;
+
+int subdev_init(const subdev_config_t *config, const char *gateway_id);
+int subdev_count(void);          // 只含 BLE 子设备，序号在本地节点之前
+
+int subdev_add_node(const char *device_id);
+int subdev_is_node(int index);
+
+int subdev_find_path(const char *path);
+int subdev_find_id(const char *device_id);
+const char *subdev_device_id(int index);
+const char *subdev_path(int index);
+const char *subdev_notify_path(int index);
+const char *subdev_write_path(int index);
+const char *subdev_topic(void);
+
+void subdev_report(int index, const telemetry_record_t *rec, int alert);
+int subdev_report_services(int index, const char *services, int len);
+int subdev_flush(int force);
+
+void subdev_get_stats(subdev_stats_t *stats);
+void subdev_log_stats(void);
+
+#endif //__SUBDEV_H
@@ -0,0 +1,79 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  telemetry.h
+ *    Description:  Telemetry record schema.
+ *                  遥测属性只在 TELEMETRY_PROPERTIES 表中声明一次，记录结构体、
+ *                  BLE 通知解析、取值校验和华为云 JSON 序列化都由该表生成。
+ *
+ *        Version:  1.0.0(2025年08月18日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月18日 15时02分51秒"
+ *
+ ********************************************************************************/
+
+#ifndef __TELEMETRY_H
+#define __TELEMETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+
+/* 属性表：X(字段名, 云端属性名, BLE通知中的键名, 缩放系数, 最小值, 最大值)
+ * 字段以缩放后的整数保存，scale 为 10 表示保留一位小数，序列化时还原为 value/scale。
+ * 新增属性只需在这里加一行。
+ */
+#define TELEMETRY_PROPERTIES(X) \
+	X(hr,   "HR",   "HR",   1, 0, 300) \
+	X(spo2, "Spo2", "SpO2", 1, 0, 100)
+
+// 华为云 IoTDA 服务ID
+#define TELEMETRY_SERVICE_ID	"mqtt"
+
+
+// 属性序号
+enum {
+#define X(name, key, ble_key, scale, min, max) TELEMETRY_PROP_##name,
+	TELEMETRY_PROPERTIES(X)
+#undef X
+	TELEMETRY_PROP_COUNT
+};
+
+// 遥测记录
+typedef struct {
+#define X(name, key, ble_key, scale, min, max) int32_t name;
+	TELEMETRY_PROPERTIES(X)
+#undef X
+	uint32_t	present;    // 已解析出的属性位图，第 i 位对应 TELEMETRY_PROP_xxx
+	time_t		timestamp;  // 采样时间（UTC 秒）
+} telemetry_record_t;
+
+#define TELEMETRY_ALL_PRESENT	((1u << TELEMETRY_PROP_COUNT) - 1)
+
+// JSON 上报缓冲区的最大长度：固定前后缀 + 每个属性的键和最长取值 + event_time
+#define TELEMETRY_JSON_MAX (64 + 48 \
+	TELEMETRY_PROPERTIES(TELEMETRY_JSON_PROP_LEN))
+#define TELEMETRY_JSON_PROP_LEN(name, key, ble_key, scale, min, max) + sizeof(key) + 16
+
+// BLE 格式（"HR:72,SpO2:98"）的最大长度
+#define TELEMETRY_BLE_MAX (1 \
+	TELEMETRY_PROPERTIES(TELEMETRY_BLE_PROP_LEN))
+#define TELEMETRY_BLE_PROP_LEN(name, key, ble_key, scale, min, max) + sizeof(ble_key) + 14
+
+
+// 错误码
+#define TELEMETRY_OK			0
+#define TELEMETRY_ERR_PARSE		-1 // 通知格式错误
+#define TELEMETRY_ERR_MISSING	-2 // 缺少属性
+#define TELEMETRY_ERR_RANGE		-3 // 取值超出范围
+#define TELEMETRY_ERR_BUFFER	-4 // 输出缓冲区太小
+
+int telemetry_parse_ble(const char *str, size_t len, telemetry_record_t *rec);
+int telemetry_validate(const telemetry_record_t *rec);
+int telemetry_alert_band(const telemetry_record_t *rec, int hr_threshold, int spo2_threshold);
+int telemetry_serialize_json(const telemetry_record_t *rec, int with_event_time, char *buf, size_t size);
+int telemetry_serialize_ble(const telemetry_record_t *rec, uint32_t mask, char *buf, size_t size);
+
+#endif //__TELEMETRY_H
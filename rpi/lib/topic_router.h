@@ -0,0 +1,54 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  topic_router.h
+ *    Description:  MQTT topic routing trie.
+ *                  启动时把订阅的主题模式（支持 '+' 和 '#' 通配符）按层级建成前缀树，
+ *                  收到消息时沿树匹配并调用对应的处理函数，匹配过程不分配内存。
+ *
+ *        Version:  1.0.0(2025年08月21日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月21日 16时40分05秒"
+ *
+ ********************************************************************************/
+
+#ifndef __TOPIC_ROUTER_H
+#define __TOPIC_ROUTER_H
+
+#include <stdint.h>
+
+#define TOPIC_ROUTER_MAX_NODES		64
+#define TOPIC_ROUTER_LEVEL_MAX		64  // 单个主题层级的最大长度
+#define TOPIC_ROUTER_MAX_CAPTURES	4   // '+' 通配符捕获的层级数
+
+
+// 匹配结果：'+' 通配符按出现顺序捕获对应的主题层级
+typedef struct {
+	const char	*topic;
+	int			count;
+	const char	*level[TOPIC_ROUTER_MAX_CAPTURES];
+	int			len[TOPIC_ROUTER_MAX_CAPTURES];
+} topic_match_t;
+
+typedef void (*topic_handler_t)(const topic_match_t *match, const void *payload, int payloadlen, void *arg);
+
+typedef struct {
+	char			level[TOPIC_ROUTER_LEVEL_MAX];
+	uint8_t			len;
+	int16_t			child;    // 第一个子节点
+	int16_t			sibling;  // 下一个兄弟节点
+	topic_handler_t	handler;
+	void			*arg;
+} topic_node_t;
+
+typedef struct {
+	topic_node_t	nodes[TOPIC_ROUTER_MAX_NODES];
+	int				count;
+} topic_router_t;
+
+void topic_router_init(topic_router_t *router);
+int topic_router_add(topic_router_t *router, const char *pattern, topic_handler_t handler, void *arg);
+int topic_router_dispatch(const topic_router_t *router, const char *topic, const void *payload, int payloadlen);
+
+#endif //__TOPIC_ROUTER_H
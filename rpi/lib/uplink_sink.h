@@ -0,0 +1,73 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  uplink_sink.h
+ *    Description:  Pluggable uplink sink for the encode stage.
+ *                  encode 阶段和子设备批量上报把编码好的消息交给 uplink_publish，
+ *                  由配置选择的汇点处理：
+ *                    mqtt   : 经 mqtt_sink 路由到 primary 和附加代理（默认）
+ *                    null   : 直接丢弃，用于测量流水线本身的吞吐
+ *                    memory : 只计数和计算校验和
+ *                    file   : 追加写入文件，超过 max_bytes 时轮转
+ *                    unix   : 每条消息作为一个数据报发给本地 Unix 域套接字
+ *                  tee 模式下 file / unix 作为旁路，本地进程可以同时取得上报的数据。
+ *
+ *        Version:  1.0.0(2025年09月04日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月04日 15时36分52秒"
+ *
+ ********************************************************************************/
+
+#ifndef __UPLINK_SINK_H
+#define __UPLINK_SINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mqtt_gateway.h"
+
+// uplink_publish 返回值（mqtt 汇点返回 mosquitto / publish_lane 的返回值）
+#define UPLINK_OK			MOSQ_ERR_SUCCESS
+#define UPLINK_ERR			-200   // 写入失败
+#define UPLINK_NO_READER	-201   // unix：没有进程在监听
+#define UPLINK_DROPPED		-202   // file / unix 汇点写入失败，已计数，采样丢弃而不转入 spool
+
+typedef struct {
+	char	*type;          // "mqtt" / "null" / "memory" / "file" / "unix"
+	char	*path;          // file：输出文件；unix：接收方的数据报套接字路径
+	int		max_bytes;      // file：单个文件的最大长度，0 表示不轮转
+	int		max_files;      // file：保留的历史文件数（path.1 ... path.N）
+	int		tee;            // 非 0 时消息照常经 mqtt 汇点上报，本汇点只是旁路，其结果不影响返回值
+} uplink_sink_config_t;
+
+typedef struct {
+	uint64_t	messages;
+	uint64_t	bytes;
+	uint64_t	failed;
+	uint64_t	no_reader;      // unix：接收方不存在
+	uint64_t	by_class[MQTT_TRAFFIC_CLASS_COUNT];
+	uint64_t	rotations;      // file
+	uint32_t	checksum;       // memory：所有主题和负载的 FNV-1a 校验和
+} uplink_sink_stats_t;
+
+// 汇点实现：open 失败时返回 -1
+typedef struct {
+	const char	*name;
+	int			(*open)(const uplink_sink_config_t *config);
+	int			(*publish)(const char *topic, const void *payload, int payloadlen, int qos, int traffic_class);
+	int			(*ready)(void);
+	void		(*close)(void);
+} uplink_sink_t;
+
+int uplink_sink_init(const uplink_sink_config_t *config);
+void uplink_sink_close(void);
+const char *uplink_sink_name(void);
+int uplink_sink_ready(void);
+
+int uplink_publish(const char *topic, const void *payload, int payloadlen, int qos, int traffic_class);
+
+void uplink_sink_get_stats(uplink_sink_stats_t *stats);
+void uplink_sink_log_stats(void);
+
+#endif //__UPLINK_SINK_H
@@ -21,6 +21,24 @@
 #include "mqtt_gateway.h"
 #include "config_parser.h"
 #include "pidfile.h"
+#include "spool.h"
+#include "payload_codec.h"
+#include "mqtt_conn.h"
+#include "mqtt_sink.h"
+#include "publish_lane.h"
+#include "report_filter.h"
+#include "pipeline.h"
+#include "inflight.h"
+#include "cmd_job.h"
+#include "cmd_dedup.h"
+#include "subdev.h"
+#include "shadow.h"
+#include "rate_ctl.h"
+#include "uplink_sink.h"
+#include "link_watch.h"
+#include "mqtt_mux.h"
+#include "local_broker.h"
+#include "coap_server.h"
 #include "log.h"
 
 // D-Bus连接对象
@@ -34,7 +52,6 @@ volatile int keep_running = 1;
 
 // 互斥锁
 pthread_mutex_t dbus_mutex;
-pthread_mutex_t mqtt_mutex;
 
 // 全局配置变量
 // MQTT 配置
@@ -47,12 +64,127 @@ char WRITABLE_CHARACTERISTIC_PATH[512];
 int HR_THRESHOLD;
 int SPO2_THRESHOLD;
 char WARNING_CMD[128];
+// 断线暂存配置
+spool_config_t spool_config;
+// 上报编码配置
+payload_codec_config_t codec_config;
+// 附加代理和路由配置
+mqtt_sinks_config_t sinks_config;
+// 发送队列配置
+publish_lanes_config_t lanes_config;
+// 上报死区配置
+report_filter_config_t filter_config;
+// 处理流水线队列配置
+pipeline_config_t pipeline_config;
+// 下行命令超时和 TTL 配置
+cmd_job_config_t cmd_job_config;
+// 网关子设备配置
+subdev_config_t subdev_config;
+// 设备影子配置
+shadow_config_t shadow_config;
+// 自适应采样速率配置
+rate_ctl_config_t rate_ctl_config;
+// 上行汇点配置
+uplink_sink_config_t uplink_config;
+// BLE 静默链路检测配置
+link_watch_config_t link_watch_config;
+// 直连模式（每个设备一个 MQTT 连接）配置
+mqtt_mux_config_t mux_config;
+// 本地 MQTT 代理配置
+local_broker_config_t broker_config;
+// CoAP 上报端点配置
+coap_server_config_t coap_config;
 
 // PID文件路径
 static char pid_file_path[PATH_MAX] = "./iot_gateway.pid";
 
 void cleanup_config();
 
+
+// 周期性输出运行统计：在途消息、PUBACK 时延和断线暂存情况
+static void log_runtime_stats(void)
+{
+    spool_stats_t spool_st;
+
+    inflight_log_stats();
+    cmd_job_log_stats();
+    cmd_dedup_log_stats();
+    subdev_log_stats();
+    shadow_log_stats();
+    rate_ctl_log_stats();
+    link_watch_log_stats();
+    mqtt_gateway_log_stats();
+    mqtt_conn_log_stats();
+    mqtt_sink_log_stats();
+    mqtt_mux_log_stats();
+    local_broker_log_stats();
+    coap_server_log_stats();
+    uplink_sink_log_stats();
+    publish_lanes_log_stats();
+    report_filter_log_stats();
+    pipeline_log_stats();
+    payload_codec_log_stats();
+
+    if (spool_is_open())
+    {
+        spool_get_stats(&spool_st);
+        log_info("Spool: appended=%llu replayed=%llu dropped=%llu crc_errors=%llu corrupt=%llu pending=%llu (%zu bytes)\n",
+                 (unsigned long long)spool_st.appended, (unsigned long long)spool_st.replayed,
+                 (unsigned long long)spool_st.dropped, (unsigned long long)spool_st.crc_errors,
+                 (unsigned long long)spool_st.corrupt, (unsigned long long)spool_st.pending,
+                 spool_st.pending_bytes);
+    }
+}
+
+// 采样速率控制周期：积压为流水线队列、遥测/批量发送队列和 spool 中等待上报的采样
+static void rate_ctl_tick_gateway(void)
+{
+    rate_ctl_input_t in;
+    publish_lane_stats_t lane_st;
+    spool_stats_t spool_st;
+
+    in.backlog = pipeline_backlog();
+    publish_lane_get_stats(MQTT_TRAFFIC_TELEMETRY, &lane_st);
+    in.backlog += lane_st.depth;
+    publish_lane_get_stats(MQTT_TRAFFIC_BULK, &lane_st);
+    in.backlog += lane_st.depth;
+    if (spool_is_open())
+    {
+        spool_get_stats(&spool_st);
+        in.backlog += (int)spool_st.pending;
+    }
+    in.connected = mqtt_connected_flag;
+
+    rate_ctl_tick(&in);
+}
+
+// 退出时仍在发送队列中的上报写入 spool，下次连上后回放；spool 只按通道记录网关和子设备批量上报，其他主题的消息丢弃
+static int spool_lane_message(int traffic_class, const char *topic, const void *payload, int payloadlen, time_t submit_time)
+{
+    int channel;
+
+    if (!spool_is_open())
+        return -1;
+
+    if (device_config.publish_topic && strcmp(topic, device_config.publish_topic) == 0)
+        channel = SPOOL_CHANNEL_GATEWAY;
+    else if (strcmp(topic, subdev_topic()) == 0)
+        channel = SPOOL_CHANNEL_SUBDEV;
+    else
+        return -1;
+
+    return spool_append(channel, submit_time, payload, payloadlen) == SPOOL_OK ? 0 : -1;
+}
+
+// 重新提交上次保存的未确认消息：发送队列放不下的上报转入 spool，不丢弃
+static int restore_message(int traffic_class, const char *topic, const void *payload, int payloadlen, int qos)
+{
+    if (publish_lane_submit(traffic_class, topic, payload, payloadlen, qos) == MOSQ_ERR_SUCCESS)
+        return 0;
+
+    return spool_lane_message(traffic_class, topic, payload, payloadlen, time(NULL));
+}
+
 // 清理函数，将在程序退出时自动调用
 void cleanup_handler()
 {
@@ -62,9 +194,30 @@ void cleanup_handler()
         remove_pid_file(pid_file_path);
     }
 
+    // 持久会话：保存仍未确认的上行消息，下次启动时重新发送
+    if (device_config.session_state_path && inflight_save(device_config.session_state_path) > 0)
+    {
+        log_info("Main: Unacknowledged messages saved to %s.\n", device_config.session_state_path);
+    }
+
+    // 发送队列中尚未发出的上报转入 spool（各线程已结束）
+    publish_lanes_flush(spool_lane_message);
+
+    // 关闭上行汇点（文件 / 套接字），之后才能释放其配置
+    uplink_sink_close();
+
     // 释放由strdup分配的内存
     cleanup_config();
 
+    // 关闭断线暂存文件，持久化读位置
+    spool_close();
+
+    // 断开附加代理
+    mqtt_sink_cleanup();
+    mqtt_mux_cleanup();
+    local_broker_cleanup();
+    coap_server_cleanup();
+
     // 释放其他资源
     if (global_dbus_conn)
     {
@@ -106,14 +259,57 @@ void cleanup_config()
     if (device_config.password) free(device_config.password);
     if (device_config.publish_topic) free(device_config.publish_topic);
     if (device_config.subscribe_topic) free(device_config.subscribe_topic);
+    if (device_config.session_state_path) free(device_config.session_state_path);
+    if (spool_config.path) free(spool_config.path);
+    for (int i = 0; i < codec_config.count; i++)
+    {
+        free(codec_config.rules[i].topic);
+        free(codec_config.rules[i].codec);
+    }
+    for (int i = 0; i < sinks_config.sink_count; i++)
+    {
+        mqtt_sink_config_t *sink = &sinks_config.sinks[i];
+        free(sink->name);
+        free(sink->client_id);
+        free(sink->username);
+        free(sink->password);
+        free(sink->ca_cert);
+        for (int j = 0; j < sink->endpoint_count; j++)
+            free(sink->endpoints[j].host);
+    }
+    for (int i = 0; i < sinks_config.route_count; i++)
+    {
+        free(sinks_config.routes[i].topic);
+        for (int j = 0; j < sinks_config.routes[i].sink_count; j++)
+            free(sinks_config.routes[i].sinks[j]);
+    }
+    if (uplink_config.type) free(uplink_config.type);
+    if (uplink_config.path) free(uplink_config.path);
+    for (int i = 0; i < subdev_config.count; i++)
+    {
+        free(subdev_config.devices[i].mac);
+        free(subdev_config.devices[i].device_id);
+        if (subdev_config.devices[i].password) free(subdev_config.devices[i].password);
+        if (subdev_config.devices[i].client_id) free(subdev_config.devices[i].client_id);
+    }
+    if (broker_config.bind) free(broker_config.bind);
+    if (coap_config.bind) free(coap_config.bind);
 }
 
 int main(int argc, char **argv)
 {
     pthread_t      uplink_tid; //上行线程ID
     pthread_t      downlink_tid; //下行线程ID
+    pthread_t      command_tid; //命令执行线程ID
+    pthread_t      sink_tid; //附加代理线程ID
+    int            sink_running = 0;
+    pthread_t      mux_tid; //直连设备连接线程ID
+    int            mux_running = 0;
+    pthread_t      broker_tid; //本地代理线程ID
+    int            broker_running = 0;
+    pthread_t      coap_tid; //CoAP 端点线程ID
+    int            coap_running = 0;
     DBusError      err;
-    int            rc;
     char           *progname = NULL;
     int            daemon_run = 0; //默认非后台运行
     char           *config_file = NULL;
@@ -122,6 +318,7 @@ int main(int argc, char **argv)
     int            log_level = LOG_LEVEL_INFO;
     int            ch;
     int            pid_rc;
+    int            stats_ticks = 0; //统计输出计时（秒）
     char           absolute_config_path[PATH_MAX] = {0}; // 用于存储配置文件的绝对路径
 
     struct option opts[] = {
@@ -241,7 +438,6 @@ int main(int argc, char **argv)
     log_info("Main: BLE-MQTT Gateway application is running. Press Ctrl+C to exit.\n");
 
     pthread_mutex_init(&dbus_mutex, NULL);
-    pthread_mutex_init(&mqtt_mutex, NULL);
 
     //step 1:初始化D-Bus连接
     dbus_error_init(&err);
@@ -255,11 +451,24 @@ int main(int argc, char **argv)
     }
     log_info("Main: D-Bus system bus connected.\n");
 
+    // 打开断线暂存文件（可选）
+    if (spool_config.enable && spool_open(&spool_config) != SPOOL_OK)
+    {
+        log_warn("Main: Spool unavailable, samples will be dropped while MQTT is disconnected.\n");
+    }
+
+    // 按主题建立上报编码器
+    if (payload_codec_init(&codec_config) != 0)
+    {
+        log_warn("Main: Some payload codec rules are invalid, falling back to json for them.\n");
+    }
+
     //step 2:初始化mosquitto 库和客户端实例
     mosquitto_lib_init();
     log_info("Main: Mosquitto library initialized.\n");
 
-    global_mosq = mosquitto_new(device_config.client_id, true, (void *)&device_config);
+    // 持久会话时 clean_session 为 false，代理在断开期间保留订阅和排队的 QoS1 命令
+    global_mosq = mosquitto_new(device_config.client_id, !device_config.persistent_session, (void *)&device_config);
     if(!global_mosq)
     {
         log_error("Main: Failed to create Mosquitto instance: %s\n", strerror(errno));
@@ -267,39 +476,111 @@ int main(int argc, char **argv)
     }
     log_info("Main: Mosquitto client instance created with Client ID: %s\n", device_config.client_id);
 
-    // 设置所有 MQTT 回调函数
-    mosquitto_connect_callback_set(global_mosq, on_connect_cb);
-    mosquitto_message_callback_set(global_mosq, on_message_cb);
-    mosquitto_publish_callback_set(global_mosq, on_publish_cb);
-    mosquitto_subscribe_callback_set(global_mosq, on_subscribe_cb);
-    mosquitto_disconnect_callback_set(global_mosq, on_disconnect_cb);
+    // 限制 QoS1 在途消息数量，网关侧窗口与 libmosquitto 保持一致
+    inflight_init(device_config.max_inflight, device_config.publish_timeout_sec);
+
+    // 上报死区和心跳
+    report_filter_init(&filter_config);
+
+    // 网关子设备（可选）：BLE 设备到 IoTDA 子设备的映射和批量上报
+    subdev_init(&subdev_config, device_config.username);
+
+    // 设备影子：缓存各设备的最新属性，回答 properties/get 和过滤重复的 properties/set
+    shadow_init(&shadow_config);
+    shadow_add_device(DEVICE_PATH);
+    for (int i = 0; i < subdev_count(); i++)
+        shadow_add_device(subdev_path(i));
+
+    // 自适应采样速率：网关积压时让稳定的设备降速，告警时提速
+    rate_ctl_init(&rate_ctl_config);
+    rate_ctl_add_device(DEVICE_PATH);
+    for (int i = 0; i < subdev_count(); i++)
+        rate_ctl_add_device(subdev_path(i));
 
-    // 设置用户名和密码，用于MQTT代理的认证
-    rc = mosquitto_username_pw_set(global_mosq, device_config.username, device_config.password);
-    if (rc != MOSQ_ERR_SUCCESS)
+    // BLE 静默链路检测：设备表与上行线程管理的链路一致（子设备与主设备同一地址时只登记一次）
+    link_watch_init(&link_watch_config);
+    if (subdev_find_path(DEVICE_PATH) < 0)
+        link_watch_add(DEVICE_PATH);
+    for (int i = 0; i < subdev_count(); i++)
+        link_watch_add(subdev_path(i));
+
+    // 上行处理流水线的阶段队列
+    if (pipeline_init(&pipeline_config) != 0)
     {
-        log_error("Main: Failed to set username/password: %s\n", mosquitto_strerror(rc));
         return -1;
     }
 
-    //使用TLS/SSL加密连接
-    if(device_config.ca_cert)
+    // 按流量类别建立发送队列和令牌桶
+    if (publish_lanes_init(&lanes_config) != 0)
     {
-        rc = mosquitto_tls_set(global_mosq,
-                               device_config.ca_cert,
-                               NULL, //client_cert_path
-                               NULL, //client_key_path
-                               NULL, //psk
-                               NULL); //psk_identify
+        log_error("Main: Failed to allocate publish lanes.\n");
+        return -1;
+    }
 
-        if(rc != MOSQ_ERR_SUCCESS)
-        {
-            log_error("Main: Failed to set TLS options: %s\n", mosquitto_strerror(errno));
-            return -1;
-        }
+    // 重新发送上次退出时仍未确认的消息
+    if (device_config.session_state_path)
+    {
+        inflight_set_retain(1);
+        inflight_restore(device_config.session_state_path, restore_message);
+    }
+
+    // 构建下行主题路由表
+    if (mqtt_gateway_init_routes() != 0)
+    {
+        log_error("Main: Failed to build downlink topic routes.\n");
+        return -1;
+    }
+
+    // 协议版本、回调函数、认证和 TLS 选项
+    if (mqtt_gateway_setup_client(global_mosq) != 0)
+    {
+        return -1;
+    }
+
+    // 附加代理（可选）：按路由规则扇出上报数据
+    if (mqtt_sink_init(&sinks_config) != 0)
+    {
+        log_warn("Main: Some sinks or routes are invalid and were skipped.\n");
+    }
+
+    // 直连模式：每个子设备以自己的 IoTDA 身份单独连接，所有连接由一个 epoll 线程驱动
+    if (mqtt_mux_init(&mux_config, device_config.host, device_config.port, device_config.ca_cert) == 0)
+    {
+        for (int i = 0; i < subdev_count(); i++)
+            mqtt_mux_add(subdev_path(i), subdev_device_id(i), subdev_config.devices[i].client_id, subdev_config.devices[i].password);
+    }
+
+    // 上行汇点：默认经上面的 mqtt 汇点发布，也可以换成 null / memory / file / unix 脱离代理测量吞吐
+    uplink_sink_init(&uplink_config);
+
+    // 本地代理：局域网节点连接网关，属性并入子设备批量上报，共用网关的云端连接
+    if (broker_config.enabled && local_broker_init(&broker_config, device_config.username) != 0)
+    {
+        log_warn("Main: Local broker disabled.\n");
+        broker_config.enabled = 0;
+    }
+
+    // CoAP 端点：电池节点用 UDP 上报，采样进入与 BLE 通知相同的流水线
+    if (coap_config.enabled && coap_server_init(&coap_config) != 0)
+    {
+        log_warn("Main: CoAP endpoint disabled.\n");
+        coap_config.enabled = 0;
     }
 
-    // step 3:创建上行线程 (BLE 通知 -> MQTT 发布)
+    // 流水线各阶段线程：解码 -> 告警判断 -> 编码发布
+    if (pipeline_start() != 0)
+    {
+        return -1;
+    }
+
+    // 下行命令队列：在上行线程之前初始化，BLE 连接成功后上行线程会更新设备链路状态
+    cmd_job_init(&cmd_job_config);
+    cmd_job_add_device(DEVICE_PATH, WRITABLE_CHARACTERISTIC_PATH, NOTIFY_CHARACTERISTIC_PATH);
+    for (int i = 0; i < subdev_count(); i++)
+        cmd_job_add_device(subdev_path(i), subdev_write_path(i), subdev_notify_path(i));
+    cmd_dedup_init(device_config.command_dedup_ttl_sec);
+
+    // step 3:创建上行线程 (BLE 通知 -> 处理流水线)
     if (pthread_create(&uplink_tid, NULL, uplink_thread_func, NULL) != 0)
     {
         log_error("Main: Failed to create uplink thread.\n");
@@ -307,29 +588,100 @@ int main(int argc, char **argv)
     }
     log_debug("Main: Uplink thread created.\n");
 
+    // 创建命令执行线程 (下行命令 -> BLE 写入 -> 命令响应)
+    if (pthread_create(&command_tid, NULL, command_thread_func, NULL) != 0)
+    {
+        log_error("Main: Failed to create command thread.\n");
+        keep_running = 0;
+        pthread_join(uplink_tid, NULL);
+        return -1;
+    }
+    log_debug("Main: Command thread created.\n");
+
     // step 4: 创建下行线程 (MQTT 订阅 -> BLE 写入)
     if (pthread_create(&downlink_tid, NULL, downlink_thread_func, NULL) != 0)
     {
         log_error("Main: Failed to create downlink thread.\n");
-        pthread_cancel(uplink_tid);
+        keep_running = 0;
+        pthread_join(uplink_tid, NULL);
+        cmd_job_stop();
+        pthread_join(command_tid, NULL);
         return -1;
     }
     log_debug("Main: Downlink thread created.\n");
 
+    // 附加代理线程：出队发布并按时延和连接状况切换 endpoint
+    if (mqtt_sink_count() > 0 && pthread_create(&sink_tid, NULL, sink_thread_func, NULL) == 0)
+    {
+        sink_running = 1;
+        log_debug("Main: Sink thread created.\n");
+    }
+
+    // 直连设备连接线程：发起连接、收发和心跳
+    if (mqtt_mux_count() > 0 && pthread_create(&mux_tid, NULL, mqtt_mux_thread_func, NULL) == 0)
+    {
+        mux_running = 1;
+        log_debug("Main: MQTT mux thread created.\n");
+    }
+
+    // 本地代理线程：接受节点连接、收发和心跳检查
+    if (broker_config.enabled && pthread_create(&broker_tid, NULL, local_broker_thread_func, NULL) == 0)
+    {
+        broker_running = 1;
+        log_debug("Main: Local broker thread created.\n");
+    }
+
+    // CoAP 端点线程：批量接收报文并回复
+    if (coap_config.enabled && pthread_create(&coap_tid, NULL, coap_server_thread_func, NULL) == 0)
+    {
+        coap_running = 1;
+        log_debug("Main: CoAP thread created.\n");
+    }
+
     log_info("Main: Gateway application is running. Press Ctrl+C to exit.\n");
 
     while(keep_running)
     {
         sleep(1);
+
+        rate_ctl_tick_gateway();
+
+        if (device_config.stats_interval_sec > 0 && ++stats_ticks >= device_config.stats_interval_sec)
+        {
+            stats_ticks = 0;
+            log_runtime_stats();
+        }
     }
 
     log_info("Main: Received exit signal, cleaning up resources...\n");
 
-    pthread_cancel(uplink_tid);
-    pthread_cancel(downlink_tid);
+    // 命令线程可能在 pthread_cond_timedwait 中持有 J.lock，不能取消：唤醒后等待它自行退出
+    cmd_job_stop();
 
+    // 上行线程在 D-Bus 循环中检查 keep_running 自行退出（每轮最多等待 100 ms）；不能取消：
+    // 阻塞策略下它可能正在 stage_queue_push 中持有队列锁等待空位，之后 pipeline_stop 会死锁
     pthread_join(uplink_tid, NULL);
+    if (coap_running)
+    {
+        pthread_join(coap_tid, NULL);
+    }
+    pipeline_stop();
+    // 下行线程在 keep_running 清零后自行退出：取消可能发生在持有 L.stats_lock / T.lock 时，
+    // 之后 cleanup_handler 中的 publish_lanes_flush / inflight_save 会死锁
     pthread_join(downlink_tid, NULL);
+    pthread_join(command_tid, NULL);
+    if (sink_running)
+    {
+        pthread_join(sink_tid, NULL);
+    }
+    if (mux_running)
+    {
+        pthread_join(mux_tid, NULL);
+    }
+    if (broker_running)
+    {
+        pthread_join(broker_tid, NULL);
+    }
 
     log_info("Main: All threads have exited.\n");
 
@@ -18,11 +18,18 @@
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <time.h>
 #include <json-c/json.h>
 
 
 #include "mqtt_gateway.h"
 #include "ble_gateway.h"
+#include "pipeline.h"
+#include "cmd_job.h"
+#include "subdev.h"
+#include "link_watch.h"
+#include "shadow.h"
+#include "rate_ctl.h"
 #include "log.h"
 
 
@@ -33,10 +40,290 @@ extern DBusConnection *global_dbus_conn;
 extern mqtt_device_config_t device_config;
 
 extern pthread_mutex_t dbus_mutex;
-extern pthread_mutex_t mqtt_mutex;
 
 static char* get_string_from_dbus_variant(DBusMessageIter *variant_iter);
 
+
+static uint64_t now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//BLE 断开后的重连间隔
+#define BLE_RECONNECT_SEC	5
+
+//BlueZ 方法调用的应答超时：连接要经过扫描、建链和服务发现，可能需要数秒
+#define BLE_CONNECT_TIMEOUT_MS	15000
+#define BLE_CALL_TIMEOUT_MS		3000
+
+//BLE 链路状态，只在上行线程中读写
+enum {
+	BLE_LINK_DOWN = 0,
+	BLE_LINK_CONNECTED,   // BlueZ 已重新连接设备，尚未启用通知
+	BLE_LINK_UP,
+};
+
+//链路上等待应答的 BlueZ 方法调用
+enum {
+	BLE_OP_NONE = 0,
+	BLE_OP_CONNECT,
+	BLE_OP_START_NOTIFY,
+	BLE_OP_STOP_NOTIFY,       // link_watch 重启通知：先停止
+	BLE_OP_RESTART_NOTIFY,    // 再重新启用
+	BLE_OP_DISCONNECT,        // link_watch 强制断开，应答后立即重连
+};
+
+//上行线程管理的 BLE 设备：网关自己的设备和各子设备
+typedef struct {
+	const char	*path;          // D-Bus 设备路径
+	const char	*notify_path;
+	const char	*name;
+	int			state;
+	time_t		retry_at;
+	int			watch;          // link_watch 中的设备序号
+	int			op;             // 等待应答的调用，BLE_OP_NONE 表示没有
+	dbus_uint32_t	op_serial;  // 该调用的消息序列号，主循环按它分发应答
+	uint64_t	op_deadline;
+} ble_link_t;
+
+static ble_link_t	ble_links[1 + SUBDEV_MAX];
+static int			ble_link_count;
+
+
+//登记主设备和子设备（子设备与主设备是同一个地址时不重复登记）
+static void ble_links_init(void)
+{
+	int		i;
+
+	ble_link_count = 0;
+	if(subdev_find_path(DEVICE_PATH) < 0)
+	{
+		ble_links[ble_link_count].path = DEVICE_PATH;
+		ble_links[ble_link_count].notify_path = NOTIFY_CHARACTERISTIC_PATH;
+		ble_links[ble_link_count].name = BLE_DEVICE_MAC;
+		ble_links[ble_link_count].watch = link_watch_find(DEVICE_PATH);
+		ble_link_count++;
+	}
+	for(i = 0; i < subdev_count(); i++)
+	{
+		ble_links[ble_link_count].path = subdev_path(i);
+		ble_links[ble_link_count].notify_path = subdev_notify_path(i);
+		ble_links[ble_link_count].name = subdev_device_id(i);
+		ble_links[ble_link_count].watch = link_watch_find(subdev_path(i));
+		ble_link_count++;
+	}
+}
+
+
+//设备对象的 PropertiesChanged 信号：跟踪 org.bluez.Device1 的 Connected 属性
+//断开时通知命令队列保留该设备的下行命令，恢复由上行线程的重连完成
+static void handle_device_properties_changed(DBusMessage *msg, ble_link_t *link)
+{
+	DBusMessageIter args;
+	DBusMessageIter changed_props;
+	DBusMessageIter entry;
+	DBusMessageIter variant_iter;
+	const char      *iface;
+	const char      *key;
+	dbus_bool_t     connected;
+
+	dbus_message_iter_init(msg, &args);
+	dbus_message_iter_get_basic(&args, &iface);
+	if(strcmp(iface, "org.bluez.Device1") != 0)
+		return ;
+	dbus_message_iter_next(&args);
+	dbus_message_iter_recurse(&args, &changed_props);
+
+	while(dbus_message_iter_get_arg_type(&changed_props) != DBUS_TYPE_INVALID)
+	{
+		dbus_message_iter_recurse(&changed_props, &entry);
+		dbus_message_iter_get_basic(&entry, &key);
+
+		if(strcmp(key, "Connected") == 0)
+		{
+			dbus_message_iter_next(&entry);
+			dbus_message_iter_recurse(&entry, &variant_iter);
+			dbus_message_iter_get_basic(&variant_iter, &connected);
+
+			if(!connected && link->state != BLE_LINK_DOWN)
+			{
+				log_warn("Uplink Thread: BLE device %s disconnected.\n", link->name);
+				link->state = BLE_LINK_DOWN;
+				cmd_job_set_link(link->path, 0);
+				link_watch_set_link(link->watch, 0, now_ms());
+				shadow_link_down(shadow_find(link->path));
+				rate_ctl_set_link(link->path, 0);
+			}
+			else if(connected && link->state == BLE_LINK_DOWN)
+			{
+				link->state = BLE_LINK_CONNECTED;
+			}
+		}
+		dbus_message_iter_next(&changed_props);
+	}
+}
+
+
+/* 异步调用 BlueZ 方法：只在发送时持有 dbus_mutex，应答由主循环按序列号交给 ble_link_reply
+ * 连接可能要等十几秒，期间命令和告警的 WriteValue 不受影响
+ */
+static int ble_link_call(ble_link_t *link, int op, const char *path, const char *interface, const char *method, int timeout_ms)
+{
+	DBusMessage		*msg;
+	dbus_uint32_t	serial = 0;
+	dbus_bool_t		sent;
+
+	msg = dbus_message_new_method_call(BLUEZ_BUS_NAME, path, interface, method);
+	if(!msg)
+	{
+		log_error("Failed to create D-BUS message for method %s.\n", method);
+		return -1;
+	}
+
+	pthread_mutex_lock(&dbus_mutex);
+	sent = dbus_connection_send(global_dbus_conn, msg, &serial);
+	pthread_mutex_unlock(&dbus_mutex);
+	dbus_message_unref(msg);
+
+	if(!sent)
+	{
+		log_error("Uplink Thread: Failed to send %s to %s.\n", method, link->name);
+		return -1;
+	}
+
+	link->op = op;
+	link->op_serial = serial;
+	link->op_deadline = now_ms() + timeout_ms;
+	return 0;
+}
+
+
+//连接 BLE 设备并启用特性通知：发出调用后立即返回，结果在 ble_link_reply 中处理
+static int ble_link_start(ble_link_t *link)
+{
+	//通过D-Bus调用BlueZ的device1接口的Connect方法来连接指定MAC地址的BLE设备
+	if(link->state == BLE_LINK_DOWN)
+	{
+		log_info("Uplink Thread: Connecting to Ble device %s...\n", link->name);
+		return ble_link_call(link, BLE_OP_CONNECT, link->path, "org.bluez.Device1", "Connect", BLE_CONNECT_TIMEOUT_MS);
+	}
+
+	//通过D-BUS 调用Bluez的GattCharacteristic1 接口的 StartNotify 方法，启用特定特征值的通知功能
+	//每次重新连接后都需要重新启用
+	return ble_link_call(link, BLE_OP_START_NOTIFY, link->notify_path, "org.bluez.GattCharacteristic1", "StartNotify", BLE_CALL_TIMEOUT_MS);
+}
+
+
+//断开链路：立即停止向该设备写入命令，Disconnect 应答（或超时）后由主循环重新连接
+static void ble_link_disconnect(ble_link_t *link)
+{
+	link->state = BLE_LINK_DOWN;
+	link->retry_at = 0;
+	cmd_job_set_link(link->path, 0);
+	link_watch_set_link(link->watch, 0, now_ms());
+	shadow_link_down(shadow_find(link->path));
+	rate_ctl_set_link(link->path, 0);
+	ble_link_call(link, BLE_OP_DISCONNECT, link->path, "org.bluez.Device1", "Disconnect", BLE_CALL_TIMEOUT_MS);
+}
+
+
+/* 链路上等待的调用收到应答，msg 为 NULL 表示超时（之后到达的应答序列号不再匹配，被忽略）
+ * 连接成功后接着启用通知，通知启用后命令队列开始向该设备写入；失败时 BLE_RECONNECT_SEC 秒后重试
+ */
+static void ble_link_reply(ble_link_t *link, DBusMessage *msg)
+{
+	DBusError	err;
+	int			op = link->op;
+	int			failed = 0;
+
+	link->op = BLE_OP_NONE;
+	dbus_error_init(&err);
+	if(!msg)
+		dbus_set_error_const(&err, DBUS_ERROR_NO_REPLY, "no reply within timeout");
+	else
+		dbus_set_error_from_message(&err, msg);
+
+	switch(op)
+	{
+		case BLE_OP_CONNECT:
+			if(dbus_error_is_set(&err))
+			{
+				log_error("Uplink Thread: Failed to connect to BLE device %s: %s\n", link->name, err.message);
+				failed = 1;
+				break;
+			}
+			log_info("Uplink Thread: Successfully connected to BLE device %s.\n", link->name);
+			link->state = BLE_LINK_CONNECTED;
+			failed = ble_link_start(link) < 0;
+			break;
+
+		case BLE_OP_START_NOTIFY:
+			//等待应答期间设备又断开了，重新连接
+			if(dbus_error_is_set(&err) || link->state == BLE_LINK_DOWN)
+			{
+				log_error("Uplink Thread: Failed to enable notification on %s: %s\n", link->name,
+						dbus_error_is_set(&err) ? err.message : "device disconnected");
+				link->state = BLE_LINK_DOWN;
+				failed = 1;
+				break;
+			}
+			link->state = BLE_LINK_UP;
+			cmd_job_set_link(link->path, 1);
+			link_watch_set_link(link->watch, 1, now_ms());
+			rate_ctl_set_link(link->path, 1);
+			break;
+
+		case BLE_OP_STOP_NOTIFY:
+			//停止失败（例如 BlueZ 认为没有在通知）不影响重新启用
+			if(link->state == BLE_LINK_UP &&
+			   ble_link_call(link, BLE_OP_RESTART_NOTIFY, link->notify_path, "org.bluez.GattCharacteristic1", "StartNotify", BLE_CALL_TIMEOUT_MS) < 0)
+				ble_link_disconnect(link);
+			break;
+
+		case BLE_OP_RESTART_NOTIFY:
+			//成功时不重置 link_watch 的阶段，通知仍然没有恢复时它会升级为重连
+			if(dbus_error_is_set(&err) && link->state == BLE_LINK_UP)
+			{
+				log_error("Uplink Thread: Failed to restart notification on %s: %s, reconnecting.\n", link->name, err.message);
+				ble_link_disconnect(link);
+			}
+			break;
+
+		case BLE_OP_DISCONNECT:
+			link->retry_at = 0;
+			break;
+	}
+
+	if(failed)
+		link->retry_at = time(NULL) + BLE_RECONNECT_SEC;
+	dbus_error_free(&err);
+}
+
+
+/* 链路仍显示连接但通知已停止：先重新启用通知，无效时断开，由主循环立即重连
+ * 调用都是异步的，后续步骤在 ble_link_reply 中进行
+ */
+static void ble_link_watch(ble_link_t *link)
+{
+	switch(link_watch_check(link->watch, now_ms()))
+	{
+		case LINK_WATCH_RESTART_NOTIFY:
+			//BlueZ 认为已经在通知时 StartNotify 不会重新写 CCCD，先停止再启用
+			if(ble_link_call(link, BLE_OP_STOP_NOTIFY, link->notify_path, "org.bluez.GattCharacteristic1", "StopNotify", BLE_CALL_TIMEOUT_MS) == 0)
+				break;
+			log_error("Uplink Thread: Failed to restart notification on %s, reconnecting.\n", link->name);
+			/* fall through */
+
+		case LINK_WATCH_RECONNECT:
+			ble_link_disconnect(link);
+			break;
+	}
+}
+
+
 //处理PropertiesChanged D-Bus 信号，提取并发布特性值
 //当 BLE 特性（特别是启用了通知的特性）的值发生变化时，BlueZ 会发出 PropertiesChanged 信号
 //此函数作为 D-Bus 消息处理的回调，解析该信号并处理其中包含的新的特性值
@@ -49,9 +336,6 @@ void handle_properties_changed(DBusMessage *msg)
 	const char *key;              // 属性键
 	DBusMessageIter variant_iter; // 属性值（变体）迭代器)
 	char *decoded_str = NULL;
-	int hr, spo2;
-	int	rc_pub;
-	char json_payload_buffer[256];
 
 	//初始化迭代器，指向消息msg 的第一个参数
 	dbus_message_iter_init(msg, &args);
@@ -79,60 +363,17 @@ void handle_properties_changed(DBusMessage *msg)
 			log_info("---Notification received from %s---\n", dbus_message_get_path(msg));
 			print_notify_value(&variant_iter); //打印通知的原始值
 
-			//将接收道德通知数据通过MQTT发布到华为云
-			if(mqtt_connected_flag)
+			//通知内容交给处理流水线（解码、告警判断、编码、发布），D-Bus 线程不在这里等待
+			decoded_str = get_string_from_dbus_variant(&variant_iter); //从D-BUS变体中获取解码后的字符串
+			if(decoded_str)
 			{
-				decoded_str = get_string_from_dbus_variant(&variant_iter); //从D-BUS变体中获取解码后的字符串
-				if(decoded_str)
-				{
-					hr = 0;
-					spo2 = 0;
-					
-					if(sscanf(decoded_str, "HR:%d,SpO2:%d", &hr, &spo2) == 2)
-					{
-						log_info("Parsed HR: %d, Spo2: %d\n", hr, spo2);
-						if((hr != 0 || spo2 != 0) && (hr > HR_THRESHOLD || spo2 < SPO2_THRESHOLD || hr < 60 ))
-						{
-							log_info("ALERT: HR(%d) > %d or Spo2 (%d) < %d. Sending warning command to BLE device.\n", hr, HR_THRESHOLD, spo2, SPO2_THRESHOLD);
-							//发送Waring
-							if(write_characteristic_value(global_dbus_conn, WRITABLE_CHARACTERISTIC_PATH, WARNING_CMD) < 0)
-							{
-								log_error("Failed to send WARING command to BLE device.\n");
-							}
-						}
-
-
-						// 调用 build_huawei_property_json 函数构建符合华为云 IoTDA 格式的 JSON 字符串
-                        build_huawei_property_json(json_payload_buffer, sizeof(json_payload_buffer), hr, spo2);
-
-                        log_info("Publishing MQTT payload: %s\n", json_payload_buffer);
-
-                        // 使用 mosquitto_publish 发布 MQTT 消息
-                        // 参数：mosq_obj, mid(NULL表示自动生成), 主题, 负载长度, 负载内容, QoS等级(1), Retain标志(false)
-                        pthread_mutex_lock(&mqtt_mutex);
-							
-						rc_pub = mosquitto_publish(global_mosq, NULL, device_config.publish_topic, strlen(json_payload_buffer), json_payload_buffer, 1, false);
-
-						pthread_mutex_unlock(&mqtt_mutex);
-
-                        if (rc_pub != MOSQ_ERR_SUCCESS) { // 检查发布结果
-                            log_error("Failed to publish MQTT message, return code %d\n", rc_pub);
-                        } 
-						else 
-						{
-                            log_info("MQTT message published successfully.\n");
-                        }		
-					}
-					else
-					{
-						log_error("Failed to parse HR and SpO2 from notification string: \"%s\"\n", decoded_str);
-					}
-					free(decoded_str);
-				}
-				else
-				{
-					log_error("Failed to get decoded string from D-Bus variant.\n");
-				}
+				if(pipeline_submit(dbus_message_get_path(msg), decoded_str, strlen(decoded_str)) != 0)
+					log_warn("Pipeline: Notification dropped by intake queue.\n");
+				free(decoded_str);
+			}
+			else
+			{
+				log_error("Failed to get decoded string from D-Bus variant.\n");
 			}
 			log_info("-----------------------------------\n");
 		}
@@ -144,6 +385,14 @@ void handle_properties_changed(DBusMessage *msg)
 //向BLE 特征值写入数据
 //通过 D-Bus 调用 BlueZ 的 GattCharacteristic1.WriteValue 方法，向指定的 BLE 特征值写入数据
 int write_characteristic_value(DBusConnection *conn, const char *char_path, const char *cmd_str)
+{
+	return write_characteristic_value_timeout(conn, char_path, cmd_str, -1);
+}
+
+
+//带超时的写入，timeout_ms 为 -1 时无限等待
+//超时返回 BLE_WRITE_TIMEOUT，其他错误返回 -1
+int write_characteristic_value_timeout(DBusConnection *conn, const char *char_path, const char *cmd_str, int timeout_ms)
 {
     DBusMessage *msg;               // D-Bus 消息指针
     DBusMessageIter args, array_iter, options_iter; // 各种参数迭代器
@@ -184,7 +433,7 @@ int write_characteristic_value(DBusConnection *conn, const char *char_path, cons
 	pthread_mutex_lock(&dbus_mutex);
 
     // 同步发送消息，等待回复。-1 表示无限等待超时。
-    DBusMessage* reply = dbus_connection_send_with_reply_and_block(conn, msg, -1, &err);
+    DBusMessage* reply = dbus_connection_send_with_reply_and_block(conn, msg, timeout_ms, &err);
     dbus_message_unref(msg); // 释放发送的消息
 
 	pthread_mutex_unlock(&dbus_mutex);
@@ -192,8 +441,9 @@ int write_characteristic_value(DBusConnection *conn, const char *char_path, cons
     if (dbus_error_is_set(&err)) // 检查方法调用是否出错
     {
         log_error("WriteValue failed for %s: %s\n", char_path, err.message);
+        int timed_out = dbus_error_has_name(&err, DBUS_ERROR_NO_REPLY) || dbus_error_has_name(&err, DBUS_ERROR_TIMEOUT);
         dbus_error_free(&err); // 释放错误信息
-        return -1; 
+        return timed_out ? BLE_WRITE_TIMEOUT : -1; 
     }
 
     log_info("Successfully sent: \"%s\" to %s\n", cmd_str, char_path);
@@ -204,6 +454,70 @@ int write_characteristic_value(DBusConnection *conn, const char *char_path, cons
 }
 
 
+//读取特征值（ReadValue），结果以字符串形式存入 buf
+//返回读到的字节数，超时返回 BLE_WRITE_TIMEOUT，其他错误返回 -1
+int read_characteristic_value_timeout(DBusConnection *conn, const char *char_path, char *buf, size_t size, int timeout_ms)
+{
+	DBusMessage		*msg;
+	DBusMessage		*reply;
+	DBusMessageIter	args;
+	DBusMessageIter	options_iter;
+	DBusMessageIter	array_iter;
+	DBusError		err;
+	uint8_t			*bytes = NULL;
+	int				n = 0;
+	int				timed_out;
+
+	dbus_error_init(&err);
+
+	msg = dbus_message_new_method_call(BLUEZ_BUS_NAME, char_path, "org.bluez.GattCharacteristic1", "ReadValue");
+	if(!msg)
+	{
+		log_error("Failed to create D-BUS message for readvalue.\n");
+		return -1;
+	}
+
+	//ReadValue 只有一个选项字典参数，同样传空字典
+	dbus_message_iter_init_append(msg, &args);
+	dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "{sv}", &options_iter);
+	dbus_message_iter_close_container(&args, &options_iter);
+
+	pthread_mutex_lock(&dbus_mutex);
+	reply = dbus_connection_send_with_reply_and_block(conn, msg, timeout_ms, &err);
+	dbus_message_unref(msg);
+	pthread_mutex_unlock(&dbus_mutex);
+
+	if(dbus_error_is_set(&err))
+	{
+		log_error("ReadValue failed for %s: %s\n", char_path, err.message);
+		timed_out = dbus_error_has_name(&err, DBUS_ERROR_NO_REPLY) || dbus_error_has_name(&err, DBUS_ERROR_TIMEOUT);
+		dbus_error_free(&err);
+		return timed_out ? BLE_WRITE_TIMEOUT : -1;
+	}
+
+	//回复为字节数组 ay
+	if(!reply || !dbus_message_iter_init(reply, &args) || dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_ARRAY)
+	{
+		log_error("ReadValue for %s returned no value.\n", char_path);
+		if(reply)
+			dbus_message_unref(reply);
+		return -1;
+	}
+
+	dbus_message_iter_recurse(&args, &array_iter);
+	if(dbus_message_iter_get_arg_type(&array_iter) == DBUS_TYPE_BYTE)
+		dbus_message_iter_get_fixed_array(&array_iter, &bytes, &n);
+	if(n > (int)size - 1)
+		n = size - 1;
+	if(n > 0)
+		memcpy(buf, bytes, n);
+	buf[n] = '\0';
+
+	dbus_message_unref(reply);
+	return n;
+}
+
+
 
 
 //从D-BUS变体迭代器中解析出字符串
@@ -330,35 +644,18 @@ void *uplink_thread_func(void *arg)
 {
 	DBusMessage *msg = NULL;
 	DBusError err;
+	ble_link_t *link;
+	int i;
 
 	dbus_error_init(&err);
+	ble_links_init();
 
 	log_info("Uplink Thread: Starting BLE operations...\n");
 
 
-	//step 1:连接到BLE设备
-	//通过D-Bus调用BlueZ的device1接口的Connect方法来连接指定MAC地址的BLE设备
-	log_info("Uplink Thread: Connecting to Ble device %s...\n", BLE_DEVICE_MAC);
-	if(call_method(global_dbus_conn, DEVICE_PATH, "org.bluez.Device1", "Connect") < 0)
-	{
-		log_error("Uplink Thread: Failed to connect to BLE device.\n");
-		return NULL;
-	}
-	log_info("Uplink Thread: Successfully connected to BLE devices.\n");
-
-
-	//step 2:启用特性通知
-	//通过D-BUS 调用Bluez的GattCharacteristic1 接口的 StartNotify 方法，启用特定特征值的通知功能
-	if(call_method(global_dbus_conn, NOTIFY_CHARACTERISTIC_PATH, "org.bluez.GattCharacteristic1", "StartNotify") < 0)
-	{
-		log_error("Uplink Thread: Failed to enable notification.\n");
-		return NULL;
-	}
-
-
-	//step 3:添加D-BUS信号匹配规则
+	//step 1:添加D-BUS信号匹配规则
 	//这告诉 D-Bus 守护进程，程序对 org.freedesktop.DBus.Properties 接口的 PropertiesChanged 信号感兴趣
-	//这使得当 BLE 特性值（如通知特性）发生变化时，BlueZ 会向本程序发送相应的 D-Bus 信号
+	//这使得当 BLE 特性值（如通知特性）发生变化、或设备连接状态变化时，BlueZ 会向本程序发送相应的 D-Bus 信号
 	dbus_bus_add_match(global_dbus_conn, "type='signal',interface='org.freedesktop.DBus.Properties',member='PropertiesChanged'", &err);
 	if(dbus_error_is_set(&err))
 	{
@@ -371,8 +668,29 @@ void *uplink_thread_func(void *arg)
 
 
 	//主循环，持续监听BLE通知
+	//step 2:各设备链路未建立（首次启动或设备断开）时连接设备并启用通知，失败后每 BLE_RECONNECT_SEC 秒重试
 	while(keep_running)
 	{
+		for(i = 0; i < ble_link_count; i++)
+		{
+			link = &ble_links[i];
+			if(link->op != BLE_OP_NONE)
+			{
+				//调用尚未应答，超时按失败处理
+				if(now_ms() >= link->op_deadline)
+					ble_link_reply(link, NULL);
+			}
+			else if(link->state != BLE_LINK_UP && time(NULL) >= link->retry_at)
+			{
+				if(ble_link_start(link) < 0)
+					link->retry_at = time(NULL) + BLE_RECONNECT_SEC;
+			}
+			else if(link->state == BLE_LINK_UP)
+			{
+				ble_link_watch(link);
+			}
+		}
+
 		pthread_mutex_lock(&dbus_mutex);
 
 		//处理D-Bus I/O (接收BLE 信号和回复)
@@ -384,14 +702,44 @@ void *uplink_thread_func(void *arg)
 		pthread_mutex_unlock(&dbus_mutex);
 		if(msg) //如果有消息
 		{
-			// 判断消息是否是 PropertiesChanged 信号，并且路径与关注的通知特性路径匹配
-			// strstr(dbus_message_get_path(msg), NOTIFY_CHARACTERISTIC_PATH) 用于过滤出特定特征值的通知))
-			if(dbus_message_is_signal(msg, "org.freedesktop.DBus.Properties", "PropertiesChanged") && strstr(dbus_message_get_path(msg), NOTIFY_CHARACTERISTIC_PATH))
+			if(dbus_message_is_signal(msg, "org.freedesktop.DBus.Properties", "PropertiesChanged"))
 			{
-				//处理通知，解析通知数据并通过MQTT发布
-				handle_properties_changed(msg);
+				for(i = 0; i < ble_link_count; i++)
+				{
+					link = &ble_links[i];
+					// 判断路径与关注的通知特性路径匹配
+					// strstr(dbus_message_get_path(msg), notify_path) 用于过滤出特定特征值的通知))
+					if(strstr(dbus_message_get_path(msg), link->notify_path))
+					{
+						//处理通知，放入处理流水线（流水线按路径区分设备）
+						link_watch_notify(link->watch, now_ms());
+						handle_properties_changed(msg);
+						break;
+					}
+					else if(strcmp(dbus_message_get_path(msg), link->path) == 0)
+					{
+						//设备连接状态变化
+						handle_device_properties_changed(msg, link);
+						break;
+					}
+				}
+			}
+			else if(dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+					dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_ERROR)
+			{
+				//异步调用的应答
+				for(i = 0; i < ble_link_count; i++)
+				{
+					link = &ble_links[i];
+					if(link->op != BLE_OP_NONE && link->op_serial == dbus_message_get_reply_serial(msg))
+					{
+						ble_link_reply(link, msg);
+						break;
+					}
+				}
 			}
 			dbus_message_unref(msg); //释放处理过的D-BUS消息
+			continue; //继续取出积压的信号
 		}
 
 		usleep(100000);
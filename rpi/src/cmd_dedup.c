@@ -0,0 +1,312 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  cmd_dedup.c
+ *    Description:  This file implements the request_id LRU cache.
+ *
+ *                  条目全部静态分配：哈希桶链表用于查找，双向链表按最近使用排序，
+ *                  表满时淘汰链表尾部的条目。查找在下行线程，完成在命令线程，用锁保护。
+ *
+ *        Version:  1.0.0(2025年09月02日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月02日 10时42分15秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "cmd_dedup.h"
+#include "cmd_job.h"
+#include "log.h"
+
+
+#define DEDUP_BUCKETS		(CMD_DEDUP_SLOTS * 2)
+
+enum {
+	ENTRY_FREE = 0,
+	ENTRY_PENDING,
+	ENTRY_DONE,
+};
+
+typedef struct {
+	int			state;
+	uint32_t	hash;
+	uint64_t	seen_ms;       //登记或完成的时间，用于 TTL
+	int			result_code;
+	int			hnext;         //同一哈希桶的下一个条目
+	int			prev;          //LRU 链表
+	int			next;
+	char		request_id[CMD_JOB_REQUEST_ID_MAX];
+	char		paras[CMD_DEDUP_PARAS_MAX];
+} dedup_entry_t;
+
+
+static struct {
+	dedup_entry_t		entries[CMD_DEDUP_SLOTS];
+	int					buckets[DEDUP_BUCKETS];
+	int					lru_head;      //最近使用
+	int					lru_tail;      //最久未用
+	int					used;
+	uint64_t			ttl_ms;
+	cmd_dedup_stats_t	stats;
+	pthread_mutex_t		lock;
+} D = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+static uint64_t now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static uint32_t hash_id(const char *s)
+{
+	uint32_t	h = 2166136261u;
+
+	while(*s)
+	{
+		h ^= (uint8_t)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+static void lru_unlink(int i)
+{
+	dedup_entry_t	*e = &D.entries[i];
+
+	if(e->prev >= 0)
+		D.entries[e->prev].next = e->next;
+	else
+		D.lru_head = e->next;
+	if(e->next >= 0)
+		D.entries[e->next].prev = e->prev;
+	else
+		D.lru_tail = e->prev;
+	e->prev = e->next = -1;
+}
+
+static void lru_push_front(int i)
+{
+	dedup_entry_t	*e = &D.entries[i];
+
+	e->prev = -1;
+	e->next = D.lru_head;
+	if(D.lru_head >= 0)
+		D.entries[D.lru_head].prev = i;
+	D.lru_head = i;
+	if(D.lru_tail < 0)
+		D.lru_tail = i;
+}
+
+
+static int find_entry(const char *request_id, uint32_t hash)
+{
+	int		i;
+
+	for(i = D.buckets[hash % DEDUP_BUCKETS]; i >= 0; i = D.entries[i].hnext)
+	{
+		if(D.entries[i].hash == hash && strcmp(D.entries[i].request_id, request_id) == 0)
+			return i;
+	}
+	return -1;
+}
+
+
+//从哈希桶和 LRU 链表中移除条目
+static void remove_entry(int i)
+{
+	dedup_entry_t	*e = &D.entries[i];
+	int				*link = &D.buckets[e->hash % DEDUP_BUCKETS];
+
+	while(*link != i)
+		link = &D.entries[*link].hnext;
+	*link = e->hnext;
+
+	lru_unlink(i);
+	e->state = ENTRY_FREE;
+	D.used--;
+}
+
+
+//取一个空闲条目，没有时淘汰最久未用的条目
+static int alloc_entry(void)
+{
+	int		i;
+
+	if(D.used == CMD_DEDUP_SLOTS)
+	{
+		i = D.lru_tail;
+		remove_entry(i);
+		D.stats.evicted++;
+		return i;
+	}
+
+	for(i = 0; i < CMD_DEDUP_SLOTS; i++)
+	{
+		if(D.entries[i].state == ENTRY_FREE)
+			return i;
+	}
+	return -1;
+}
+
+
+//ttl_sec 为 0 时不做去重
+int cmd_dedup_init(int ttl_sec)
+{
+	int		i;
+
+	pthread_mutex_lock(&D.lock);
+	memset(D.entries, 0, sizeof(D.entries));
+	for(i = 0; i < DEDUP_BUCKETS; i++)
+		D.buckets[i] = -1;
+	D.lru_head = D.lru_tail = -1;
+	D.used = 0;
+	D.ttl_ms = ttl_sec > 0 ? (uint64_t)ttl_sec * 1000 : 0;
+	memset(&D.stats, 0, sizeof(D.stats));
+	pthread_mutex_unlock(&D.lock);
+
+	if(ttl_sec > 0)
+		log_info("Command: Duplicate request_id suppression for %d s, %d entries.\n", ttl_sec, CMD_DEDUP_SLOTS);
+	return 0;
+}
+
+
+/* 查找 request_id
+ * 未见过（或已过期）时登记为执行中并返回 CMD_DEDUP_MISS；正在执行返回 CMD_DEDUP_PENDING；
+ * 已完成返回 CMD_DEDUP_DONE，并把缓存的 result_code 和响应参数复制给调用者
+ */
+int cmd_dedup_lookup(const char *request_id, int *result_code, char *paras, size_t size)
+{
+	dedup_entry_t	*e;
+	uint32_t		hash;
+	uint64_t		now = now_ms();
+	int				rv = CMD_DEDUP_MISS;
+	int				i;
+
+	if(!D.ttl_ms || !request_id || !request_id[0])
+		return CMD_DEDUP_MISS;
+
+	hash = hash_id(request_id);
+
+	pthread_mutex_lock(&D.lock);
+	D.stats.lookups++;
+
+	i = find_entry(request_id, hash);
+	if(i >= 0 && now - D.entries[i].seen_ms > D.ttl_ms)
+	{
+		remove_entry(i);
+		D.stats.expired++;
+		i = -1;
+	}
+
+	if(i >= 0)
+	{
+		e = &D.entries[i];
+		lru_unlink(i);
+		lru_push_front(i);
+
+		if(e->state == ENTRY_PENDING)
+		{
+			D.stats.hits_pending++;
+			rv = CMD_DEDUP_PENDING;
+		}
+		else
+		{
+			D.stats.hits_done++;
+			*result_code = e->result_code;
+			snprintf(paras, size, "%s", e->paras);
+			rv = CMD_DEDUP_DONE;
+		}
+	}
+	else if((i = alloc_entry()) >= 0)
+	{
+		e = &D.entries[i];
+		e->state = ENTRY_PENDING;
+		e->hash = hash;
+		e->seen_ms = now;
+		snprintf(e->request_id, sizeof(e->request_id), "%s", request_id);
+		e->paras[0] = '\0';
+
+		e->hnext = D.buckets[hash % DEDUP_BUCKETS];
+		D.buckets[hash % DEDUP_BUCKETS] = i;
+		lru_push_front(i);
+		D.used++;
+	}
+
+	D.stats.entries = D.used;
+	pthread_mutex_unlock(&D.lock);
+
+	return rv;
+}
+
+
+//命令执行完成，保存响应供重复的请求重发（TTL 从完成时刻起算）
+void cmd_dedup_complete(const char *request_id, int result_code, const char *paras)
+{
+	dedup_entry_t	*e;
+	int				i;
+
+	if(!D.ttl_ms || !request_id || !request_id[0])
+		return ;
+
+	pthread_mutex_lock(&D.lock);
+	i = find_entry(request_id, hash_id(request_id));
+	if(i >= 0)
+	{
+		e = &D.entries[i];
+		e->state = ENTRY_DONE;
+		e->seen_ms = now_ms();
+		e->result_code = result_code;
+		snprintf(e->paras, sizeof(e->paras), "%s", paras ? paras : "{}");
+	}
+	pthread_mutex_unlock(&D.lock);
+}
+
+
+//命令未被执行（例如任务表已满），删除登记，云端重试时重新执行
+void cmd_dedup_forget(const char *request_id)
+{
+	int		i;
+
+	if(!D.ttl_ms || !request_id || !request_id[0])
+		return ;
+
+	pthread_mutex_lock(&D.lock);
+	i = find_entry(request_id, hash_id(request_id));
+	if(i >= 0)
+		remove_entry(i);
+	D.stats.entries = D.used;
+	pthread_mutex_unlock(&D.lock);
+}
+
+
+void cmd_dedup_get_stats(cmd_dedup_stats_t *stats)
+{
+	pthread_mutex_lock(&D.lock);
+	*stats = D.stats;
+	pthread_mutex_unlock(&D.lock);
+}
+
+
+void cmd_dedup_log_stats(void)
+{
+	cmd_dedup_stats_t	st;
+
+	if(!D.ttl_ms)
+		return ;
+
+	cmd_dedup_get_stats(&st);
+	log_info("Command: dedup lookups=%llu hits_done=%llu hits_pending=%llu expired=%llu evicted=%llu entries=%u\n",
+			(unsigned long long)st.lookups, (unsigned long long)st.hits_done,
+			(unsigned long long)st.hits_pending, (unsigned long long)st.expired,
+			(unsigned long long)st.evicted, st.entries);
+}
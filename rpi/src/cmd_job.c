@@ -0,0 +1,578 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  cmd_job.c
+ *    Description:  This file runs downlink commands on a dedicated thread.
+ *
+ *                  任务表为固定大小的数组，按提交顺序执行。每个任务有截止时间：
+ *                  排队超时则直接回复超时，不再写入 BLE；BLE 写入本身也使用剩余时间作为
+ *                  D-Bus 调用超时。响应在写入完成后才发布，result_code 反映真实结果。
+ *
+ *                  每个任务记录目标设备和过期时间：设备链路断开时任务留在表中不被取出，
+ *                  链路恢复后按提交顺序执行；过期的任务无论链路状态都会被取出并回复超时，
+ *                  不写入设备。
+ *
+ *        Version:  1.0.0(2025年08月25日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月25日 11时20分36秒"
+ *                  2, Per-device queues with TTL on "2025年09月02日 15时06分27秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "cmd_job.h"
+#include "cmd_dedup.h"
+#include "mqtt_gateway.h"
+#include "ble_gateway.h"
+#include "shadow.h"
+#include "rate_ctl.h"
+#include "log.h"
+
+
+enum {
+	JOB_FREE = 0,
+	JOB_QUEUED,
+	JOB_RUNNING,
+};
+
+typedef struct {
+	int			state;
+	int			kind;                                  //CMD_JOB_COMMAND / PROPERTY_SET / PROPERTY_GET
+	int			device;                                //目标设备下标
+	uint64_t	seq;                                   //提交顺序
+	uint64_t	enqueue_ms;
+	uint64_t	expire_ms;                             //超过该时间不再写入设备
+	int			held;                                  //曾因链路断开而等待
+	uint32_t	mask;                                  //PROPERTY_SET：写入的属性
+	char		request_id[CMD_JOB_REQUEST_ID_MAX];    //为空表示不需要响应（普通下行消息）
+	char		payload[CMD_JOB_PAYLOAD_MAX];
+} cmd_job_t;
+
+typedef struct {
+	char					path[256];                 //D-Bus 设备对象路径
+	char					char_path[512];            //写入命令的特征值路径
+	char					read_path[512];            //属性查询时读取的特征值路径
+	cmd_job_device_stats_t	stats;
+} cmd_device_t;
+
+
+static struct {
+	cmd_job_t			jobs[CMD_JOB_MAX];
+	cmd_device_t		devices[CMD_JOB_DEVICE_MAX];
+	int					device_count;
+	uint64_t			next_seq;
+	cmd_job_config_t	config;
+	cmd_job_stats_t		stats;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+} J;
+
+
+static uint64_t now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+int cmd_job_init(const cmd_job_config_t *config)
+{
+	pthread_condattr_t	attr;
+
+	memset(J.jobs, 0, sizeof(J.jobs));
+	memset(J.devices, 0, sizeof(J.devices));
+	memset(&J.stats, 0, sizeof(J.stats));
+	J.device_count = 0;
+	J.next_seq = 0;
+	J.config = *config;
+	if(J.config.timeout_ms <= 0)
+		J.config.timeout_ms = 5000;
+	if(J.config.default_ttl_sec <= 0)
+		J.config.default_ttl_sec = 30;
+
+	pthread_mutex_init(&J.lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&J.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	log_info("Command: BLE write timeout %d ms, default TTL %d s, %d per-type TTLs.\n",
+			J.config.timeout_ms, J.config.default_ttl_sec, J.config.ttl_count);
+	return 0;
+}
+
+
+//调用时持有锁
+static int find_device(const char *device_path)
+{
+	int		i;
+
+	for(i = 0; i < J.device_count; i++)
+	{
+		if(strcmp(J.devices[i].path, device_path) == 0)
+			return i;
+	}
+	return -1;
+}
+
+
+//登记目标设备，链路初始为断开，连接成功后由 BLE 线程调用 cmd_job_set_link
+int cmd_job_add_device(const char *device_path, const char *char_path, const char *read_path)
+{
+	cmd_device_t	*dev;
+	int				i;
+
+	pthread_mutex_lock(&J.lock);
+	if((i = find_device(device_path)) < 0)
+	{
+		if(J.device_count == CMD_JOB_DEVICE_MAX)
+		{
+			pthread_mutex_unlock(&J.lock);
+			return -1;
+		}
+		i = J.device_count++;
+	}
+	dev = &J.devices[i];
+	snprintf(dev->path, sizeof(dev->path), "%s", device_path);
+	snprintf(dev->char_path, sizeof(dev->char_path), "%s", char_path);
+	snprintf(dev->read_path, sizeof(dev->read_path), "%s", read_path);
+	pthread_mutex_unlock(&J.lock);
+
+	return i;
+}
+
+
+//BLE 链路状态变化：断开后该设备的命令留在队列中，恢复后唤醒命令线程按顺序执行
+void cmd_job_set_link(const char *device_path, int up)
+{
+	cmd_device_t	*dev;
+	int				i;
+
+	pthread_mutex_lock(&J.lock);
+	if((i = find_device(device_path)) < 0 || J.devices[i].stats.link_up == !!up)
+	{
+		pthread_mutex_unlock(&J.lock);
+		return ;
+	}
+
+	dev = &J.devices[i];
+	dev->stats.link_up = !!up;
+	if(up)
+	{
+		log_info("Command: %s link up, flushing %u queued commands.\n", dev->path, dev->stats.queued);
+		pthread_cond_signal(&J.cond);
+	}
+	else
+	{
+		dev->stats.disconnects++;
+		log_warn("Command: %s link down, holding downlink commands until reconnect.\n", dev->path);
+	}
+	pthread_mutex_unlock(&J.lock);
+}
+
+
+//按命令类型取 TTL，未单独配置时使用默认值
+int cmd_job_ttl_ms(const char *command_name)
+{
+	int		i;
+
+	for(i = 0; command_name && i < J.config.ttl_count; i++)
+	{
+		if(strcmp(J.config.ttl[i].command_name, command_name) == 0)
+			return J.config.ttl[i].ttl_sec * 1000;
+	}
+	return J.config.default_ttl_sec * 1000;
+}
+
+
+static int submit_job(const char *device_path, int kind, const char *request_id, const char *ble_cmd, size_t len, uint32_t mask, int ttl_ms)
+{
+	cmd_job_t		*job = NULL;
+	cmd_device_t	*dev;
+	uint64_t		now = now_ms();
+	int				device;
+	int				i;
+
+	if(len >= CMD_JOB_PAYLOAD_MAX)
+		return -1;
+
+	pthread_mutex_lock(&J.lock);
+
+	if((device = find_device(device_path)) < 0)
+	{
+		pthread_mutex_unlock(&J.lock);
+		log_error("Command: Unknown target device %s.\n", device_path);
+		return -1;
+	}
+	dev = &J.devices[device];
+
+	for(i = 0; i < CMD_JOB_MAX; i++)
+	{
+		if(J.jobs[i].state == JOB_FREE)
+		{
+			if(!job)
+				job = &J.jobs[i];
+		}
+		else if(request_id && request_id[0] && strcmp(J.jobs[i].request_id, request_id) == 0)
+		{
+			//同一个 request_id 已经在处理中（QoS1 重发），忽略
+			pthread_mutex_unlock(&J.lock);
+			log_info("Command: request_id=%s is already pending, duplicate ignored.\n", request_id);
+			return 0;
+		}
+	}
+
+	if(!job || dev->stats.queued >= CMD_JOB_DEVICE_QUEUE)
+	{
+		J.stats.rejected++;
+		pthread_mutex_unlock(&J.lock);
+		return -2;
+	}
+
+	job->state = JOB_QUEUED;
+	job->kind = kind;
+	job->mask = mask;
+	job->device = device;
+	job->seq = J.next_seq++;
+	job->enqueue_ms = now;
+	job->expire_ms = now + (ttl_ms > 0 ? ttl_ms : J.config.default_ttl_sec * 1000);
+	job->held = !dev->stats.link_up;
+	snprintf(job->request_id, sizeof(job->request_id), "%s", request_id ? request_id : "");
+	if(len)
+		memcpy(job->payload, ble_cmd, len);
+	job->payload[len] = '\0';
+
+	J.stats.submitted++;
+	J.stats.queued++;
+	dev->stats.queued++;
+	if(job->held)
+	{
+		dev->stats.held++;
+		log_info("Command: %s link down, command queued (%u pending, TTL %d ms).\n",
+				dev->path, dev->stats.queued, (int)(job->expire_ms - now));
+	}
+
+	pthread_cond_signal(&J.cond);
+	pthread_mutex_unlock(&J.lock);
+
+	return 0;
+}
+
+
+/* 提交一个命令任务（在 MQTT 回调中调用，不阻塞）
+ * request_id 为 NULL 或空字符串时执行完不发布响应；ttl_ms 为 0 时使用默认 TTL
+ */
+int cmd_job_submit(const char *device_path, const char *request_id, const char *ble_cmd, size_t len, int ttl_ms)
+{
+	return submit_job(device_path, CMD_JOB_COMMAND, request_id, ble_cmd, len, 0, ttl_ms);
+}
+
+
+/* 提交属性设置（写入 ble_cmd，mask 为写入的属性）或属性查询（读取 BLE，ble_cmd 为 NULL）任务，
+ * 与命令共用设备队列和 TTL，完成后发布对应的 properties/set 或 properties/get 响应
+ */
+int cmd_job_submit_property(const char *device_path, int kind, const char *request_id, const char *ble_cmd, size_t len, uint32_t mask, int ttl_ms)
+{
+	return submit_job(device_path, kind, request_id, ble_cmd, len, mask, ttl_ms);
+}
+
+
+/* 取出最早提交的可执行任务：目标设备链路已连接，或者已经过期（过期任务只回复不写入）
+ * 没有则等待，等待时间不超过最近的过期时间
+ */
+static cmd_job_t *next_job(void)
+{
+	struct timespec	ts;
+	cmd_job_t		*job = NULL;
+	uint64_t		now;
+	uint64_t		wake;
+	int				i;
+
+	pthread_mutex_lock(&J.lock);
+	while(keep_running)
+	{
+		job = NULL;
+		now = now_ms();
+		wake = now + 1000;
+		for(i = 0; i < CMD_JOB_MAX; i++)
+		{
+			if(J.jobs[i].state != JOB_QUEUED)
+				continue;
+
+			if(now < J.jobs[i].expire_ms && !J.devices[J.jobs[i].device].stats.link_up)
+			{
+				if(J.jobs[i].expire_ms < wake)
+					wake = J.jobs[i].expire_ms;
+				continue;
+			}
+
+			if(!job || J.jobs[i].seq < job->seq)
+				job = &J.jobs[i];
+		}
+		if(job)
+		{
+			job->state = JOB_RUNNING;
+			J.stats.queued--;
+			J.devices[job->device].stats.queued--;
+			break;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += (wake - now) / 1000;
+		ts.tv_nsec += (long)((wake - now) % 1000) * 1000000;
+		if(ts.tv_nsec >= 1000000000)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&J.cond, &J.lock, &ts);
+	}
+	pthread_mutex_unlock(&J.lock);
+
+	return job;
+}
+
+
+//退出时唤醒等待中的命令线程（keep_running 已清零），由调用者 pthread_join
+void cmd_job_stop(void)
+{
+	pthread_mutex_lock(&J.lock);
+	pthread_cond_broadcast(&J.cond);
+	pthread_mutex_unlock(&J.lock);
+}
+
+
+//按任务类型发布响应，在途窗口已满时短暂重试
+static void publish_response(const cmd_job_t *job, int result_code, const char *result, uint64_t queue_ms, uint64_t ble_ms)
+{
+	char				paras[CMD_DEDUP_PARAS_MAX];
+	telemetry_record_t	rec;
+	int					rc;
+	int					retry;
+
+	if(job->kind == CMD_JOB_COMMAND)
+	{
+		snprintf(paras, sizeof(paras), "{\"result\":\"%s\",\"ble_latency_ms\":%llu,\"queue_ms\":%llu}",
+				result, (unsigned long long)ble_ms, (unsigned long long)queue_ms);
+
+		//记录结果，重复到达的同一命令直接重发这个响应
+		cmd_dedup_complete(job->request_id, result_code, paras);
+	}
+	else if(job->kind == CMD_JOB_PROPERTY_GET)
+	{
+		//读取失败时用影子中现有的值回答
+		shadow_get(shadow_find(J.devices[job->device].path), &rec);
+	}
+
+	for(retry = 0; retry < 100; retry++)
+	{
+		if(job->kind == CMD_JOB_PROPERTY_GET)
+			rc = mqtt_publish_property_get_response(job->request_id, &rec);
+		else if(job->kind == CMD_JOB_PROPERTY_SET)
+			rc = mqtt_publish_property_set_response(job->request_id, result_code, result);
+		else
+			rc = mqtt_publish_command_response_to(J.devices[job->device].path, job->request_id, result_code, paras);
+		if(rc != MQTT_PUBLISH_WINDOW_FULL)
+			break;
+		usleep(10000);
+	}
+
+	if(rc != MOSQ_ERR_SUCCESS)
+		log_error("Command: Failed to publish response for request_id=%s: %d\n", job->request_id, rc);
+	else
+		log_info("Command: request_id=%s result_code=%d (%s), BLE %llu ms, queued %llu ms\n",
+				job->request_id, result_code, result, (unsigned long long)ble_ms, (unsigned long long)queue_ms);
+}
+
+
+static void run_job(cmd_job_t *job)
+{
+	uint64_t			start = now_ms();
+	uint64_t			queue_ms = start - job->enqueue_ms;
+	uint64_t			ble_ms = 0;
+	cmd_device_t		*dev = &J.devices[job->device];
+	telemetry_record_t	rec;
+	char				value[TELEMETRY_BLE_MAX * 2];
+	int					timeout_ms = J.config.timeout_ms;
+	int					expired = 0;
+	int					result_code;
+	const char			*result;
+	int					rv;
+
+	if(start >= job->expire_ms)
+	{
+		//超过 TTL（通常是设备一直未重连），不再写入 BLE
+		expired = 1;
+		result_code = CMD_RESULT_TIMEOUT;
+		result = "expired";
+		log_warn("Command: Command for %s expired after %llu ms in queue, not written.\n",
+				dev->path, (unsigned long long)queue_ms);
+	}
+	else if(!global_dbus_conn)
+	{
+		log_error("D-Bus connection not available for BLE write.\n");
+		result_code = CMD_RESULT_FAILED;
+		result = "dbus unavailable";
+	}
+	else
+	{
+		//写入超时不超过剩余的 TTL
+		if(job->expire_ms - start < (uint64_t)timeout_ms)
+			timeout_ms = (int)(job->expire_ms - start);
+
+		if(job->held)
+			log_info("Command: Flushing held command after %llu ms.\n", (unsigned long long)queue_ms);
+		if(job->kind == CMD_JOB_PROPERTY_GET)
+		{
+			//影子中的数据已过期：读取设备当前值并更新影子
+			rv = read_characteristic_value_timeout(global_dbus_conn, dev->read_path, value, sizeof(value), timeout_ms);
+			if(rv >= 0 && telemetry_parse_ble(value, rv, &rec) == TELEMETRY_OK && telemetry_validate(&rec) == TELEMETRY_OK)
+			{
+				rec.timestamp = time(NULL);
+				shadow_update(shadow_find(dev->path), &rec);
+				rv = 0;
+			}
+			else if(rv >= 0)
+			{
+				log_error("Shadow: Unexpected value read from %s: \"%s\"\n", dev->read_path, value);
+				rv = -1;
+			}
+		}
+		else
+		{
+			log_info("Forwarding MQTT payload to BLE \"%s\" to %s\n", job->payload, dev->char_path);
+			rv = write_characteristic_value_timeout(global_dbus_conn, dev->char_path, job->payload, timeout_ms);
+		}
+		ble_ms = now_ms() - start;
+
+		if(rv == 0)
+		{
+			result_code = CMD_RESULT_SUCCESS;
+			result = "success";
+		}
+		else if(rv == BLE_WRITE_TIMEOUT)
+		{
+			result_code = CMD_RESULT_TIMEOUT;
+			result = "timeout";
+		}
+		else
+		{
+			log_error("Failed to send BLE command to microcontroller.\n");
+			result_code = CMD_RESULT_FAILED;
+			result = job->kind == CMD_JOB_PROPERTY_GET ? "ble read failed" : "ble write failed";
+		}
+	}
+
+	pthread_mutex_lock(&J.lock);
+	if(expired)
+	{
+		J.stats.expired++;
+		J.devices[job->device].stats.expired++;
+	}
+	else if(result_code == CMD_RESULT_SUCCESS)
+		J.stats.succeeded++;
+	else if(result_code == CMD_RESULT_TIMEOUT)
+		J.stats.timed_out++;
+	else
+		J.stats.failed++;
+	J.stats.latency_sum_ms += ble_ms;
+	if(ble_ms > J.stats.latency_max_ms)
+		J.stats.latency_max_ms = (uint32_t)ble_ms;
+	pthread_mutex_unlock(&J.lock);
+
+	//属性写入结束，成功写入的值用于过滤之后同样的 set 请求
+	if(job->kind == CMD_JOB_PROPERTY_SET)
+		shadow_set_done(shadow_find(dev->path), job->mask, !expired && result_code == CMD_RESULT_SUCCESS);
+
+	//速率命令写入成功后设备的采样间隔才算改变
+	if(job->kind == CMD_JOB_RATE)
+		rate_ctl_done(dev->path, (int)job->mask, !expired && result_code == CMD_RESULT_SUCCESS);
+
+	if(job->request_id[0])
+		publish_response(job, result_code, result, queue_ms, ble_ms);
+}
+
+
+//命令线程：串行执行 BLE 写入并发布响应
+void *command_thread_func(void *arg)
+{
+	cmd_job_t	*job;
+
+	log_info("Command Thread: Waiting for downlink commands...\n");
+
+	while(keep_running)
+	{
+		job = next_job();
+		if(!job)
+			continue;
+
+		run_job(job);
+
+		pthread_mutex_lock(&J.lock);
+		job->state = JOB_FREE;
+		job->request_id[0] = '\0';
+		pthread_mutex_unlock(&J.lock);
+	}
+
+	log_info("Command Thread: Exiting...\n");
+	return NULL;
+}
+
+
+void cmd_job_get_stats(cmd_job_stats_t *stats)
+{
+	pthread_mutex_lock(&J.lock);
+	*stats = J.stats;
+	pthread_mutex_unlock(&J.lock);
+}
+
+
+int cmd_job_get_device_stats(int device, cmd_job_device_stats_t *stats)
+{
+	int		rv = -1;
+
+	pthread_mutex_lock(&J.lock);
+	if(device >= 0 && device < J.device_count)
+	{
+		*stats = J.devices[device].stats;
+		rv = 0;
+	}
+	pthread_mutex_unlock(&J.lock);
+
+	return rv;
+}
+
+
+void cmd_job_log_stats(void)
+{
+	cmd_job_stats_t			st;
+	cmd_job_device_stats_t	dev;
+	uint64_t				done;
+	int						i;
+
+	cmd_job_get_stats(&st);
+	done = st.succeeded + st.failed + st.timed_out;
+
+	log_info("Command: submitted=%llu succeeded=%llu failed=%llu timed_out=%llu expired=%llu rejected=%llu queued=%u ble_avg=%llums ble_max=%ums\n",
+			(unsigned long long)st.submitted, (unsigned long long)st.succeeded,
+			(unsigned long long)st.failed, (unsigned long long)st.timed_out,
+			(unsigned long long)st.expired, (unsigned long long)st.rejected, st.queued,
+			(unsigned long long)(done ? st.latency_sum_ms / done : 0), st.latency_max_ms);
+
+	for(i = 0; cmd_job_get_device_stats(i, &dev) == 0; i++)
+	{
+		log_info("Command: device %s link=%s queued=%u held=%llu expired=%llu disconnects=%llu\n",
+				J.devices[i].path, dev.link_up ? "up" : "down", dev.queued,
+				(unsigned long long)dev.held, (unsigned long long)dev.expired,
+				(unsigned long long)dev.disconnects);
+	}
+}
@@ -0,0 +1,870 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  coap_server.c
+ *    Description:  This file implements the CoAP telemetry endpoint.
+ *
+ *                  一个线程用 recvmmsg 一次取出多个报文，逐个解析处理后，本批的响应
+ *                  用一次 sendmmsg 发出。
+ *                  CON 请求以捎带 ACK 回复；NON 请求只在出错或分块上传时回复 NON，
+ *                  成功的单个 NON 上报不回复，节点发完即可休眠。
+ *                  按 (地址, 端口, Message ID) 记录 EXCHANGE_LIFETIME 内处理过的请求及其
+ *                  响应，重传的请求直接重发缓存的响应，不会重复进入流水线；记录已满时回复
+ *                  5.03 不处理，也不会重复提交。
+ *                  Block1：按 (地址, 节点名) 重组，块号必须连续，完整后作为一个负载处理。
+ *                  负载中每行一个采样，全部通过解析和校验后才提交，任何一行出错整个请求
+ *                  返回 4.00，节点可以原样重发。
+ *                  节点按名字登记为网关的本地节点，采样并入子设备批量上报。
+ *
+ *        Version:  1.0.0(2025年09月07日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月07日 09时36分15秒"
+ *
+ ********************************************************************************/
+
+#define _GNU_SOURCE     //recvmmsg / sendmmsg
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "coap_server.h"
+#include "mqtt_gateway.h"
+#include "pipeline.h"
+#include "subdev.h"
+#include "telemetry.h"
+#include "log.h"
+
+
+#define COAP_VERSION			1
+#define COAP_RESP_MAX			64       //响应报文不带大负载
+#define COAP_NODE_MAX			32       //Uri-Path 中节点名的最大长度
+#define COAP_BLOCK_TIMEOUT_MS	60000    //分块上传中途停止后释放重组缓冲区
+#define COAP_DEDUP_MS			247000   //EXCHANGE_LIFETIME（RFC 7252 4.8.2）
+#define COAP_RCVBUF				(256 * 1024)
+#define COAP_PATH_PREFIX		"coap/"  //流水线中的设备路径 "coap/{node}"
+
+//报文类型
+enum {
+	COAP_CON = 0,
+	COAP_NON,
+	COAP_ACK,
+	COAP_RST,
+};
+
+//代码：类别 << 5 | 细节
+#define COAP_CODE(c, d)			(((c) << 5) | (d))
+#define CODE_EMPTY				COAP_CODE(0, 0)
+#define CODE_POST				COAP_CODE(0, 2)
+#define CODE_CHANGED			COAP_CODE(2, 4)
+#define CODE_CONTINUE			COAP_CODE(2, 31)
+#define CODE_BAD_REQUEST		COAP_CODE(4, 0)
+#define CODE_BAD_OPTION			COAP_CODE(4, 2)
+#define CODE_FORBIDDEN			COAP_CODE(4, 3)
+#define CODE_NOT_FOUND			COAP_CODE(4, 4)
+#define CODE_NOT_ALLOWED		COAP_CODE(4, 5)
+#define CODE_INCOMPLETE			COAP_CODE(4, 8)
+#define CODE_TOO_LARGE			COAP_CODE(4, 13)
+#define CODE_BAD_FORMAT			COAP_CODE(4, 15)
+#define CODE_UNAVAILABLE		COAP_CODE(5, 3)
+
+//选项号
+#define OPT_URI_HOST			3
+#define OPT_URI_PORT			7
+#define OPT_URI_PATH			11
+#define OPT_CONTENT_FORMAT		12
+#define OPT_URI_QUERY			15
+#define OPT_BLOCK1				27
+#define OPT_SIZE1				60
+
+//解析结果：丢弃，或格式错误（CON 回复 RST）
+#define PARSE_DROP				-1
+#define PARSE_REJECT			-2
+
+typedef struct {
+	uint8_t			type;
+	uint8_t			code;
+	uint8_t			tkl;
+	uint16_t		mid;
+	uint8_t			token[8];
+	uint8_t			error;              //选项检查得到的错误响应码，0 表示没有
+	int				segments;           //Uri-Path 段数
+	int				path_ok;            //路径为 /t 或 /t/{node}
+	char			node[COAP_NODE_MAX];
+	int				block1;             //带 Block1 选项
+	uint32_t		block_num;
+	uint8_t			block_more;
+	uint8_t			block_szx;
+	const uint8_t	*payload;
+	int				payload_len;
+} coap_request_t;
+
+//Block1 重组缓冲区
+typedef struct {
+	struct sockaddr_in	addr;
+	char				node[COAP_NODE_MAX];
+	uint64_t			last_ms;            //0 表示空闲
+	int					len;
+	char				body[COAP_BODY_MAX];
+} block_slot_t;
+
+/* 去重缓存：按 (地址, 端口, Message ID) 散列到桶，每桶 COAP_DEDUP_WAYS 个条目
+ * 条目在 EXCHANGE_LIFETIME 内不会被覆盖；桶内没有过期条目时请求不处理，保证处理过的请求都有记录
+ */
+typedef struct {
+	struct sockaddr_in	addr;
+	uint16_t			mid;
+	uint8_t				len;                //缓存的响应长度，0 表示没有回复
+	uint64_t			ms;                 //0 表示空闲
+	uint8_t				resp[COAP_RESP_MAX];
+} dedup_entry_t;
+
+
+static struct {
+	coap_server_config_t	config;
+	int						fd;
+	uint16_t				next_mid;
+	block_slot_t			blocks[COAP_BLOCK_SLOTS];
+	dedup_entry_t			dedup[COAP_DEDUP_BUCKETS][COAP_DEDUP_WAYS];
+	struct mmsghdr			in_msgs[COAP_BATCH_MAX];
+	struct iovec			in_iov[COAP_BATCH_MAX];
+	struct sockaddr_in		in_addr[COAP_BATCH_MAX];
+	uint8_t					in_buf[COAP_BATCH_MAX][COAP_DATAGRAM_MAX];
+	struct mmsghdr			out_msgs[COAP_BATCH_MAX];
+	struct iovec			out_iov[COAP_BATCH_MAX];
+	uint8_t					out_buf[COAP_BATCH_MAX][COAP_RESP_MAX];
+	coap_server_stats_t		stats;
+	pthread_mutex_t			lock;
+} C = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+static uint64_t now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static int same_peer(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+	return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+
+/* ----- 解析 ----- */
+
+//选项头中 13 / 14 表示后面还有 1 / 2 字节的扩展值，15 保留
+static int option_ext(const uint8_t *p, int len, int *off, uint32_t *value)
+{
+	if(*value == 13)
+	{
+		if(*off + 1 > len)
+			return -1;
+		*value = 13 + p[(*off)++];
+	}
+	else if(*value == 14)
+	{
+		if(*off + 2 > len)
+			return -1;
+		*value = 269 + ((p[*off] << 8) | p[*off + 1]);
+		*off += 2;
+	}
+	else if(*value == 15)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+
+static uint32_t option_uint(const uint8_t *p, int len)
+{
+	uint32_t	value = 0;
+	int			i;
+
+	for(i = 0; i < len; i++)
+		value = (value << 8) | p[i];
+	return value;
+}
+
+
+static int valid_node(const uint8_t *p, int len)
+{
+	int		i;
+
+	if(len <= 0 || len >= COAP_NODE_MAX)
+		return 0;
+
+	for(i = 0; i < len; i++)
+	{
+		if(!((p[i] >= 'a' && p[i] <= 'z') || (p[i] >= 'A' && p[i] <= 'Z') ||
+			 (p[i] >= '0' && p[i] <= '9') || p[i] == '_' || p[i] == '-' || p[i] == '.'))
+			return 0;
+	}
+	return 1;
+}
+
+
+//检查一个选项，不认识的关键选项（奇数号）记为 4.02
+static void parse_option(coap_request_t *req, uint32_t num, const uint8_t *v, int len)
+{
+	uint32_t	value;
+
+	switch(num)
+	{
+		case OPT_URI_PATH:
+			if(req->segments == 0)
+				req->path_ok = (len == 1 && v[0] == 't');
+			else if(req->segments == 1 && valid_node(v, len))
+			{
+				memcpy(req->node, v, len);
+				req->node[len] = '\0';
+			}
+			else
+				req->path_ok = 0;
+			req->segments++;
+			break;
+
+		case OPT_CONTENT_FORMAT:
+			//只接受 text/plain
+			if(len > 2 || option_uint(v, len) != 0)
+				req->error = CODE_BAD_FORMAT;
+			break;
+
+		case OPT_BLOCK1:
+			value = option_uint(v, len);
+			if(len > 3 || (value & 0x07) == 7)
+			{
+				req->error = CODE_BAD_REQUEST;
+				break;
+			}
+			req->block1 = 1;
+			req->block_num = value >> 4;
+			req->block_more = (value >> 3) & 0x01;
+			req->block_szx = value & 0x07;
+			break;
+
+		case OPT_URI_HOST:
+		case OPT_URI_PORT:
+		case OPT_URI_QUERY:
+		case OPT_SIZE1:
+			break;
+
+		default:
+			if(num & 0x01)
+				req->error = CODE_BAD_OPTION;
+			break;
+	}
+}
+
+
+static int parse_request(const uint8_t *p, int len, coap_request_t *req)
+{
+	uint32_t	delta;
+	uint32_t	olen;
+	uint32_t	num = 0;
+	int			off;
+
+	memset(req, 0, sizeof(*req));
+	if(len < 4 || (p[0] >> 6) != COAP_VERSION)
+		return PARSE_DROP;
+
+	req->type = (p[0] >> 4) & 0x03;
+	req->tkl = p[0] & 0x0f;
+	req->code = p[1];
+	req->mid = (p[2] << 8) | p[3];
+	if(req->tkl > 8 || 4 + req->tkl > len)
+		return PARSE_REJECT;
+	memcpy(req->token, p + 4, req->tkl);
+
+	for(off = 4 + req->tkl; off < len && p[off] != 0xff; off += olen)
+	{
+		delta = p[off] >> 4;
+		olen = p[off] & 0x0f;
+		off++;
+		if(option_ext(p, len, &off, &delta) < 0 || option_ext(p, len, &off, &olen) < 0 || off + (int)olen > len)
+			return PARSE_REJECT;
+
+		num += delta;
+		parse_option(req, num, p + off, olen);
+	}
+
+	//负载标志后面必须有负载
+	if(off < len)
+	{
+		if(++off == len)
+			return PARSE_REJECT;
+		req->payload = p + off;
+		req->payload_len = len - off;
+	}
+	return 0;
+}
+
+
+/* ----- 响应 ----- */
+
+static int put_option(uint8_t *buf, int off, uint32_t *last, uint32_t num, uint32_t value)
+{
+	uint32_t	delta = num - *last;
+	uint8_t		v[4];
+	int			n = 0;
+	int			i;
+
+	for(i = 3; i >= 0; i--)
+	{
+		if((value >> (8 * i)) & 0xff || n)
+			v[n++] = (value >> (8 * i)) & 0xff;
+	}
+
+	if(delta < 13)
+	{
+		buf[off++] = (delta << 4) | n;
+	}
+	else
+	{
+		buf[off++] = (13 << 4) | n;
+		buf[off++] = delta - 13;
+	}
+	memcpy(buf + off, v, n);
+	*last = num;
+	return off + n;
+}
+
+
+/* 生成响应：CON 以捎带 ACK 回复，NON 回复 NON
+ * block 为 1 时回显 Block1（块号、是否还有后续、块大小），size1 非 0 时带 Size1
+ */
+static int build_response(const coap_request_t *req, uint8_t code, int block, uint32_t size1, const char *diag, uint8_t *buf)
+{
+	uint16_t	mid = req->type == COAP_CON ? req->mid : C.next_mid++;
+	uint32_t	last = 0;
+	int			off;
+	int			n;
+
+	buf[0] = (COAP_VERSION << 6) | ((req->type == COAP_CON ? COAP_ACK : COAP_NON) << 4) | req->tkl;
+	buf[1] = code;
+	buf[2] = mid >> 8;
+	buf[3] = mid & 0xff;
+	memcpy(buf + 4, req->token, req->tkl);
+	off = 4 + req->tkl;
+
+	if(block)
+		off = put_option(buf, off, &last, OPT_BLOCK1, (req->block_num << 4) | (req->block_more << 3) | req->block_szx);
+	if(size1)
+		off = put_option(buf, off, &last, OPT_SIZE1, size1);
+
+	//诊断信息放在负载中，放不下时截断
+	if(diag && (n = strlen(diag)) > 0 && off + 2 < COAP_RESP_MAX)
+	{
+		if(n > COAP_RESP_MAX - off - 1)
+			n = COAP_RESP_MAX - off - 1;
+		buf[off++] = 0xff;
+		memcpy(buf + off, diag, n);
+		off += n;
+	}
+
+	return off;
+}
+
+
+//RST：拒绝格式错误的 CON 报文，也用来回答 CoAP ping（空的 CON）
+static int build_reset(const uint8_t *p, uint8_t *buf)
+{
+	buf[0] = (COAP_VERSION << 6) | (COAP_RST << 4);
+	buf[1] = CODE_EMPTY;
+	buf[2] = p[2];
+	buf[3] = p[3];
+	return 4;
+}
+
+
+/* ----- 去重 ----- */
+
+static dedup_entry_t *dedup_bucket(const struct sockaddr_in *from, uint16_t mid)
+{
+	uint32_t	h = from->sin_addr.s_addr * 2654435761u ^ from->sin_port * 40503u ^ mid;
+
+	return C.dedup[(h ^ (h >> 16)) % COAP_DEDUP_BUCKETS];
+}
+
+
+static dedup_entry_t *dedup_find(const struct sockaddr_in *from, uint16_t mid, uint64_t now)
+{
+	dedup_entry_t	*e = dedup_bucket(from, mid);
+	int				i;
+
+	for(i = 0; i < COAP_DEDUP_WAYS; i++, e++)
+	{
+		if(e->ms && now - e->ms < COAP_DEDUP_MS && e->mid == mid && same_peer(&e->addr, from))
+			return e;
+	}
+	return NULL;
+}
+
+
+//在桶内找一个空闲或已过期的条目记录新请求，桶内条目都还在有效期内时返回 NULL
+static dedup_entry_t *dedup_reserve(const struct sockaddr_in *from, uint16_t mid, uint64_t now)
+{
+	dedup_entry_t	*e = dedup_bucket(from, mid);
+	int				i;
+
+	for(i = 0; i < COAP_DEDUP_WAYS; i++, e++)
+	{
+		if(!e->ms || now - e->ms >= COAP_DEDUP_MS)
+		{
+			e->addr = *from;
+			e->mid = mid;
+			e->ms = now;
+			e->len = 0;
+			return e;
+		}
+	}
+	return NULL;
+}
+
+
+/* ----- 请求处理 ----- */
+
+/* 负载每行一个采样，与 BLE 通知格式相同；全部通过解析和校验后才提交
+ * 返回响应码
+ */
+static uint8_t submit_body(const char *path, const char *body, int len, const char **diag)
+{
+	telemetry_record_t	rec;
+	const char			*line;
+	const char			*end;
+	const char			*eol;
+	int					line_len;
+	int					samples = 0;
+	int					queued = 0;
+	int					index;
+	int					pass;
+
+	//第一遍检查，第二遍提交
+	for(pass = 0; pass < 2; pass++)
+	{
+		for(line = body, end = body + len; line < end; line = eol + 1)
+		{
+			if(!(eol = memchr(line, '\n', end - line)))
+				eol = end;
+			line_len = eol - line;
+			if(line_len && line[line_len - 1] == '\r')
+				line_len--;
+			if(!line_len)
+				continue;
+
+			if(pass == 0)
+			{
+				if(line_len >= PIPELINE_RAW_MAX || telemetry_parse_ble(line, line_len, &rec) != TELEMETRY_OK ||
+				   telemetry_validate(&rec) != TELEMETRY_OK)
+				{
+					*diag = "invalid sample";
+					return CODE_BAD_REQUEST;
+				}
+				samples++;
+				continue;
+			}
+
+			if(pipeline_submit(path, line, line_len) == 0)
+				queued++;
+			else
+				C.stats.dropped++;
+		}
+
+		if(!samples)
+		{
+			*diag = "no samples";
+			return CODE_BAD_REQUEST;
+		}
+
+		//通过检查后把节点登记为网关的本地节点：流水线按路径找到它，采样并入子设备批量上报，
+		//不会当作网关自己的 BLE 设备；与 BLE 子设备同名的节点拒绝
+		if(pass == 0 && (index = subdev_add_node(path + strlen(COAP_PATH_PREFIX))) < 0)
+		{
+			*diag = "node table full";
+			return CODE_UNAVAILABLE;
+		}
+		if(pass == 0 && !subdev_is_node(index))
+		{
+			*diag = "not a node";
+			return CODE_FORBIDDEN;
+		}
+	}
+
+	C.stats.bodies++;
+	C.stats.samples += queued;
+
+	//全部被过载策略丢弃：节点应退避后重发
+	if(!queued)
+	{
+		*diag = "overloaded";
+		return CODE_UNAVAILABLE;
+	}
+	return CODE_CHANGED;
+}
+
+
+static block_slot_t *block_find(const struct sockaddr_in *from, const char *node, int create, uint64_t now)
+{
+	block_slot_t	*oldest = &C.blocks[0];
+	int				i;
+
+	for(i = 0; i < COAP_BLOCK_SLOTS; i++)
+	{
+		if(C.blocks[i].last_ms && same_peer(&C.blocks[i].addr, from) && strcmp(C.blocks[i].node, node) == 0)
+			return &C.blocks[i];
+		if(C.blocks[i].last_ms < oldest->last_ms)
+			oldest = &C.blocks[i];
+	}
+
+	if(!create)
+		return NULL;
+
+	//没有空闲的缓冲区时覆盖最久没有进展的上传
+	oldest->addr = *from;
+	snprintf(oldest->node, sizeof(oldest->node), "%s", node);
+	oldest->last_ms = now;
+	oldest->len = 0;
+	return oldest;
+}
+
+
+static void block_expire(uint64_t now)
+{
+	int		i;
+
+	for(i = 0; i < COAP_BLOCK_SLOTS; i++)
+	{
+		if(C.blocks[i].last_ms && now - C.blocks[i].last_ms >= COAP_BLOCK_TIMEOUT_MS)
+			C.blocks[i].last_ms = 0;
+	}
+}
+
+
+/* 处理一个请求，生成响应；返回响应长度，0 表示不回复
+ * 设备路径为 "coap/{node}"，没有节点名时用来源地址，节点以同样的名字登记为网关的本地节点
+ */
+static int handle_request(const struct sockaddr_in *from, coap_request_t *req, uint8_t *resp, uint64_t now)
+{
+	char			path[COAP_NODE_MAX + 8];
+	char			addr[INET_ADDRSTRLEN];
+	const char		*diag = NULL;
+	block_slot_t	*slot;
+	uint32_t		size;
+	uint8_t			code;
+
+	if(req->type == COAP_CON)
+		C.stats.confirmable++;
+	else
+		C.stats.non_confirmable++;
+
+	if(req->code != CODE_POST)
+	{
+		code = (req->code >> 5) == 0 ? CODE_NOT_ALLOWED : CODE_BAD_REQUEST;
+		goto error;
+	}
+	if(req->error)
+	{
+		code = req->error;
+		goto error;
+	}
+	if(!req->path_ok)
+	{
+		code = CODE_NOT_FOUND;
+		goto error;
+	}
+
+	if(req->node[0])
+		snprintf(path, sizeof(path), COAP_PATH_PREFIX "%s", req->node);
+	else
+		snprintf(path, sizeof(path), COAP_PATH_PREFIX "%s", inet_ntop(AF_INET, &from->sin_addr, addr, sizeof(addr)));
+
+	if(!req->block1)
+	{
+		code = submit_body(path, (const char *)req->payload, req->payload_len, &diag);
+		if(code != CODE_CHANGED)
+			goto error;
+		return req->type == COAP_CON ? build_response(req, code, 0, 0, NULL, resp) : 0;
+	}
+
+	//Block1：非最后一块必须是完整的块，块号必须紧接已收到的内容
+	C.stats.blocks++;
+	size = 16u << req->block_szx;
+	if(req->block_more && (uint32_t)req->payload_len != size)
+	{
+		code = CODE_BAD_REQUEST;
+		diag = "short block";
+		goto error;
+	}
+
+	//块号 0 总是开始一次新的上传
+	slot = block_find(from, req->node, req->block_num == 0, now);
+	if(slot && req->block_num == 0)
+		slot->len = 0;
+	if(!slot || req->block_num * size != (uint32_t)slot->len)
+	{
+		code = CODE_INCOMPLETE;
+		goto error;
+	}
+
+	if(slot->len + req->payload_len > COAP_BODY_MAX)
+	{
+		slot->last_ms = 0;
+		C.stats.errors++;
+		return build_response(req, CODE_TOO_LARGE, 0, COAP_BODY_MAX, NULL, resp);
+	}
+
+	memcpy(slot->body + slot->len, req->payload, req->payload_len);
+	slot->len += req->payload_len;
+	slot->last_ms = now;
+
+	if(req->block_more)
+		return build_response(req, CODE_CONTINUE, 1, 0, NULL, resp);
+
+	slot->last_ms = 0;
+	code = submit_body(path, slot->body, slot->len, &diag);
+	if(code != CODE_CHANGED)
+		C.stats.errors++;
+	return build_response(req, code, 1, 0, diag, resp);
+
+error:
+	C.stats.errors++;
+	return build_response(req, code, 0, 0, diag, resp);
+}
+
+
+//处理一个报文；需要回复时把响应写入 resp，返回响应长度
+static int handle_datagram(const struct sockaddr_in *from, const uint8_t *p, int len, uint8_t *resp, uint64_t now)
+{
+	coap_request_t	req;
+	dedup_entry_t	*dup;
+	dedup_entry_t	*slot;
+	int				rc;
+	int				n;
+
+	rc = parse_request(p, len, &req);
+	if(rc == PARSE_DROP)
+		return 0;
+	if(rc == PARSE_REJECT)
+	{
+		C.stats.errors++;
+		return ((p[0] >> 4) & 0x03) == COAP_CON ? build_reset(p, resp) : 0;
+	}
+
+	//我们不发 CON，收到的 ACK / RST 直接忽略；空的 CON 是 CoAP ping
+	if(req.type == COAP_ACK || req.type == COAP_RST)
+		return 0;
+	if(req.code == CODE_EMPTY)
+		return req.type == COAP_CON ? build_reset(p, resp) : 0;
+
+	if((dup = dedup_find(from, req.mid, now)))
+	{
+		C.stats.duplicates++;
+		if(dup->len)
+			memcpy(resp, dup->resp, dup->len);
+		return dup->len;
+	}
+
+	//没有地方记录时不处理：否则重传会被当作新请求再次提交
+	if(!(slot = dedup_reserve(from, req.mid, now)))
+	{
+		C.stats.deferred++;
+		C.stats.errors++;
+		return build_response(&req, CODE_UNAVAILABLE, 0, 0, "busy", resp);
+	}
+
+	n = handle_request(from, &req, resp, now);
+	slot->len = n;
+	if(n)
+		memcpy(slot->resp, resp, n);
+	return n;
+}
+
+
+/* ----- 接口 ----- */
+
+int coap_server_init(const coap_server_config_t *config)
+{
+	struct sockaddr_in	addr;
+	struct timeval		tv = { 1, 0 };
+	int					rcvbuf = COAP_RCVBUF;
+
+	C.config = *config;
+	if(!C.config.enabled)
+		return 0;
+
+	if(C.config.port <= 0)
+		C.config.port = COAP_DEFAULT_PORT;
+	if(C.config.batch <= 0 || C.config.batch > COAP_BATCH_MAX)
+		C.config.batch = COAP_BATCH_MAX;
+	C.next_mid = (uint16_t)time(NULL);
+	memset(C.blocks, 0, sizeof(C.blocks));
+	memset(C.dedup, 0, sizeof(C.dedup));
+	memset(&C.stats, 0, sizeof(C.stats));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(C.config.port);
+	if(inet_pton(AF_INET, C.config.bind ? C.config.bind : "0.0.0.0", &addr.sin_addr) != 1)
+	{
+		log_error("CoAP: Invalid bind address %s.\n", C.config.bind);
+		return -1;
+	}
+
+	C.fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if(C.fd < 0)
+	{
+		log_error("CoAP: Failed to create socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	//接收超时让线程定期检查退出标志；加大接收缓冲区吸收节点的突发上报
+	setsockopt(C.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(C.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	if(bind(C.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		log_error("CoAP: Failed to bind %s:%d: %s\n", C.config.bind ? C.config.bind : "0.0.0.0", C.config.port, strerror(errno));
+		coap_server_cleanup();
+		return -1;
+	}
+
+	log_info("CoAP: Listening on udp %s:%d, up to %d datagrams per batch.\n",
+			C.config.bind ? C.config.bind : "0.0.0.0", C.config.port, C.config.batch);
+	return 0;
+}
+
+
+void *coap_server_thread_func(void *arg)
+{
+	uint64_t	now;
+	uint64_t	last_expire = 0;
+	int			n;
+	int			out;
+	int			sent;
+	int			rc;
+	int			i;
+
+	log_info("CoAP: Thread started.\n");
+
+	for(i = 0; i < COAP_BATCH_MAX; i++)
+	{
+		C.in_iov[i].iov_base = C.in_buf[i];
+		C.in_iov[i].iov_len = sizeof(C.in_buf[i]);
+		C.in_msgs[i].msg_hdr.msg_iov = &C.in_iov[i];
+		C.in_msgs[i].msg_hdr.msg_iovlen = 1;
+		C.in_msgs[i].msg_hdr.msg_name = &C.in_addr[i];
+		C.out_iov[i].iov_base = C.out_buf[i];
+		C.out_msgs[i].msg_hdr.msg_iov = &C.out_iov[i];
+		C.out_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while(keep_running)
+	{
+		for(i = 0; i < C.config.batch; i++)
+			C.in_msgs[i].msg_hdr.msg_namelen = sizeof(C.in_addr[i]);
+
+		//至少等到一个报文（或接收超时），然后取走已经到达的全部报文
+		n = recvmmsg(C.fd, C.in_msgs, C.config.batch, MSG_WAITFORONE, NULL);
+		if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		{
+			log_error("CoAP: recvmmsg failed: %s\n", strerror(errno));
+			break;
+		}
+
+		pthread_mutex_lock(&C.lock);
+		now = now_ms();
+		out = 0;
+		if(n > 0)
+			C.stats.batches++;
+
+		for(i = 0; i < n; i++)
+		{
+			C.stats.datagrams++;
+			C.stats.bytes_in += C.in_msgs[i].msg_len;
+
+			//超过 COAP_DATAGRAM_MAX 的报文被截断，无法可靠处理
+			if(C.in_msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+			{
+				C.stats.errors++;
+				continue;
+			}
+
+			rc = handle_datagram(&C.in_addr[i], C.in_buf[i], C.in_msgs[i].msg_len, C.out_buf[out], now);
+			if(rc > 0)
+			{
+				C.out_iov[out].iov_len = rc;
+				C.out_msgs[out].msg_hdr.msg_name = &C.in_addr[i];
+				C.out_msgs[out].msg_hdr.msg_namelen = sizeof(C.in_addr[i]);
+				out++;
+			}
+		}
+
+		if(now - last_expire >= 1000)
+		{
+			block_expire(now);
+			last_expire = now;
+		}
+		C.stats.responses += out;
+		pthread_mutex_unlock(&C.lock);
+
+		//本批的响应一次发出；发送失败只影响这一批，节点会重传
+		for(sent = 0; sent < out; sent += rc)
+		{
+			rc = sendmmsg(C.fd, C.out_msgs + sent, out - sent, 0);
+			if(rc <= 0)
+			{
+				log_warn("CoAP: sendmmsg failed: %s\n", strerror(errno));
+				break;
+			}
+		}
+	}
+
+	log_info("CoAP: Thread exiting.\n");
+	return NULL;
+}
+
+
+void coap_server_cleanup(void)
+{
+	if(C.fd >= 0)
+		close(C.fd);
+	C.fd = -1;
+}
+
+
+void coap_server_get_stats(coap_server_stats_t *stats)
+{
+	pthread_mutex_lock(&C.lock);
+	*stats = C.stats;
+	pthread_mutex_unlock(&C.lock);
+}
+
+
+void coap_server_log_stats(void)
+{
+	coap_server_stats_t	st;
+
+	if(!C.config.enabled)
+		return ;
+
+	coap_server_get_stats(&st);
+	log_info("CoAP: datagrams=%llu avg_per_batch=%.1f con=%llu non=%llu duplicates=%llu deferred=%llu blocks=%llu bodies=%llu samples=%llu dropped=%llu errors=%llu responses=%llu in=%lluB\n",
+			(unsigned long long)st.datagrams, st.batches ? (double)st.datagrams / st.batches : 0.0,
+			(unsigned long long)st.confirmable, (unsigned long long)st.non_confirmable,
+			(unsigned long long)st.duplicates, (unsigned long long)st.deferred,
+			(unsigned long long)st.blocks,
+			(unsigned long long)st.bodies, (unsigned long long)st.samples,
+			(unsigned long long)st.dropped, (unsigned long long)st.errors,
+			(unsigned long long)st.responses, (unsigned long long)st.bytes_in);
+}
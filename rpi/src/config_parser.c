@@ -7,6 +7,21 @@
 #include "config_parser.h"
 #include "mqtt_gateway.h"
 #include "ble_gateway.h"
+#include "spool.h"
+#include "payload_codec.h"
+#include "mqtt_sink.h"
+#include "publish_lane.h"
+#include "report_filter.h"
+#include "pipeline.h"
+#include "cmd_job.h"
+#include "subdev.h"
+#include "shadow.h"
+#include "rate_ctl.h"
+#include "uplink_sink.h"
+#include "link_watch.h"
+#include "mqtt_mux.h"
+#include "local_broker.h"
+#include "coap_server.h"
 
 
 extern mqtt_device_config_t device_config;
@@ -17,6 +32,21 @@ extern char WRITABLE_CHARACTERISTIC_PATH[512];
 extern int HR_THRESHOLD;
 extern int SPO2_THRESHOLD;
 extern char WARNING_CMD[128];
+extern spool_config_t spool_config;
+extern payload_codec_config_t codec_config;
+extern mqtt_sinks_config_t sinks_config;
+extern publish_lanes_config_t lanes_config;
+extern report_filter_config_t filter_config;
+extern pipeline_config_t pipeline_config;
+extern cmd_job_config_t cmd_job_config;
+extern subdev_config_t subdev_config;
+extern shadow_config_t shadow_config;
+extern rate_ctl_config_t rate_ctl_config;
+extern uplink_sink_config_t uplink_config;
+extern link_watch_config_t link_watch_config;
+extern mqtt_mux_config_t mux_config;
+extern local_broker_config_t broker_config;
+extern coap_server_config_t coap_config;
 
 
 //JSON解析帮助函数：安全地获取指定键对应的字符串指针
@@ -47,6 +77,19 @@ static int get_json_int(json_object *obj, const char *key)
 }
 
 
+//JSON解析帮助函数：获取整数值，键不存在时返回默认值（用于可选配置项）
+static int get_json_int_default(json_object *obj, const char *key, int def)
+{
+	json_object *field;
+	if(json_object_object_get_ex(obj, key, &field))
+	{
+		return json_object_get_int(field);
+	}
+
+	return def;
+}
+
+
 /* 解析指定的JSON配置文件，并填充到全局配置变量中 */
 int parse_json_config(const char *filename)
 {
@@ -76,6 +119,45 @@ int parse_json_config(const char *filename)
 		device_config.subscribe_topic = strdup(get_json_string(mqtt_config, "subscribe_topic"));
 		device_config.keepalive_interval = get_json_int(mqtt_config, "keepalive_interval");
 		device_config.publish_interval_sec = get_json_int(mqtt_config, "publish_interval_sec");
+		device_config.max_inflight = get_json_int_default(mqtt_config, "max_inflight", 20);
+		device_config.publish_timeout_sec = get_json_int_default(mqtt_config, "publish_timeout_sec", 30);
+		device_config.stats_interval_sec = get_json_int_default(mqtt_config, "stats_interval_sec", 60);
+		device_config.command_timeout_ms = get_json_int_default(mqtt_config, "command_timeout_ms", 5000);
+		device_config.command_dedup_ttl_sec = get_json_int_default(mqtt_config, "command_dedup_ttl_sec", 300);
+
+		//持久会话（默认关闭，每次连接都是新会话）
+		const char *state_path = get_json_string(mqtt_config, "session_state_path");
+		device_config.persistent_session = get_json_int_default(mqtt_config, "persistent_session", 0);
+		device_config.session_expiry_sec = get_json_int_default(mqtt_config, "session_expiry_sec", 3600);
+		device_config.session_state_path = (device_config.persistent_session && state_path) ? strdup(state_path) : NULL;
+		device_config.session_state_interval_ms = get_json_int_default(mqtt_config, "session_state_interval_ms", 2000);
+
+		//MQTT v5 选项（默认使用 v3.1.1）
+		device_config.protocol_version = get_json_int_default(mqtt_config, "protocol_version", MQTT_PROTOCOL_311);
+		if(device_config.protocol_version != MQTT_PROTOCOL_50)
+			device_config.protocol_version = MQTT_PROTOCOL_311;
+		device_config.receive_maximum = get_json_int_default(mqtt_config, "receive_maximum", 0);
+		device_config.topic_alias = get_json_int_default(mqtt_config, "topic_alias", 1);
+
+		//重连与地址缓存
+		device_config.dns_ttl_sec = get_json_int_default(mqtt_config, "dns_ttl_sec", 300);
+		device_config.reconnect_base_ms = get_json_int_default(mqtt_config, "reconnect_base_ms", 500);
+		device_config.reconnect_max_ms = get_json_int_default(mqtt_config, "reconnect_max_ms", 60000);
+		device_config.connect_timeout_ms = get_json_int_default(mqtt_config, "connect_timeout_ms", 10000);
+
+		//各类流量的消息过期时间，例如 "message_expiry_sec": {"telemetry": 600, "response": 30}
+		json_object *expiry_obj;
+		if(json_object_object_get_ex(mqtt_config, "message_expiry_sec", &expiry_obj))
+		{
+			for(int i = 0; i < MQTT_TRAFFIC_CLASS_COUNT; i++)
+				device_config.message_expiry_sec[i] = get_json_int_default(expiry_obj, mqtt_traffic_class_name(i), 0);
+
+			//告警和回放数据默认与属性上报相同
+			device_config.message_expiry_sec[MQTT_TRAFFIC_ALERT] = get_json_int_default(expiry_obj, "alert",
+					device_config.message_expiry_sec[MQTT_TRAFFIC_TELEMETRY]);
+			device_config.message_expiry_sec[MQTT_TRAFFIC_BULK] = get_json_int_default(expiry_obj, "bulk",
+					device_config.message_expiry_sec[MQTT_TRAFFIC_TELEMETRY]);
+		}
 		
 		device_config.ca_cert = strdup(get_json_string(mqtt_config, "ca_cert"));
 	}
@@ -123,7 +205,428 @@ int parse_json_config(const char *filename)
 	}
 
 
-	//4.根据解析出的数据，构建完整的D-BUS路径
+	//4.解析可选的"spool_config"配置段（断线暂存），缺省时不启用
+	json_object *spool_cfg;
+	if(json_object_object_get_ex(root, "spool_config", &spool_cfg))
+	{
+		const char *spool_path = get_json_string(spool_cfg, "path");
+
+		spool_config.enable = get_json_int_default(spool_cfg, "enable", 1);
+		spool_config.path = strdup(spool_path ? spool_path : "./iot_gateway.spool");
+		spool_config.max_bytes = (size_t)get_json_int_default(spool_cfg, "max_bytes", 4 * 1024 * 1024);
+		spool_config.segment_size = (size_t)get_json_int_default(spool_cfg, "segment_size", 64 * 1024);
+		spool_config.replay_rate = get_json_int_default(spool_cfg, "replay_rate", 20);
+	}
+
+
+	//解析可选的"publish_lanes"配置段（发送队列和令牌桶）
+	//例如 "publish_lanes": {"device_rate": 10, "device_burst": 20, "telemetry": {"rate": 5, "weight": 4}}
+	{
+		static const int default_depth[MQTT_TRAFFIC_CLASS_COUNT] = { 64, 32, 16, 16 };
+		static const int default_weight[MQTT_TRAFFIC_CLASS_COUNT] = { 4, 1, 1, 1 };
+		json_object *lanes_obj = NULL;
+		json_object *lane_obj;
+
+		json_object_object_get_ex(root, "publish_lanes", &lanes_obj);
+		lanes_config.device_rate = lanes_obj ? get_json_int_default(lanes_obj, "device_rate", 0) : 0;
+		lanes_config.device_burst = lanes_obj ? get_json_int_default(lanes_obj, "device_burst", lanes_config.device_rate) : 0;
+
+		for(int i = 0; i < MQTT_TRAFFIC_CLASS_COUNT; i++)
+		{
+			publish_lane_config_t *lane = &lanes_config.lanes[i];
+
+			//回放速率默认沿用 spool_config.replay_rate
+			lane->rate = (i == MQTT_TRAFFIC_BULK) ? (spool_config.replay_rate > 0 ? spool_config.replay_rate : 20) : 0;
+			lane->burst = lane->rate;
+			lane->weight = default_weight[i];
+			lane->depth = default_depth[i];
+
+			if(lanes_obj && json_object_object_get_ex(lanes_obj, mqtt_traffic_class_name(i), &lane_obj))
+			{
+				lane->rate = get_json_int_default(lane_obj, "rate", lane->rate);
+				lane->burst = get_json_int_default(lane_obj, "burst", lane->rate);
+				lane->weight = get_json_int_default(lane_obj, "weight", lane->weight);
+				lane->depth = get_json_int_default(lane_obj, "depth", lane->depth);
+			}
+		}
+	}
+
+
+	//解析可选的"report_filter"配置段（各属性的上报死区），心跳周期使用 publish_interval_sec
+	//例如 "report_filter": {"hr": {"abs": 2, "rel_pct": 3}, "spo2": {"abs": 1}}
+	//未配置的属性死区为 0，即取值不变时不上报；publish_interval_sec 为 0 时不过滤
+	{
+		static const char *prop_names[TELEMETRY_PROP_COUNT] = {
+#define X(name, key, ble_key, scale, min, max) #name,
+			TELEMETRY_PROPERTIES(X)
+#undef X
+		};
+		json_object *filter_obj = NULL;
+		json_object *prop_obj;
+
+		json_object_object_get_ex(root, "report_filter", &filter_obj);
+		filter_config.heartbeat_sec = device_config.publish_interval_sec;
+		for(int i = 0; i < TELEMETRY_PROP_COUNT; i++)
+		{
+			filter_config.deadband[i].abs = 0;
+			filter_config.deadband[i].rel_pct = 0;
+			if(filter_obj && json_object_object_get_ex(filter_obj, prop_names[i], &prop_obj))
+			{
+				filter_config.deadband[i].abs = get_json_int_default(prop_obj, "abs", 0);
+				filter_config.deadband[i].rel_pct = get_json_int_default(prop_obj, "rel_pct", 0);
+			}
+		}
+	}
+
+
+	//解析可选的"pipeline"配置段（处理阶段之间的队列长度和过载策略）
+	//例如 "pipeline": {"intake": {"capacity": 64, "policy": "block"}, "encode": {"policy": "decimate", "decimate": 4}}
+	//策略：block / drop-oldest / drop-newest / decimate，缺省为 drop-oldest
+	{
+		json_object *pipeline_obj = NULL;
+		json_object *queue_obj;
+
+		json_object_object_get_ex(root, "pipeline", &pipeline_obj);
+		for(int i = 0; i < PIPELINE_Q_COUNT; i++)
+		{
+			stage_queue_config_t *qc = &pipeline_config.queues[i];
+
+			qc->capacity = 64;
+			qc->policy = STAGE_POLICY_DROP_OLDEST;
+			qc->decimate = 4;
+			if(pipeline_obj && json_object_object_get_ex(pipeline_obj, pipeline_queue_name(i), &queue_obj))
+			{
+				const char *policy = get_json_string(queue_obj, "policy");
+
+				qc->capacity = get_json_int_default(queue_obj, "capacity", qc->capacity);
+				qc->decimate = get_json_int_default(queue_obj, "decimate", qc->decimate);
+				if(policy && (qc->policy = stage_queue_policy_parse(policy)) < 0)
+				{
+					fprintf(stderr, "Warning: Unknown pipeline policy '%s' for %s queue, using drop-oldest.\n", policy, pipeline_queue_name(i));
+					qc->policy = STAGE_POLICY_DROP_OLDEST;
+				}
+			}
+		}
+	}
+
+
+	//解析可选的"command_ttl"配置段（下行命令在设备断开时最多保留的时间）
+	//例如 "command_ttl": {"default": 30, "set_alarm": 300}，云端命令中的 paras.ttl_sec 优先
+	{
+		json_object *ttl_obj = NULL;
+
+		cmd_job_config.timeout_ms = device_config.command_timeout_ms;
+		cmd_job_config.default_ttl_sec = 30;
+		cmd_job_config.ttl_count = 0;
+		if(json_object_object_get_ex(root, "command_ttl", &ttl_obj) && json_object_is_type(ttl_obj, json_type_object))
+		{
+			json_object_object_foreach(ttl_obj, name, val)
+			{
+				if(strcmp(name, "default") == 0)
+				{
+					cmd_job_config.default_ttl_sec = json_object_get_int(val);
+				}
+				else if(cmd_job_config.ttl_count < CMD_JOB_TTL_TYPES)
+				{
+					snprintf(cmd_job_config.ttl[cmd_job_config.ttl_count].command_name, sizeof(cmd_job_config.ttl[0].command_name), "%s", name);
+					cmd_job_config.ttl[cmd_job_config.ttl_count].ttl_sec = json_object_get_int(val);
+					cmd_job_config.ttl_count++;
+				}
+			}
+		}
+	}
+
+
+	//解析可选的"gateway"配置段：网关模式下每个 BLE 设备对应一个 IoTDA 子设备，属性合并批量上报
+	//例如 "gateway": {"batch_interval_ms": 1000, "batch_max": 0,
+	//               "sub_devices": [{"mac": "AA_BB_CC_DD_EE_01", "device_id": "gw01_band01"}]}
+	//mac 的写法与 ble_config.device_mac 相同；ble_config 中的设备也列出时同样按子设备上报
+	//"mode": "direct" 时每个设备以自己的身份单独连接，需要 password，可选 client_id：
+	//例如 "gateway": {"mode": "direct", "connect_stagger_ms": 50, "keepalive": 60, "max_inflight": 4,
+	//               "sub_devices": [{"mac": "AA_BB_CC_DD_EE_01", "device_id": "band01", "password": "xxx"}]}
+	//直连模式的客户端引擎 "engine": "mosquitto"（默认）或 "lite"（内置客户端，仅明文 TCP）
+	{
+		json_object *gateway_obj = NULL;
+		json_object *subdev_arr;
+		const char *mode;
+		const char *engine;
+
+		subdev_config.count = 0;
+		subdev_config.batch_interval_ms = 1000;
+		subdev_config.batch_max = 0;
+		memset(&mux_config, 0, sizeof(mux_config));
+		if(json_object_object_get_ex(root, "gateway", &gateway_obj))
+		{
+			subdev_config.batch_interval_ms = get_json_int_default(gateway_obj, "batch_interval_ms", 1000);
+			subdev_config.batch_max = get_json_int_default(gateway_obj, "batch_max", 0);
+
+			mode = get_json_string(gateway_obj, "mode");
+			mux_config.enabled = mode && strcmp(mode, "direct") == 0;
+			mux_config.connect_stagger_ms = get_json_int_default(gateway_obj, "connect_stagger_ms", 50);
+			mux_config.keepalive = get_json_int_default(gateway_obj, "keepalive", device_config.keepalive_interval);
+			mux_config.max_inflight = get_json_int_default(gateway_obj, "max_inflight", 4);
+			mux_config.reconnect_base_ms = get_json_int_default(gateway_obj, "reconnect_base_ms", 1000);
+			mux_config.reconnect_max_ms = get_json_int_default(gateway_obj, "reconnect_max_ms", 60000);
+			if(mode && !mux_config.enabled && strcmp(mode, "gateway") != 0)
+				fprintf(stderr, "Warning: unknown gateway mode '%s', using gateway mode.\n", mode);
+
+			engine = get_json_string(gateway_obj, "engine");
+			mux_config.engine = engine && strcmp(engine, "lite") == 0 ? MQTT_MUX_ENGINE_LITE : MQTT_MUX_ENGINE_MOSQUITTO;
+			if(engine && mux_config.engine != MQTT_MUX_ENGINE_LITE && strcmp(engine, "mosquitto") != 0)
+				fprintf(stderr, "Warning: unknown gateway engine '%s', using mosquitto.\n", engine);
+			if(json_object_object_get_ex(gateway_obj, "sub_devices", &subdev_arr) && json_object_is_type(subdev_arr, json_type_array))
+			{
+				int n = json_object_array_length(subdev_arr);
+				for(int i = 0; i < n && subdev_config.count < SUBDEV_MAX; i++)
+				{
+					json_object *dev_obj = json_object_array_get_idx(subdev_arr, i);
+					const char *mac = get_json_string(dev_obj, "mac");
+					const char *device_id = get_json_string(dev_obj, "device_id");
+
+					const char *password = get_json_string(dev_obj, "password");
+					const char *client_id = get_json_string(dev_obj, "client_id");
+
+					if(!mac || !device_id || strlen(device_id) >= SUBDEV_ID_MAX)
+					{
+						fprintf(stderr, "Warning: gateway sub_devices entry %d needs 'mac' and 'device_id', ignored.\n", i);
+						continue;
+					}
+					if(mux_config.enabled && !password)
+					{
+						fprintf(stderr, "Warning: gateway sub_devices entry %d needs 'password' in direct mode, ignored.\n", i);
+						continue;
+					}
+					subdev_config.devices[subdev_config.count].mac = strdup(mac);
+					subdev_config.devices[subdev_config.count].device_id = strdup(device_id);
+					subdev_config.devices[subdev_config.count].password = password ? strdup(password) : NULL;
+					subdev_config.devices[subdev_config.count].client_id = client_id ? strdup(client_id) : NULL;
+					subdev_config.count++;
+				}
+			}
+		}
+	}
+
+
+	//解析可选的"local_broker"配置段：局域网节点连接网关的本地 MQTT 代理
+	//例如 "local_broker": {"enabled": 1, "bind": "192.168.1.10", "port": 1883, "max_clients": 32}
+	//节点按 $oc/devices/{device_id}/sys/properties/report 上报，device_id 需在云端添加为网关的子设备，
+	//且必须与节点 CONNECT 的用户名（没有用户名时为客户端 ID）一致；不配置 bind 时只监听 127.0.0.1
+	//这一核对不是认证：用户名由节点自己声明，密码不检查，bind 只应设为可信局域网的地址
+	{
+		json_object *broker_obj = NULL;
+		const char *bind;
+
+		memset(&broker_config, 0, sizeof(broker_config));
+		if(json_object_object_get_ex(root, "local_broker", &broker_obj))
+		{
+			broker_config.enabled = get_json_int_default(broker_obj, "enabled", 0);
+			broker_config.port = get_json_int_default(broker_obj, "port", 1883);
+			broker_config.max_clients = get_json_int_default(broker_obj, "max_clients", LOCAL_BROKER_CLIENTS_MAX);
+			bind = get_json_string(broker_obj, "bind");
+			broker_config.bind = bind ? strdup(bind) : NULL;
+		}
+	}
+
+
+	//解析可选的"coap"配置段：电池节点经 UDP 上报的 CoAP 端点
+	//例如 "coap": {"enabled": 1, "bind": "0.0.0.0", "port": 5683, "batch": 32}
+	//节点 POST coap://gateway/t/{node}，负载与 BLE 通知格式相同，每行一个采样
+	{
+		json_object *coap_obj = NULL;
+		const char *bind;
+
+		memset(&coap_config, 0, sizeof(coap_config));
+		if(json_object_object_get_ex(root, "coap", &coap_obj))
+		{
+			coap_config.enabled = get_json_int_default(coap_obj, "enabled", 0);
+			coap_config.port = get_json_int_default(coap_obj, "port", COAP_DEFAULT_PORT);
+			coap_config.batch = get_json_int_default(coap_obj, "batch", COAP_BATCH_MAX);
+			bind = get_json_string(coap_obj, "bind");
+			coap_config.bind = bind ? strdup(bind) : NULL;
+		}
+	}
+
+
+	//解析可选的"shadow"配置段：properties/get 用缓存回答时允许的最大数据年龄
+	//例如 "shadow": {"max_age_ms": 5000}
+	{
+		json_object *shadow_obj = NULL;
+
+		shadow_config.max_age_ms = 5000;
+		if(json_object_object_get_ex(root, "shadow", &shadow_obj))
+			shadow_config.max_age_ms = get_json_int_default(shadow_obj, "max_age_ms", 5000);
+	}
+
+
+	//解析可选的"rate_control"配置段：按网关积压和告警调整设备采样间隔，设备需支持速率命令
+	//例如 "rate_control": {"enabled": 1, "normal_sec": 1, "slow_sec": 5, "alert_sec": 1,
+	//                      "high_water": 200, "low_water": 50, "disconnect_sec": 30,
+	//                      "hold_sec": 60, "alert_hold_sec": 120, "cmd_format": "RATE:%d"}
+	{
+		json_object *rate_obj = NULL;
+		const char *cmd_format = NULL;
+
+		memset(&rate_ctl_config, 0, sizeof(rate_ctl_config));
+		if(json_object_object_get_ex(root, "rate_control", &rate_obj))
+		{
+			rate_ctl_config.enabled = get_json_int_default(rate_obj, "enabled", 0);
+			rate_ctl_config.normal_sec = get_json_int_default(rate_obj, "normal_sec", 1);
+			rate_ctl_config.slow_sec = get_json_int_default(rate_obj, "slow_sec", 5);
+			rate_ctl_config.alert_sec = get_json_int_default(rate_obj, "alert_sec", 1);
+			rate_ctl_config.high_water = get_json_int_default(rate_obj, "high_water", 200);
+			rate_ctl_config.low_water = get_json_int_default(rate_obj, "low_water", 50);
+			rate_ctl_config.disconnect_sec = get_json_int_default(rate_obj, "disconnect_sec", 30);
+			rate_ctl_config.hold_sec = get_json_int_default(rate_obj, "hold_sec", 60);
+			rate_ctl_config.alert_hold_sec = get_json_int_default(rate_obj, "alert_hold_sec", 120);
+			cmd_format = get_json_string(rate_obj, "cmd_format");
+		}
+		snprintf(rate_ctl_config.cmd_format, sizeof(rate_ctl_config.cmd_format), "%s", cmd_format ? cmd_format : "RATE:%d");
+	}
+
+
+	//5.解析可选的"payload_codec"数组（按主题选择上报编码），缺省全部使用 JSON
+	//例如 [{"topic": "gateway/telemetry", "codec": "cbor", "delta": 1, "keyframe_interval": 30}]
+	json_object *codec_arr;
+	if(json_object_object_get_ex(root, "payload_codec", &codec_arr) && json_object_is_type(codec_arr, json_type_array))
+	{
+		int n = json_object_array_length(codec_arr);
+		for(int i = 0; i < n && codec_config.count < PAYLOAD_CODEC_MAX_TOPICS; i++)
+		{
+			json_object *rule_obj = json_object_array_get_idx(codec_arr, i);
+			const char *topic = get_json_string(rule_obj, "topic");
+			const char *codec = get_json_string(rule_obj, "codec");
+			payload_codec_rule_t *rule;
+
+			if(!topic || !codec)
+			{
+				fprintf(stderr, "Warning: payload_codec entry %d needs 'topic' and 'codec', ignored.\n", i);
+				continue;
+			}
+
+			rule = &codec_config.rules[codec_config.count++];
+			rule->topic = strdup(topic);
+			rule->codec = strdup(codec);
+			rule->delta = get_json_int_default(rule_obj, "delta", 0);
+			rule->keyframe_interval = get_json_int_default(rule_obj, "keyframe_interval", 0);
+		}
+	}
+
+
+	//6.解析可选的附加代理 "sinks" 和路由规则 "routes"，缺省只使用 mqtt_config 中的代理
+	//例如 "sinks": [{"name": "onprem", "endpoints": [{"host": "10.0.0.2", "port": 1883}], "client_id": "gw01"}]
+	//     "routes": [{"topic": "$oc/devices/+/sys/properties/report", "sinks": ["primary", "onprem"]}]
+	json_object *sinks_arr;
+	if(json_object_object_get_ex(root, "sinks", &sinks_arr) && json_object_is_type(sinks_arr, json_type_array))
+	{
+		int n = json_object_array_length(sinks_arr);
+		for(int i = 0; i < n && sinks_config.sink_count < MQTT_SINK_MAX; i++)
+		{
+			json_object *sink_obj = json_object_array_get_idx(sinks_arr, i);
+			json_object *ep_arr;
+			const char *name = get_json_string(sink_obj, "name");
+			const char *str;
+			mqtt_sink_config_t *sink;
+
+			if(!name || !json_object_object_get_ex(sink_obj, "endpoints", &ep_arr) || !json_object_is_type(ep_arr, json_type_array))
+			{
+				fprintf(stderr, "Warning: sinks entry %d needs 'name' and 'endpoints', ignored.\n", i);
+				continue;
+			}
+
+			sink = &sinks_config.sinks[sinks_config.sink_count++];
+			sink->name = strdup(name);
+			for(int j = 0; j < (int)json_object_array_length(ep_arr) && sink->endpoint_count < MQTT_SINK_ENDPOINT_MAX; j++)
+			{
+				json_object *ep_obj = json_object_array_get_idx(ep_arr, j);
+				const char *host = get_json_string(ep_obj, "host");
+				if(!host)
+					continue;
+				sink->endpoints[sink->endpoint_count].host = strdup(host);
+				sink->endpoints[sink->endpoint_count].port = get_json_int_default(ep_obj, "port", 1883);
+				sink->endpoint_count++;
+			}
+
+			sink->client_id = (str = get_json_string(sink_obj, "client_id")) ? strdup(str) : NULL;
+			sink->username = (str = get_json_string(sink_obj, "username")) ? strdup(str) : NULL;
+			sink->password = (str = get_json_string(sink_obj, "password")) ? strdup(str) : NULL;
+			sink->ca_cert = (str = get_json_string(sink_obj, "ca_cert")) ? strdup(str) : NULL;
+			sink->keepalive = get_json_int_default(sink_obj, "keepalive_interval", 60);
+			sink->queue_size = get_json_int_default(sink_obj, "queue_size", 256);
+			sink->max_inflight = get_json_int_default(sink_obj, "max_inflight", 20);
+			sink->failover_latency_ms = get_json_int_default(sink_obj, "failover_latency_ms", 0);
+			sink->failover_after_sec = get_json_int_default(sink_obj, "failover_after_sec", 30);
+		}
+	}
+
+	json_object *routes_arr;
+	if(json_object_object_get_ex(root, "routes", &routes_arr) && json_object_is_type(routes_arr, json_type_array))
+	{
+		int n = json_object_array_length(routes_arr);
+		for(int i = 0; i < n && sinks_config.route_count < MQTT_SINK_ROUTE_MAX; i++)
+		{
+			json_object *route_obj = json_object_array_get_idx(routes_arr, i);
+			json_object *names;
+			const char *topic = get_json_string(route_obj, "topic");
+			mqtt_route_config_t *route;
+
+			if(!topic || !json_object_object_get_ex(route_obj, "sinks", &names) || !json_object_is_type(names, json_type_array))
+			{
+				fprintf(stderr, "Warning: routes entry %d needs 'topic' and 'sinks', ignored.\n", i);
+				continue;
+			}
+
+			route = &sinks_config.routes[sinks_config.route_count++];
+			route->topic = strdup(topic);
+			for(int j = 0; j < (int)json_object_array_length(names) && route->sink_count < MQTT_SINK_MAX + 1; j++)
+				route->sinks[route->sink_count++] = strdup(json_object_get_string(json_object_array_get_idx(names, j)));
+		}
+	}
+
+
+	//解析可选的"link_watch"配置段：通知静默超过预期间隔的 notify_k 倍时重新启用通知，reconnect_k 倍时断开重连
+	//例如 "link_watch": {"enabled": 1, "notify_k": 4, "reconnect_k": 8, "min_silence_ms": 3000, "warmup": 8}
+	{
+		json_object *watch_obj = NULL;
+
+		link_watch_config.enabled = 1;
+		link_watch_config.notify_k = 4;
+		link_watch_config.reconnect_k = 8;
+		link_watch_config.min_silence_ms = 3000;
+		link_watch_config.warmup = 8;
+		if(json_object_object_get_ex(root, "link_watch", &watch_obj))
+		{
+			link_watch_config.enabled = get_json_int_default(watch_obj, "enabled", 1);
+			link_watch_config.notify_k = get_json_int_default(watch_obj, "notify_k", 4);
+			link_watch_config.reconnect_k = get_json_int_default(watch_obj, "reconnect_k", 8);
+			link_watch_config.min_silence_ms = get_json_int_default(watch_obj, "min_silence_ms", 3000);
+			link_watch_config.warmup = get_json_int_default(watch_obj, "warmup", 8);
+		}
+	}
+
+
+	//解析可选的"uplink_sink"配置段：上报数据的去向，缺省为 mqtt（上面的 primary 和附加代理）
+	//例如 "uplink_sink": {"type": "file", "path": "/var/log/gateway/uplink.log", "max_bytes": 1048576, "max_files": 3}
+	//     "uplink_sink": {"type": "unix", "path": "/run/gateway/uplink.sock", "tee": 1}
+	{
+		json_object *uplink_obj = NULL;
+		const char *type = NULL;
+		const char *path = NULL;
+
+		memset(&uplink_config, 0, sizeof(uplink_config));
+		if(json_object_object_get_ex(root, "uplink_sink", &uplink_obj))
+		{
+			type = get_json_string(uplink_obj, "type");
+			path = get_json_string(uplink_obj, "path");
+			uplink_config.max_bytes = get_json_int_default(uplink_obj, "max_bytes", 0);
+			uplink_config.max_files = get_json_int_default(uplink_obj, "max_files", 3);
+			uplink_config.tee = get_json_int_default(uplink_obj, "tee", 0);
+		}
+		uplink_config.type = strdup(type ? type : "mqtt");
+		uplink_config.path = path ? strdup(path) : NULL;
+	}
+
+
+	//7.根据解析出的数据，构建完整的D-BUS路径
 	if(strlen(BLE_DEVICE_MAC) > 0)
 	{
 		//构建设备路径
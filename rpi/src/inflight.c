@@ -0,0 +1,590 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  inflight.c
+ *    Description:  This file tracks QoS1 publishes between mosquitto_publish and PUBACK.
+ *
+ *                  发布流程：inflight_reserve() 预留槽位 -> mosquitto_publish() 得到 mid
+ *                  -> inflight_commit() 登记。PUBACK 在下行线程的 mosquitto_loop 中回调，
+ *                  可能早于 commit 到达，这类确认先记在 early_acks 中，commit 时再匹配。
+ *
+ *        Version:  1.0.0(2025年08月14日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月14日 09时30分12秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "inflight.h"
+#include "log.h"
+
+
+#define EARLY_ACK_SLOTS		16
+#define EARLY_ACK_TTL_MS	2000   //提前到达的确认只在 publish 与 commit 之间有意义，超过即作废
+
+//在途消息文件：文件头 + 若干条 {class, topic_len, payload_len, topic, payload}
+#define STATE_MAGIC			0x31464e49   // "INF1"
+
+enum {
+	SLOT_FREE = 0,
+	SLOT_RESERVED,
+	SLOT_INFLIGHT,
+};
+
+typedef struct {
+	int			state;
+	int			mid;
+	int			overdue;     //已超过确认时限，槽位仍保留到 PUBACK
+	uint64_t	enqueue_ms;
+
+	//持久会话时保留的消息副本
+	int			traffic_class;
+	int			topic_len;
+	int			len;
+	char		*copy;       // topic + '\0' + payload
+} inflight_slot_t;
+
+//PUBACK 先于 inflight_commit 到达时暂存，带到达时间，避免 mid 回绕后误匹配新消息
+typedef struct {
+	int			mid;
+	uint64_t	ack_ms;
+} early_ack_t;
+
+
+static struct {
+	int				window;
+	int				limit;        //当前允许的在途数，可按代理的 Receive Maximum 收紧
+	uint64_t		timeout_ms;
+	inflight_slot_t	slots[INFLIGHT_MAX_WINDOW];
+	early_ack_t		early_acks[EARLY_ACK_SLOTS];
+	int				early_next;
+	int				used;         //RESERVED + INFLIGHT 的槽位数
+	int				retain;       //是否保留消息副本
+	int				dirty;        //在途集合自上次保存后有变化
+	uint64_t		saved_ms;     //上次保存的时间
+	inflight_stats_t stats;
+	pthread_mutex_t	lock;
+} T = { .window = 0 };
+
+
+static uint64_t now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+//按确认时延落入对数直方图
+static void record_latency(uint64_t latency_ms)
+{
+	int		bucket = 0;
+
+	while(bucket < INFLIGHT_HIST_BUCKETS - 1 && latency_ms >= (1ULL << bucket))
+		bucket++;
+
+	T.stats.hist[bucket]++;
+	T.stats.latency_sum_ms += latency_ms;
+	if(latency_ms > T.stats.latency_max_ms)
+		T.stats.latency_max_ms = (uint32_t)latency_ms;
+}
+
+
+static void clear_early_acks(void)
+{
+	int		i;
+
+	for(i = 0; i < EARLY_ACK_SLOTS; i++)
+		T.early_acks[i].mid = -1;
+}
+
+
+static void release_slot(inflight_slot_t *slot)
+{
+	if(slot->state == SLOT_INFLIGHT && slot->copy)
+		T.dirty = 1;
+	if(slot->overdue)
+		T.stats.overdue_pending--;
+	slot->overdue = 0;
+	slot->state = SLOT_FREE;
+	slot->mid = 0;
+	free(slot->copy);
+	slot->copy = NULL;
+	T.used--;
+	T.stats.in_flight = T.used;
+}
+
+
+int inflight_init(int max_inflight, int timeout_sec)
+{
+	if(max_inflight <= 0 || max_inflight > INFLIGHT_MAX_WINDOW)
+		max_inflight = max_inflight <= 0 ? 20 : INFLIGHT_MAX_WINDOW;
+
+	pthread_mutex_init(&T.lock, NULL);
+	memset(T.slots, 0, sizeof(T.slots));
+	memset(&T.stats, 0, sizeof(T.stats));
+	clear_early_acks();
+
+	T.window = max_inflight;
+	T.limit = max_inflight;
+	T.timeout_ms = (uint64_t)(timeout_sec > 0 ? timeout_sec : 30) * 1000;
+	T.used = 0;
+
+	log_info("Inflight: QoS1 window %d message(s), PUBACK timeout %llu ms.\n",
+			T.window, (unsigned long long)T.timeout_ms);
+	return T.window;
+}
+
+
+//开启后 inflight_retain() 为在途消息保存副本，供退出时写入文件
+void inflight_set_retain(int enable)
+{
+	T.retain = enable;
+}
+
+
+//为预留的槽位保存消息副本（在 inflight_commit 之前调用）
+void inflight_retain(int slot, const char *topic, const void *payload, int payloadlen, int traffic_class)
+{
+	int		topic_len = (int)strlen(topic);
+	char	*copy;
+
+	if(!T.retain || slot < 0 || slot >= T.window)
+		return ;
+
+	copy = malloc(topic_len + 1 + payloadlen);
+	if(!copy)
+		return ;
+	memcpy(copy, topic, topic_len + 1);
+	memcpy(copy + topic_len + 1, payload, payloadlen);
+
+	pthread_mutex_lock(&T.lock);
+	free(T.slots[slot].copy);
+	T.slots[slot].copy = copy;
+	T.slots[slot].topic_len = topic_len;
+	T.slots[slot].len = payloadlen;
+	T.slots[slot].traffic_class = traffic_class;
+	pthread_mutex_unlock(&T.lock);
+}
+
+
+//预留一个在途槽位，窗口已满时返回 -1，调用者应暂缓发布（背压）
+int inflight_reserve(void)
+{
+	int		i;
+	int		slot = -1;
+
+	pthread_mutex_lock(&T.lock);
+	if(T.used < T.limit)
+	{
+		for(i = 0; i < T.window; i++)
+		{
+			if(T.slots[i].state == SLOT_FREE)
+			{
+				T.slots[i].state = SLOT_RESERVED;
+				T.slots[i].enqueue_ms = now_ms();
+				T.used++;
+				if((uint32_t)T.used > T.stats.peak)
+					T.stats.peak = T.used;
+				T.stats.in_flight = T.used;
+				slot = i;
+				break;
+			}
+		}
+	}
+	else
+	{
+		T.stats.rejected++;
+	}
+	pthread_mutex_unlock(&T.lock);
+
+	return slot;
+}
+
+
+//发布成功后登记 mid
+void inflight_commit(int slot, int mid)
+{
+	early_ack_t	*ack;
+	uint64_t	now = now_ms();
+	int			i;
+
+	if(slot < 0 || slot >= T.window)
+		return ;
+
+	pthread_mutex_lock(&T.lock);
+	T.stats.published++;
+
+	//PUBACK 已经先于 commit 到达：必须是本槽位预留之后、且在有效期内收到的确认
+	for(i = 0; i < EARLY_ACK_SLOTS; i++)
+	{
+		ack = &T.early_acks[i];
+		if(ack->mid == mid && ack->ack_ms >= T.slots[slot].enqueue_ms && now - ack->ack_ms <= EARLY_ACK_TTL_MS)
+		{
+			ack->mid = -1;
+			T.stats.acked++;
+			record_latency(now - T.slots[slot].enqueue_ms);
+			release_slot(&T.slots[slot]);
+			pthread_mutex_unlock(&T.lock);
+			return ;
+		}
+	}
+
+	T.slots[slot].mid = mid;
+	T.slots[slot].state = SLOT_INFLIGHT;
+	if(T.slots[slot].copy)
+		T.dirty = 1;
+	pthread_mutex_unlock(&T.lock);
+}
+
+
+//发布失败时归还预留的槽位
+void inflight_cancel(int slot)
+{
+	if(slot < 0 || slot >= T.window)
+		return ;
+
+	pthread_mutex_lock(&T.lock);
+	if(T.slots[slot].state == SLOT_RESERVED)
+		release_slot(&T.slots[slot]);
+	pthread_mutex_unlock(&T.lock);
+}
+
+
+//PUBACK 回调：匹配 mid 并统计确认时延
+void inflight_ack(int mid)
+{
+	int			i;
+	uint64_t	latency;
+
+	pthread_mutex_lock(&T.lock);
+	for(i = 0; i < T.window; i++)
+	{
+		if(T.slots[i].state == SLOT_INFLIGHT && T.slots[i].mid == mid)
+		{
+			latency = now_ms() - T.slots[i].enqueue_ms;
+			T.stats.acked++;
+			record_latency(latency);
+			release_slot(&T.slots[i]);
+			pthread_mutex_unlock(&T.lock);
+
+			log_debug("Inflight: mid %d acknowledged after %llu ms.\n", mid, (unsigned long long)latency);
+			return ;
+		}
+	}
+
+	//未找到：可能是发布线程尚未 commit，先记录下来
+	T.early_acks[T.early_next].mid = mid;
+	T.early_acks[T.early_next].ack_ms = now_ms();
+	T.early_next = (T.early_next + 1) % EARLY_ACK_SLOTS;
+	pthread_mutex_unlock(&T.lock);
+}
+
+
+/* 标记超时未确认的消息并计数
+ * 消息仍在 libmosquitto 的队列中等待确认（重连后由库重发），槽位保留到 PUBACK 或 inflight_reset，
+ * 窗口因此始终限制库内排队的消息数，持久会话保存的也仍是完整的未确认集合
+ */
+void inflight_expire(void)
+{
+	int			i;
+	int			overdue = 0;
+	int			first_mid = 0;
+	uint32_t	pending;
+	uint64_t	now = now_ms();
+
+	pthread_mutex_lock(&T.lock);
+	for(i = 0; i < T.window; i++)
+	{
+		if(T.slots[i].state == SLOT_INFLIGHT && !T.slots[i].overdue && now - T.slots[i].enqueue_ms > T.timeout_ms)
+		{
+			T.slots[i].overdue = 1;
+			T.stats.overdue++;
+			T.stats.overdue_pending++;
+			if(!overdue++)
+				first_mid = T.slots[i].mid;
+		}
+	}
+
+	//作废过期的提前确认
+	for(i = 0; i < EARLY_ACK_SLOTS; i++)
+	{
+		if(T.early_acks[i].mid != -1 && now - T.early_acks[i].ack_ms > EARLY_ACK_TTL_MS)
+			T.early_acks[i].mid = -1;
+	}
+	pending = T.stats.overdue_pending;
+	pthread_mutex_unlock(&T.lock);
+
+	if(overdue)
+		log_warn("Inflight: %d message(s) not acknowledged within %llu ms (first mid %d), %u overdue slot(s) held until PUBACK.\n",
+				overdue, (unsigned long long)T.timeout_ms, first_mid, pending);
+}
+
+
+//连接断开：暂存的提前确认属于旧连接，不能再匹配之后的发布
+void inflight_discard_early_acks(void)
+{
+	pthread_mutex_lock(&T.lock);
+	clear_early_acks();
+	pthread_mutex_unlock(&T.lock);
+}
+
+
+/* 调整允许的在途数量（不超过初始化时的窗口）
+ * 已在途的消息不受影响，新预留在在途数降到新上限以下之前会被拒绝
+ */
+void inflight_set_window(int limit)
+{
+	if(limit <= 0 || limit > T.window)
+		limit = T.window;
+
+	pthread_mutex_lock(&T.lock);
+	if(limit != T.limit)
+		log_info("Inflight: QoS1 window adjusted from %d to %d message(s).\n", T.limit, limit);
+	T.limit = limit;
+	pthread_mutex_unlock(&T.lock);
+}
+
+
+//丢弃全部在途消息（会话被重置，这些消息不会再收到 PUBACK），按超时计数
+void inflight_reset(void)
+{
+	int		i;
+
+	pthread_mutex_lock(&T.lock);
+	for(i = 0; i < T.window; i++)
+	{
+		if(T.slots[i].state == SLOT_INFLIGHT)
+		{
+			T.stats.expired++;
+			release_slot(&T.slots[i]);
+		}
+	}
+	clear_early_acks();
+	pthread_mutex_unlock(&T.lock);
+}
+
+
+/* 把仍未确认的消息写入文件，返回写入的条数
+ * 先写临时文件、刷盘后再改名，运行中保存时崩溃或断电也不会留下半个文件；
+ * 没有在途消息时删除旧文件
+ */
+int inflight_save(const char *path)
+{
+	FILE			*fp;
+	inflight_slot_t	*slot;
+	char			tmp[PATH_MAX];
+	uint32_t		hdr[3];
+	uint32_t		magic = STATE_MAGIC;
+	int				count = 0;
+	int				failed = 0;
+	int				i;
+
+	//未开启保留（例如启动早期就退出）时不动上次保存的文件
+	if(!path || !T.retain)
+		return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "wb");
+	if(!fp)
+	{
+		log_error("Inflight: Failed to open %s for saving: %s\n", tmp, strerror(errno));
+		return -1;
+	}
+	fwrite(&magic, sizeof(magic), 1, fp);
+
+	pthread_mutex_lock(&T.lock);
+	for(i = 0; i < T.window; i++)
+	{
+		slot = &T.slots[i];
+		if(slot->state != SLOT_INFLIGHT || !slot->copy)
+			continue;
+
+		hdr[0] = slot->traffic_class;
+		hdr[1] = slot->topic_len;
+		hdr[2] = slot->len;
+		if(fwrite(hdr, sizeof(hdr), 1, fp) != 1 ||
+		   fwrite(slot->copy, slot->topic_len + 1 + slot->len, 1, fp) != 1)
+		{
+			failed = 1;
+			break;
+		}
+		count++;
+	}
+	T.dirty = 0;
+	T.saved_ms = now_ms();
+	pthread_mutex_unlock(&T.lock);
+
+	if(fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+		failed = 1;
+	if(fclose(fp) != 0)
+		failed = 1;
+
+	if(failed)
+	{
+		log_error("Inflight: Failed to write %s, previous state kept.\n", tmp);
+		remove(tmp);
+		return -1;
+	}
+
+	if(count == 0)
+	{
+		remove(tmp);
+		remove(path);
+	}
+	else if(rename(tmp, path) != 0)
+	{
+		log_error("Inflight: Failed to replace %s: %s\n", path, strerror(errno));
+		remove(tmp);
+		return -1;
+	}
+
+	T.stats.saved = count;
+	log_debug("Inflight: Saved %d unacknowledged message(s) to %s.\n", count, path);
+	return count;
+}
+
+
+/* 运行中定期保存：在途集合有变化且距上次保存超过 interval_ms 时写入文件
+ * 由下行线程在 inflight_expire 之后调用
+ */
+int inflight_checkpoint(const char *path, int interval_ms)
+{
+	int		due;
+
+	if(!path || !T.retain)
+		return 0;
+
+	pthread_mutex_lock(&T.lock);
+	due = T.dirty && now_ms() - T.saved_ms >= (uint64_t)(interval_ms > 0 ? interval_ms : 0);
+	if(due)
+		T.stats.checkpoints++;
+	pthread_mutex_unlock(&T.lock);
+
+	if(!due)
+		return 0;
+
+	return inflight_save(path);
+}
+
+
+/* 启动时读取上次保存的在途消息，通过 resubmit 重新提交，返回提交的条数
+ * 文件读完即删除，重复提交按 QoS1 至少一次的语义处理
+ */
+int inflight_restore(const char *path, inflight_resubmit_t resubmit)
+{
+	FILE		*fp;
+	uint32_t	hdr[3];
+	uint32_t	magic = 0;
+	char		*buf;
+	int			count = 0;
+	int			dropped = 0;
+
+	if(!path || !(fp = fopen(path, "rb")))
+		return 0;
+
+	if(fread(&magic, sizeof(magic), 1, fp) != 1 || magic != STATE_MAGIC)
+	{
+		log_warn("Inflight: %s is not a saved session state, ignored.\n", path);
+		fclose(fp);
+		remove(path);
+		return 0;
+	}
+
+	while(fread(hdr, sizeof(hdr), 1, fp) == 1)
+	{
+		if(hdr[1] > 1024 || hdr[2] > 1024 * 1024)
+			break;
+
+		buf = malloc(hdr[1] + 1 + hdr[2]);
+		if(!buf)
+			break;
+		if(fread(buf, hdr[1] + 1 + hdr[2], 1, fp) != 1 || buf[hdr[1]] != '\0')
+		{
+			free(buf);
+			break;
+		}
+
+		if(resubmit((int)hdr[0], buf, buf + hdr[1] + 1, (int)hdr[2], 1) == 0)
+			count++;
+		else
+			dropped++;
+		free(buf);
+	}
+
+	fclose(fp);
+	remove(path);
+
+	T.stats.restored = count;
+	T.stats.restore_dropped = dropped;
+	if(count)
+		log_info("Inflight: Restored %d unacknowledged message(s) from %s.\n", count, path);
+	if(dropped)
+		log_warn("Inflight: %d saved message(s) could not be resubmitted and were dropped.\n", dropped);
+	return count;
+}
+
+
+int inflight_count(void)
+{
+	int		count;
+
+	pthread_mutex_lock(&T.lock);
+	count = T.used;
+	pthread_mutex_unlock(&T.lock);
+
+	return count;
+}
+
+
+void inflight_get_stats(inflight_stats_t *stats)
+{
+	pthread_mutex_lock(&T.lock);
+	*stats = T.stats;
+	pthread_mutex_unlock(&T.lock);
+}
+
+
+void inflight_log_stats(void)
+{
+	inflight_stats_t	st;
+	char				hist[INFLIGHT_HIST_BUCKETS * 24];
+	int					len = 0;
+	int					i;
+
+	inflight_get_stats(&st);
+
+	for(i = 0; i < INFLIGHT_HIST_BUCKETS; i++)
+	{
+		if(!st.hist[i])
+			continue;
+
+		if(i == INFLIGHT_HIST_BUCKETS - 1)
+			len += snprintf(hist + len, sizeof(hist) - len, " >=%lums:%llu", 1UL << (i - 1), (unsigned long long)st.hist[i]);
+		else
+			len += snprintf(hist + len, sizeof(hist) - len, " <%lums:%llu", 1UL << i, (unsigned long long)st.hist[i]);
+	}
+	hist[len] = '\0';
+
+	log_info("Inflight: published=%llu acked=%llu overdue=%llu(%u held) expired=%llu rejected=%llu in_flight=%u peak=%u avg=%llums max=%ums\n",
+			(unsigned long long)st.published, (unsigned long long)st.acked,
+			(unsigned long long)st.overdue, st.overdue_pending,
+			(unsigned long long)st.expired, (unsigned long long)st.rejected,
+			st.in_flight, st.peak,
+			(unsigned long long)(st.acked ? st.latency_sum_ms / st.acked : 0), st.latency_max_ms);
+	if(len)
+		log_info("Inflight: PUBACK latency histogram:%s\n", hist);
+	if(T.retain)
+		log_info("Inflight: session state saved=%u checkpoints=%llu restored=%u restore_dropped=%u\n",
+				st.saved, (unsigned long long)st.checkpoints, st.restored, st.restore_dropped);
+}
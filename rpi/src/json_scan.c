@@ -0,0 +1,316 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  json_scan.c
+ *    Description:  This file implements a zero-allocation JSON path scanner.
+ *
+ *                  只做查找所需的最少工作：与路径不匹配的成员整体跳过，
+ *                  匹配的值以指针+长度的形式返回。复杂命令仍可回退到 json-c 完整解析。
+ *
+ *        Version:  1.0.0(2025年08月21日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月21日 16时40分05秒"
+ *
+ ********************************************************************************/
+
+#include <string.h>
+
+#include "json_scan.h"
+
+
+#define JSON_SCAN_MAX_DEPTH		32
+
+
+static const char *skip_ws(const char *p, const char *end)
+{
+	while(p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+		p++;
+	return p;
+}
+
+
+//p 指向起始引号，返回结束引号之后的位置
+static const char *scan_string(const char *p, const char *end, int *escaped)
+{
+	for(p++; p < end; p++)
+	{
+		if(*p == '\\')
+		{
+			if(escaped)
+				*escaped = 1;
+			p++;
+			continue;
+		}
+		if(*p == '"')
+			return p + 1;
+	}
+	return NULL;
+}
+
+
+//跳过任意一个值，返回值之后的位置；对象和数组按括号深度整体跳过
+static const char *skip_value(const char *p, const char *end)
+{
+	int		depth = 0;
+
+	p = skip_ws(p, end);
+	if(p >= end)
+		return NULL;
+
+	do
+	{
+		if(p >= end)
+			return NULL;
+
+		switch(*p)
+		{
+			case '"':
+				p = scan_string(p, end, NULL);
+				if(!p)
+					return NULL;
+				continue;
+
+			case '{':
+			case '[':
+				if(++depth > JSON_SCAN_MAX_DEPTH)
+					return NULL;
+				p++;
+				continue;
+
+			case '}':
+			case ']':
+				if(--depth < 0)
+					return NULL;
+				p++;
+				continue;
+
+			default:
+				if(depth == 0)
+				{
+					//数字或 true/false/null
+					while(p < end && *p != ',' && *p != '}' && *p != ']' &&
+						  *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+						p++;
+					return p;
+				}
+				p++;
+				continue;
+		}
+	} while(depth > 0);
+
+	return p;
+}
+
+
+static void fill_value(const char *start, const char *stop, json_scan_value_t *out)
+{
+	out->escaped = 0;
+
+	switch(*start)
+	{
+		case '"':
+			out->type = JSON_SCAN_STRING;
+			out->ptr = start + 1;
+			out->len = stop - start - 2;
+			out->escaped = memchr(out->ptr, '\\', out->len) != NULL;
+			return ;
+		case '{':
+			out->type = JSON_SCAN_OBJECT;
+			break;
+		case '[':
+			out->type = JSON_SCAN_ARRAY;
+			break;
+		case 't':
+		case 'f':
+			out->type = JSON_SCAN_BOOL;
+			break;
+		case 'n':
+			out->type = JSON_SCAN_NULL;
+			break;
+		default:
+			out->type = JSON_SCAN_NUMBER;
+			break;
+	}
+	out->ptr = start;
+	out->len = stop - start;
+}
+
+
+/* 按点分路径（例如 "paras.report"）查找字段
+ * 找到时 out 指向 json 缓冲区内部，调用者需保证缓冲区在使用期间有效
+ */
+int json_scan_get(const char *json, size_t len, const char *path, json_scan_value_t *out)
+{
+	const char	*p = json;
+	const char	*end = json + len;
+	const char	*key;
+	const char	*key_end;
+	const char	*val;
+	const char	*comp = path;
+	size_t		comp_len;
+	int			matched;
+
+	memset(out, 0, sizeof(*out));
+
+	while(1)
+	{
+		comp_len = strcspn(comp, ".");
+
+		p = skip_ws(p, end);
+		if(p >= end || *p != '{')
+			return JSON_SCAN_NOT_FOUND;
+		p++;
+
+		matched = 0;
+		while(!matched)
+		{
+			p = skip_ws(p, end);
+			if(p >= end)
+				return JSON_SCAN_SYNTAX;
+			if(*p == '}')
+				return JSON_SCAN_NOT_FOUND;
+			if(*p != '"')
+				return JSON_SCAN_SYNTAX;
+
+			key = p + 1;
+			p = scan_string(p, end, NULL);
+			if(!p)
+				return JSON_SCAN_SYNTAX;
+			key_end = p - 1;
+
+			p = skip_ws(p, end);
+			if(p >= end || *p != ':')
+				return JSON_SCAN_SYNTAX;
+			p = skip_ws(p + 1, end);
+			val = p;
+
+			if((size_t)(key_end - key) == comp_len && memcmp(key, comp, comp_len) == 0)
+			{
+				matched = 1;
+				break;
+			}
+
+			p = skip_value(p, end);
+			if(!p)
+				return JSON_SCAN_SYNTAX;
+			p = skip_ws(p, end);
+			if(p < end && *p == ',')
+				p++;
+		}
+
+		if(comp[comp_len] == '\0')
+		{
+			p = skip_value(val, end);
+			if(!p)
+				return JSON_SCAN_SYNTAX;
+			fill_value(val, p, out);
+			return JSON_SCAN_OK;
+		}
+
+		//继续在子对象中查找下一级
+		comp += comp_len + 1;
+		p = val;
+	}
+}
+
+
+static int hex4(const char *p)
+{
+	int		v = 0;
+	int		i;
+
+	for(i = 0; i < 4; i++)
+	{
+		v <<= 4;
+		if(p[i] >= '0' && p[i] <= '9')
+			v |= p[i] - '0';
+		else if(p[i] >= 'a' && p[i] <= 'f')
+			v |= p[i] - 'a' + 10;
+		else if(p[i] >= 'A' && p[i] <= 'F')
+			v |= p[i] - 'A' + 10;
+		else
+			return -1;
+	}
+	return v;
+}
+
+
+/* 将字符串值反转义并复制到 buf（以 '\0' 结尾），返回长度，缓冲区不足返回 -1 */
+int json_scan_unescape(const json_scan_value_t *val, char *buf, size_t size)
+{
+	const char	*p = val->ptr;
+	const char	*end = val->ptr + val->len;
+	size_t		n = 0;
+	int			cp;
+
+	if(val->type != JSON_SCAN_STRING || size == 0)
+		return -1;
+
+	while(p < end)
+	{
+		if(n + 4 >= size)
+			return -1;
+
+		if(*p != '\\')
+		{
+			buf[n++] = *p++;
+			continue;
+		}
+
+		if(++p >= end)
+			return -1;
+		switch(*p)
+		{
+			case 'b': buf[n++] = '\b'; break;
+			case 'f': buf[n++] = '\f'; break;
+			case 'n': buf[n++] = '\n'; break;
+			case 'r': buf[n++] = '\r'; break;
+			case 't': buf[n++] = '\t'; break;
+			case 'u':
+				if(end - p < 5 || (cp = hex4(p + 1)) < 0)
+					return -1;
+				p += 4;
+				//代理对
+				if(cp >= 0xD800 && cp <= 0xDBFF && end - p >= 7 && p[1] == '\\' && p[2] == 'u')
+				{
+					int lo = hex4(p + 3);
+					if(lo >= 0xDC00 && lo <= 0xDFFF)
+					{
+						cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+						p += 6;
+					}
+				}
+				if(cp < 0x80)
+				{
+					buf[n++] = (char)cp;
+				}
+				else if(cp < 0x800)
+				{
+					buf[n++] = (char)(0xC0 | (cp >> 6));
+					buf[n++] = (char)(0x80 | (cp & 0x3F));
+				}
+				else if(cp < 0x10000)
+				{
+					buf[n++] = (char)(0xE0 | (cp >> 12));
+					buf[n++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+					buf[n++] = (char)(0x80 | (cp & 0x3F));
+				}
+				else
+				{
+					buf[n++] = (char)(0xF0 | (cp >> 18));
+					buf[n++] = (char)(0x80 | ((cp >> 12) & 0x3F));
+					buf[n++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+					buf[n++] = (char)(0x80 | (cp & 0x3F));
+				}
+				break;
+			default: //  \" \\ \/
+				buf[n++] = *p;
+				break;
+		}
+		p++;
+	}
+
+	buf[n] = '\0';
+	return (int)n;
+}
@@ -0,0 +1,320 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  link_watch.c
+ *    Description:  This file implements stale BLE link detection.
+ *
+ *                  到达间隔按 TCP RTT 的方式估计：interval += (gap - interval) / 8，
+ *                  jitter += (|gap - interval| - jitter) / 4，预期间隔取 interval + 2 * jitter。
+ *                  静默从最近一次通知或链路建立算起；超过预期的中断不参与估计，
+ *                  数据恢复时按最近一次通知到恢复的时长计入直方图。
+ *                  上行线程调用 notify / check / set_link，速率控制改变采样间隔时调用
+ *                  set_interval，统计由主线程读取，由一把锁保护。
+ *
+ *        Version:  1.0.0(2025年09月05日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月05日 09时17分45秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "link_watch.h"
+#include "log.h"
+
+
+typedef struct {
+	char						path[256];          //D-Bus 设备路径
+	uint64_t					last_data_ms;       //最近一次通知，0 表示还没有收到
+	uint64_t					ref_ms;             //静默的起点：最近一次通知或链路建立
+	int64_t						interval8;          //到达间隔 EWMA（毫秒 * 8）
+	int64_t						jitter4;            //平均偏差（毫秒 * 4）
+	uint32_t					samples;            //参与估计的间隔数
+	int							up;
+	int							stage;              //已采取的动作：LINK_WATCH_OK / RESTART_NOTIFY / RECONNECT
+	int							in_gap;             //当前处于超过预期的中断中
+	link_watch_device_stats_t	stats;
+} watch_dev_t;
+
+
+static struct {
+	link_watch_config_t	config;
+	watch_dev_t			devs[LINK_WATCH_DEVICE_MAX];
+	int					count;
+	link_watch_stats_t	stats;
+	pthread_mutex_t		lock;
+} W = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static const uint32_t gap_limits[LINK_WATCH_GAP_BUCKETS - 1] = LINK_WATCH_GAP_LIMITS;
+
+
+int link_watch_init(const link_watch_config_t *config)
+{
+	pthread_mutex_lock(&W.lock);
+	W.config = *config;
+	if(W.config.notify_k <= 0)
+		W.config.notify_k = 4;
+	if(W.config.reconnect_k <= W.config.notify_k)
+		W.config.reconnect_k = W.config.notify_k * 2;
+	if(W.config.warmup <= 0)
+		W.config.warmup = 8;
+	memset(W.devs, 0, sizeof(W.devs));
+	W.count = 0;
+	memset(&W.stats, 0, sizeof(W.stats));
+	pthread_mutex_unlock(&W.lock);
+
+	if(W.config.enabled)
+		log_info("LinkWatch: restart notify after %dx, reconnect after %dx the expected interval (at least %d ms).\n",
+				W.config.notify_k, W.config.reconnect_k, W.config.min_silence_ms);
+	return 0;
+}
+
+
+int link_watch_add(const char *device_path)
+{
+	int		i;
+
+	pthread_mutex_lock(&W.lock);
+	if(W.count == LINK_WATCH_DEVICE_MAX)
+	{
+		pthread_mutex_unlock(&W.lock);
+		return -1;
+	}
+	i = W.count++;
+	snprintf(W.devs[i].path, sizeof(W.devs[i].path), "%s", device_path);
+	pthread_mutex_unlock(&W.lock);
+
+	return i;
+}
+
+
+//设备路径及其下的特征值路径都能匹配（设备表在启动后不再变化）
+int link_watch_find(const char *path)
+{
+	size_t	len;
+	int		i;
+
+	for(i = 0; path && i < W.count; i++)
+	{
+		len = strlen(W.devs[i].path);
+		if(strncmp(path, W.devs[i].path, len) == 0 && (path[len] == '\0' || path[len] == '/'))
+			return i;
+	}
+	return -1;
+}
+
+
+//静默超过 k 倍预期间隔的阈值（调用时持有锁）
+static uint64_t threshold_ms(const watch_dev_t *d, int k)
+{
+	uint64_t	expected = (uint64_t)(d->interval8 / 8 + 2 * (d->jitter4 / 4));
+	uint64_t	thr = expected * k;
+
+	return thr < (uint64_t)W.config.min_silence_ms ? (uint64_t)W.config.min_silence_ms : thr;
+}
+
+
+static void record_gap(watch_dev_t *d, uint64_t gap)
+{
+	int		i;
+
+	for(i = 0; i < LINK_WATCH_GAP_BUCKETS - 1 && gap >= (uint64_t)gap_limits[i] * 1000; i++)
+		;
+	W.stats.gap_hist[i]++;
+	W.stats.gaps++;
+	d->stats.gaps++;
+	if(gap > d->stats.gap_max_ms)
+		d->stats.gap_max_ms = gap > UINT32_MAX ? UINT32_MAX : (uint32_t)gap;
+}
+
+
+//收到设备的通知
+void link_watch_notify(int device, uint64_t now_ms)
+{
+	watch_dev_t	*d;
+	uint64_t	gap;
+	int64_t		err;
+
+	if(device < 0 || device >= W.count)
+		return ;
+
+	pthread_mutex_lock(&W.lock);
+	d = &W.devs[device];
+	d->stats.notifications++;
+
+	if(d->last_data_ms)
+	{
+		gap = now_ms - d->last_data_ms;
+		if(d->in_gap || (d->samples >= (uint32_t)W.config.warmup && gap >= threshold_ms(d, W.config.notify_k)))
+		{
+			//数据中断：计入直方图，不参与估计
+			record_gap(d, gap);
+			log_info("LinkWatch: %s notifications resumed after %llu ms.\n", d->path, (unsigned long long)gap);
+		}
+		else if(d->ref_ms == d->last_data_ms)
+		{
+			if(!d->samples)
+			{
+				d->interval8 = gap * 8;
+				d->jitter4 = gap * 2;
+			}
+			else
+			{
+				err = (int64_t)gap - d->interval8 / 8;
+				d->interval8 += err;
+				d->jitter4 += (err < 0 ? -err : err) - d->jitter4 / 4;
+			}
+			d->samples++;
+		}
+	}
+
+	d->last_data_ms = now_ms;
+	d->ref_ms = now_ms;
+	d->stage = LINK_WATCH_OK;
+	d->in_gap = 0;
+	pthread_mutex_unlock(&W.lock);
+}
+
+
+//链路建立或断开；建立时重新开始计算静默，断开期间必然是数据中断
+void link_watch_set_link(int device, int up, uint64_t now_ms)
+{
+	watch_dev_t	*d;
+
+	if(device < 0 || device >= W.count)
+		return ;
+
+	pthread_mutex_lock(&W.lock);
+	d = &W.devs[device];
+	d->up = up;
+	if(up)
+	{
+		d->ref_ms = now_ms;
+		d->stage = LINK_WATCH_OK;
+	}
+	else if(d->last_data_ms)
+	{
+		d->in_gap = 1;
+	}
+	pthread_mutex_unlock(&W.lock);
+}
+
+
+/* 上行线程周期调用，返回需要采取的动作
+ * 静默超过 notify_k 倍预期间隔返回 LINK_WATCH_RESTART_NOTIFY，超过 reconnect_k 倍返回 LINK_WATCH_RECONNECT，
+ * 每个阶段只返回一次，收到通知或链路重新建立后重新开始
+ */
+int link_watch_check(int device, uint64_t now_ms)
+{
+	watch_dev_t	*d;
+	uint64_t	silence;
+	int			action = LINK_WATCH_OK;
+
+	if(!W.config.enabled || device < 0 || device >= W.count)
+		return LINK_WATCH_OK;
+
+	pthread_mutex_lock(&W.lock);
+	d = &W.devs[device];
+	if(!d->up || !d->ref_ms || d->samples < (uint32_t)W.config.warmup)
+	{
+		pthread_mutex_unlock(&W.lock);
+		return LINK_WATCH_OK;
+	}
+
+	silence = now_ms - d->ref_ms;
+	if(d->stage == LINK_WATCH_OK && silence >= threshold_ms(d, W.config.notify_k))
+	{
+		action = LINK_WATCH_RESTART_NOTIFY;
+		d->in_gap = 1;
+		d->stats.restarts++;
+		W.stats.restarts++;
+	}
+	else if(d->stage == LINK_WATCH_RESTART_NOTIFY && silence >= threshold_ms(d, W.config.reconnect_k))
+	{
+		action = LINK_WATCH_RECONNECT;
+		d->stats.reconnects++;
+		W.stats.reconnects++;
+	}
+
+	if(action != LINK_WATCH_OK)
+	{
+		d->stage = action;
+		log_warn("LinkWatch: %s silent for %llu ms (expected every %lld ms), %s.\n", d->path,
+				(unsigned long long)silence, (long long)(d->interval8 / 8),
+				action == LINK_WATCH_RECONNECT ? "forcing reconnect" : "restarting notifications");
+	}
+	pthread_mutex_unlock(&W.lock);
+	return action;
+}
+
+
+//设备的采样间隔被主动改变（速率控制），按新间隔重新估计
+void link_watch_set_interval(const char *device_path, int interval_ms)
+{
+	watch_dev_t	*d;
+	int			i;
+
+	if((i = link_watch_find(device_path)) < 0 || interval_ms <= 0)
+		return ;
+
+	pthread_mutex_lock(&W.lock);
+	d = &W.devs[i];
+	d->interval8 = (int64_t)interval_ms * 8;
+	d->jitter4 = interval_ms;
+	if(d->samples)
+		d->samples = W.config.warmup;
+	pthread_mutex_unlock(&W.lock);
+}
+
+
+void link_watch_get_device_stats(int device, link_watch_device_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if(device < 0 || device >= W.count)
+		return ;
+
+	pthread_mutex_lock(&W.lock);
+	*stats = W.devs[device].stats;
+	stats->interval_ms = (uint32_t)(W.devs[device].interval8 / 8);
+	stats->jitter_ms = (uint32_t)(W.devs[device].jitter4 / 4);
+	pthread_mutex_unlock(&W.lock);
+}
+
+
+void link_watch_get_stats(link_watch_stats_t *stats)
+{
+	pthread_mutex_lock(&W.lock);
+	*stats = W.stats;
+	pthread_mutex_unlock(&W.lock);
+}
+
+
+void link_watch_log_stats(void)
+{
+	link_watch_device_stats_t	ds;
+	link_watch_stats_t			st;
+	int							i;
+
+	if(!W.config.enabled)
+		return ;
+
+	link_watch_get_stats(&st);
+	log_info("LinkWatch: restarts=%llu reconnects=%llu gaps=%llu gap_hist <2s:%llu <5s:%llu <10s:%llu <30s:%llu <60s:%llu <300s:%llu <1800s:%llu >=1800s:%llu\n",
+			(unsigned long long)st.restarts, (unsigned long long)st.reconnects, (unsigned long long)st.gaps,
+			(unsigned long long)st.gap_hist[0], (unsigned long long)st.gap_hist[1],
+			(unsigned long long)st.gap_hist[2], (unsigned long long)st.gap_hist[3],
+			(unsigned long long)st.gap_hist[4], (unsigned long long)st.gap_hist[5],
+			(unsigned long long)st.gap_hist[6], (unsigned long long)st.gap_hist[7]);
+
+	for(i = 0; i < W.count; i++)
+	{
+		link_watch_get_device_stats(i, &ds);
+		log_info("LinkWatch: %s interval=%ums jitter=%ums notifications=%llu restarts=%llu reconnects=%llu gaps=%llu max_gap=%ums\n",
+				W.devs[i].path, ds.interval_ms, ds.jitter_ms, (unsigned long long)ds.notifications,
+				(unsigned long long)ds.restarts, (unsigned long long)ds.reconnects,
+				(unsigned long long)ds.gaps, ds.gap_max_ms);
+	}
+}
@@ -0,0 +1,1038 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  local_broker.c
+ *    Description:  This file implements the embedded local MQTT broker.
+ *
+ *                  一个线程用 epoll 处理监听套接字和所有节点连接，每个连接一块固定的
+ *                  输入/输出缓冲区，收到的报文在输入缓冲区中原地解析。QoS1 的 PUBACK 在
+ *                  处理完本次读到的报文后随其他应答一次写出，不等待云端；发往云端的
+ *                  消息先交给子设备上报或上行通道，没有接收时不回 PUBACK 并关闭连接，
+ *                  由节点重连后重发。
+ *                  订阅前缀树的每个节点用位图记录在此结束的订阅者，一次匹配得到全部目标。
+ *                  只支持 clean session：断开后订阅清除，投递给订阅者的 QoS1 消息不保存
+ *                  在途副本，不支持保留消息和遗嘱消息。
+ *                  云端命令由 MQTT 线程经 local_broker_forward 投递，所有状态由一把锁保护。
+ *
+ *        Version:  1.0.0(2025年09月06日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月06日 16时12分40秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "local_broker.h"
+#include "mqtt_gateway.h"
+#include "uplink_sink.h"
+#include "subdev.h"
+#include "json_scan.h"
+#include "log.h"
+
+
+#define BROKER_EVENTS_MAX			32
+#define BROKER_LISTEN_ID			0xffffffffu      //epoll 中监听套接字的标识
+#define BROKER_TICK_MS				1000
+#define BROKER_CONNECT_TIMEOUT_MS	10000            //建立 TCP 连接后必须在此时间内发来 CONNECT
+#define BROKER_TOPIC_MAX			256
+#define BROKER_REFUSED				-2               //handle_packet：发往云端的 QoS1 消息未被接收，关闭连接
+
+//MQTT 报文类型
+enum {
+	PKT_CONNECT = 1,
+	PKT_CONNACK,
+	PKT_PUBLISH,
+	PKT_PUBACK,
+	PKT_SUBSCRIBE = 8,
+	PKT_SUBACK,
+	PKT_UNSUBSCRIBE,
+	PKT_UNSUBACK,
+	PKT_PINGREQ,
+	PKT_PINGRESP,
+	PKT_DISCONNECT,
+};
+
+typedef struct {
+	int			fd;
+	uint8_t		connected;          //已收到 CONNECT
+	uint8_t		want_write;         //epoll 中是否关注了 EPOLLOUT
+	uint16_t	keepalive;
+	uint16_t	next_mid;
+	uint64_t	accepted_ms;
+	uint64_t	last_in_ms;
+	char		client_id[SUBDEV_ID_MAX];
+	int			in_len;
+	int			out_len;
+	uint8_t		in[LOCAL_BROKER_IN_SIZE];
+	uint8_t		out[LOCAL_BROKER_OUT_SIZE];
+} broker_client_t;
+
+//订阅前缀树节点，节点 0 是根
+typedef struct {
+	char		level[LOCAL_BROKER_LEVEL_MAX];
+	uint8_t		len;
+	int16_t		child;              //第一个子节点
+	int16_t		sibling;            //下一个兄弟节点
+	uint64_t	subs;               //订阅在此结束的客户端位图
+	uint64_t	qos1;               //其中以 QoS1 订阅的
+} trie_node_t;
+
+
+static struct {
+	local_broker_config_t	config;
+	char					gateway_id[SUBDEV_ID_MAX];
+	int						listen_fd;
+	int						epfd;
+	broker_client_t			*clients[LOCAL_BROKER_CLIENTS_MAX];
+	trie_node_t				nodes[LOCAL_BROKER_TRIE_NODES];
+	int						node_count;
+	local_broker_stats_t	stats;
+	pthread_mutex_t			lock;
+} B = { .listen_fd = -1, .epfd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+static uint64_t now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* ----- 订阅前缀树 ----- */
+
+//查找子节点，create 为 1 时不存在则创建；节点用完返回 -1
+static int trie_child(int parent, const char *level, int len, int create)
+{
+	trie_node_t	*n;
+	int			i;
+
+	for(i = B.nodes[parent].child; i >= 0; i = B.nodes[i].sibling)
+	{
+		if(B.nodes[i].len == len && memcmp(B.nodes[i].level, level, len) == 0)
+			return i;
+	}
+
+	if(!create || B.node_count == LOCAL_BROKER_TRIE_NODES)
+		return -1;
+
+	i = B.node_count++;
+	n = &B.nodes[i];
+	memset(n, 0, sizeof(*n));
+	memcpy(n->level, level, len);
+	n->len = (uint8_t)len;
+	n->child = -1;
+	n->sibling = B.nodes[parent].child;
+	B.nodes[parent].child = (int16_t)i;
+	return i;
+}
+
+
+//沿订阅主题逐级查找节点：'#' 只能是最后一级，通配符必须独占一级；主题无效或节点用完返回 -1
+static int trie_walk(const char *filter, int create)
+{
+	const char	*p = filter;
+	const char	*end;
+	int			node = 0;
+	int			len;
+
+	if(!*filter)
+		return -1;
+
+	for( ;; )
+	{
+		end = strchr(p, '/');
+		len = end ? (int)(end - p) : (int)strlen(p);
+		if(len >= LOCAL_BROKER_LEVEL_MAX ||
+		   (len > 1 && (memchr(p, '+', len) || memchr(p, '#', len))) ||
+		   (len == 1 && *p == '#' && end))
+			return -1;
+
+		if((node = trie_child(node, p, len, create)) < 0)
+			return -1;
+		if(!end)
+			return node;
+		p = end + 1;
+	}
+}
+
+
+static int trie_subscribe(const char *filter, int client, int qos)
+{
+	uint64_t	bit = 1ULL << client;
+	int			node;
+
+	if((node = trie_walk(filter, 1)) < 0)
+		return -1;
+
+	B.nodes[node].subs |= bit;
+	if(qos)
+		B.nodes[node].qos1 |= bit;
+	else
+		B.nodes[node].qos1 &= ~bit;
+	return 0;
+}
+
+
+static void trie_unsubscribe(const char *filter, int client)
+{
+	uint64_t	bit = 1ULL << client;
+	int			node;
+
+	if((node = trie_walk(filter, 0)) >= 0)
+	{
+		B.nodes[node].subs &= ~bit;
+		B.nodes[node].qos1 &= ~bit;
+	}
+}
+
+
+//客户端断开：清除它的全部订阅（节点保留，同样的主题再订阅时复用）
+static void trie_remove_client(int client)
+{
+	uint64_t	mask = ~(1ULL << client);
+	int			i;
+
+	for(i = 0; i < B.node_count; i++)
+	{
+		B.nodes[i].subs &= mask;
+		B.nodes[i].qos1 &= mask;
+	}
+}
+
+
+static int is_wildcard(const trie_node_t *n, char c)
+{
+	return n->len == 1 && n->level[0] == c;
+}
+
+
+/* 匹配主题的剩余部分，合并所有匹配订阅的客户端位图
+ * '$' 开头的主题不匹配首级的通配符（MQTT 3.1.1 4.7.2）
+ */
+static void trie_match(int parent, const char *topic, int first, uint64_t *subs, uint64_t *qos1)
+{
+	const char	*end = strchr(topic, '/');
+	int			len = end ? (int)(end - topic) : (int)strlen(topic);
+	int			wild = !(first && topic[0] == '$');
+	trie_node_t	*n;
+	int			i;
+	int			j;
+
+	for(i = B.nodes[parent].child; i >= 0; i = B.nodes[i].sibling)
+	{
+		n = &B.nodes[i];
+		if(is_wildcard(n, '#'))
+		{
+			if(wild)
+			{
+				*subs |= n->subs;
+				*qos1 |= n->qos1;
+			}
+			continue;
+		}
+
+		if(!(wild && is_wildcard(n, '+')) && !(n->len == len && memcmp(n->level, topic, len) == 0))
+			continue;
+
+		if(end)
+		{
+			trie_match(i, end + 1, 0, subs, qos1);
+			continue;
+		}
+
+		*subs |= n->subs;
+		*qos1 |= n->qos1;
+
+		//"a/#" 也匹配 "a"
+		for(j = n->child; j >= 0; j = B.nodes[j].sibling)
+		{
+			if(is_wildcard(&B.nodes[j], '#'))
+			{
+				*subs |= B.nodes[j].subs;
+				*qos1 |= B.nodes[j].qos1;
+			}
+		}
+	}
+}
+
+
+/* ----- 连接 ----- */
+
+static void set_want_write(broker_client_t *c, int index, int want)
+{
+	struct epoll_event	ev;
+
+	if(c->want_write == want)
+		return ;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+	ev.data.u32 = index;
+	if(epoll_ctl(B.epfd, EPOLL_CTL_MOD, c->fd, &ev) == 0)
+		c->want_write = want;
+}
+
+
+//尽量写出输出缓冲区，写不完时关注 EPOLLOUT；连接出错返回 -1
+static int flush_client(broker_client_t *c, int index)
+{
+	ssize_t		n;
+
+	while(c->out_len > 0)
+	{
+		n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		B.stats.bytes_out += n;
+		c->out_len -= n;
+		if(c->out_len)
+			memmove(c->out, c->out + n, c->out_len);
+	}
+
+	set_want_write(c, index, c->out_len > 0);
+	return 0;
+}
+
+
+static void close_client(int index, const char *reason)
+{
+	broker_client_t	*c = B.clients[index];
+
+	if(!c)
+		return ;
+
+	if(c->connected)
+	{
+		B.stats.disconnects++;
+		log_info("Broker: Client %s disconnected: %s\n", c->client_id, reason);
+	}
+	epoll_ctl(B.epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	trie_remove_client(index);
+	B.clients[index] = NULL;
+	B.stats.clients--;
+	free(c);
+}
+
+
+static void accept_clients(uint64_t now)
+{
+	struct epoll_event	ev;
+	broker_client_t		*c;
+	int					one = 1;
+	int					fd;
+	int					i;
+
+	while((fd = accept(B.listen_fd, NULL, NULL)) >= 0)
+	{
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+		for(i = 0; i < B.config.max_clients && B.clients[i]; i++)
+			;
+
+		c = i < B.config.max_clients ? calloc(1, sizeof(*c)) : NULL;
+		if(!c)
+		{
+			log_warn("Broker: Connection rejected, %d clients already connected.\n", (int)B.stats.clients);
+			B.stats.rejected++;
+			close(fd);
+			continue;
+		}
+
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		c->fd = fd;
+		c->next_mid = 1;
+		c->accepted_ms = now;
+		c->last_in_ms = now;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		if(epoll_ctl(B.epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		{
+			close(fd);
+			free(c);
+			continue;
+		}
+		B.clients[i] = c;
+		B.stats.clients++;
+	}
+}
+
+
+/* ----- 报文 ----- */
+
+//追加一条报文：固定头 + 剩余长度 + 可变部分（两段，第二段可以为空）；缓冲区不足返回 -1
+static int queue_packet(broker_client_t *c, uint8_t header, const void *a, int alen, const void *b, int blen)
+{
+	uint8_t		fixed[5];
+	int			remaining = alen + blen;
+	int			n = 0;
+
+	fixed[n++] = header;
+	do
+	{
+		fixed[n] = remaining % 128;
+		remaining /= 128;
+		if(remaining)
+			fixed[n] |= 0x80;
+		n++;
+	} while(remaining);
+
+	if(c->out_len + n + alen + blen > LOCAL_BROKER_OUT_SIZE)
+		return -1;
+
+	memcpy(c->out + c->out_len, fixed, n);
+	c->out_len += n;
+	if(alen)
+		memcpy(c->out + c->out_len, a, alen);
+	c->out_len += alen;
+	if(blen)
+		memcpy(c->out + c->out_len, b, blen);
+	c->out_len += blen;
+	return 0;
+}
+
+
+static int queue_ack(broker_client_t *c, uint8_t header, uint16_t mid)
+{
+	uint8_t		v[2] = { mid >> 8, mid & 0xff };
+
+	return queue_packet(c, header, v, 2, NULL, 0);
+}
+
+
+//把一条消息投递给匹配的本地订阅者，QoS 取发布和订阅中较小的一个；返回投递的客户端数
+static int deliver(const char *topic, const void *payload, int payloadlen, int qos)
+{
+	uint8_t			head[2 + BROKER_TOPIC_MAX + 2];
+	uint64_t		subs = 0;
+	uint64_t		qos1 = 0;
+	broker_client_t	*c;
+	int				topic_len = strlen(topic);
+	int				sent = 0;
+	int				q;
+	int				i;
+
+	trie_match(0, topic, 1, &subs, &qos1);
+
+	head[0] = topic_len >> 8;
+	head[1] = topic_len & 0xff;
+	memcpy(head + 2, topic, topic_len);
+
+	for(i = 0; subs && i < LOCAL_BROKER_CLIENTS_MAX; i++)
+	{
+		if(!(subs & (1ULL << i)) || !(c = B.clients[i]) || !c->connected)
+			continue;
+
+		q = qos && (qos1 & (1ULL << i));
+		if(q)
+		{
+			//不保存在途副本，只需要一个非零的报文标识
+			if(!++c->next_mid)
+				c->next_mid = 1;
+			head[2 + topic_len] = c->next_mid >> 8;
+			head[3 + topic_len] = c->next_mid & 0xff;
+		}
+
+		if(queue_packet(c, (PKT_PUBLISH << 4) | (q << 1), head, 2 + topic_len + (q ? 2 : 0), payload, payloadlen) < 0)
+		{
+			B.stats.dropped++;
+			continue;
+		}
+
+		//失败的连接在下一次读事件中关闭
+		if(flush_client(c, i) == 0)
+		{
+			B.stats.delivered++;
+			sent++;
+		}
+	}
+
+	return sent;
+}
+
+
+//取出长度前缀的字符串（UTF-8 字段），返回字段总长度，越界返回 -1
+static int get_string(const uint8_t *p, int avail, const uint8_t **str, int *len)
+{
+	if(avail < 2)
+		return -1;
+
+	*len = (p[0] << 8) | p[1];
+	if(*len > avail - 2)
+		return -1;
+
+	*str = p + 2;
+	return 2 + *len;
+}
+
+
+static int copy_string(const uint8_t *str, int len, char *buf, int size)
+{
+	if(len >= size || memchr(str, '\0', len))
+		return -1;
+
+	memcpy(buf, str, len);
+	buf[len] = '\0';
+	return 0;
+}
+
+
+/* 节点发往云端的消息：
+ *   $oc/devices/{id}/sys/properties/report                       并入子设备批量上报
+ *   $oc/devices/{id}/sys/commands/response/request_id={request}  以网关身份发布
+ *   $oc/devices/{id}/sys/properties/{get,set}/response/...       同上
+ * 其他主题只在本地投递；{id} 必须是该连接 CONNECT 时的身份（用户名或客户端 ID），
+ * 防止节点配置错误时把数据记到别的设备上。这不是认证：用户名由节点自己声明，密码不检查，
+ * 局域网内的客户端仍然可以用别的节点的用户名连接，代理只能部署在可信网络中
+ * 不是发往云端的主题或身份不符时返回 0；应当转发但没有被接收时返回 -1
+ */
+static int uplink_node_message(broker_client_t *c, const char *topic, const void *payload, int payloadlen)
+{
+	json_scan_value_t	val;
+	char				device_id[SUBDEV_ID_MAX];
+	char				gw_topic[BROKER_TOPIC_MAX + SUBDEV_ID_MAX];
+	const char			*id = topic + strlen("$oc/devices/");
+	const char			*rest;
+	int					index;
+	int					rc;
+
+	if(strncmp(topic, "$oc/devices/", strlen("$oc/devices/")) != 0 || !(rest = strchr(id, '/')) ||
+	   rest == id || rest - id >= (int)sizeof(device_id))
+		return 0;
+
+	memcpy(device_id, id, rest - id);
+	device_id[rest - id] = '\0';
+
+	if(strcmp(device_id, c->client_id) != 0)
+	{
+		B.stats.spoofed++;
+		log_warn("Broker: Client %s published to %s, not forwarded.\n", c->client_id, topic);
+		return 0;
+	}
+
+	if(strcmp(rest, "/sys/properties/report") == 0)
+	{
+		if(json_scan_get(payload, payloadlen, "services", &val) != JSON_SCAN_OK || val.type != JSON_SCAN_ARRAY)
+		{
+			log_warn("Broker: Report from %s without services array, not forwarded.\n", device_id);
+			return -1;
+		}
+
+		if((index = subdev_add_node(device_id)) < 0 || !subdev_is_node(index))
+		{
+			log_warn("Broker: Cannot register %s as local node, report not forwarded.\n", device_id);
+			return -1;
+		}
+
+		if(subdev_report_services(index, val.ptr, (int)val.len) != 0)
+		{
+			log_warn("Broker: Report from %s too long (%d bytes), not forwarded.\n", device_id, (int)val.len);
+			return -1;
+		}
+		B.stats.reports++;
+		return 0;
+	}
+
+	if(strncmp(rest, "/sys/commands/response/", strlen("/sys/commands/response/")) == 0 ||
+	   strncmp(rest, "/sys/properties/get/response/", strlen("/sys/properties/get/response/")) == 0 ||
+	   strncmp(rest, "/sys/properties/set/response/", strlen("/sys/properties/set/response/")) == 0)
+	{
+		snprintf(gw_topic, sizeof(gw_topic), "$oc/devices/%s%s", B.gateway_id, rest);
+		rc = uplink_publish(gw_topic, payload, payloadlen, 1, MQTT_TRAFFIC_RESPONSE);
+		if(rc == UPLINK_OK)
+			B.stats.responses++;
+		else if(rc != UPLINK_DROPPED)
+		{
+			log_warn("Broker: Failed to forward command response from %s.\n", device_id);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+static int handle_connect(broker_client_t *c, const uint8_t *p, int len)
+{
+	const uint8_t	*str;
+	int				slen;
+	int				off;
+	int				n;
+	uint8_t			flags;
+	const uint8_t	*username = NULL;
+	int				username_len = 0;
+	const uint8_t	*client_id;
+	int				client_id_len;
+
+	//协议名 "MQTT" 级别 4（也接受 3.1 的 "MQIsdp" 级别 3）
+	if((off = get_string(p, len, &str, &slen)) < 0 || off + 4 > len ||
+	   !((slen == 4 && memcmp(str, "MQTT", 4) == 0 && p[off] == 4) ||
+		 (slen == 6 && memcmp(str, "MQIsdp", 6) == 0 && p[off] == 3)))
+		return -1;
+
+	flags = p[off + 1];
+	c->keepalive = (p[off + 2] << 8) | p[off + 3];
+	off += 4;
+
+	if((n = get_string(p + off, len - off, &client_id, &client_id_len)) < 0)
+		return -1;
+	off += n;
+
+	//遗嘱主题和消息：跳过
+	if(flags & 0x04)
+	{
+		if((n = get_string(p + off, len - off, &str, &slen)) < 0)
+			return -1;
+		off += n;
+		if((n = get_string(p + off, len - off, &str, &slen)) < 0)
+			return -1;
+		off += n;
+	}
+
+	//用户名即 IoTDA 设备 ID，优先用它标识节点；密码是节点连云端用的，这里不检查
+	if(flags & 0x80)
+	{
+		if((n = get_string(p + off, len - off, &username, &username_len)) < 0)
+			return -1;
+	}
+
+	if(username && username_len)
+		return copy_string(username, username_len, c->client_id, sizeof(c->client_id));
+	return copy_string(client_id, client_id_len, c->client_id, sizeof(c->client_id));
+}
+
+
+static int handle_publish(broker_client_t *c, uint8_t flags, const uint8_t *p, int len)
+{
+	char			topic[BROKER_TOPIC_MAX];
+	const uint8_t	*str;
+	int				slen;
+	int				off;
+	int				qos = (flags >> 1) & 0x03;
+	uint16_t		mid = 0;
+
+	if(qos > 1 || (off = get_string(p, len, &str, &slen)) < 0 ||
+	   copy_string(str, slen, topic, sizeof(topic)) < 0 || !slen || strpbrk(topic, "+#"))
+		return -1;
+
+	if(qos)
+	{
+		if(off + 2 > len)
+			return -1;
+		mid = (p[off] << 8) | p[off + 1];
+		off += 2;
+	}
+
+	B.stats.published++;
+
+	//节点收到 PUBACK 就丢弃这条消息，所以先转发：没有被接收的 QoS1 消息不确认、不投递，
+	//关闭连接让节点重连后重发；QoS0 消息照常本地投递
+	if(uplink_node_message(c, topic, p + off, len - off) < 0)
+	{
+		B.stats.refused++;
+		if(qos)
+			return BROKER_REFUSED;
+	}
+
+	if(qos && queue_ack(c, PKT_PUBACK << 4, mid) < 0)
+		return -1;
+
+	deliver(topic, p + off, len - off, qos);
+	return 0;
+}
+
+
+static int handle_subscribe(broker_client_t *c, int index, int unsubscribe, const uint8_t *p, int len)
+{
+	uint8_t			granted[32];
+	char			filter[BROKER_TOPIC_MAX];
+	const uint8_t	*str;
+	int				slen;
+	int				off = 2;
+	int				count = 0;
+	int				n;
+	int				qos;
+
+	if(len < 2)
+		return -1;
+
+	granted[0] = p[0];
+	granted[1] = p[1];
+	while(off < len)
+	{
+		if((n = get_string(p + off, len - off, &str, &slen)) < 0 || count == (int)sizeof(granted) - 2)
+			return -1;
+		off += n;
+
+		if(unsubscribe)
+		{
+			if(copy_string(str, slen, filter, sizeof(filter)) == 0)
+				trie_unsubscribe(filter, index);
+			continue;
+		}
+
+		if(off >= len)
+			return -1;
+		qos = p[off++] & 0x03;
+
+		//不支持 QoS2，降为 QoS1
+		if(copy_string(str, slen, filter, sizeof(filter)) < 0 || trie_subscribe(filter, index, qos ? 1 : 0) < 0)
+		{
+			log_warn("Broker: Client %s subscription %.*s rejected.\n", c->client_id, slen, (const char *)str);
+			granted[2 + count++] = 0x80;
+		}
+		else
+		{
+			granted[2 + count++] = qos ? 1 : 0;
+		}
+	}
+
+	if(unsubscribe)
+		return queue_packet(c, PKT_UNSUBACK << 4, granted, 2, NULL, 0);
+	return count ? queue_packet(c, PKT_SUBACK << 4, granted, 2 + count, NULL, 0) : -1;
+}
+
+
+//处理一条完整的报文，连接应当关闭时返回 -1 或 BROKER_REFUSED
+static int handle_packet(broker_client_t *c, int index, uint8_t header, const uint8_t *p, int len)
+{
+	int		type = header >> 4;
+
+	if(!c->connected && type != PKT_CONNECT)
+		return -1;
+
+	switch(type)
+	{
+		case PKT_CONNECT:
+			if(c->connected || handle_connect(c, p, len) < 0)
+				return -1;
+			c->connected = 1;
+			B.stats.connects++;
+			log_info("Broker: Client %s connected, keepalive %ds.\n", c->client_id, c->keepalive);
+			return queue_packet(c, PKT_CONNACK << 4, "\x00\x00", 2, NULL, 0);
+
+		case PKT_PUBLISH:
+			return handle_publish(c, header & 0x0f, p, len);
+
+		case PKT_PUBACK:
+			return 0;
+
+		case PKT_SUBSCRIBE:
+		case PKT_UNSUBSCRIBE:
+			if((header & 0x0f) != 0x02)
+				return -1;
+			return handle_subscribe(c, index, type == PKT_UNSUBSCRIBE, p, len);
+
+		case PKT_PINGREQ:
+			return queue_packet(c, PKT_PINGRESP << 4, NULL, 0, NULL, 0);
+
+		default:
+			//DISCONNECT 和不支持的报文都关闭连接
+			return -1;
+	}
+}
+
+
+//读出并处理所有完整的报文，再一次写出全部应答
+static void handle_read(int index, uint64_t now)
+{
+	broker_client_t	*c = B.clients[index];
+	uint32_t		remaining;
+	int				mul;
+	int				off;
+	int				pos;
+	ssize_t			n;
+	int				rv;
+
+	n = recv(c->fd, c->in + c->in_len, LOCAL_BROKER_IN_SIZE - c->in_len, 0);
+	if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+	{
+		close_client(index, n == 0 ? "closed by peer" : strerror(errno));
+		return ;
+	}
+	if(n < 0)
+		return ;
+
+	B.stats.bytes_in += n;
+	c->in_len += n;
+	c->last_in_ms = now;
+
+	for(off = 0; ; )
+	{
+		//固定头：类型 + 1~4 字节的剩余长度
+		remaining = 0;
+		mul = 1;
+		for(pos = off + 1; pos < c->in_len && pos < off + 5; pos++)
+		{
+			remaining += (c->in[pos] & 0x7f) * mul;
+			mul *= 128;
+			if(!(c->in[pos] & 0x80))
+				break;
+		}
+		if(pos >= c->in_len)
+			break;
+		if(pos == off + 5 || remaining > LOCAL_BROKER_IN_SIZE - 5)
+		{
+			close_client(index, "packet too large");
+			return ;
+		}
+		if(c->in_len - (pos + 1) < (int)remaining)
+			break;
+
+		if((rv = handle_packet(c, index, c->in[off], c->in + pos + 1, (int)remaining)) < 0)
+		{
+			//前面已处理报文的应答仍然写出，节点只需重发未确认的那一条
+			flush_client(c, index);
+			close_client(index, rv == BROKER_REFUSED ? "message not accepted" :
+					(c->in[off] >> 4) == PKT_DISCONNECT ? "disconnect" : "protocol error");
+			return ;
+		}
+		off = pos + 1 + remaining;
+	}
+
+	if(off)
+	{
+		c->in_len -= off;
+		memmove(c->in, c->in + off, c->in_len);
+	}
+
+	if(flush_client(c, index) < 0)
+		close_client(index, "write failed");
+}
+
+
+//每秒检查：超时未发 CONNECT、超过 1.5 倍心跳间隔没有任何报文的连接关闭
+static void check_timeouts(uint64_t now)
+{
+	broker_client_t	*c;
+	int				i;
+
+	for(i = 0; i < LOCAL_BROKER_CLIENTS_MAX; i++)
+	{
+		if(!(c = B.clients[i]))
+			continue;
+
+		if(!c->connected && now - c->accepted_ms >= BROKER_CONNECT_TIMEOUT_MS)
+			close_client(i, "no CONNECT");
+		else if(c->connected && c->keepalive && now - c->last_in_ms >= (uint64_t)c->keepalive * 1500)
+			close_client(i, "keepalive timeout");
+	}
+}
+
+
+/* ----- 接口 ----- */
+
+int local_broker_init(const local_broker_config_t *config, const char *gateway_id)
+{
+	struct sockaddr_in	addr;
+	struct epoll_event	ev;
+	int					one = 1;
+
+	B.config = *config;
+	if(!B.config.enabled)
+		return 0;
+
+	if(B.config.port <= 0)
+		B.config.port = 1883;
+	if(B.config.max_clients <= 0 || B.config.max_clients > LOCAL_BROKER_CLIENTS_MAX)
+		B.config.max_clients = LOCAL_BROKER_CLIENTS_MAX;
+	snprintf(B.gateway_id, sizeof(B.gateway_id), "%s", gateway_id);
+
+	memset(&B.nodes[0], 0, sizeof(B.nodes[0]));
+	B.nodes[0].child = -1;
+	B.nodes[0].sibling = -1;
+	B.node_count = 1;
+	memset(&B.stats, 0, sizeof(B.stats));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(B.config.port);
+	if(inet_pton(AF_INET, B.config.bind ? B.config.bind : LOCAL_BROKER_BIND_DEFAULT, &addr.sin_addr) != 1)
+	{
+		log_error("Broker: Invalid bind address %s.\n", B.config.bind);
+		return -1;
+	}
+
+	B.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(B.listen_fd < 0)
+	{
+		log_error("Broker: Failed to create socket: %s\n", strerror(errno));
+		return -1;
+	}
+	setsockopt(B.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if(bind(B.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(B.listen_fd, 16) < 0)
+	{
+		log_error("Broker: Failed to listen on %s:%d: %s\n", B.config.bind ? B.config.bind : LOCAL_BROKER_BIND_DEFAULT, B.config.port, strerror(errno));
+		local_broker_cleanup();
+		return -1;
+	}
+
+	B.epfd = epoll_create1(EPOLL_CLOEXEC);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = BROKER_LISTEN_ID;
+	if(B.epfd < 0 || epoll_ctl(B.epfd, EPOLL_CTL_ADD, B.listen_fd, &ev) < 0)
+	{
+		log_error("Broker: Failed to create epoll.\n");
+		local_broker_cleanup();
+		return -1;
+	}
+
+	log_info("Broker: Listening on %s:%d for up to %d local clients.\n",
+			B.config.bind ? B.config.bind : LOCAL_BROKER_BIND_DEFAULT, B.config.port, B.config.max_clients);
+	return 0;
+}
+
+
+void *local_broker_thread_func(void *arg)
+{
+	struct epoll_event	events[BROKER_EVENTS_MAX];
+	uint64_t			now;
+	uint64_t			last_tick = 0;
+	uint32_t			id;
+	int					n;
+	int					i;
+
+	log_info("Broker: Thread started.\n");
+
+	while(keep_running)
+	{
+		n = epoll_wait(B.epfd, events, BROKER_EVENTS_MAX, BROKER_TICK_MS);
+		if(n < 0 && errno != EINTR)
+		{
+			log_error("Broker: epoll_wait failed: %s\n", strerror(errno));
+			break;
+		}
+
+		pthread_mutex_lock(&B.lock);
+		now = now_ms();
+		for(i = 0; i < n; i++)
+		{
+			id = events[i].data.u32;
+			if(id == BROKER_LISTEN_ID)
+			{
+				accept_clients(now);
+				continue;
+			}
+
+			//同一批事件中前面的处理可能已经关闭了这个连接
+			if(id >= LOCAL_BROKER_CLIENTS_MAX || !B.clients[id])
+				continue;
+
+			if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				handle_read(id, now);
+			if(B.clients[id] && (events[i].events & EPOLLOUT) && flush_client(B.clients[id], id) < 0)
+				close_client(id, "write failed");
+		}
+
+		if(now - last_tick >= BROKER_TICK_MS)
+		{
+			check_timeouts(now);
+			last_tick = now;
+		}
+		pthread_mutex_unlock(&B.lock);
+	}
+
+	log_info("Broker: Thread exiting.\n");
+	return NULL;
+}
+
+
+void local_broker_cleanup(void)
+{
+	int		i;
+
+	pthread_mutex_lock(&B.lock);
+	for(i = 0; i < LOCAL_BROKER_CLIENTS_MAX; i++)
+		close_client(i, "shutdown");
+
+	if(B.listen_fd >= 0)
+		close(B.listen_fd);
+	if(B.epfd >= 0)
+		close(B.epfd);
+	B.listen_fd = -1;
+	B.epfd = -1;
+	pthread_mutex_unlock(&B.lock);
+}
+
+
+//device_id 是否是经本地代理上报过的节点
+int local_broker_is_node(const char *device_id)
+{
+	return B.config.enabled && subdev_is_node(subdev_find_id(device_id));
+}
+
+
+/* 把云端发给节点的消息转发到节点自己的主题 $oc/devices/{device_id}/{suffix}（由 MQTT 线程调用）
+ * 返回投递的客户端数，0 表示节点当前没有订阅该主题（离线）
+ */
+int local_broker_forward(const char *device_id, const char *suffix, const void *payload, int payloadlen)
+{
+	char	topic[BROKER_TOPIC_MAX];
+	int		sent;
+
+	if(snprintf(topic, sizeof(topic), "$oc/devices/%s/%s", device_id, suffix) >= (int)sizeof(topic))
+		return 0;
+
+	pthread_mutex_lock(&B.lock);
+	sent = deliver(topic, payload, payloadlen, 1);
+	if(sent)
+		B.stats.commands++;
+	pthread_mutex_unlock(&B.lock);
+
+	if(sent)
+		log_info("Broker: Forwarded %s to %d local client(s).\n", topic, sent);
+	else
+		log_warn("Broker: No local client subscribed to %s, node offline.\n", topic);
+	return sent;
+}
+
+
+void local_broker_get_stats(local_broker_stats_t *stats)
+{
+	pthread_mutex_lock(&B.lock);
+	*stats = B.stats;
+	pthread_mutex_unlock(&B.lock);
+}
+
+
+void local_broker_log_stats(void)
+{
+	local_broker_stats_t	st;
+
+	if(!B.config.enabled)
+		return ;
+
+	local_broker_get_stats(&st);
+	log_info("Broker: clients=%u connects=%llu disconnects=%llu rejected=%llu published=%llu delivered=%llu dropped=%llu reports=%llu responses=%llu refused=%llu spoofed=%llu commands=%llu in=%lluB out=%lluB\n",
+			st.clients, (unsigned long long)st.connects, (unsigned long long)st.disconnects,
+			(unsigned long long)st.rejected, (unsigned long long)st.published,
+			(unsigned long long)st.delivered, (unsigned long long)st.dropped,
+			(unsigned long long)st.reports, (unsigned long long)st.responses,
+			(unsigned long long)st.refused, (unsigned long long)st.spoofed, (unsigned long long)st.commands, (unsigned long long)st.bytes_in,
+			(unsigned long long)st.bytes_out);
+}
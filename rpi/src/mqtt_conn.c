@@ -0,0 +1,419 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  mqtt_conn.c
+ *    Description:  This file implements the broker address cache and reconnect backoff.
+ *
+ *                  只由下行线程调用（统计接口除外）。选出的数字地址交给 mosquitto_connect_async，
+ *                  libmosquitto 不再为每次重连做 DNS 查询；缓存过期或全部地址都失败后才重新解析，
+ *                  解析失败时继续使用过期的结果。
+ *
+ *        Version:  1.0.0(2025年08月28日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月28日 15时02分37秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "mqtt_conn.h"
+#include "log.h"
+
+
+static struct {
+	char					host[256];
+	char					port[8];
+	mqtt_conn_config_t		cfg;
+
+	//地址缓存
+	struct sockaddr_storage	addrs[MQTT_CONN_MAX_ADDRS];
+	socklen_t				lens[MQTT_CONN_MAX_ADDRS];
+	int						count;
+	int						current;
+	uint64_t				expires_ms;
+	int						addr_failures;    //本次解析结果下的失败次数，达到地址数后重新解析
+
+	//退避状态
+	int						fail_streak;      //连续失败次数
+	uint32_t				prev_delay;
+	uint64_t				down_since_ms;    //断开时刻，0 表示当前已连接
+	unsigned int			seed;
+
+	mqtt_conn_stats_t		stats;
+	pthread_mutex_t			lock;             //保护 stats
+} C;
+
+
+uint64_t mqtt_conn_now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+//随机种子取自 /dev/urandom，同一批网关即使同时启动也不会得到相同的退避序列
+static unsigned int random_seed(const char *host)
+{
+	unsigned int	seed = 0;
+	int				fd;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if(fd >= 0)
+	{
+		if(read(fd, &seed, sizeof(seed)) != sizeof(seed))
+			seed = 0;
+		close(fd);
+	}
+
+	if(!seed)
+		seed = (unsigned int)time(NULL) ^ (unsigned int)getpid() ^ (unsigned int)(uintptr_t)host;
+	return seed;
+}
+
+
+//[lo, hi] 之间的随机数
+static uint32_t rand_between(uint32_t lo, uint32_t hi)
+{
+	if(hi <= lo)
+		return lo;
+	return lo + (uint32_t)(((uint64_t)rand_r(&C.seed) * (hi - lo + 1)) / ((uint64_t)RAND_MAX + 1));
+}
+
+
+int mqtt_conn_init(const char *host, int port, const mqtt_conn_config_t *config)
+{
+	memset(&C, 0, sizeof(C));
+	pthread_mutex_init(&C.lock, NULL);
+
+	snprintf(C.host, sizeof(C.host), "%s", host);
+	snprintf(C.port, sizeof(C.port), "%d", port);
+	C.cfg = *config;
+	if(C.cfg.base_ms <= 0)
+		C.cfg.base_ms = 500;
+	if(C.cfg.max_ms < C.cfg.base_ms)
+		C.cfg.max_ms = C.cfg.base_ms;
+	if(C.cfg.probe_timeout_ms <= 0)
+		C.cfg.probe_timeout_ms = 3000;
+
+	C.seed = random_seed(host);
+	C.prev_delay = C.cfg.base_ms;
+	C.down_since_ms = mqtt_conn_now_ms();
+	C.stats.first_delay_min_ms = UINT32_MAX;
+
+	if(!C.cfg.use_cached_address)
+		log_info("MQTT Conn: TLS enabled, broker hostname is resolved by libmosquitto.\n");
+
+	return 0;
+}
+
+
+/* ----- 地址缓存 ----- */
+
+static int resolve(void)
+{
+	struct addrinfo	hints;
+	struct addrinfo	*res = NULL;
+	struct addrinfo	*ai;
+	int				count = 0;
+	int				rv;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+
+	pthread_mutex_lock(&C.lock);
+	C.stats.dns_lookups++;
+	pthread_mutex_unlock(&C.lock);
+
+	rv = getaddrinfo(C.host, C.port, &hints, &res);
+	if(rv != 0)
+	{
+		pthread_mutex_lock(&C.lock);
+		C.stats.dns_failures++;
+		pthread_mutex_unlock(&C.lock);
+		log_error("MQTT Conn: Failed to resolve %s: %s\n", C.host, gai_strerror(rv));
+		return -1;
+	}
+
+	//保持 getaddrinfo 的排序（RFC 6724）
+	for(ai = res; ai && count < MQTT_CONN_MAX_ADDRS; ai = ai->ai_next)
+	{
+		if(ai->ai_addrlen > sizeof(C.addrs[0]))
+			continue;
+		memcpy(&C.addrs[count], ai->ai_addr, ai->ai_addrlen);
+		C.lens[count] = ai->ai_addrlen;
+		count++;
+	}
+	freeaddrinfo(res);
+
+	if(!count)
+		return -1;
+
+	C.count = count;
+	C.current = 0;
+	C.addr_failures = 0;
+	C.expires_ms = mqtt_conn_now_ms() + (uint64_t)(C.cfg.dns_ttl_sec > 0 ? C.cfg.dns_ttl_sec : 300) * 1000;
+
+	log_info("MQTT Conn: %s resolved to %d address(es).\n", C.host, count);
+	return 0;
+}
+
+
+/* 同时向所有缓存地址发起非阻塞 TCP 连接，返回最先连通的地址序号，全部失败返回 -1
+ * 只在上一次连接失败且有多个地址时使用，探测连接随即关闭
+ */
+static int probe_addresses(void)
+{
+	struct pollfd	pfd[MQTT_CONN_MAX_ADDRS];
+	int				idx[MQTT_CONN_MAX_ADDRS];
+	int				n = 0;
+	int				winner = -1;
+	int				err;
+	socklen_t		err_len;
+	uint64_t		deadline = mqtt_conn_now_ms() + C.cfg.probe_timeout_ms;
+	uint64_t		now;
+	int				i;
+	int				fd;
+
+	pthread_mutex_lock(&C.lock);
+	C.stats.probes++;
+	pthread_mutex_unlock(&C.lock);
+
+	for(i = 0; i < C.count; i++)
+	{
+		fd = socket(C.addrs[i].ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if(fd < 0)
+			continue;
+
+		if(connect(fd, (struct sockaddr *)&C.addrs[i], C.lens[i]) == 0)
+		{
+			winner = i;
+			close(fd);
+			break;
+		}
+		if(errno != EINPROGRESS)
+		{
+			close(fd);
+			continue;
+		}
+
+		pfd[n].fd = fd;
+		pfd[n].events = POLLOUT;
+		idx[n] = i;
+		n++;
+	}
+
+	while(winner < 0 && n > 0 && (now = mqtt_conn_now_ms()) < deadline)
+	{
+		if(poll(pfd, n, (int)(deadline - now)) <= 0)
+			break;
+
+		for(i = 0; i < n; i++)
+		{
+			if(pfd[i].fd < 0 || !pfd[i].revents)
+				continue;
+
+			err = 0;
+			err_len = sizeof(err);
+			getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+			if(err == 0 && winner < 0)
+				winner = idx[i];
+
+			//失败的地址不再等待
+			close(pfd[i].fd);
+			pfd[i].fd = -1;
+		}
+	}
+
+	for(i = 0; i < n; i++)
+	{
+		if(pfd[i].fd >= 0)
+			close(pfd[i].fd);
+	}
+
+	return winner;
+}
+
+
+/* 选出本次连接使用的主机：缓存的数字地址，或者（TLS/解析失败时）原始主机名
+ * 返回的指针指向 buf 或内部保存的主机名
+ */
+const char *mqtt_conn_select_host(char *buf, size_t size)
+{
+	uint64_t	now = mqtt_conn_now_ms();
+	int			winner;
+
+	if(!C.cfg.use_cached_address)
+		return C.host;
+
+	if(!C.count || now >= C.expires_ms || C.addr_failures >= C.count)
+	{
+		//解析失败时继续使用过期的地址
+		if(resolve() != 0 && !C.count)
+			return C.host;
+		if(C.addr_failures >= C.count)
+			C.addr_failures = 0;
+	}
+
+	if(C.fail_streak > 0 && C.count > 1)
+	{
+		winner = probe_addresses();
+		if(winner >= 0)
+			C.current = winner;
+	}
+
+	if(getnameinfo((struct sockaddr *)&C.addrs[C.current], C.lens[C.current], buf, size, NULL, 0, NI_NUMERICHOST) != 0)
+		return C.host;
+
+	return buf;
+}
+
+
+/* ----- 退避 ----- */
+
+/* 去相关抖动：delay = min(max, random(base, prev * 3))
+ * 断开后的第一次重连在 [0, base] 内随机，尽快恢复的同时把整批网关打散
+ */
+static uint32_t next_delay(void)
+{
+	uint32_t	delay;
+	uint64_t	upper;
+
+	if(C.fail_streak == 0)
+	{
+		delay = rand_between(0, C.cfg.base_ms);
+
+		pthread_mutex_lock(&C.lock);
+		if(delay < C.stats.first_delay_min_ms)
+			C.stats.first_delay_min_ms = delay;
+		if(delay > C.stats.first_delay_max_ms)
+			C.stats.first_delay_max_ms = delay;
+		C.stats.first_delay_sum_ms += delay;
+		C.stats.first_delay_count++;
+		pthread_mutex_unlock(&C.lock);
+	}
+	else
+	{
+		upper = (uint64_t)C.prev_delay * 3;
+		if(upper > (uint64_t)C.cfg.max_ms)
+			upper = C.cfg.max_ms;
+		delay = rand_between(C.cfg.base_ms, (uint32_t)upper);
+	}
+
+	C.prev_delay = delay < (uint32_t)C.cfg.base_ms ? (uint32_t)C.cfg.base_ms : delay;
+	return delay;
+}
+
+
+//启动时的第一次连接同样随机等待，避免停电恢复后整批网关同时连接
+int mqtt_conn_first_delay_ms(void)
+{
+	return (int)next_delay();
+}
+
+
+void mqtt_conn_attempt(void)
+{
+	pthread_mutex_lock(&C.lock);
+	C.stats.attempts++;
+	pthread_mutex_unlock(&C.lock);
+}
+
+
+//收到 CONNACK，记录从断开到恢复的时间
+void mqtt_conn_connected(void)
+{
+	uint64_t	elapsed = 0;
+
+	if(C.down_since_ms)
+		elapsed = mqtt_conn_now_ms() - C.down_since_ms;
+
+	C.fail_streak = 0;
+	C.addr_failures = 0;
+	C.prev_delay = C.cfg.base_ms;
+	C.down_since_ms = 0;
+
+	pthread_mutex_lock(&C.lock);
+	C.stats.connects++;
+	C.stats.reconnect_last_ms = (uint32_t)elapsed;
+	if(elapsed > C.stats.reconnect_max_ms)
+		C.stats.reconnect_max_ms = (uint32_t)elapsed;
+	C.stats.reconnect_sum_ms += elapsed;
+	pthread_mutex_unlock(&C.lock);
+
+	log_info("MQTT Conn: Connected after %llu ms.\n", (unsigned long long)elapsed);
+}
+
+
+//连接尝试失败：换下一个地址，返回下一次尝试前的等待时间
+int mqtt_conn_failed(void)
+{
+	pthread_mutex_lock(&C.lock);
+	C.stats.failures++;
+	pthread_mutex_unlock(&C.lock);
+
+	C.fail_streak++;
+	if(C.count)
+	{
+		C.addr_failures++;
+		C.current = (C.current + 1) % C.count;
+	}
+
+	return (int)next_delay();
+}
+
+
+//已建立的连接断开，返回第一次重连前的等待时间
+int mqtt_conn_lost(void)
+{
+	pthread_mutex_lock(&C.lock);
+	C.stats.disconnects++;
+	pthread_mutex_unlock(&C.lock);
+
+	C.down_since_ms = mqtt_conn_now_ms();
+	C.fail_streak = 0;
+	C.addr_failures = 0;
+
+	return (int)next_delay();
+}
+
+
+void mqtt_conn_get_stats(mqtt_conn_stats_t *stats)
+{
+	pthread_mutex_lock(&C.lock);
+	*stats = C.stats;
+	pthread_mutex_unlock(&C.lock);
+}
+
+
+void mqtt_conn_log_stats(void)
+{
+	mqtt_conn_stats_t	st;
+
+	mqtt_conn_get_stats(&st);
+
+	log_info("MQTT Conn: attempts=%llu connects=%llu failures=%llu disconnects=%llu dns=%llu/%llu failed probes=%llu "
+			 "reconnect_last=%ums reconnect_avg=%llums reconnect_max=%ums first_delay=[%u..%u] avg %llums\n",
+			(unsigned long long)st.attempts, (unsigned long long)st.connects,
+			(unsigned long long)st.failures, (unsigned long long)st.disconnects,
+			(unsigned long long)st.dns_lookups, (unsigned long long)st.dns_failures,
+			(unsigned long long)st.probes,
+			st.reconnect_last_ms, (unsigned long long)(st.connects ? st.reconnect_sum_ms / st.connects : 0),
+			st.reconnect_max_ms,
+			st.first_delay_count ? st.first_delay_min_ms : 0, st.first_delay_max_ms,
+			(unsigned long long)(st.first_delay_count ? st.first_delay_sum_ms / st.first_delay_count : 0));
+}
@@ -22,6 +22,18 @@
 
 #include "mqtt_gateway.h"
 #include "ble_gateway.h"
+#include "spool.h"
+#include "inflight.h"
+#include "topic_router.h"
+#include "json_scan.h"
+#include "cmd_job.h"
+#include "cmd_dedup.h"
+#include "mqtt_conn.h"
+#include "publish_lane.h"
+#include "subdev.h"
+#include "shadow.h"
+#include "mqtt_mux.h"
+#include "local_broker.h"
 #include "log.h"
 
 
@@ -30,21 +42,387 @@ extern volatile int mqtt_connected_flag;
 extern volatile int keep_running;
 extern mqtt_device_config_t device_config;
 
-extern pthread_mutex_t mqtt_mutex;
+extern spool_config_t spool_config;
 
 
-void build_huawei_property_json(char *buffer, size_t size, int hr_value, int spo2_value)
+/* ----- MQTT v5 发布属性 ----- */
+
+#define MQTT_ALIAS_MAX	4
+
+static const char *traffic_class_names[MQTT_TRAFFIC_CLASS_COUNT] = {
+	"telemetry",
+	"response",
+	"alert",
+	"bulk",
+};
+
+//v5 主题别名状态
+//别名映射只在一条网络连接内有效，on_connect_v5_cb 通过递增 connection_gen 使旧映射失效
+static struct {
+	const char		*alias_topic[MQTT_ALIAS_MAX]; // 使用别名的高频主题，别名为下标+1
+	int				alias_gen[MQTT_ALIAS_MAX];    // 该别名在哪一次连接中已经建立
+	volatile int	connection_gen;
+	volatile int	broker_alias_max;             // CONNACK 中的 Topic Alias Maximum
+	volatile int	alias_only_sent;              // 当前连接中发送过只带别名的 QoS1 消息
+	uint64_t		alias_publishes;
+	uint64_t		bytes_saved;                  // 省略主题节省的字节数
+	uint64_t		stale_dropped;                // 回放时因超过过期时间而丢弃的消息数
+} v5;
+
+
+const char *mqtt_traffic_class_name(int traffic_class)
+{
+	if(traffic_class < 0 || traffic_class >= MQTT_TRAFFIC_CLASS_COUNT)
+		return "unknown";
+	return traffic_class_names[traffic_class];
+}
+
+
+//登记一个需要使用别名的高频主题
+static void register_alias_topic(const char *topic)
+{
+	int		i;
+
+	for(i = 0; i < MQTT_ALIAS_MAX; i++)
+	{
+		if(!v5.alias_topic[i] || strcmp(v5.alias_topic[i], topic) == 0)
+		{
+			v5.alias_topic[i] = topic;
+			return ;
+		}
+	}
+}
+
+
+/* 为本次发布添加 v5 属性
+ * 返回实际要发送的主题：别名已在当前连接上建立时返回 NULL，只发送别名
+ */
+static const char *apply_v5_properties(const char *topic, int qos, int traffic_class, mosquitto_property **props, int *alias_idx)
+{
+	int		expiry = device_config.message_expiry_sec[traffic_class];
+	int		i;
+
+	*alias_idx = -1;
+	if(expiry > 0)
+		mosquitto_property_add_int32(props, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, (uint32_t)expiry);
+
+	if(!device_config.topic_alias)
+		return topic;
+
+	for(i = 0; i < MQTT_ALIAS_MAX && i < v5.broker_alias_max; i++)
+	{
+		if(v5.alias_topic[i] && strcmp(v5.alias_topic[i], topic) == 0)
+			break;
+	}
+	if(i >= MQTT_ALIAS_MAX || i >= v5.broker_alias_max)
+		return topic;
+
+	mosquitto_property_add_int16(props, MQTT_PROP_TOPIC_ALIAS, (uint16_t)(i + 1));
+	*alias_idx = i;
+
+	if(v5.alias_gen[i] != v5.connection_gen)
+	{
+		//当前连接上第一次使用：带完整主题建立映射
+		v5.alias_gen[i] = v5.connection_gen;
+		return topic;
+	}
+
+	v5.alias_publishes++;
+	v5.bytes_saved += strlen(topic);
+	if(qos > 0)
+		v5.alias_only_sent = 1;
+	return NULL;
+}
+
+
+//持久会话统计
+static struct {
+	int			connects;            //成功连接次数
+	uint64_t	connack_ms;          //本次连接收到 CONNACK 的时间
+	int			waiting_first_cmd;   //本次连接尚未收到命令
+	uint64_t	resumed;             //代理保留了会话（session present）
+	uint64_t	lost;                //重连时会话已不存在，排队的下行命令随之丢失
+	uint64_t	subscribes_skipped;
+	uint32_t	first_cmd_max_ms;    //重连到收到第一条命令的时间
+	uint64_t	first_cmd_sum_ms;
+	uint64_t	first_cmd_count;
+} sess;
+
+
+/* 直连设备的记录只能经该设备自己的连接发出：设备未连接时回放停在这条记录上（不写 spool）。
+ * 网关或任一直连设备重连后允许把未连接设备的记录移到队尾，最多整体轮转一遍，
+ * 其后的记录照常回放，未连接设备的记录等它重连后再发
+ */
+static struct {
+	uint64_t	rotate;          //本轮还能处理（发出或移到队尾）的记录数，0 表示不再轮转
+	uint64_t	mux_reconnects;  //上次看到的直连设备连接成功次数
+} replay;
+
+static void replay_rescan(void)
+{
+	spool_stats_t	st;
+
+	spool_get_stats(&st);
+	replay.rotate = st.pending;
+}
+
+
+//回放一条直连设备的记录，返回 0 表示已从 spool 删除，可以继续下一条
+static int replay_direct(const char *payload, size_t len, time_t event_time)
+{
+	int		rc;
+
+	rc = mqtt_mux_replay(payload, (int)len);
+	if(rc < 0)
+		return -1;
+
+	//设备未连接：本轮还能轮转时移到队尾，否则停在这条记录上等它重连
+	if(rc > 0 && (!replay.rotate || spool_append(SPOOL_CHANNEL_DIRECT, event_time, payload, len) != SPOOL_OK))
+		return -1;
+
+	spool_consume();
+	if(replay.rotate > 0)
+		replay.rotate--;
+	return 0;
+}
+
+
+//回放spool中断线期间暂存的数据
+//记录放入回放队列 (bulk lane) 后即从 spool 删除，限速由该队列的令牌桶负责，
+//队列很短，积压数据不会挤占实时数据的发送；直连设备的记录经 mqtt_mux 发出
+static void replay_spooled_messages(void)
+{
+	char					payload[SPOOL_MAX_PAYLOAD];
+	size_t					len;
+	time_t					event_time;
+	const char				*topic;
+	int						channel;
+	int						expiry = 0;
+	int						rc;
+
+	if(device_config.protocol_version == MQTT_PROTOCOL_50)
+		expiry = device_config.message_expiry_sec[MQTT_TRAFFIC_BULK];
+
+	if(!spool_is_open())
+		return ;
+
+	if(mqtt_mux_count() > 0 && mqtt_mux_reconnects() != replay.mux_reconnects)
+	{
+		replay.mux_reconnects = mqtt_mux_reconnects();
+		replay_rescan();
+	}
+
+	while(publish_lane_room(MQTT_TRAFFIC_BULK) > 0 && mqtt_connected_flag && keep_running)
+	{
+		rc = spool_peek(payload, sizeof(payload), &len, &event_time, &channel);
+		if(rc == SPOOL_ERR_BUFFER)
+		{
+			log_error("Spool: Oversized record skipped during replay.\n");
+			spool_consume();
+			continue;
+		}
+		if(rc != SPOOL_OK)
+			break;
+
+		//v5 模式下，超过回放消息过期时间的暂存数据不再发送
+		if(expiry > 0 && time(NULL) - event_time > expiry)
+		{
+			v5.stale_dropped++;
+			spool_consume();
+			continue;
+		}
+
+		//按记录的通道选择主题，无法识别的通道（更新版本写入）跳过
+		if(channel == SPOOL_CHANNEL_DIRECT)
+		{
+			if(replay_direct(payload, len, event_time) != 0)
+				break;
+			continue;
+		}
+		else if(channel == SPOOL_CHANNEL_GATEWAY)
+			topic = device_config.publish_topic;
+		else if(channel == SPOOL_CHANNEL_SUBDEV)
+			topic = subdev_topic();
+		else
+		{
+			log_warn("Spool: Record with unknown channel %d skipped during replay.\n", channel);
+			spool_consume();
+			continue;
+		}
+
+		rc = publish_lane_submit(MQTT_TRAFFIC_BULK, topic, payload, (int)len, 1);
+		if(rc != MOSQ_ERR_SUCCESS)
+			break;
+
+		log_debug("Spool: Queued %zu bytes for replay\n", len);
+		spool_consume();
+		if(replay.rotate > 0)
+			replay.rotate--;
+	}
+}
+
+
+//发布一条消息并登记到在途表中
+//QoS1 消息受在途窗口限制，窗口已满时返回 MQTT_PUBLISH_WINDOW_FULL，
+//由调用者决定暂存或丢弃，避免 libmosquitto 内部队列在慢速链路上无限增长
+//v5 模式下按流量类别附加消息过期时间，高频主题使用主题别名
+//只能由拥有 mosquitto 实例的下行线程调用，其它线程通过 publish_lane_submit 提交
+int mqtt_publish_tracked(const char *topic, const void *payload, int payloadlen, int qos, int traffic_class)
+{
+	mosquitto_property	*props = NULL;
+	const char			*pub_topic;
+	int					alias_idx;
+	int					slot = -1;
+	int					mid = 0;
+	int					rc;
+
+	if(traffic_class < 0 || traffic_class >= MQTT_TRAFFIC_CLASS_COUNT)
+		traffic_class = MQTT_TRAFFIC_TELEMETRY;
+
+	if(qos > 0)
+	{
+		slot = inflight_reserve();
+		if(slot < 0)
+			return MQTT_PUBLISH_WINDOW_FULL;
+	}
+
+	if(device_config.protocol_version == MQTT_PROTOCOL_50)
+	{
+		pub_topic = apply_v5_properties(topic, qos, traffic_class, &props, &alias_idx);
+		rc = mosquitto_publish_v5(global_mosq, &mid, pub_topic, payloadlen, payload, qos, false, props);
+		if(rc != MOSQ_ERR_SUCCESS && pub_topic && alias_idx >= 0)
+			v5.alias_gen[alias_idx] = 0; //映射未能建立，下次重新带主题
+	}
+	else
+	{
+		rc = mosquitto_publish(global_mosq, &mid, topic, payloadlen, payload, qos, false);
+	}
+	mosquitto_property_free_all(&props);
+
+	if(qos > 0)
+	{
+		if(rc == MOSQ_ERR_SUCCESS)
+		{
+			inflight_retain(slot, topic, payload, payloadlen, traffic_class);
+			inflight_commit(slot, mid);
+		}
+		else
+			inflight_cancel(slot);
+	}
+
+	return rc;
+}
+
+
+/* 设置客户端实例的协议版本、回调函数、认证和 TLS 选项
+ * 启动时由 main 调用；v5 下需要丢弃旧会话时，重新初始化实例后再次调用
+ */
+int mqtt_gateway_setup_client(struct mosquitto *mosq)
+{
+	int		rc;
+
+	if(device_config.protocol_version == MQTT_PROTOCOL_50)
+	{
+		mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V5);
+		if(device_config.receive_maximum > 0)
+			mosquitto_int_option(mosq, MOSQ_OPT_RECEIVE_MAXIMUM, device_config.receive_maximum);
+		mosquitto_connect_v5_callback_set(mosq, on_connect_v5_cb);
+		register_alias_topic(device_config.publish_topic);
+	}
+	else
+	{
+		//带 CONNACK 标志的回调，用于判断代理是否保留了会话
+		mosquitto_connect_with_flags_callback_set(mosq, on_connect_cb);
+	}
+
+	mosquitto_max_inflight_messages_set(mosq, device_config.max_inflight);
+
+	mosquitto_message_callback_set(mosq, on_message_cb);
+	mosquitto_publish_callback_set(mosq, on_publish_cb);
+	mosquitto_subscribe_callback_set(mosq, on_subscribe_cb);
+	mosquitto_disconnect_callback_set(mosq, on_disconnect_cb);
+
+	// 设置用户名和密码，用于MQTT代理的认证
+	rc = mosquitto_username_pw_set(mosq, device_config.username, device_config.password);
+	if(rc != MOSQ_ERR_SUCCESS)
+	{
+		log_error("MQTT: Failed to set username/password: %s\n", mosquitto_strerror(rc));
+		return -1;
+	}
+
+	//使用TLS/SSL加密连接
+	if(device_config.ca_cert)
+	{
+		rc = mosquitto_tls_set(mosq,
+							   device_config.ca_cert,
+							   NULL, //client_cert_path
+							   NULL, //client_key_path
+							   NULL, //psk
+							   NULL); //psk_identify
+		if(rc != MOSQ_ERR_SUCCESS)
+		{
+			log_error("MQTT: Failed to set TLS options: %s\n", mosquitto_strerror(rc));
+			return -1;
+		}
+	}
+
+	log_info("MQTT: Client configured for MQTT %s.\n", device_config.protocol_version == MQTT_PROTOCOL_50 ? "v5" : "v3.1.1");
+	return 0;
+}
+
+
+/* v5 重连前的会话检查
+ * libmosquitto 会在重连后重发未确认的 QoS1 消息，而只带别名的消息在新连接上没有映射，
+ * 代理会按协议错误断开。此时重新初始化客户端实例，丢弃这些消息（按超时计入在途统计）。
+ */
+static void reset_session_if_aliased(void)
 {
-	snprintf(buffer, size,
-			"{\"services\":[{\"service_id\":\"mqtt\",\"properties\":{\"HR\":%d,\"Spo2\":%d}}]}",
-			hr_value, spo2_value);
+	int		rc;
+
+	if(device_config.protocol_version != MQTT_PROTOCOL_50 || !v5.alias_only_sent)
+		return ;
+	v5.alias_only_sent = 0;
+
+	if(inflight_count() == 0)
+		return ;
+
+	log_warn("MQTT: Discarding %d unacknowledged aliased publishes before reconnect.\n", inflight_count());
+
+	rc = mosquitto_reinitialise(global_mosq, device_config.client_id, !device_config.persistent_session, &device_config);
+	if(rc == MOSQ_ERR_SUCCESS)
+		rc = mqtt_gateway_setup_client(global_mosq) == 0 ? MOSQ_ERR_SUCCESS : MOSQ_ERR_INVAL;
+
+	if(rc != MOSQ_ERR_SUCCESS)
+		log_error("MQTT: Failed to reinitialise client: %s\n", mosquitto_strerror(rc));
+
+	inflight_reset();
+}
+
+
+void mqtt_gateway_log_stats(void)
+{
+	if(device_config.persistent_session)
+	{
+		log_info("MQTT: session resumed=%llu lost=%llu subscribes_skipped=%llu first_command avg=%llums max=%ums (%llu sample(s))\n",
+				(unsigned long long)sess.resumed, (unsigned long long)sess.lost,
+				(unsigned long long)sess.subscribes_skipped,
+				(unsigned long long)(sess.first_cmd_count ? sess.first_cmd_sum_ms / sess.first_cmd_count : 0),
+				sess.first_cmd_max_ms, (unsigned long long)sess.first_cmd_count);
+	}
+
+	if(device_config.protocol_version != MQTT_PROTOCOL_50)
+		return ;
+
+	log_info("MQTT: v5 alias_max=%d alias_publishes=%llu bytes_saved=%llu stale_dropped=%llu\n",
+			v5.broker_alias_max, (unsigned long long)v5.alias_publishes,
+			(unsigned long long)v5.bytes_saved, (unsigned long long)v5.stale_dropped);
 }
 
 
 /* ----- Mosquitto 回调函数----- */
 
-//MQTT连接回调函数
-void on_connect_cb(struct mosquitto *mosq_obj, void *userdata, int result)
+//MQTT连接回调函数，flags 为 CONNACK 标志，第 0 位表示代理保留了上次的会话
+void on_connect_cb(struct mosquitto *mosq_obj, void *userdata, int result, int flags)
 {
 	int		i;
 	int		subscribe_rc;
@@ -59,6 +437,25 @@ void on_connect_cb(struct mosquitto *mosq_obj, void *userdata, int result)
 		log_info("MQTT: Connected to broker successfully.\n");
 		mqtt_connected_flag = 1;
 
+		sess.connack_ms = mqtt_conn_now_ms();
+		sess.waiting_first_cmd = sess.connects++ > 0;
+		if(cfg->persistent_session)
+		{
+			//会话仍在：订阅和代理排队的 QoS1 命令都保留着，不必再订阅
+			if(flags & 0x01)
+			{
+				sess.resumed++;
+				sess.subscribes_skipped++;
+				log_info("MQTT: Session resumed, subscription to %s kept by broker.\n", cfg->subscribe_topic);
+				return ;
+			}
+			if(sess.connects > 1)
+			{
+				sess.lost++;
+				log_warn("MQTT: Broker did not keep the session, queued commands were lost.\n");
+			}
+		}
+
 		log_info("MQTT: Subscribing to topic: %s\n", cfg->subscribe_topic);
 
 
@@ -90,122 +487,570 @@ void on_connect_cb(struct mosquitto *mosq_obj, void *userdata, int result)
 
 
 
-//MQTT消息接收回调函数（处理下行指令）
-void on_message_cb(struct mosquitto *mosq_obj, void *userdata, const struct mosquitto_message *msg)
+//MQTT v5 连接回调：读取 CONNACK 属性后复用 v3.1.1 的连接处理
+void on_connect_v5_cb(struct mosquitto *mosq_obj, void *userdata, int result, int flags, const mosquitto_property *props)
 {
-	char *ble_cmd_to_send = NULL; 
-	char *request_id = NULL;
-	char response_topic[256];
-	char response_payload[128];
-	int	 rc_pub;
-	const char *ble_payload_to_send = NULL;
-	size_t	ble_payload_len = 0;
-	json_object *json_obj = NULL;
-	json_object *paras_obj = NULL;
-	json_object *report_obj = NULL;
-	const char *report_value = NULL;
+	uint16_t	alias_max = 0;
+	uint16_t	receive_max = 0;
 
+	if(result == 0)
+	{
+		//代理未声明 Topic Alias Maximum 时不允许使用别名
+		mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &alias_max, false);
+		v5.broker_alias_max = alias_max;
+		v5.connection_gen++;
+		v5.alias_only_sent = 0;
 
-	log_info("\n--- Dwonlink message received ---\n");
-	log_info("Topic: %s\n", msg->topic);
-	log_info("Message: %.*s\n", msg->payloadlen, (char *)msg->payload);
-	log_info("------------------------------------\n\n");
+		//代理的 Receive Maximum 小于本地窗口时按代理的值收紧在途窗口
+		if(mosquitto_property_read_int16(props, MQTT_PROP_RECEIVE_MAXIMUM, &receive_max, false) && receive_max > 0)
+			inflight_set_window(receive_max < device_config.max_inflight ? receive_max : device_config.max_inflight);
 
-    // 检查是否是命令请求主题
-    if (strstr(msg->topic, "/sys/commands/request_id=") != NULL)
-    {
-        // 提取 request_id
-        char *request_id_start = strstr(msg->topic, "request_id=");
-        if (request_id_start != NULL)
-        {
-            request_id = request_id_start + strlen("request_id=");
-            log_debug("DEBUG: Received command with request_id: %s\n", request_id);
-
-            // 1. 构建响应主题
-            snprintf(response_topic, sizeof(response_topic),
-                     "$oc/devices/%s/sys/commands/response/request_id=%s",
-                     device_config.username, request_id);
-
-            // 2. 构建响应负载（简单的成功响应）
-            snprintf(response_payload, sizeof(response_payload),
-                     "{\"result_code\":0}");
-
-            // 3. 发布响应消息
-            pthread_mutex_lock(&mqtt_mutex);
-            rc_pub = mosquitto_publish(mosq_obj, NULL, response_topic, strlen(response_payload), response_payload, 1, false);
-            pthread_mutex_unlock(&mqtt_mutex);
-
-            if (rc_pub != MOSQ_ERR_SUCCESS)
-            {
-                log_error("MQTT: Failed to publish command response: %s\n", mosquitto_strerror(rc_pub));
-            }
-            else
-            {
-                log_info("MQTT: Published command response to topic: %s\n", response_topic);
-            }
-        }
-    }
-
-
-	/* 解析JSON （云端下发的命令） */
-	json_obj = json_tokener_parse(msg->payload);
-	if( !json_obj )
-	{
-		log_error("JSON parsing failed for message payload, Forwarding original payload.\n");
-		//解析失败，发送原始MQTT负载给BLE
-		ble_payload_to_send = (const char *)msg->payload;
-		ble_payload_len = msg->payloadlen;
+		log_info("MQTT: v5 CONNACK topic_alias_max=%u receive_max=%u\n", alias_max, receive_max);
 	}
-	else
+
+	on_connect_cb(mosq_obj, userdata, result, flags);
+}
+
+
+
+//发布命令响应到 $oc/devices/{device_id}/sys/commands/response/request_id={request_id}
+//paras_json 为响应参数对象，可以为 NULL
+int mqtt_publish_command_response(const char *request_id, int result_code, const char *paras_json)
+{
+	char	response_topic[256];
+	char	response_payload[384];
+	int		len;
+
+	snprintf(response_topic, sizeof(response_topic),
+			 "$oc/devices/%s/sys/commands/response/request_id=%s",
+			 device_config.username, request_id);
+
+	len = snprintf(response_payload, sizeof(response_payload),
+			 "{\"result_code\":%d,\"response_name\":\"COMMAND_RESPONSE\",\"paras\":%s}",
+			 result_code, paras_json ? paras_json : "{}");
+
+	//命令响应走严格优先的 response 队列
+	return publish_lane_submit(MQTT_TRAFFIC_RESPONSE, response_topic, response_payload, len, 1);
+}
+
+
+//按设备路径选择响应的身份：直连模式下设备有自己的连接时经该连接回复，否则以网关身份回复
+int mqtt_publish_command_response_to(const char *device_path, const char *request_id, int result_code, const char *paras_json)
+{
+	char	response_topic[256];
+	char	response_payload[384];
+	int		index;
+	int		len;
+
+	if(!device_path || (index = mqtt_mux_find_path(device_path)) < 0)
+		return mqtt_publish_command_response(request_id, result_code, paras_json);
+
+	snprintf(response_topic, sizeof(response_topic),
+			 "$oc/devices/%s/sys/commands/response/request_id=%s",
+			 mqtt_mux_device_id(index), request_id);
+
+	len = snprintf(response_payload, sizeof(response_payload),
+			 "{\"result_code\":%d,\"response_name\":\"COMMAND_RESPONSE\",\"paras\":%s}",
+			 result_code, paras_json ? paras_json : "{}");
+
+	return mqtt_mux_publish(index, response_topic, response_payload, len, 1);
+}
+
+
+//发布属性查询响应到 $oc/devices/{device_id}/sys/properties/get/response/request_id={request_id}
+int mqtt_publish_property_get_response(const char *request_id, const telemetry_record_t *rec)
+{
+	char	response_topic[256];
+	char	response_payload[TELEMETRY_JSON_MAX];
+	int		len = -1;
+
+	snprintf(response_topic, sizeof(response_topic),
+			 "$oc/devices/%s/sys/properties/get/response/request_id=%s",
+			 device_config.username, request_id);
+
+	if(rec->present)
+		len = telemetry_serialize_json(rec, 1, response_payload, sizeof(response_payload));
+	if(len < 0)
+		len = snprintf(response_payload, sizeof(response_payload), "{\"services\":[]}");
+
+	return publish_lane_submit(MQTT_TRAFFIC_RESPONSE, response_topic, response_payload, len, 1);
+}
+
+
+//发布属性设置响应到 $oc/devices/{device_id}/sys/properties/set/response/request_id={request_id}
+int mqtt_publish_property_set_response(const char *request_id, int result_code, const char *result_desc)
+{
+	char	response_topic[256];
+	char	response_payload[128];
+	int		len;
+
+	snprintf(response_topic, sizeof(response_topic),
+			 "$oc/devices/%s/sys/properties/set/response/request_id=%s",
+			 device_config.username, request_id);
+
+	len = snprintf(response_payload, sizeof(response_payload),
+			 "{\"result_code\":%d,\"result_desc\":\"%s\"}", result_code, result_desc);
+
+	return publish_lane_submit(MQTT_TRAFFIC_RESPONSE, response_topic, response_payload, len, 1);
+}
+
+
+/* ----- 下行消息路由 ----- */
+
+//下行主题路由表，启动时由 mqtt_gateway_init_routes() 构建
+static topic_router_t downlink_router;
+
+
+/* 从云端下发的命令中取出要写给BLE的内容（paras.report）
+ * 先用零分配的 json_scan 就地查找，扫描器无法处理的负载再回退到 json-c 完整解析；
+ * 找不到 report 字段时转发原始负载。返回写入 buf 的长度，buf 以 '\0' 结尾。
+ */
+static int extract_ble_command(const void *payload, int payloadlen, char *buf, size_t size)
+{
+	json_scan_value_t	val;
+	json_object			*json_obj = NULL;
+	json_object			*paras_obj = NULL;
+	json_object			*report_obj = NULL;
+	const char			*report_value = NULL;
+	int					rc;
+	int					len = -1;
+
+	rc = json_scan_get((const char *)payload, payloadlen, "paras.report", &val);
+	if(rc == JSON_SCAN_OK)
 	{
-		if(json_object_object_get_ex(json_obj, "paras", &paras_obj) && json_object_object_get_ex(paras_obj, "report", &report_obj))
+		if(val.type == JSON_SCAN_STRING)
 		{
-			report_value = json_object_get_string(report_obj);
-			log_debug("JSON Parse: Found parse:report: %s. Using this for BLE command.\n", report_value);
+			len = json_scan_unescape(&val, buf, size);
+		}
+		else if(val.len < size)
+		{
+			//数字、对象等非字符串取值按原文转发
+			memcpy(buf, val.ptr, val.len);
+			buf[val.len] = '\0';
+			len = (int)val.len;
+		}
 
-			//解析成功
-			ble_payload_to_send = report_value;
-			ble_payload_len = strlen(report_value);
+		if(len >= 0)
+		{
+			log_debug("JSON Scan: Found paras.report: %s. Using this for BLE command.\n", buf);
+			return len;
 		}
-		else
+	}
+	else if(rc == JSON_SCAN_SYNTAX)
+	{
+		/* 回退：json-c 完整解析（云端下发的命令） */
+		json_obj = json_tokener_parse(payload);
+		if(json_obj)
 		{
-			//解析成功，但没有找到report字段，发送原始负载
-			log_error("JSON parsing successded, but 'paras.report' field not found. Forwarding original payload.\n");
-			ble_payload_to_send = (const char *)msg->payload;
-			ble_payload_len = msg->payloadlen;
+			if(json_object_object_get_ex(json_obj, "paras", &paras_obj) && json_object_object_get_ex(paras_obj, "report", &report_obj))
+			{
+				report_value = json_object_get_string(report_obj);
+				if(strlen(report_value) < size)
+				{
+					log_debug("JSON Parse: Found parse:report: %s. Using this for BLE command.\n", report_value);
+					strcpy(buf, report_value);
+					len = (int)strlen(buf);
+				}
+			}
+			json_object_put(json_obj); //释放JSON对象
+
+			if(len >= 0)
+				return len;
 		}
+	}
+
+	//没有找到report字段或解析失败，发送原始负载
+	log_error("'paras.report' field not found in payload, Forwarding original payload.\n");
+	if((size_t)payloadlen >= size)
+		return -1;
+	memcpy(buf, payload, payloadlen);
+	buf[payloadlen] = '\0';
+	return payloadlen;
+}
 
-		json_object_put(json_obj); //释放JSON对象
 
-	}	
+/* 命令的 TTL：优先使用云端命令中的 paras.ttl_sec，否则按 command_name 取配置的默认值
+ * 负载无法扫描时使用默认 TTL
+ */
+static int command_ttl_ms(const void *payload, int payloadlen)
+{
+	json_scan_value_t	val;
+	char				name[32];
+	int					ttl_sec;
+
+	if(json_scan_get((const char *)payload, payloadlen, "paras.ttl_sec", &val) == JSON_SCAN_OK &&
+	   val.type == JSON_SCAN_NUMBER && (ttl_sec = atoi(val.ptr)) > 0)
+		return ttl_sec * 1000;
+
+	if(json_scan_get((const char *)payload, payloadlen, "command_name", &val) == JSON_SCAN_OK &&
+	   val.type == JSON_SCAN_STRING && json_scan_unescape(&val, name, sizeof(name)) >= 0)
+		return cmd_job_ttl_ms(name);
+
+	return cmd_job_ttl_ms(NULL);
+}
+
 
+/* 命令的目标 BLE 设备：object_device_id 是已登记的 BLE 子设备时发给该子设备，
+ * 没有该字段或就是网关自己时发给网关的 BLE 设备；未知的子设备和本地节点返回 NULL
+ */
+static const char *command_target(const void *payload, int payloadlen)
+{
+	json_scan_value_t	val;
+	char				device_id[SUBDEV_ID_MAX];
+	int					index;
+
+	if(json_scan_get((const char *)payload, payloadlen, "object_device_id", &val) != JSON_SCAN_OK ||
+	   val.type != JSON_SCAN_STRING || json_scan_unescape(&val, device_id, sizeof(device_id)) < 0 ||
+	   strcmp(device_id, device_config.username) == 0)
+		return DEVICE_PATH;
 
+	index = subdev_find_id(device_id);
+	if(index < 0 && !subdev_count())
+		return DEVICE_PATH;
 
-	//如果D-Bus 系统总线连接成功,尝试将MQTT 负载转发给BLE设备
-	if(global_dbus_conn && ble_payload_to_send)
+	if(index < 0)
 	{
-		ble_cmd_to_send = (char *)malloc(msg->payloadlen + 1);
-		if(ble_cmd_to_send)
-		{
-			memcpy(ble_cmd_to_send, ble_payload_to_send, ble_payload_len);
-			ble_cmd_to_send[ble_payload_len] = '\0';
+		log_error("MQTT: Command for unknown sub-device %s.\n", device_id);
+		return NULL;
+	}
+	if(subdev_is_node(index))
+	{
+		log_error("MQTT: %s is a local node without BLE link, command not written.\n", device_id);
+		return NULL;
+	}
+	return subdev_path(index);
+}
 
-			log_info("Forwarding MQTT payload to BLE \"%s\" to %s\n", ble_cmd_to_send, WRITABLE_CHARACTERISTIC_PATH);
-			//向BLE特性写入数据
-			if(write_characteristic_value(global_dbus_conn, WRITABLE_CHARACTERISTIC_PATH, ble_cmd_to_send) < 0)
-			{
-				log_error("Failed to send BLE command to microcontroller.\n");
-			}
-			free(ble_cmd_to_send);
-		}
-		else
+
+/* object_device_id 是本地代理接入的节点时，把消息原样转发到节点自己的主题上，由节点解析
+ * 返回 -1 表示不是本地节点，否则返回投递的客户端数（0 表示节点离线）
+ */
+static int forward_to_node(const void *payload, int payloadlen, const char *suffix)
+{
+	json_scan_value_t	val;
+	char				device_id[SUBDEV_ID_MAX];
+
+	if(json_scan_get((const char *)payload, payloadlen, "object_device_id", &val) != JSON_SCAN_OK ||
+	   val.type != JSON_SCAN_STRING || json_scan_unescape(&val, device_id, sizeof(device_id)) < 0 ||
+	   !local_broker_is_node(device_id))
+		return -1;
+
+	return local_broker_forward(device_id, suffix, payload, payloadlen);
+}
+
+
+//普通下行消息：提取命令内容，交给命令线程写入BLE
+static void handle_downlink_message(const topic_match_t *match, const void *payload, int payloadlen, void *arg)
+{
+	char		ble_cmd[CMD_JOB_PAYLOAD_MAX];
+	const char	*target;
+	int			len;
+
+	if(forward_to_node(payload, payloadlen, "sys/messages/down") >= 0)
+		return ;
+
+	len = extract_ble_command(payload, payloadlen, ble_cmd, sizeof(ble_cmd));
+	if(len < 0)
+	{
+		log_error("Downlink command too long (%d bytes), dropped.\n", payloadlen);
+		return ;
+	}
+
+	if(!(target = command_target(payload, payloadlen)))
+		return ;
+
+	if(cmd_job_submit(target, NULL, ble_cmd, len, command_ttl_ms(payload, payloadlen)) != 0)
+		log_error("Command queue full, downlink message dropped.\n");
+}
+
+
+//提取 request_id（路由的最后一级 '+' 捕获了 "request_id=xxx"）
+static int match_request_id(const topic_match_t *match, char *request_id, size_t size)
+{
+	int		id_len;
+
+	id_len = match->count < 1 ? 0 : match->len[0] - (int)strlen("request_id=");
+	if(id_len <= 0 || id_len >= (int)size ||
+	   strncmp(match->level[0], "request_id=", strlen("request_id=")) != 0)
+	{
+		log_error("MQTT: Topic without valid request_id: %s\n", match->topic);
+		return -1;
+	}
+	memcpy(request_id, match->level[0] + strlen("request_id="), id_len);
+	request_id[id_len] = '\0';
+	return 0;
+}
+
+
+/* 执行一条带 request_id 的命令
+ * identity 为直连设备的路径时命令来自该设备自己的连接，目标就是该设备，响应经同一连接发回；
+ * 为 NULL 时命令来自网关身份，按 object_device_id 选择目标
+ */
+static void command_request(const char *request_id, const char *identity, const void *payload, int payloadlen)
+{
+	char		ble_cmd[CMD_JOB_PAYLOAD_MAX];
+	char		paras[CMD_DEDUP_PARAS_MAX];
+	const char	*target;
+	int			result_code;
+	int			len;
+
+	log_debug("DEBUG: Received command with request_id: %s\n", request_id);
+
+	//QoS1 重发或云端重试：已执行过的命令重发缓存的响应，执行中的忽略，不再写入 BLE
+	switch(cmd_dedup_lookup(request_id, &result_code, paras, sizeof(paras)))
+	{
+		case CMD_DEDUP_DONE:
+			log_info("MQTT: Duplicate command request_id=%s, resending cached response.\n", request_id);
+			mqtt_publish_command_response_to(identity, request_id, result_code, paras);
+			return ;
+
+		case CMD_DEDUP_PENDING:
+			log_info("MQTT: Duplicate command request_id=%s still executing, ignored.\n", request_id);
+			return ;
+	}
+
+	len = extract_ble_command(payload, payloadlen, ble_cmd, sizeof(ble_cmd));
+	if(len < 0)
+	{
+		cmd_dedup_complete(request_id, CMD_RESULT_FAILED, "{\"result\":\"command too long\"}");
+		mqtt_publish_command_response_to(identity, request_id, CMD_RESULT_FAILED, "{\"result\":\"command too long\"}");
+		return ;
+	}
+
+	//网关子设备的命令按 object_device_id 发给对应的 BLE 设备
+	if(!(target = identity ? identity : command_target(payload, payloadlen)))
+	{
+		cmd_dedup_complete(request_id, CMD_RESULT_FAILED, "{\"result\":\"unknown sub device\"}");
+		mqtt_publish_command_response(request_id, CMD_RESULT_FAILED, "{\"result\":\"unknown sub device\"}");
+		return ;
+	}
+
+	//设备链路断开时命令留在该设备的队列中，重连后执行，超过 TTL 回复超时
+	if(cmd_job_submit(target, request_id, ble_cmd, len, command_ttl_ms(payload, payloadlen)) != 0)
+	{
+		//没有执行，云端重试时应重新执行
+		cmd_dedup_forget(request_id);
+		log_error("MQTT: Command queue full, rejecting request_id=%s\n", request_id);
+		mqtt_publish_command_response_to(identity, request_id, CMD_RESULT_BUSY, "{\"result\":\"busy\"}");
+	}
+}
+
+
+//命令下发：$oc/devices/{device_id}/sys/commands/request_id={request_id}
+//响应在BLE写入完成后由命令线程发布，result_code 反映真实的写入结果
+static void handle_command_request(const topic_match_t *match, const void *payload, int payloadlen, void *arg)
+{
+	char		request_id[CMD_JOB_REQUEST_ID_MAX];
+	char		suffix[CMD_JOB_REQUEST_ID_MAX + 32];
+	int			rv;
+
+	if(match_request_id(match, request_id, sizeof(request_id)) < 0)
+		return ;
+
+	//本地节点的命令由节点执行并经本地代理回复响应，节点离线时直接回复失败
+	snprintf(suffix, sizeof(suffix), "sys/commands/request_id=%s", request_id);
+	if((rv = forward_to_node(payload, payloadlen, suffix)) == 0)
+		mqtt_publish_command_response(request_id, CMD_RESULT_FAILED, "{\"result\":\"node offline\"}");
+	if(rv >= 0)
+		return ;
+
+	command_request(request_id, NULL, payload, payloadlen);
+}
+
+
+/* 直连模式下设备自己的连接收到的下行消息（由 mqtt_mux 线程调用）
+ * 设备只订阅了自己的 sys/commands/# 和 sys/messages/down，不需要经过路由表
+ */
+void mqtt_gateway_device_message(const char *device_path, const char *topic, const void *payload, int payloadlen)
+{
+	char		request_id[CMD_JOB_REQUEST_ID_MAX];
+	char		ble_cmd[CMD_JOB_PAYLOAD_MAX];
+	const char	*p;
+	int			len;
+
+	p = strstr(topic, "/sys/commands/request_id=");
+	if(p)
+	{
+		p += strlen("/sys/commands/request_id=");
+		if(!*p || strchr(p, '/') || strlen(p) >= sizeof(request_id))
 		{
-			log_error("Memory allocation failed to BLE command.\n");
+			log_error("MQTT: Topic without valid request_id: %s\n", topic);
+			return ;
 		}
+		strcpy(request_id, p);
+		command_request(request_id, device_path, payload, payloadlen);
+		return ;
 	}
-	else
+
+	len = extract_ble_command(payload, payloadlen, ble_cmd, sizeof(ble_cmd));
+	if(len < 0)
+	{
+		log_error("Downlink command too long (%d bytes), dropped.\n", payloadlen);
+		return ;
+	}
+
+	if(cmd_job_submit(device_path, NULL, ble_cmd, len, command_ttl_ms(payload, payloadlen)) != 0)
+		log_error("Command queue full, downlink message dropped.\n");
+}
+
+
+//属性查询：$oc/devices/{device_id}/sys/properties/get/request_id={request_id}
+//影子中的数据足够新时直接回答，否则排队读取 BLE，读取完成后由命令线程回答
+static void handle_property_get(const topic_match_t *match, const void *payload, int payloadlen, void *arg)
+{
+	char				request_id[CMD_JOB_REQUEST_ID_MAX];
+	char				suffix[CMD_JOB_REQUEST_ID_MAX + 32];
+	telemetry_record_t	rec;
+	const char			*target;
+	int					rv;
+
+	if(match_request_id(match, request_id, sizeof(request_id)) < 0)
+		return ;
+
+	//本地节点没有 BLE 链路和影子，查询转发给节点，由节点经本地代理回答
+	snprintf(suffix, sizeof(suffix), "sys/properties/get/request_id=%s", request_id);
+	if((rv = forward_to_node(payload, payloadlen, suffix)) == 0)
+	{
+		memset(&rec, 0, sizeof(rec));
+		mqtt_publish_property_get_response(request_id, &rec);
+	}
+	if(rv >= 0)
+		return ;
+
+	if(!(target = command_target(payload, payloadlen)))
+	{
+		memset(&rec, 0, sizeof(rec));
+		mqtt_publish_property_get_response(request_id, &rec);
+		return ;
+	}
+
+	rv = shadow_query(shadow_find(target), &rec);
+	if(rv == SHADOW_FRESH)
+	{
+		log_debug("Shadow: properties/get request_id=%s answered from cache.\n", request_id);
+		mqtt_publish_property_get_response(request_id, &rec);
+		return ;
+	}
+
+	if(cmd_job_submit_property(target, CMD_JOB_PROPERTY_GET, request_id, NULL, 0, 0, command_ttl_ms(payload, payloadlen)) != 0)
+	{
+		//队列已满：有缓存就用缓存回答
+		log_warn("Shadow: Command queue full, answering request_id=%s from %s cache.\n",
+				request_id, rv == SHADOW_STALE ? "stale" : "empty");
+		mqtt_publish_property_get_response(request_id, &rec);
+	}
+}
+
+
+//属性设置：$oc/devices/{device_id}/sys/properties/set/request_id={request_id}
+//只把与上次成功写入设备的值（或正在写入的值）不同的属性写入 BLE
+static void handle_property_set(const topic_match_t *match, const void *payload, int payloadlen, void *arg)
+{
+	char				request_id[CMD_JOB_REQUEST_ID_MAX];
+	char				suffix[CMD_JOB_REQUEST_ID_MAX + 32];
+	char				ble_cmd[TELEMETRY_BLE_MAX];
+	telemetry_record_t	desired;
+	const char			*target;
+	uint32_t			mask;
+	int					device;
+	int					len;
+	int					rv;
+
+	if(match_request_id(match, request_id, sizeof(request_id)) < 0)
+		return ;
+
+	snprintf(suffix, sizeof(suffix), "sys/properties/set/request_id=%s", request_id);
+	if((rv = forward_to_node(payload, payloadlen, suffix)) == 0)
+		mqtt_publish_property_set_response(request_id, CMD_RESULT_FAILED, "node offline");
+	if(rv >= 0)
+		return ;
+
+	if(!(target = command_target(payload, payloadlen)))
+	{
+		mqtt_publish_property_set_response(request_id, CMD_RESULT_FAILED, "unknown sub device");
+		return ;
+	}
+
+	if(shadow_parse_set(payload, payloadlen, &desired) <= 0)
+	{
+		log_error("Shadow: properties/set request_id=%s has no known property.\n", request_id);
+		mqtt_publish_property_set_response(request_id, CMD_RESULT_FAILED, "no known property");
+		return ;
+	}
+
+	device = shadow_find(target);
+	mask = shadow_set_desired(device, &desired);
+	if(!mask)
+	{
+		log_info("Shadow: properties/set request_id=%s already applied, nothing written.\n", request_id);
+		mqtt_publish_property_set_response(request_id, CMD_RESULT_SUCCESS, "success");
+		return ;
+	}
+
+	len = telemetry_serialize_ble(&desired, mask, ble_cmd, sizeof(ble_cmd));
+	if(len < 0 || len >= CMD_JOB_PAYLOAD_MAX ||
+	   cmd_job_submit_property(target, CMD_JOB_PROPERTY_SET, request_id, ble_cmd, len, mask, command_ttl_ms(payload, payloadlen)) != 0)
 	{
-		log_error("D-Bus connection not available for BLE write.\n");
+		shadow_set_done(device, mask, 0);
+		log_error("Shadow: Failed to queue properties/set request_id=%s\n", request_id);
+		mqtt_publish_property_set_response(request_id, CMD_RESULT_BUSY, "busy");
+	}
+}
+
+
+//根据设备ID构建下行主题路由表
+int mqtt_gateway_init_routes(void)
+{
+	char	pattern[256];
+	int		rv = 0;
+
+	topic_router_init(&downlink_router);
+
+	snprintf(pattern, sizeof(pattern), "$oc/devices/%s/sys/commands/+", device_config.username);
+	rv |= topic_router_add(&downlink_router, pattern, handle_command_request, NULL);
+
+	snprintf(pattern, sizeof(pattern), "$oc/devices/%s/sys/messages/down", device_config.username);
+	rv |= topic_router_add(&downlink_router, pattern, handle_downlink_message, NULL);
+
+	snprintf(pattern, sizeof(pattern), "$oc/devices/%s/sys/properties/get/+", device_config.username);
+	rv |= topic_router_add(&downlink_router, pattern, handle_property_get, NULL);
+
+	snprintf(pattern, sizeof(pattern), "$oc/devices/%s/sys/properties/set/+", device_config.username);
+	rv |= topic_router_add(&downlink_router, pattern, handle_property_set, NULL);
+
+	return rv;
+}
+
+
+//MQTT消息接收回调函数（处理下行指令）
+void on_message_cb(struct mosquitto *mosq_obj, void *userdata, const struct mosquitto_message *msg)
+{
+	topic_match_t	match;
+	uint64_t		wait;
+
+	log_info("\n--- Dwonlink message received ---\n");
+	log_info("Topic: %s\n", msg->topic);
+	log_info("Message: %.*s\n", msg->payloadlen, (char *)msg->payload);
+	log_info("------------------------------------\n\n");
+
+	//重连后收到第一条消息（持久会话下通常是代理排队的命令）的时间
+	if(sess.waiting_first_cmd)
+	{
+		wait = mqtt_conn_now_ms() - sess.connack_ms;
+		sess.waiting_first_cmd = 0;
+		sess.first_cmd_count++;
+		sess.first_cmd_sum_ms += wait;
+		if(wait > sess.first_cmd_max_ms)
+			sess.first_cmd_max_ms = (uint32_t)wait;
+		log_debug("MQTT: First downlink message %llu ms after reconnect.\n", (unsigned long long)wait);
+	}
+
+	//按主题分发，没有匹配的路由时按普通下行消息处理
+	if(topic_router_dispatch(&downlink_router, msg->topic, msg->payload, msg->payloadlen) == 0)
+	{
+		memset(&match, 0, sizeof(match));
+		match.topic = msg->topic;
+		handle_downlink_message(&match, msg->payload, msg->payloadlen, NULL);
 	}
 }
 
@@ -215,6 +1060,7 @@ void on_message_cb(struct mosquitto *mosq_obj, void *userdata, const struct mosq
 void on_publish_cb(struct mosquitto *mosq_obj, void *userdata, int mid)
 {
 	log_info("MQTT: Message published successfully, Message ID: %d\n", mid);
+	inflight_ack(mid);
 }
 
 
@@ -232,21 +1078,54 @@ void on_disconnect_cb(struct mosquitto *mosq_obj, void *userdata, int result)
 {
 	log_info("MQTT: Disconnected from broker, return code: %d\n", result);
 	mqtt_connected_flag = 0;
+	inflight_discard_early_acks();
+}
+
+
+
+
+/* 发起连接
+ * v5 持久会话需要在 CONNECT 中携带 Session Expiry Interval，libmosquitto 只有同步的
+ * mosquitto_connect_bind_v5 能带连接属性：它只阻塞在 TCP 握手上（地址已由缓存解析），
+ * CONNACK 仍由事件循环异步处理。
+ */
+static int mqtt_connect_start(const char *host)
+{
+	mosquitto_property	*props = NULL;
+	int					rc;
+
+	if(device_config.protocol_version != MQTT_PROTOCOL_50 || !device_config.persistent_session)
+		return mosquitto_connect_async(global_mosq, host, device_config.port, device_config.keepalive_interval);
+
+	mosquitto_property_add_int32(&props, MQTT_PROP_SESSION_EXPIRY_INTERVAL, (uint32_t)device_config.session_expiry_sec);
+	rc = mosquitto_connect_bind_v5(global_mosq, host, device_config.port, device_config.keepalive_interval, NULL, props);
+	mosquitto_property_free_all(&props);
+
+	return rc;
 }
 
 
+//连接状态
+enum {
+	LINK_IDLE = 0,     //等待下一次连接
+	LINK_CONNECTING,   //已发起异步连接，等待 CONNACK
+	LINK_CONNECTED,
+};
 
 
 //下行线程：负责MQTT连接管理和下行消息处理
-//该线程会持续尝试连接MQTT代理，并在连接成功后监听下行消息
+//连接使用 mosquitto_connect_async，由本线程的事件循环推进，不阻塞在 DNS 或 TCP 握手上
 //ps：它不负责向MQTT周期性发布数据，发布操作现在由BLE线程负责
 void *downlink_thread_func(void *arg)
 {
-	int			rc;
-	int			loop_status_initial;
-	int			loop_attemps = 0;
-	const int	MAX_LOOP_ATTEMPTS = 10; //最大尝试连接次数
-	const int	LOOP_TIMEOUT_MS = 100; //每次循环的超时时间
+	mqtt_conn_config_t	conn_cfg;
+	char				addr[MQTT_CONN_HOST_MAX];
+	const char			*host;
+	int					state = LINK_IDLE;
+	uint64_t			next_attempt_ms;
+	uint64_t			deadline_ms = 0;
+	uint64_t			now;
+	int					rc;
 
 	//检查MOsquitto 客户端实例是否已再main线程中初始化
 	if(!global_mosq)
@@ -255,73 +1134,113 @@ void *downlink_thread_func(void *arg)
 		return NULL;
 	}
 
+	memset(&conn_cfg, 0, sizeof(conn_cfg));
+	conn_cfg.dns_ttl_sec = device_config.dns_ttl_sec;
+	conn_cfg.use_cached_address = device_config.ca_cert == NULL; //TLS 需要按主机名校验证书
+	conn_cfg.base_ms = device_config.reconnect_base_ms;
+	conn_cfg.max_ms = device_config.reconnect_max_ms;
+	mqtt_conn_init(device_config.host, device_config.port, &conn_cfg);
+
+	next_attempt_ms = mqtt_conn_now_ms() + mqtt_conn_first_delay_ms();
+
 	log_info("---Downlink Thread: MQTT communication loop ---");
 	while(keep_running)
 	{
-		//连接到MQTT Broker
-		rc = mosquitto_connect(global_mosq, device_config.host, device_config.port, device_config.keepalive_interval);
-		if(rc != MOSQ_ERR_SUCCESS)
+		now = mqtt_conn_now_ms();
+
+		switch(state)
 		{
-			log_error("Downlink Thread: Failed to connect to MQTT broker: %s. Retrying in 5 seconds...\n", mosquitto_strerror(rc));
-			sleep(5);
-			continue ;
-		}
+			case LINK_IDLE:
+				if(now < next_attempt_ms)
+				{
+					usleep((next_attempt_ms - now > 100 ? 100 : next_attempt_ms - now) * 1000);
+					break;
+				}
 
+				reset_session_if_aliased();
 
-		//确保在进入主循环之前，有足够的机会让Mosquitto客户端完成连接的实际握手和初始化设置（订阅主题等）
-		do
-		{
-			loop_status_initial = mosquitto_loop(global_mosq, LOOP_TIMEOUT_MS, 1);
-			if(loop_status_initial != MOSQ_ERR_SUCCESS && loop_status_initial != MOSQ_ERR_NO_CONN)
-			{
-				log_error("DEBUS: Initial loop after connect encountered error: %s\n", mosquitto_strerror(loop_status_initial));
-				break; //遇到错误就退出do-while循环
-			}
-			usleep(10000);
-			loop_attemps++;
-		} while(loop_attemps < MAX_LOOP_ATTEMPTS && mqtt_connected_flag == 0 && keep_running);	//循环条件：
-																								//1、未达到最大尝试次数
-																								//2、MQTT 尚未连接成功
-																								//3、程序未被要求停止
-
-		//如果多次循环仍未连接成功，返回外层循环，重新尝试完整的连接过程
-		if(mqtt_connected_flag == 0 && keep_running)
-		{
-			log_error("DEBUS: Initial connection/subscription loop timed out or failed, attempting full reconnect...\n");
-			mosquitto_disconnect(global_mosq); //断开当前可能存在的半连接
-			sleep(1);
-			continue ;
-		}
-		log_debug("DEBUG: Finished initiao loop after connect. Continuing main loop.\n");
+				//连接到MQTT Broker（地址来自缓存，不触发 DNS 查询）
+				host = mqtt_conn_select_host(addr, sizeof(addr));
+				mqtt_conn_attempt();
+				rc = mqtt_connect_start(host);
+				if(rc != MOSQ_ERR_SUCCESS)
+				{
+					next_attempt_ms = mqtt_conn_now_ms() + mqtt_conn_failed();
+					log_error("Downlink Thread: Failed to connect to MQTT broker %s: %s. Retrying in %llu ms...\n",
+							host, mosquitto_strerror(rc), (unsigned long long)(next_attempt_ms - now));
+					break;
+				}
 
+				log_debug("Downlink Thread: Connecting to %s:%d...\n", host, device_config.port);
+				deadline_ms = now + (device_config.connect_timeout_ms > 0 ? device_config.connect_timeout_ms : 10000);
+				state = LINK_CONNECTING;
+				break;
 
-		//循环处理MQTT网络事件和下行消息的持续接收
-		//存在重连机制，如果连接丢失，退出while循环重连
-		while(mqtt_connected_flag && keep_running)
-		{
-			rc = mosquitto_loop(global_mosq, 100, 1);
-			if(rc != MOSQ_ERR_SUCCESS)
-			{
-				if(rc == MOSQ_ERR_NO_CONN) //如果错误是连接丢失
+			case LINK_CONNECTING:
+				//握手和订阅由 mosquitto_loop 推进，CONNACK 到达后 on_connect_cb 置位连接标志
+				rc = mosquitto_loop(global_mosq, 100, 1);
+				if(mqtt_connected_flag)
 				{
-					log_debug("Downlink Thread: Moquitto loop reports no connection, breaking to reconnect.\n");
-					mqtt_connected_flag = 0;
+					mqtt_conn_connected();
+					replay_rescan();
+					state = LINK_CONNECTED;
+					break;
 				}
-				else //其他类型的错误
+
+				if((rc != MOSQ_ERR_SUCCESS && rc != MOSQ_ERR_CONN_PENDING) || mqtt_conn_now_ms() >= deadline_ms)
 				{
-					log_error("Downlink Thread: Moquitto loop error: %s. Attempting to reconnect...\n", mosquitto_strerror(rc));
-					mosquitto_disconnect(global_mosq); //强制断开以触发重连
+					mosquitto_disconnect(global_mosq); //断开当前可能存在的半连接
+					next_attempt_ms = mqtt_conn_now_ms() + mqtt_conn_failed();
+					log_error("Downlink Thread: Connection attempt %s, retrying in %llu ms...\n",
+							mqtt_conn_now_ms() < deadline_ms ? mosquitto_strerror(rc) : "timed out",
+							(unsigned long long)(next_attempt_ms - mqtt_conn_now_ms()));
+					state = LINK_IDLE;
 				}
-				sleep(1);
-				break ; //退出尝试重连
-			}
+				break;
 
-			usleep(10000);
-		}	
+			case LINK_CONNECTED:
+				//循环处理MQTT网络事件和下行消息的持续接收
+				//等待时间较短，排队的告警和命令响应能及时发出
+				rc = mosquitto_loop(global_mosq, 20, 1);
+				if(rc != MOSQ_ERR_SUCCESS || !mqtt_connected_flag)
+				{
+					if(rc == MOSQ_ERR_NO_CONN || rc == MOSQ_ERR_SUCCESS) //如果错误是连接丢失
+					{
+						log_debug("Downlink Thread: Moquitto loop reports no connection, reconnecting.\n");
+					}
+					else //其他类型的错误
+					{
+						log_error("Downlink Thread: Moquitto loop error: %s. Attempting to reconnect...\n", mosquitto_strerror(rc));
+						mosquitto_disconnect(global_mosq); //强制断开以触发重连
+					}
+					mqtt_connected_flag = 0;
+					next_attempt_ms = mqtt_conn_now_ms() + mqtt_conn_lost();
+					state = LINK_IDLE;
+					break;
+				}
+
+				//连接正常时回放断线期间暂存的数据
+				replay_spooled_messages();
+
+				//按优先级和令牌桶调度各队列的发送
+				publish_lanes_drain();
+
+				//标记超时未确认的在途消息（槽位保留到 PUBACK）
+				inflight_expire();
+
+				//持久会话：在途集合有变化时定期写入状态文件，崩溃或断电后也能重发
+				inflight_checkpoint(device_config.session_state_path, device_config.session_state_interval_ms);
+				break;
+		}
+	}
+
+	//keep_running 清零后在状态之间退出，不持有任何锁；未确认的消息和发送队列由 cleanup_handler 保存
+	if(state != LINK_IDLE)
+	{
+		mosquitto_disconnect(global_mosq);
+		mqtt_connected_flag = 0;
 	}
 
 	log_info("Downlink Thread: Exiting...\n");
 	return NULL;
 }
-
-
@@ -0,0 +1,883 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  mqtt_lite.c
+ *    Description:  This file implements a lightweight event-loop MQTT 3.1.1 client.
+ *
+ *                  每个连接一次分配：结构体 + 输出环形缓冲区 + 输入缓冲区 + 在途槽位。
+ *                  发布时报文头、主题和负载直接写入输出缓冲区，套接字空闲时立即尝试发送，
+ *                  否则留在缓冲区中，下次可写时与后面的报文一起用一次 writev 发出（跨越
+ *                  环形缓冲区末尾时两段）。QoS1 报文同时保存在在途槽位中，收到 PUBACK 释放，
+ *                  连接断开后重新连上时置 DUP 重发，输出缓冲区放不下的在 mqtt_lite_write 腾出空间后继续。
+ *                  收到的 PUBLISH 把主题左移两个字节覆盖长度字段，末尾补 '\0'，不复制报文；
+ *                  负载之后的一个字节在回调期间临时置为 '\0'（与 libmosquitto 一样，负载总是以 '\0' 结尾），
+ *                  输入缓冲区为此多分配了 IN_RESERVE 个字节。
+ *
+ *        Version:  1.0.0(2025年09月06日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月06日 10时05分27秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "mqtt_lite.h"
+
+
+// 控制报文类型（固定报头高 4 位）
+#define PKT_CONNECT		0x10
+#define PKT_CONNACK		0x20
+#define PKT_PUBLISH		0x30
+#define PKT_PUBACK		0x40
+#define PKT_SUBSCRIBE	0x82     // 保留位必须为 0010
+#define PKT_SUBACK		0x90
+#define PKT_PINGREQ		0xC0
+#define PKT_PINGRESP	0xD0
+#define PKT_DISCONNECT	0xE0
+
+#define PUBLISH_DUP		0x08
+
+// 输入缓冲区末尾的保留字节：报文占满缓冲区时负载后面仍有位置放 '\0'，取 8 保持后面槽位表的对齐
+#define IN_RESERVE		8
+
+// 连接状态
+enum {
+	LITE_DISCONNECTED = 0,
+	LITE_TCP_CONNECTING,     // 非阻塞 connect 尚未完成
+	LITE_MQTT_CONNECTING,    // 已发出 CONNECT，等待 CONNACK
+	LITE_CONNECTED,
+};
+
+typedef struct {
+	uint16_t	mid;           // 0 表示空闲
+	uint16_t	len;
+	uint8_t		resend;        // 重连后等待复制到输出缓冲区重发
+	uint8_t		*pkt;          // 指向本连接分配的槽位存储
+} lite_slot_t;
+
+struct mqtt_lite {
+	int						fd;
+	int						state;
+	int						keepalive;
+	uint16_t				next_mid;
+	int						in_callback;
+	int						deferred;      // 只排队，由调用者在可写时统一发送
+	char					*client_id;
+	char					*username;
+	char					*password;
+	mqtt_lite_callbacks_t	cb;
+	void					*userdata;
+
+	uint64_t				last_out_ms;
+	uint64_t				ping_sent_ms;     // 0 表示没有等待中的 PINGRESP
+
+	uint8_t					*out;
+	uint32_t				out_head;         // 下一个待发送字节
+	uint32_t				out_len;          // 待发送字节数
+	uint8_t					*in;
+	uint32_t				in_len;
+
+	lite_slot_t				*slots;
+	int						slot_count;
+	int						inflight;
+	int						resend_pending;   // 重连时输出缓冲区放不下、还没排队的重发
+
+	mqtt_lite_stats_t		stats;
+};
+
+
+static uint64_t now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+const char *mqtt_lite_strerror(int rc)
+{
+	switch(rc)
+	{
+		case MQTT_LITE_OK:					return "No error";
+		case MQTT_LITE_ERR_NOMEM:			return "Out of memory";
+		case MQTT_LITE_ERR_PROTOCOL:		return "Protocol error";
+		case MQTT_LITE_ERR_INVAL:			return "Invalid argument";
+		case MQTT_LITE_ERR_NO_CONN:			return "Not connected";
+		case MQTT_LITE_ERR_CONN_REFUSED:	return "Connection refused";
+		case MQTT_LITE_ERR_CONN_LOST:		return "Connection lost";
+		case MQTT_LITE_ERR_PAYLOAD_SIZE:	return "Packet too large";
+		case MQTT_LITE_ERR_ERRNO:			return strerror(errno);
+		case MQTT_LITE_ERR_EAI:				return "Lookup error";
+		case MQTT_LITE_ERR_WINDOW_FULL:		return "Inflight window or output buffer full";
+		default:							return "Unknown error";
+	}
+}
+
+
+/* ----- 创建和销毁 ----- */
+
+mqtt_lite_t *mqtt_lite_new(const char *client_id, int max_inflight, const mqtt_lite_callbacks_t *cb, void *userdata)
+{
+	mqtt_lite_t	*c;
+	uint8_t		*p;
+	size_t		size;
+	int			i;
+
+	if(!client_id || max_inflight <= 0)
+		return NULL;
+	if(max_inflight > MQTT_LITE_INFLIGHT_MAX)
+		max_inflight = MQTT_LITE_INFLIGHT_MAX;
+
+	//一次分配全部缓冲区，连接存续期间不再分配内存
+	size = sizeof(*c) + MQTT_LITE_OUT_SIZE + MQTT_LITE_IN_SIZE + IN_RESERVE +
+		(size_t)max_inflight * (sizeof(lite_slot_t) + MQTT_LITE_SLOT_SIZE);
+	c = calloc(1, size);
+	if(!c)
+		return NULL;
+
+	c->client_id = strdup(client_id);
+	if(!c->client_id)
+	{
+		free(c);
+		return NULL;
+	}
+
+	p = (uint8_t *)(c + 1);
+	c->out = p;
+	p += MQTT_LITE_OUT_SIZE;
+	c->in = p;
+	p += MQTT_LITE_IN_SIZE + IN_RESERVE;
+	c->slots = (lite_slot_t *)p;
+	p += (size_t)max_inflight * sizeof(lite_slot_t);
+	for(i = 0; i < max_inflight; i++)
+		c->slots[i].pkt = p + (size_t)i * MQTT_LITE_SLOT_SIZE;
+	c->slot_count = max_inflight;
+
+	c->fd = -1;
+	c->state = LITE_DISCONNECTED;
+	c->next_mid = 1;
+	if(cb)
+		c->cb = *cb;
+	c->userdata = userdata;
+	return c;
+}
+
+
+void mqtt_lite_destroy(mqtt_lite_t *c)
+{
+	if(!c)
+		return ;
+
+	if(c->fd >= 0)
+		close(c->fd);
+	free(c->client_id);
+	free(c->username);
+	free(c->password);
+	free(c);
+}
+
+
+int mqtt_lite_set_login(mqtt_lite_t *c, const char *username, const char *password)
+{
+	free(c->username);
+	free(c->password);
+	c->username = username ? strdup(username) : NULL;
+	c->password = password ? strdup(password) : NULL;
+	return (username && !c->username) || (password && !c->password) ? MQTT_LITE_ERR_NOMEM : MQTT_LITE_OK;
+}
+
+
+/* 延迟发送：publish / subscribe / PINGREQ 只排队、不写套接字，want_write 变为真，
+ * 由调用者的事件循环在 EPOLLOUT 时调用 mqtt_lite_write，把这期间排队的报文一次发出；
+ * 适合由其他线程发布、事件循环统一发送的场景
+ */
+void mqtt_lite_set_deferred(mqtt_lite_t *c, int deferred)
+{
+	c->deferred = deferred;
+}
+
+
+/* ----- 输出缓冲区 ----- */
+
+static uint32_t out_free(const mqtt_lite_t *c)
+{
+	return MQTT_LITE_OUT_SIZE - c->out_len;
+}
+
+
+//追加到环形缓冲区末尾（调用前已确认空间足够）
+static void out_put(mqtt_lite_t *c, const void *data, uint32_t len)
+{
+	uint32_t	tail = (c->out_head + c->out_len) % MQTT_LITE_OUT_SIZE;
+	uint32_t	first = MQTT_LITE_OUT_SIZE - tail;
+
+	if(first > len)
+		first = len;
+	memcpy(c->out + tail, data, first);
+	memcpy(c->out, (const uint8_t *)data + first, len - first);
+	c->out_len += len;
+}
+
+
+static void out_put_u16(mqtt_lite_t *c, uint16_t v)
+{
+	uint8_t		b[2] = { (uint8_t)(v >> 8), (uint8_t)v };
+
+	out_put(c, b, 2);
+}
+
+
+static void out_put_str(mqtt_lite_t *c, const char *s, uint16_t len)
+{
+	out_put_u16(c, len);
+	out_put(c, s, len);
+}
+
+
+//固定报头：类型字节加剩余长度（变长编码），返回写入 buf 的字节数
+static int encode_header(uint8_t *buf, uint8_t type, uint32_t remaining)
+{
+	int		n = 0;
+
+	buf[n++] = type;
+	do
+	{
+		buf[n] = remaining % 128;
+		remaining /= 128;
+		if(remaining)
+			buf[n] |= 0x80;
+		n++;
+	} while(remaining);
+
+	return n;
+}
+
+
+static int close_with(mqtt_lite_t *c, int rc);
+
+/* 发出缓冲区中的所有数据，一次 writev 最多两段
+ * 写不完时保留剩余部分等待 EPOLLOUT
+ */
+static int flush(mqtt_lite_t *c)
+{
+	struct iovec	iov[2];
+	uint32_t		first;
+	ssize_t			n;
+	int				cnt;
+
+	while(c->out_len > 0)
+	{
+		first = MQTT_LITE_OUT_SIZE - c->out_head;
+		if(first >= c->out_len)
+		{
+			iov[0].iov_base = c->out + c->out_head;
+			iov[0].iov_len = c->out_len;
+			cnt = 1;
+		}
+		else
+		{
+			iov[0].iov_base = c->out + c->out_head;
+			iov[0].iov_len = first;
+			iov[1].iov_base = c->out;
+			iov[1].iov_len = c->out_len - first;
+			cnt = 2;
+		}
+
+		n = writev(c->fd, iov, cnt);
+		c->stats.writev_calls++;
+		if(n < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return MQTT_LITE_OK;
+			if(errno == EINTR)
+				continue;
+			return close_with(c, MQTT_LITE_ERR_CONN_LOST);
+		}
+
+		c->out_head = (c->out_head + (uint32_t)n) % MQTT_LITE_OUT_SIZE;
+		c->out_len -= (uint32_t)n;
+		c->stats.bytes_out += (uint64_t)n;
+		c->last_out_ms = now_ms();
+	}
+
+	c->out_head = 0;
+	return MQTT_LITE_OK;
+}
+
+
+/* 排队完成后：缓冲区原来为空时立即发送；原来就有没发完的数据说明套接字正忙，
+ * 新报文留在缓冲区中，可写时与之前的报文一起用一次 writev 发出（发布流水线）
+ * 回调中排队的报文在处理完输入后统一发送；延迟模式下一律等调用者写
+ */
+static int kick(mqtt_lite_t *c, uint32_t pending)
+{
+	c->stats.packets_out++;
+	if(pending || c->deferred || c->in_callback || c->state == LITE_TCP_CONNECTING)
+		return MQTT_LITE_OK;
+	return flush(c);
+}
+
+
+/* ----- 连接 ----- */
+
+//断开连接，连接曾经建立过时通知上层；在途表保留，重连后重发
+static int close_with(mqtt_lite_t *c, int rc)
+{
+	int		notify = c->state != LITE_DISCONNECTED;
+
+	if(c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+	c->state = LITE_DISCONNECTED;
+	c->out_head = c->out_len = 0;
+	c->in_len = 0;
+	c->ping_sent_ms = 0;
+
+	if(notify && c->cb.on_disconnect)
+	{
+		c->in_callback++;
+		c->cb.on_disconnect(c, c->userdata, rc);
+		c->in_callback--;
+	}
+	return rc;
+}
+
+
+//CONNECT 报文的剩余长度，客户端ID、用户名或密码超过 16 位长度字段时返回 0
+static uint32_t connect_remaining(const mqtt_lite_t *c)
+{
+	size_t		id_len = strlen(c->client_id);
+	size_t		user_len = c->username ? strlen(c->username) : 0;
+	size_t		pass_len = c->password ? strlen(c->password) : 0;
+
+	if(id_len > 65535 || user_len > 65535 || pass_len > 65535)
+		return 0;
+	return (uint32_t)(10 + 2 + id_len + (c->username ? 2 + user_len : 0) + (c->password ? 2 + pass_len : 0));
+}
+
+
+//排入 CONNECT 报文（调用前 mqtt_lite_connect 已确认整个报文能放进空的输出缓冲区）
+static void queue_connect(mqtt_lite_t *c)
+{
+	uint8_t		hdr[5];
+	uint16_t	id_len = (uint16_t)strlen(c->client_id);
+	uint16_t	user_len = c->username ? (uint16_t)strlen(c->username) : 0;
+	uint16_t	pass_len = c->password ? (uint16_t)strlen(c->password) : 0;
+	uint32_t	remaining = connect_remaining(c);
+	uint8_t		flags = 0x02;    //clean session
+	uint8_t		var[8] = { 0, 4, 'M', 'Q', 'T', 'T', 4, 0 };
+
+	if(c->username)
+		flags |= 0x80;
+	if(c->password)
+		flags |= 0x40;
+	var[7] = flags;
+
+	out_put(c, hdr, encode_header(hdr, PKT_CONNECT, remaining));
+	out_put(c, var, sizeof(var));
+	out_put_u16(c, (uint16_t)c->keepalive);
+	out_put_str(c, c->client_id, id_len);
+	if(c->username)
+		out_put_str(c, c->username, user_len);
+	if(c->password)
+		out_put_str(c, c->password, pass_len);
+	c->stats.packets_out++;
+}
+
+
+//发起非阻塞连接，CONNECT 报文在套接字可写后发出
+int mqtt_lite_connect(mqtt_lite_t *c, const char *host, int port, int keepalive)
+{
+	struct addrinfo	hints;
+	struct addrinfo	*res = NULL;
+	char			service[8];
+	uint32_t		remaining;
+	int				one = 1;
+	int				fd;
+
+	if(c->fd >= 0)
+		close_with(c, MQTT_LITE_OK);
+
+	//字符串的长度字段为 16 位；CONNECT 报文（固定报头最多 5 个字节）必须整个放进输出缓冲区
+	remaining = connect_remaining(c);
+	if(!remaining)
+		return MQTT_LITE_ERR_INVAL;
+	if(remaining + 5 > MQTT_LITE_OUT_SIZE)
+		return MQTT_LITE_ERR_PAYLOAD_SIZE;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", port);
+	if(getaddrinfo(host, service, &hints, &res) != 0 || !res)
+		return MQTT_LITE_ERR_EAI;
+
+	fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0)
+	{
+		freeaddrinfo(res);
+		return MQTT_LITE_ERR_ERRNO;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if(connect(fd, res->ai_addr, res->ai_addrlen) < 0 && errno != EINPROGRESS)
+	{
+		freeaddrinfo(res);
+		close(fd);
+		return MQTT_LITE_ERR_ERRNO;
+	}
+	freeaddrinfo(res);
+
+	c->fd = fd;
+	c->keepalive = keepalive;
+	c->state = LITE_TCP_CONNECTING;
+	c->out_head = c->out_len = 0;
+	c->in_len = 0;
+	c->ping_sent_ms = 0;
+	c->last_out_ms = now_ms();
+	queue_connect(c);
+	return MQTT_LITE_OK;
+}
+
+
+//尽量发出 DISCONNECT 后关闭，不调用 on_disconnect
+int mqtt_lite_disconnect(mqtt_lite_t *c)
+{
+	uint8_t		pkt[2] = { PKT_DISCONNECT, 0 };
+
+	if(c->fd < 0)
+		return MQTT_LITE_ERR_NO_CONN;
+
+	if(c->state == LITE_CONNECTED && out_free(c) >= sizeof(pkt))
+	{
+		out_put(c, pkt, sizeof(pkt));
+		flush(c);
+	}
+
+	close(c->fd);
+	c->fd = -1;
+	c->state = LITE_DISCONNECTED;
+	c->out_head = c->out_len = 0;
+	c->in_len = 0;
+	return MQTT_LITE_OK;
+}
+
+
+int mqtt_lite_socket(const mqtt_lite_t *c)
+{
+	return c->fd;
+}
+
+
+int mqtt_lite_want_write(const mqtt_lite_t *c)
+{
+	return c->fd >= 0 && (c->out_len > 0 || c->resend_pending || c->state == LITE_TCP_CONNECTING);
+}
+
+
+/* ----- 发布和订阅 ----- */
+
+static lite_slot_t *find_slot(mqtt_lite_t *c, uint16_t mid)
+{
+	int		i;
+
+	for(i = 0; i < c->slot_count; i++)
+	{
+		if(c->slots[i].mid == mid)
+			return &c->slots[i];
+	}
+	return NULL;
+}
+
+
+static uint16_t alloc_mid(mqtt_lite_t *c)
+{
+	uint16_t	mid;
+
+	do
+	{
+		mid = c->next_mid++;
+		if(!c->next_mid)
+			c->next_mid = 1;
+	} while(!mid || find_slot(c, mid));
+
+	return mid;
+}
+
+
+/* QoS0 直接写入输出缓冲区；QoS1 先在在途槽位中序列化，再复制到输出缓冲区
+ * 在途表或输出缓冲区已满、重连后的重发还没排完时返回 MQTT_LITE_ERR_WINDOW_FULL，不丢弃已排队的报文
+ */
+int mqtt_lite_publish(mqtt_lite_t *c, int *mid, const char *topic, int payloadlen, const void *payload, int qos)
+{
+	uint8_t		hdr[5];
+	lite_slot_t	*slot;
+	uint32_t	remaining;
+	uint32_t	total;
+	uint16_t	topic_len;
+	uint32_t	pending;
+	uint16_t	id = 0;
+	int			hlen;
+
+	if(!topic || payloadlen < 0 || qos < 0 || qos > 1 || strlen(topic) > 65535)
+		return MQTT_LITE_ERR_INVAL;
+	if(c->state != LITE_CONNECTED)
+		return MQTT_LITE_ERR_NO_CONN;
+
+	topic_len = (uint16_t)strlen(topic);
+	remaining = 2 + topic_len + (qos ? 2 : 0) + (uint32_t)payloadlen;
+	hlen = encode_header(hdr, PKT_PUBLISH | (qos << 1), remaining);
+	total = hlen + remaining;
+
+	if(total > MQTT_LITE_OUT_SIZE || (qos && total > MQTT_LITE_SLOT_SIZE))
+		return MQTT_LITE_ERR_PAYLOAD_SIZE;
+	if(total > out_free(c) || (qos && c->inflight == c->slot_count) || c->resend_pending)
+		return MQTT_LITE_ERR_WINDOW_FULL;
+	pending = c->out_len;
+
+	if(qos)
+	{
+		id = alloc_mid(c);
+		slot = find_slot(c, 0);
+		slot->mid = id;
+		slot->len = (uint16_t)total;
+		memcpy(slot->pkt, hdr, hlen);
+		slot->pkt[hlen] = topic_len >> 8;
+		slot->pkt[hlen + 1] = topic_len & 0xff;
+		memcpy(slot->pkt + hlen + 2, topic, topic_len);
+		slot->pkt[hlen + 2 + topic_len] = id >> 8;
+		slot->pkt[hlen + 3 + topic_len] = id & 0xff;
+		memcpy(slot->pkt + hlen + 4 + topic_len, payload, payloadlen);
+		out_put(c, slot->pkt, total);
+		c->inflight++;
+	}
+	else
+	{
+		out_put(c, hdr, hlen);
+		out_put_str(c, topic, topic_len);
+		out_put(c, payload, payloadlen);
+	}
+
+	if(mid)
+		*mid = id;
+	return kick(c, pending);
+}
+
+
+int mqtt_lite_subscribe(mqtt_lite_t *c, const char *topic, int qos)
+{
+	uint8_t		hdr[5];
+	uint32_t	remaining;
+	uint32_t	pending;
+	uint16_t	topic_len;
+	uint8_t		q = (uint8_t)qos;
+
+	if(!topic || qos < 0 || qos > 1 || strlen(topic) > 65535)
+		return MQTT_LITE_ERR_INVAL;
+	if(c->state != LITE_CONNECTED)
+		return MQTT_LITE_ERR_NO_CONN;
+
+	topic_len = (uint16_t)strlen(topic);
+	remaining = 2 + 2 + topic_len + 1;
+	if(remaining + 5 > out_free(c))
+		return MQTT_LITE_ERR_WINDOW_FULL;
+	pending = c->out_len;
+
+	out_put(c, hdr, encode_header(hdr, PKT_SUBSCRIBE, remaining));
+	out_put_u16(c, alloc_mid(c));
+	out_put_str(c, topic, topic_len);
+	out_put(c, &q, 1);
+	return kick(c, pending);
+}
+
+
+/* ----- 接收 ----- */
+
+//把等待重发的在途消息按槽位序号复制到输出缓冲区，放不下时停止，由 mqtt_lite_write 腾出空间后继续
+static void queue_resend(mqtt_lite_t *c)
+{
+	int		i;
+
+	for(i = 0; i < c->slot_count && c->resend_pending; i++)
+	{
+		if(!c->slots[i].resend)
+			continue;
+		if(c->slots[i].len > out_free(c))
+			break;
+
+		c->slots[i].resend = 0;
+		c->resend_pending--;
+		c->slots[i].pkt[0] |= PUBLISH_DUP;
+		out_put(c, c->slots[i].pkt, c->slots[i].len);
+		c->stats.packets_out++;
+		c->stats.resent++;
+	}
+}
+
+
+//连接建立后重发所有未确认的 QoS1 消息（按槽位序号，不是发布顺序）
+static void resend_inflight(mqtt_lite_t *c)
+{
+	int		i;
+
+	c->resend_pending = 0;
+	for(i = 0; i < c->slot_count; i++)
+	{
+		c->slots[i].resend = c->slots[i].mid != 0;
+		c->resend_pending += c->slots[i].resend;
+	}
+	queue_resend(c);
+}
+
+
+/* 原地处理 PUBLISH：主题左移两个字节覆盖长度字段，腾出的位置放 '\0'
+ * 负载后面是下一个报文的开头，回调期间临时改成 '\0'，返回后恢复
+ */
+static int handle_publish(mqtt_lite_t *c, uint8_t flags, uint8_t *body, uint32_t len)
+{
+	uint8_t		ack[4] = { PKT_PUBACK, 2, 0, 0 };
+	uint16_t	topic_len;
+	uint32_t	offset;
+	uint8_t		saved;
+	int			qos = (flags >> 1) & 0x03;
+
+	if(len < 2 || qos > 1)
+		return MQTT_LITE_ERR_PROTOCOL;
+
+	topic_len = (uint16_t)(body[0] << 8 | body[1]);
+	offset = 2 + topic_len + (qos ? 2 : 0);
+	if(offset > len)
+		return MQTT_LITE_ERR_PROTOCOL;
+
+	//与 libmosquitto 相同，PUBACK 在交给上层之前排队，回调中的发布不会挤占它的空间
+	if(qos)
+	{
+		if(out_free(c) < sizeof(ack))
+			return MQTT_LITE_ERR_WINDOW_FULL;
+		ack[2] = body[2 + topic_len];
+		ack[3] = body[3 + topic_len];
+		out_put(c, ack, sizeof(ack));
+		c->stats.packets_out++;
+	}
+
+	memmove(body, body + 2, topic_len);
+	body[topic_len] = '\0';
+
+	saved = body[len];
+	body[len] = '\0';
+	if(c->cb.on_message)
+		c->cb.on_message(c, c->userdata, (const char *)body, body + offset, (int)(len - offset));
+	body[len] = saved;
+	return MQTT_LITE_OK;
+}
+
+
+static int dispatch(mqtt_lite_t *c, uint8_t type, uint8_t *body, uint32_t len)
+{
+	lite_slot_t	*slot;
+	uint16_t	mid;
+	int			rc;
+
+	switch(type & 0xF0)
+	{
+		case PKT_CONNACK:
+			if(len != 2 || c->state != LITE_MQTT_CONNECTING)
+				return MQTT_LITE_ERR_PROTOCOL;
+			rc = body[1];
+			if(rc == 0)
+			{
+				c->state = LITE_CONNECTED;
+				resend_inflight(c);
+			}
+			if(c->cb.on_connect)
+				c->cb.on_connect(c, c->userdata, rc);
+			return rc == 0 ? MQTT_LITE_OK : MQTT_LITE_ERR_CONN_REFUSED;
+
+		case PKT_PUBLISH:
+			return handle_publish(c, type & 0x0F, body, len);
+
+		case PKT_PUBACK:
+			if(len != 2)
+				return MQTT_LITE_ERR_PROTOCOL;
+			mid = (uint16_t)(body[0] << 8 | body[1]);
+			if(mid && (slot = find_slot(c, mid)) != NULL)
+			{
+				if(slot->resend)
+				{
+					slot->resend = 0;
+					c->resend_pending--;
+				}
+				slot->mid = 0;
+				c->inflight--;
+				if(c->cb.on_publish)
+					c->cb.on_publish(c, c->userdata, mid);
+			}
+			return MQTT_LITE_OK;
+
+		case PKT_SUBACK:
+			return MQTT_LITE_OK;
+
+		case PKT_PINGRESP:
+			c->ping_sent_ms = 0;
+			return MQTT_LITE_OK;
+
+		default:
+			return MQTT_LITE_ERR_PROTOCOL;
+	}
+}
+
+
+/* 读取可用数据并处理其中所有完整的报文，不完整的留在缓冲区开头等下次读取
+ * 出错时关闭连接并返回错误码
+ */
+int mqtt_lite_read(mqtt_lite_t *c)
+{
+	uint32_t	pos = 0;
+	uint32_t	remaining;
+	uint32_t	mult;
+	uint32_t	hlen;
+	ssize_t		n;
+	int			rc = MQTT_LITE_OK;
+
+	if(c->fd < 0)
+		return MQTT_LITE_ERR_NO_CONN;
+	if(c->state == LITE_TCP_CONNECTING)
+		return MQTT_LITE_OK;
+
+	n = read(c->fd, c->in + c->in_len, MQTT_LITE_IN_SIZE - c->in_len);
+	c->stats.read_calls++;
+	if(n == 0)
+		return close_with(c, MQTT_LITE_ERR_CONN_LOST);
+	if(n < 0)
+	{
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return MQTT_LITE_OK;
+		return close_with(c, MQTT_LITE_ERR_CONN_LOST);
+	}
+	c->in_len += (uint32_t)n;
+	c->stats.bytes_in += (uint64_t)n;
+
+	c->in_callback++;
+	while(rc == MQTT_LITE_OK && c->in_len - pos >= 2)
+	{
+		//剩余长度最多 4 个字节
+		remaining = 0;
+		mult = 1;
+		for(hlen = 1; hlen <= 4; hlen++)
+		{
+			if(pos + hlen >= c->in_len)
+				break;
+			remaining += (c->in[pos + hlen] & 0x7F) * mult;
+			mult *= 128;
+			if(!(c->in[pos + hlen] & 0x80))
+				break;
+		}
+		if(hlen > 4)
+		{
+			rc = MQTT_LITE_ERR_PROTOCOL;
+			break;
+		}
+		if(pos + hlen >= c->in_len)
+			break;
+
+		hlen++;
+		if(hlen + remaining > MQTT_LITE_IN_SIZE)
+		{
+			rc = MQTT_LITE_ERR_PAYLOAD_SIZE;
+			break;
+		}
+		if(pos + hlen + remaining > c->in_len)
+			break;
+
+		c->stats.packets_in++;
+		rc = dispatch(c, c->in[pos], c->in + pos + hlen, remaining);
+		pos += hlen + remaining;
+	}
+	c->in_callback--;
+
+	if(rc != MQTT_LITE_OK)
+		return close_with(c, rc);
+
+	if(pos < c->in_len)
+		memmove(c->in, c->in + pos, c->in_len - pos);
+	c->in_len -= pos;
+
+	//回调中排队的 PUBACK、订阅和重发
+	return c->out_len ? flush(c) : MQTT_LITE_OK;
+}
+
+
+int mqtt_lite_write(mqtt_lite_t *c)
+{
+	socklen_t	len = sizeof(int);
+	int			err = 0;
+	int			rc;
+
+	if(c->fd < 0)
+		return MQTT_LITE_ERR_NO_CONN;
+
+	//非阻塞 connect 完成（或失败）后套接字变为可写
+	if(c->state == LITE_TCP_CONNECTING)
+	{
+		if(getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+		{
+			errno = err;
+			return close_with(c, MQTT_LITE_ERR_ERRNO);
+		}
+		c->state = LITE_MQTT_CONNECTING;
+	}
+
+	rc = flush(c);
+
+	//重连时输出缓冲区放不下的重发，腾出空间后继续排队
+	if(rc == MQTT_LITE_OK && c->resend_pending && c->state == LITE_CONNECTED)
+	{
+		queue_resend(c);
+		rc = flush(c);
+	}
+	return rc;
+}
+
+
+//心跳：keepalive 内没有发送过报文时发 PINGREQ，一个 keepalive 周期内没有 PINGRESP 视为断开
+int mqtt_lite_misc(mqtt_lite_t *c)
+{
+	uint8_t		ping[2] = { PKT_PINGREQ, 0 };
+	uint64_t	now = now_ms();
+	uint64_t	interval = (uint64_t)c->keepalive * 1000;
+
+	if(c->fd < 0)
+		return MQTT_LITE_ERR_NO_CONN;
+	if(c->state != LITE_CONNECTED || !interval)
+		return MQTT_LITE_OK;
+
+	if(c->ping_sent_ms && now - c->ping_sent_ms >= interval)
+		return close_with(c, MQTT_LITE_ERR_CONN_LOST);
+
+	if(!c->ping_sent_ms && now - c->last_out_ms >= interval && out_free(c) >= sizeof(ping))
+	{
+		out_put(c, ping, sizeof(ping));
+		c->ping_sent_ms = now;
+		return kick(c, 0);
+	}
+	return MQTT_LITE_OK;
+}
+
+
+void mqtt_lite_get_stats(const mqtt_lite_t *c, mqtt_lite_stats_t *stats)
+{
+	*stats = c->stats;
+	stats->inflight = c->inflight;
+}
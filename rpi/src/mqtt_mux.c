@@ -0,0 +1,1066 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  mqtt_mux.c
+ *    Description:  This file implements per-device MQTT connections on one epoll loop.
+ *
+ *                  每个设备一个客户端，但不调用 mosquitto_loop_start：
+ *                  mux 线程把各客户端的套接字加入同一个 epoll，可读时 read，
+ *                  客户端有待发数据时才关注 EPOLLOUT 并 write，每秒对所有连接执行一次 misc（心跳）。
+ *                  客户端引擎可选 libmosquitto（外部循环接口）或内置的 mqtt_lite，
+ *                  两者经 mux_engine_t 适配成相同的操作。
+ *                  其他线程发布时客户端直接写套接字，写不完时经 eventfd 唤醒
+ *                  mux 线程关注 EPOLLOUT。每个客户端一把递归锁：命令回调中发布响应时
+ *                  会在持有锁的情况下再次进入。
+ *                  发起连接：每 connect_stagger_ms 最多一个，断开后按去相关抖动退避。
+ *                  TLS：所有连接共用一个 SSL_CTX（CA 只加载一次，空闲连接释放读写缓冲区）。
+ *
+ *        Version:  1.0.0(2025年09月05日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月05日 15时42分08秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <mosquitto.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "mqtt_mux.h"
+#include "mqtt_lite.h"
+#include "mqtt_gateway.h"
+#include "spool.h"
+#include "log.h"
+
+
+#define MUX_EVENTS_MAX			64
+#define MUX_WAKE_ID				0xffffffffu      //epoll 中 eventfd 的标识
+#define MUX_MISC_INTERVAL_MS	1000
+#define MUX_CONNECT_TIMEOUT_MS	20000            //发起连接到收到 CONNACK 的超时时间
+#define MUX_RESOLVE_TTL_MS		300000           //代理地址缓存时间
+
+typedef struct {
+	void				*conn;              //mosquitto 或 mqtt_lite 客户端
+	char				*device_id;
+	char				*path;              //D-Bus 设备路径
+	int					fd;                 //已加入 epoll 的套接字，-1 表示没有
+	uint16_t			index;
+	uint8_t				state;
+	uint8_t				want_write;         //epoll 中是否关注了 EPOLLOUT
+	volatile uint8_t	dirty;              //其他线程发布后需要重新检查 want_write
+	uint32_t			prev_delay;         //上次退避时间，0 表示上次连接成功过
+	uint64_t			connect_at_ms;      //IDLE：何时发起连接；CONNECTING：发起的时刻
+	pthread_mutex_t		lock;
+} mux_client_t;
+
+//客户端引擎：返回值都是 MOSQ_ERR_* 取值
+typedef struct {
+	const char	*name;
+	void		*(*create)(mux_client_t *c, const char *client_id, const char *password);
+	void		(*destroy)(void *conn);
+	int			(*connect)(void *conn, const char *host, int port, int keepalive);
+	int			(*disconnect)(void *conn);
+	int			(*socket)(void *conn);
+	int			(*want_write)(void *conn);
+	int			(*read)(void *conn);
+	int			(*write)(void *conn);
+	int			(*misc)(void *conn);
+	int			(*publish)(void *conn, const char *topic, const void *payload, int payloadlen, int qos);
+	int			(*subscribe)(void *conn, const char *topic, int qos);
+	const char	*(*strerror)(int rc);
+} mux_engine_t;
+
+
+static struct {
+	mqtt_mux_config_t	config;
+	const mux_engine_t	*engine;
+	mux_client_t		*clients[MQTT_MUX_MAX];
+	int					count;
+	char				host[256];
+	int					port;
+	char				addr[INET6_ADDRSTRLEN];   //缓存的代理地址，TLS 下为空（按主机名连接）
+	uint64_t			resolved_ms;
+	SSL_CTX				*ssl_ctx;
+	int					epfd;
+	int					wakefd;
+	int					cursor;                  //下一次从哪个客户端开始查找待连接的
+	uint64_t			next_connect_ms;
+	unsigned int		seed;
+	mqtt_mux_stats_t	stats;
+	pthread_mutex_t		lock;                    //保护 stats
+} M = { .epfd = -1, .wakefd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+static uint64_t now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+//[lo, hi] 之间的随机数
+static uint32_t rand_between(uint32_t lo, uint32_t hi)
+{
+	if(hi <= lo)
+		return lo;
+	return lo + (uint32_t)(((uint64_t)rand_r(&M.seed) * (hi - lo + 1)) / ((uint64_t)RAND_MAX + 1));
+}
+
+
+#define STAT_ADD(field, n)	do { pthread_mutex_lock(&M.lock); M.stats.field += (n); pthread_mutex_unlock(&M.lock); } while(0)
+
+
+/* ----- TLS ----- */
+
+/* 所有连接共用的 SSL_CTX：CA 只加载一次，证书校验和主机名校验都在这里配置，
+ * 因此传给 libmosquitto 时关闭 MOSQ_OPT_SSL_CTX_WITH_DEFAULTS。
+ * SSL_MODE_RELEASE_BUFFERS 让空闲连接释放约 34KB 的读写缓冲区。
+ */
+static SSL_CTX *create_ssl_ctx(const char *ca_cert, const char *host)
+{
+	SSL_CTX		*ctx;
+
+	ctx = SSL_CTX_new(TLS_client_method());
+	if(!ctx)
+		return NULL;
+
+	if(SSL_CTX_load_verify_locations(ctx, ca_cert, NULL) != 1)
+	{
+		log_error("MQTT Mux: Failed to load CA certificate %s\n", ca_cert);
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	X509_VERIFY_PARAM_set1_host(SSL_CTX_get0_param(ctx), host, 0);
+	SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+	return ctx;
+}
+
+
+/* ----- 客户端事件（在持有客户端锁的线程中调用） ----- */
+
+static void schedule_reconnect(mux_client_t *c, uint64_t now);
+
+static void client_connected(mux_client_t *c, int result)
+{
+	char	topic[256];
+
+	if(result != 0)
+	{
+		//CONNACK 拒绝（多为密码错误），read 随后返回错误，由循环断开并退避
+		log_error("MQTT Mux: %s connection refused: %s\n", c->device_id, mosquitto_connack_string(result));
+		return ;
+	}
+
+	c->state = MQTT_MUX_CONNECTED;
+	c->prev_delay = 0;
+	STAT_ADD(connacks, 1);
+	log_info("MQTT Mux: %s connected.\n", c->device_id);
+
+	//在回调中订阅只是排队，退出回调后由循环按 want_write 发送
+	snprintf(topic, sizeof(topic), "$oc/devices/%s/sys/commands/#", c->device_id);
+	M.engine->subscribe(c->conn, topic, 1);
+	snprintf(topic, sizeof(topic), "$oc/devices/%s/sys/messages/down", c->device_id);
+	M.engine->subscribe(c->conn, topic, 1);
+}
+
+
+//套接字已被客户端关闭（随之从 epoll 中移除），可能发生在发布线程中
+static void client_lost(mux_client_t *c, int result)
+{
+	if(c->state == MQTT_MUX_IDLE)
+		return ;
+
+	if(c->state == MQTT_MUX_CONNECTED)
+	{
+		STAT_ADD(disconnects, 1);
+		log_warn("MQTT Mux: %s disconnected (%d).\n", c->device_id, result);
+	}
+	else
+	{
+		STAT_ADD(failures, 1);
+	}
+	c->fd = -1;
+	schedule_reconnect(c, now_ms());
+}
+
+
+//下行命令交给网关的命令处理，响应经同一连接发回
+static void client_message(mux_client_t *c, const char *topic, const void *payload, int payloadlen)
+{
+	STAT_ADD(received, 1);
+	log_info("MQTT Mux: %s downlink %s\n", c->device_id, topic);
+	mqtt_gateway_device_message(c->path, topic, payload, payloadlen);
+}
+
+
+/* ----- libmosquitto 引擎 ----- */
+
+static void mosq_on_connect(struct mosquitto *mosq, void *userdata, int result)
+{
+	client_connected(userdata, result);
+}
+
+static void mosq_on_disconnect(struct mosquitto *mosq, void *userdata, int result)
+{
+	client_lost(userdata, result);
+}
+
+static void mosq_on_message(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *msg)
+{
+	client_message(userdata, msg->topic, msg->payload, msg->payloadlen);
+}
+
+static void *mosq_create(mux_client_t *c, const char *client_id, const char *password)
+{
+	struct mosquitto	*mosq;
+
+	mosq = mosquitto_new(client_id, true, c);
+	if(!mosq)
+		return NULL;
+
+	mosquitto_connect_callback_set(mosq, mosq_on_connect);
+	mosquitto_disconnect_callback_set(mosq, mosq_on_disconnect);
+	mosquitto_message_callback_set(mosq, mosq_on_message);
+	mosquitto_max_inflight_messages_set(mosq, M.config.max_inflight);
+	mosquitto_username_pw_set(mosq, c->device_id, password);
+
+	if(M.ssl_ctx)
+	{
+		mosquitto_void_option(mosq, MOSQ_OPT_SSL_CTX, M.ssl_ctx);
+		mosquitto_int_option(mosq, MOSQ_OPT_SSL_CTX_WITH_DEFAULTS, 0);
+	}
+	return mosq;
+}
+
+static void mosq_destroy(void *conn)
+{
+	mosquitto_destroy(conn);
+}
+
+static int mosq_connect(void *conn, const char *host, int port, int keepalive)
+{
+	return mosquitto_connect_async(conn, host, port, keepalive);
+}
+
+static int mosq_socket(void *conn)
+{
+	return mosquitto_socket(conn);
+}
+
+static int mosq_want_write(void *conn)
+{
+	return mosquitto_want_write(conn);
+}
+
+static int mosq_read(void *conn)
+{
+	return mosquitto_loop_read(conn, 1);
+}
+
+static int mosq_write(void *conn)
+{
+	return mosquitto_loop_write(conn, 1);
+}
+
+static int mosq_misc(void *conn)
+{
+	return mosquitto_loop_misc(conn);
+}
+
+static int mosq_subscribe(void *conn, const char *topic, int qos)
+{
+	return mosquitto_subscribe(conn, NULL, topic, qos);
+}
+
+static int mosq_publish(void *conn, const char *topic, const void *payload, int payloadlen, int qos)
+{
+	return mosquitto_publish(conn, NULL, topic, payloadlen, payload, qos, false);
+}
+
+//发出 DISCONNECT（外部循环下需要自己调用一次 write）
+static int mosq_disconnect(void *conn)
+{
+	int		rc = mosquitto_disconnect(conn);
+
+	if(rc == MOSQ_ERR_SUCCESS)
+		mosquitto_loop_write(conn, 1);
+	return rc;
+}
+
+static const mux_engine_t mosq_engine = {
+	"mosquitto", mosq_create, mosq_destroy, mosq_connect, mosq_disconnect, mosq_socket, mosq_want_write,
+	mosq_read, mosq_write, mosq_misc, mosq_publish, mosq_subscribe, mosquitto_strerror,
+};
+
+
+/* ----- mqtt_lite 引擎 ----- */
+
+static void lite_on_connect(mqtt_lite_t *lite, void *userdata, int rc)
+{
+	client_connected(userdata, rc);
+}
+
+static void lite_on_disconnect(mqtt_lite_t *lite, void *userdata, int rc)
+{
+	client_lost(userdata, rc);
+}
+
+static void lite_on_message(mqtt_lite_t *lite, void *userdata, const char *topic, const void *payload, int payloadlen)
+{
+	client_message(userdata, topic, payload, payloadlen);
+}
+
+static const mqtt_lite_callbacks_t lite_callbacks = {
+	lite_on_connect, lite_on_disconnect, lite_on_message, NULL,
+};
+
+static void *lite_create(mux_client_t *c, const char *client_id, const char *password)
+{
+	mqtt_lite_t		*lite;
+
+	lite = mqtt_lite_new(client_id, M.config.max_inflight, &lite_callbacks, c);
+	if(lite && mqtt_lite_set_login(lite, c->device_id, password) != MQTT_LITE_OK)
+	{
+		mqtt_lite_destroy(lite);
+		return NULL;
+	}
+
+	//采样由编码线程发布，只排队并唤醒循环，循环在可写时把积累的报文一次 writev 发出
+	if(lite)
+		mqtt_lite_set_deferred(lite, 1);
+	return lite;
+}
+
+static void lite_destroy(void *conn)
+{
+	mqtt_lite_destroy(conn);
+}
+
+static int lite_connect(void *conn, const char *host, int port, int keepalive)
+{
+	return mqtt_lite_connect(conn, host, port, keepalive);
+}
+
+static int lite_disconnect(void *conn)
+{
+	return mqtt_lite_disconnect(conn);
+}
+
+static int lite_socket(void *conn)
+{
+	return mqtt_lite_socket(conn);
+}
+
+static int lite_want_write(void *conn)
+{
+	return mqtt_lite_want_write(conn);
+}
+
+static int lite_read(void *conn)
+{
+	return mqtt_lite_read(conn);
+}
+
+static int lite_write(void *conn)
+{
+	return mqtt_lite_write(conn);
+}
+
+static int lite_misc(void *conn)
+{
+	return mqtt_lite_misc(conn);
+}
+
+static int lite_subscribe(void *conn, const char *topic, int qos)
+{
+	return mqtt_lite_subscribe(conn, topic, qos);
+}
+
+//在途表已满与网关的发送窗口满同样处理，命令响应会稍后重试
+static int lite_publish(void *conn, const char *topic, const void *payload, int payloadlen, int qos)
+{
+	int		rc = mqtt_lite_publish(conn, NULL, topic, payloadlen, payload, qos);
+
+	return rc == MQTT_LITE_ERR_WINDOW_FULL ? MQTT_PUBLISH_WINDOW_FULL : rc;
+}
+
+static const mux_engine_t lite_engine = {
+	"lite", lite_create, lite_destroy, lite_connect, lite_disconnect, lite_socket, lite_want_write,
+	lite_read, lite_write, lite_misc, lite_publish, lite_subscribe, mqtt_lite_strerror,
+};
+
+
+/* ----- 初始化 ----- */
+
+int mqtt_mux_init(const mqtt_mux_config_t *config, const char *host, int port, const char *ca_cert)
+{
+	struct epoll_event	ev;
+
+	M.config = *config;
+	if(!M.config.enabled)
+		return 0;
+
+	if(M.config.connect_stagger_ms < 0)
+		M.config.connect_stagger_ms = 0;
+	if(M.config.keepalive <= 0)
+		M.config.keepalive = 60;
+	if(M.config.max_inflight <= 0)
+		M.config.max_inflight = 4;
+	if(M.config.reconnect_base_ms <= 0)
+		M.config.reconnect_base_ms = 1000;
+	if(M.config.reconnect_max_ms < M.config.reconnect_base_ms)
+		M.config.reconnect_max_ms = M.config.reconnect_base_ms;
+
+	snprintf(M.host, sizeof(M.host), "%s", host);
+	M.port = port;
+	M.addr[0] = '\0';
+	M.seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+	memset(&M.stats, 0, sizeof(M.stats));
+	M.stats.client_bytes = sizeof(mux_client_t);
+
+	M.epfd = epoll_create1(EPOLL_CLOEXEC);
+	M.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(M.epfd < 0 || M.wakefd < 0)
+	{
+		log_error("MQTT Mux: Failed to create epoll/eventfd.\n");
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = MUX_WAKE_ID;
+	epoll_ctl(M.epfd, EPOLL_CTL_ADD, M.wakefd, &ev);
+
+	if(ca_cert && !(M.ssl_ctx = create_ssl_ctx(ca_cert, host)))
+	{
+		log_error("MQTT Mux: Failed to create shared TLS context.\n");
+		return -1;
+	}
+
+	//mqtt_lite 只支持明文 TCP
+	M.engine = &mosq_engine;
+	if(M.config.engine == MQTT_MUX_ENGINE_LITE)
+	{
+		if(M.ssl_ctx)
+			log_warn("MQTT Mux: Engine 'lite' does not support TLS, using libmosquitto.\n");
+		else
+			M.engine = &lite_engine;
+	}
+
+	log_info("MQTT Mux: Direct mode, one %s connection per device to %s:%d%s, connect stagger %d ms.\n",
+			M.engine->name, M.host, M.port, M.ssl_ctx ? " (TLS, shared context)" : "", M.config.connect_stagger_ms);
+	return 0;
+}
+
+
+/* ----- 设备 ----- */
+
+int mqtt_mux_add(const char *device_path, const char *device_id, const char *client_id, const char *password)
+{
+	pthread_mutexattr_t	attr;
+	mux_client_t		*c;
+
+	if(!M.config.enabled || M.count == MQTT_MUX_MAX)
+		return -1;
+
+	c = calloc(1, sizeof(*c));
+	if(!c)
+		return -1;
+
+	c->path = strdup(device_path);
+	c->device_id = strdup(device_id);
+	if(c->path && c->device_id)
+		c->conn = M.engine->create(c, client_id ? client_id : device_id, password);
+	if(!c->conn)
+	{
+		log_error("MQTT Mux: Failed to allocate client for %s\n", device_id);
+		free(c->path);
+		free(c->device_id);
+		free(c);
+		return -1;
+	}
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&c->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	c->fd = -1;
+	c->index = (uint16_t)M.count;
+	c->state = MQTT_MUX_IDLE;
+	c->connect_at_ms = 0;
+
+	M.clients[M.count++] = c;
+	pthread_mutex_lock(&M.lock);
+	M.stats.clients = M.count;
+	pthread_mutex_unlock(&M.lock);
+	log_info("MQTT Mux: Device %s -> %s\n", device_id, device_path);
+	return c->index;
+}
+
+
+int mqtt_mux_count(void)
+{
+	return M.count;
+}
+
+
+//设备路径及其下的特征值路径都能匹配（设备表在启动后不再变化）
+int mqtt_mux_find_path(const char *path)
+{
+	size_t	len;
+	int		i;
+
+	for(i = 0; path && i < M.count; i++)
+	{
+		len = strlen(M.clients[i]->path);
+		if(strncmp(path, M.clients[i]->path, len) == 0 && (path[len] == '\0' || path[len] == '/'))
+			return i;
+	}
+	return -1;
+}
+
+
+const char *mqtt_mux_device_id(int index)
+{
+	return index >= 0 && index < M.count ? M.clients[index]->device_id : NULL;
+}
+
+
+/* ----- 连接管理（mux 线程） ----- */
+
+/* 去相关抖动：第一次重连在 [0, base] 内随机，之后 min(max, random(base, prev * 3))
+ * 代理重启时几百个连接同时断开，随机化把重连分散开
+ */
+static void schedule_reconnect(mux_client_t *c, uint64_t now)
+{
+	uint64_t	upper;
+	uint32_t	delay;
+
+	if(c->prev_delay == 0)
+	{
+		delay = rand_between(0, M.config.reconnect_base_ms);
+	}
+	else
+	{
+		upper = (uint64_t)c->prev_delay * 3;
+		if(upper > (uint64_t)M.config.reconnect_max_ms)
+			upper = M.config.reconnect_max_ms;
+		delay = rand_between(M.config.reconnect_base_ms, (uint32_t)upper);
+	}
+
+	c->prev_delay = delay < (uint32_t)M.config.reconnect_base_ms ? (uint32_t)M.config.reconnect_base_ms : delay;
+	c->state = MQTT_MUX_IDLE;
+	c->want_write = 0;
+	c->connect_at_ms = now + delay;
+}
+
+
+//按客户端当前的套接字和待发数据更新 epoll（调用时持有客户端锁）
+static void sync_events(mux_client_t *c)
+{
+	struct epoll_event	ev;
+	int					fd = M.engine->socket(c->conn);
+	int					want = fd >= 0 && M.engine->want_write(c->conn);
+
+	c->dirty = 0;
+	if(fd < 0)
+	{
+		c->fd = -1;
+		return ;
+	}
+
+	if(fd == c->fd && want == c->want_write)
+		return ;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+	ev.data.u32 = c->index;
+
+	//套接字关闭时已自动从 epoll 中移除，新套接字（即使复用了同一个描述符号）总是重新加入
+	if(epoll_ctl(M.epfd, fd == c->fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0)
+	{
+		log_error("MQTT Mux: %s epoll_ctl failed on fd %d.\n", c->device_id, fd);
+		return ;
+	}
+	c->fd = fd;
+	c->want_write = want;
+}
+
+
+//连接出错：关闭仍然打开的套接字，进入退避（调用时持有客户端锁）
+static void drop_client(mux_client_t *c, int rc, const char *reason, uint64_t now)
+{
+	int		fd = M.engine->socket(c->conn);
+	int		state = c->state;
+
+	//先置为 IDLE，disconnect 触发的断开回调直接返回；libmosquitto 的套接字在下次发起连接时关闭
+	c->state = MQTT_MUX_IDLE;
+	if(fd >= 0)
+	{
+		epoll_ctl(M.epfd, EPOLL_CTL_DEL, fd, NULL);
+		M.engine->disconnect(c->conn);
+	}
+	c->fd = -1;
+
+	//断开回调已经处理过
+	if(state == MQTT_MUX_IDLE)
+		return ;
+
+	if(state == MQTT_MUX_CONNECTED)
+		STAT_ADD(disconnects, 1);
+	else
+		STAT_ADD(failures, 1);
+
+	log_warn("MQTT Mux: %s %s: %s\n", c->device_id, reason, M.engine->strerror(rc));
+	schedule_reconnect(c, now);
+}
+
+
+//不使用 TLS 时解析一次代理地址供所有连接使用，避免几百次 DNS 查询；TLS 下按主机名连接
+static void resolve_broker(uint64_t now)
+{
+	struct addrinfo	hints;
+	struct addrinfo	*res = NULL;
+	char			port[8];
+	void			*sa;
+
+	if(M.ssl_ctx || (M.addr[0] && now - M.resolved_ms < MUX_RESOLVE_TTL_MS))
+		return ;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port, sizeof(port), "%d", M.port);
+
+	M.resolved_ms = now;
+	if(getaddrinfo(M.host, port, &hints, &res) != 0 || !res)
+	{
+		log_warn("MQTT Mux: Failed to resolve %s, %s.\n", M.host, M.addr[0] ? "keeping cached address" : "using hostname");
+		return ;
+	}
+
+	if(res->ai_family == AF_INET6)
+		sa = &((struct sockaddr_in6 *)res->ai_addr)->sin6_addr;
+	else
+		sa = &((struct sockaddr_in *)res->ai_addr)->sin_addr;
+	inet_ntop(res->ai_family, sa, M.addr, sizeof(M.addr));
+	freeaddrinfo(res);
+}
+
+
+static void start_connect(mux_client_t *c, uint64_t now)
+{
+	int		rc;
+
+	pthread_mutex_lock(&c->lock);
+	rc = M.engine->connect(c->conn, M.addr[0] ? M.addr : M.host, M.port, M.config.keepalive);
+	STAT_ADD(connects, 1);
+	c->state = MQTT_MUX_CONNECTING;
+	c->connect_at_ms = now;
+	if(rc != MOSQ_ERR_SUCCESS)
+		drop_client(c, rc, "connect failed", now);
+	else
+		sync_events(c);
+	pthread_mutex_unlock(&c->lock);
+}
+
+
+/* 每 connect_stagger_ms 最多发起一个连接，从上次的位置继续查找，保证公平
+ * 返回下一次需要检查的时间
+ */
+static uint64_t connect_due(uint64_t now)
+{
+	mux_client_t	*c;
+	uint64_t		next = UINT64_MAX;
+	int				i, n;
+
+	if(now < M.next_connect_ms)
+		return M.next_connect_ms;
+
+	for(n = 0; n < M.count; n++)
+	{
+		i = (M.cursor + n) % M.count;
+		c = M.clients[i];
+		if(c->state != MQTT_MUX_IDLE)
+			continue;
+
+		if(c->connect_at_ms > now)
+		{
+			if(c->connect_at_ms < next)
+				next = c->connect_at_ms;
+			continue;
+		}
+
+		resolve_broker(now);
+		start_connect(c, now);
+		M.cursor = (i + 1) % M.count;
+		M.next_connect_ms = now + M.config.connect_stagger_ms;
+		return M.next_connect_ms;
+	}
+
+	//没有到期的连接：最迟一秒后再查找（其他线程中断开的连接不会提前唤醒循环）
+	if(next > now + MUX_MISC_INTERVAL_MS)
+		next = now + MUX_MISC_INTERVAL_MS;
+	M.next_connect_ms = next;
+	return next;
+}
+
+
+//心跳、PUBACK 重发和连接超时，每秒一次
+static void run_misc(uint64_t now)
+{
+	mux_client_t	*c;
+	int				rc;
+	int				i;
+
+	for(i = 0; i < M.count; i++)
+	{
+		c = M.clients[i];
+		pthread_mutex_lock(&c->lock);
+		if(c->state == MQTT_MUX_CONNECTING && now - c->connect_at_ms >= MUX_CONNECT_TIMEOUT_MS)
+		{
+			drop_client(c, MOSQ_ERR_CONN_LOST, "connect timeout", now);
+		}
+		else if(c->state != MQTT_MUX_IDLE)
+		{
+			rc = M.engine->misc(c->conn);
+			if(rc != MOSQ_ERR_SUCCESS)
+				drop_client(c, rc, "keepalive failed", now);
+			else
+				sync_events(c);
+		}
+		pthread_mutex_unlock(&c->lock);
+	}
+}
+
+
+static void handle_event(mux_client_t *c, uint32_t events, uint64_t now)
+{
+	int		rc = MOSQ_ERR_SUCCESS;
+
+	pthread_mutex_lock(&c->lock);
+
+	//事件属于已经关闭的旧套接字
+	if(c->fd < 0 || c->state == MQTT_MUX_IDLE)
+	{
+		pthread_mutex_unlock(&c->lock);
+		return ;
+	}
+
+	if(events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+		rc = M.engine->read(c->conn);
+	if(rc == MOSQ_ERR_SUCCESS && (events & EPOLLOUT))
+		rc = M.engine->write(c->conn);
+
+	if(rc != MOSQ_ERR_SUCCESS)
+		drop_client(c, rc, c->state == MQTT_MUX_CONNECTED ? "connection lost" : "connect failed", now);
+	else
+		sync_events(c);
+
+	pthread_mutex_unlock(&c->lock);
+}
+
+
+//其他线程发布后客户端有没写完的数据
+static void handle_wakeup(void)
+{
+	uint64_t		val;
+	mux_client_t	*c;
+	int				i;
+
+	if(read(M.wakefd, &val, sizeof(val)) < 0)
+		return ;
+
+	for(i = 0; i < M.count; i++)
+	{
+		c = M.clients[i];
+		if(!c->dirty)
+			continue;
+
+		pthread_mutex_lock(&c->lock);
+		if(c->state != MQTT_MUX_IDLE)
+			sync_events(c);
+		pthread_mutex_unlock(&c->lock);
+	}
+}
+
+
+void *mqtt_mux_thread_func(void *arg)
+{
+	struct epoll_event	events[MUX_EVENTS_MAX];
+	uint64_t			now;
+	uint64_t			next_misc = 0;
+	uint64_t			next_connect;
+	uint64_t			wake;
+	int					timeout;
+	int					n, i;
+
+	log_info("MQTT Mux: Event loop started for %d device connection(s).\n", M.count);
+
+	while(keep_running)
+	{
+		now = now_ms();
+		next_connect = connect_due(now);
+
+		if(now >= next_misc)
+		{
+			run_misc(now);
+			next_misc = now + MUX_MISC_INTERVAL_MS;
+		}
+
+		wake = next_connect < next_misc ? next_connect : next_misc;
+		timeout = wake > now ? (int)(wake - now) : 0;
+
+		n = epoll_wait(M.epfd, events, MUX_EVENTS_MAX, timeout);
+		if(n < 0)
+			continue;
+
+		now = now_ms();
+		pthread_mutex_lock(&M.lock);
+		M.stats.wakeups++;
+		M.stats.events += n;
+		pthread_mutex_unlock(&M.lock);
+
+		for(i = 0; i < n; i++)
+		{
+			if(events[i].data.u32 == MUX_WAKE_ID)
+				handle_wakeup();
+			else if(events[i].data.u32 < (uint32_t)M.count)
+				handle_event(M.clients[events[i].data.u32], events[i].events, now);
+		}
+	}
+
+	log_info("MQTT Mux: Event loop exited.\n");
+	return NULL;
+}
+
+
+void mqtt_mux_cleanup(void)
+{
+	mux_client_t	*c;
+	int				i;
+
+	for(i = 0; i < M.count; i++)
+	{
+		c = M.clients[i];
+		if(c->state == MQTT_MUX_CONNECTED)
+			M.engine->disconnect(c->conn);
+		M.engine->destroy(c->conn);
+		pthread_mutex_destroy(&c->lock);
+		free(c->path);
+		free(c->device_id);
+		free(c);
+		M.clients[i] = NULL;
+	}
+	M.count = 0;
+
+	//各 libmosquitto 客户端持有的引用随 destroy 释放
+	if(M.ssl_ctx)
+		SSL_CTX_free(M.ssl_ctx);
+	M.ssl_ctx = NULL;
+	if(M.wakefd >= 0)
+		close(M.wakefd);
+	if(M.epfd >= 0)
+		close(M.epfd);
+	M.wakefd = M.epfd = -1;
+}
+
+
+/* ----- 发布（任意线程） ----- */
+
+//设备未连接时返回 MOSQ_ERR_NO_CONN，由调用者决定暂存或丢弃
+int mqtt_mux_publish(int index, const char *topic, const void *payload, int payloadlen, int qos)
+{
+	mux_client_t	*c;
+	uint64_t		one = 1;
+	int				wake = 0;
+	int				rc;
+
+	if(index < 0 || index >= M.count)
+		return MOSQ_ERR_INVAL;
+
+	c = M.clients[index];
+	pthread_mutex_lock(&c->lock);
+	if(c->state != MQTT_MUX_CONNECTED)
+	{
+		rc = MOSQ_ERR_NO_CONN;
+	}
+	else
+	{
+		rc = M.engine->publish(c->conn, topic, payload, payloadlen, qos);
+		if(rc == MOSQ_ERR_SUCCESS && !c->want_write && M.engine->want_write(c->conn))
+		{
+			c->dirty = 1;
+			wake = 1;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	if(wake && write(M.wakefd, &one, sizeof(one)) < 0)
+		log_debug("MQTT Mux: Failed to wake event loop.\n");
+
+	if(rc == MOSQ_ERR_SUCCESS)
+		STAT_ADD(published, 1);
+	else
+		STAT_ADD(publish_failed, 1);
+	return rc;
+}
+
+
+/* 直连设备的 spool 记录：device_id、'\0'、带 event_time 的属性 JSON
+ * 回放时按 device_id 而不是序号找回设备，重启后配置顺序变化也不会发给别的设备
+ */
+static int spool_report(int index, const telemetry_record_t *rec)
+{
+	char	buf[SPOOL_MAX_PAYLOAD];
+	int		id_len = (int)strlen(M.clients[index]->device_id) + 1;
+	int		len;
+
+	if(!spool_is_open() || id_len >= (int)sizeof(buf))
+		return -1;
+
+	memcpy(buf, M.clients[index]->device_id, id_len);
+	len = telemetry_serialize_json(rec, 1, buf + id_len, sizeof(buf) - id_len);
+	if(len < 0 || spool_append(SPOOL_CHANNEL_DIRECT, rec->timestamp, buf, id_len + len) != SPOOL_OK)
+		return -1;
+
+	STAT_ADD(spooled, 1);
+	return 0;
+}
+
+
+/* 设备以自己的身份上报属性：$oc/devices/{device_id}/sys/properties/report
+ * 未连接或在途窗口已满时采样写入 spool，设备重连后由下行线程回放（mqtt_mux_replay）
+ */
+int mqtt_mux_report(int index, const telemetry_record_t *rec)
+{
+	char	topic[256];
+	char	payload[512];
+	int		len;
+	int		rc;
+
+	if(index < 0 || index >= M.count)
+		return MOSQ_ERR_INVAL;
+
+	len = telemetry_serialize_json(rec, 0, payload, sizeof(payload));
+	if(len < 0)
+	{
+		STAT_ADD(publish_failed, 1);
+		return MOSQ_ERR_PAYLOAD_SIZE;
+	}
+
+	snprintf(topic, sizeof(topic), "$oc/devices/%s/sys/properties/report", M.clients[index]->device_id);
+	rc = mqtt_mux_publish(index, topic, payload, len, 1);
+	if(rc != MOSQ_ERR_SUCCESS)
+		log_debug("MQTT Mux: %s report %s: %s\n", M.clients[index]->device_id,
+				spool_report(index, rec) == 0 ? "spooled" : "dropped",
+				rc == MQTT_PUBLISH_WINDOW_FULL ? "window full" : M.engine->strerror(rc));
+	return rc;
+}
+
+
+/* 回放一条 SPOOL_CHANNEL_DIRECT 记录（下行线程调用）
+ * 返回 0：已发布，或记录无效、设备已不在配置中而丢弃；1：设备未连接；-1：发布失败（在途窗口已满等），稍后重试
+ */
+int mqtt_mux_replay(const void *record, int len)
+{
+	const char		*id = record;
+	const char		*end = memchr(record, '\0', len);
+	mux_client_t	*c = NULL;
+	char			topic[256];
+	int				i;
+
+	for(i = 0; end && i < M.count; i++)
+	{
+		if(strcmp(M.clients[i]->device_id, id) == 0)
+		{
+			c = M.clients[i];
+			break;
+		}
+	}
+	if(!c)
+	{
+		log_warn("MQTT Mux: Spooled report for unknown device skipped.\n");
+		return 0;
+	}
+
+	//未连接时不尝试发布，不计入 publish_failed
+	if(c->state != MQTT_MUX_CONNECTED)
+		return 1;
+
+	snprintf(topic, sizeof(topic), "$oc/devices/%s/sys/properties/report", c->device_id);
+	if(mqtt_mux_publish(c->index, topic, end + 1, len - (int)(end + 1 - id), 1) != MOSQ_ERR_SUCCESS)
+		return -1;
+
+	STAT_ADD(replayed, 1);
+	return 0;
+}
+
+
+//累计连接成功次数，下行线程据此判断是否有设备重连，需要重新检查 spool 中暂停回放的记录
+uint64_t mqtt_mux_reconnects(void)
+{
+	uint64_t	n;
+
+	pthread_mutex_lock(&M.lock);
+	n = M.stats.connacks;
+	pthread_mutex_unlock(&M.lock);
+	return n;
+}
+
+
+/* ----- 统计 ----- */
+
+void mqtt_mux_get_stats(mqtt_mux_stats_t *stats)
+{
+	int		i;
+
+	pthread_mutex_lock(&M.lock);
+	*stats = M.stats;
+	pthread_mutex_unlock(&M.lock);
+
+	stats->connected = 0;
+	stats->connecting = 0;
+	for(i = 0; i < M.count; i++)
+	{
+		if(M.clients[i]->state == MQTT_MUX_CONNECTED)
+			stats->connected++;
+		else if(M.clients[i]->state == MQTT_MUX_CONNECTING)
+			stats->connecting++;
+	}
+}
+
+
+void mqtt_mux_log_stats(void)
+{
+	mqtt_mux_stats_t	st;
+
+	if(!M.count)
+		return ;
+
+	mqtt_mux_get_stats(&st);
+	log_info("MQTT Mux: clients=%u connected=%u connecting=%u connects=%llu connacks=%llu failures=%llu disconnects=%llu published=%llu publish_failed=%llu spooled=%llu replayed=%llu received=%llu wakeups=%llu events=%llu client_bytes=%u\n",
+			st.clients, st.connected, st.connecting,
+			(unsigned long long)st.connects, (unsigned long long)st.connacks,
+			(unsigned long long)st.failures, (unsigned long long)st.disconnects,
+			(unsigned long long)st.published, (unsigned long long)st.publish_failed,
+			(unsigned long long)st.spooled, (unsigned long long)st.replayed,
+			(unsigned long long)st.received, (unsigned long long)st.wakeups,
+			(unsigned long long)st.events, st.client_bytes);
+}
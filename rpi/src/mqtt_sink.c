@@ -0,0 +1,634 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  mqtt_sink.c
+ *    Description:  This file implements MQTT fan-out to multiple brokers.
+ *
+ *                  负载只编码一次：发往多个汇点时复制到一个带引用计数的共享缓冲区，
+ *                  各汇点的发送队列只保存指针。附加汇点的网络收发由 libmosquitto 的
+ *                  线程完成（mosquitto_loop_start），本文件的汇点线程负责出队发布、
+ *                  统计 PUBACK 时延以及 endpoint 切换。
+ *
+ *        Version:  1.0.0(2025年08月29日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月29日 09时41分13秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <mosquitto.h>
+
+#include "mqtt_sink.h"
+#include "mqtt_gateway.h"
+#include "publish_lane.h"
+#include "log.h"
+
+
+#define SINK_INFLIGHT_MAX		64
+#define SINK_EARLY_ACKS			8
+#define SINK_EARLY_ACK_TTL_MS	2000    // 提前到达的 PUBACK 只在 publish 返回前有意义
+#define SINK_MIN_DWELL_MS		30000   // 切换 endpoint 后至少停留的时间，防止来回切换
+
+//共享负载：主题和负载放在同一块内存中，最后一个引用释放时回收
+typedef struct {
+	int		refs;
+	int		len;
+	char	*payload;
+	char	topic[];
+} sink_buf_t;
+
+typedef struct {
+	sink_buf_t	*buf;
+	int			qos;
+} sink_msg_t;
+
+typedef struct {
+	const mqtt_sink_config_t	*cfg;
+	struct mosquitto			*mosq;
+	volatile int				connected;
+	int							endpoint;
+	uint64_t					state_since_ms;   //最近一次连上或断开的时刻
+	uint64_t					switched_ms;
+	uint32_t					ewma_ms[MQTT_SINK_ENDPOINT_MAX];
+
+	sink_msg_t					*queue;
+	int							queue_size;
+	int							head;
+	int							count;
+
+	struct {
+		int			mid;
+		uint64_t	sent_ms;
+	}							inflight[SINK_INFLIGHT_MAX];
+	int							inflight_count;
+	struct {
+		int			mid;
+		uint64_t	ack_ms;
+	}							early_acks[SINK_EARLY_ACKS];
+	int							early_next;
+
+	mqtt_sink_stats_t			stats;
+	pthread_mutex_t				lock;
+} sink_t;
+
+
+static struct {
+	sink_t			sinks[MQTT_SINK_MAX];
+	int				count;
+	uint32_t		route_masks[MQTT_SINK_ROUTE_MAX];  //bit 0 为 primary，bit i+1 为 sinks[i]
+	const mqtt_sinks_config_t *cfg;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+} S = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+
+static uint64_t now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static void buf_release(sink_buf_t *buf)
+{
+	if(__sync_sub_and_fetch(&buf->refs, 1) == 0)
+		free(buf);
+}
+
+
+//清空在途表和提前到达的确认（切换 endpoint 后旧连接的 mid 不再有意义），调用者持有 s->lock
+static void clear_inflight(sink_t *s)
+{
+	int		i;
+
+	s->inflight_count = 0;
+	for(i = 0; i < SINK_EARLY_ACKS; i++)
+		s->early_acks[i].mid = -1;
+}
+
+
+/* ----- libmosquitto 回调（在各汇点的网络线程中执行）----- */
+
+static void sink_on_connect(struct mosquitto *mosq, void *userdata, int result)
+{
+	sink_t	*s = (sink_t *)userdata;
+
+	s->connected = (result == 0);
+	s->state_since_ms = now_ms();
+	if(result == 0)
+		log_info("Sink[%s]: Connected to %s:%d.\n", s->cfg->name,
+				s->cfg->endpoints[s->endpoint].host, s->cfg->endpoints[s->endpoint].port);
+	else
+		log_error("Sink[%s]: Connection refused: %s\n", s->cfg->name, mosquitto_connack_string(result));
+
+	pthread_cond_signal(&S.cond);
+}
+
+
+static void sink_on_disconnect(struct mosquitto *mosq, void *userdata, int result)
+{
+	sink_t	*s = (sink_t *)userdata;
+
+	if(s->connected)
+		log_warn("Sink[%s]: Disconnected, return code: %d\n", s->cfg->name, result);
+	s->connected = 0;
+	s->state_since_ms = now_ms();
+}
+
+
+//PUBACK：计算时延，更新当前 endpoint 的时延平均值 (EWMA, 1/8)
+static void sink_on_publish(struct mosquitto *mosq, void *userdata, int mid)
+{
+	sink_t		*s = (sink_t *)userdata;
+	uint32_t	latency;
+	uint32_t	*ewma;
+	int			i;
+
+	pthread_mutex_lock(&s->lock);
+	for(i = 0; i < s->inflight_count; i++)
+	{
+		if(s->inflight[i].mid == mid)
+			break;
+	}
+
+	if(i == s->inflight_count)
+	{
+		//发布线程尚未登记该 mid
+		s->early_acks[s->early_next].mid = mid;
+		s->early_acks[s->early_next].ack_ms = now_ms();
+		s->early_next = (s->early_next + 1) % SINK_EARLY_ACKS;
+		pthread_mutex_unlock(&s->lock);
+		return ;
+	}
+
+	latency = (uint32_t)(now_ms() - s->inflight[i].sent_ms);
+	s->inflight[i] = s->inflight[--s->inflight_count];
+
+	ewma = &s->ewma_ms[s->endpoint];
+	*ewma = *ewma ? (*ewma * 7 + latency) / 8 : latency;
+	s->stats.acked++;
+	s->stats.latency_ewma_ms = *ewma;
+	if(latency > s->stats.latency_max_ms)
+		s->stats.latency_max_ms = latency;
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_cond_signal(&S.cond);
+}
+
+
+/* ----- 初始化 ----- */
+
+static int sink_connect(sink_t *s)
+{
+	const mqtt_endpoint_t	*ep = &s->cfg->endpoints[s->endpoint];
+	int						rc;
+
+	s->state_since_ms = now_ms();
+
+	//连接失败时 libmosquitto 的网络线程会按 reconnect_delay 自动重试
+	rc = mosquitto_connect_async(s->mosq, ep->host, ep->port, s->cfg->keepalive > 0 ? s->cfg->keepalive : 60);
+	if(rc != MOSQ_ERR_SUCCESS)
+		log_warn("Sink[%s]: Connect to %s:%d failed: %s, will retry.\n", s->cfg->name, ep->host, ep->port, mosquitto_strerror(rc));
+
+	return mosquitto_loop_start(s->mosq);
+}
+
+
+static int sink_index(const char *name)
+{
+	int		i;
+
+	if(strcmp(name, MQTT_SINK_PRIMARY_NAME) == 0)
+		return 0;
+
+	for(i = 0; i < S.count; i++)
+	{
+		if(strcmp(S.sinks[i].cfg->name, name) == 0)
+			return i + 1;
+	}
+	return -1;
+}
+
+
+int mqtt_sink_init(const mqtt_sinks_config_t *config)
+{
+	const mqtt_route_config_t	*route;
+	sink_t						*s;
+	int							rv = 0;
+	int							i, j, idx;
+
+	S.cfg = config;
+	S.count = 0;
+
+	for(i = 0; i < config->sink_count && i < MQTT_SINK_MAX; i++)
+	{
+		s = &S.sinks[S.count];
+		memset(s, 0, sizeof(*s));
+		s->cfg = &config->sinks[i];
+		if(!s->cfg->name || !s->cfg->endpoint_count)
+			continue;
+
+		pthread_mutex_init(&s->lock, NULL);
+		clear_inflight(s);
+
+		s->queue_size = s->cfg->queue_size > 0 ? s->cfg->queue_size : 256;
+		s->queue = calloc(s->queue_size, sizeof(sink_msg_t));
+		s->mosq = mosquitto_new(s->cfg->client_id, true, s);
+		if(!s->queue || !s->mosq)
+		{
+			log_error("Sink[%s]: Failed to allocate client.\n", s->cfg->name);
+			free(s->queue);
+			if(s->mosq)
+				mosquitto_destroy(s->mosq);
+			rv = -1;
+			continue;
+		}
+
+		mosquitto_connect_callback_set(s->mosq, sink_on_connect);
+		mosquitto_disconnect_callback_set(s->mosq, sink_on_disconnect);
+		mosquitto_publish_callback_set(s->mosq, sink_on_publish);
+		mosquitto_max_inflight_messages_set(s->mosq, s->cfg->max_inflight);
+		mosquitto_reconnect_delay_set(s->mosq, 1, 30, true);
+
+		if(s->cfg->username)
+			mosquitto_username_pw_set(s->mosq, s->cfg->username, s->cfg->password);
+		if(s->cfg->ca_cert && mosquitto_tls_set(s->mosq, s->cfg->ca_cert, NULL, NULL, NULL, NULL) != MOSQ_ERR_SUCCESS)
+		{
+			log_error("Sink[%s]: Failed to set TLS options.\n", s->cfg->name);
+			rv = -1;
+		}
+
+		S.count++;
+	}
+
+	//路由规则：汇点名转为位图
+	for(i = 0; i < config->route_count && i < MQTT_SINK_ROUTE_MAX; i++)
+	{
+		route = &config->routes[i];
+		S.route_masks[i] = 0;
+		for(j = 0; j < route->sink_count; j++)
+		{
+			idx = sink_index(route->sinks[j]);
+			if(idx < 0)
+			{
+				log_error("Sink: Route %s refers to unknown sink '%s'.\n", route->topic, route->sinks[j]);
+				rv = -1;
+				continue;
+			}
+			S.route_masks[i] |= 1u << idx;
+		}
+	}
+
+	for(i = 0; i < S.count; i++)
+	{
+		if(sink_connect(&S.sinks[i]) != MOSQ_ERR_SUCCESS)
+		{
+			log_error("Sink[%s]: Failed to start network thread.\n", S.sinks[i].cfg->name);
+			rv = -1;
+		}
+	}
+
+	if(S.count)
+		log_info("Sink: %d additional broker(s), %d route(s).\n", S.count, config->route_count);
+	return rv;
+}
+
+
+void mqtt_sink_cleanup(void)
+{
+	sink_t	*s;
+	int		i;
+
+	for(i = 0; i < S.count; i++)
+	{
+		s = &S.sinks[i];
+		mosquitto_disconnect(s->mosq);
+		mosquitto_loop_stop(s->mosq, true);
+		mosquitto_destroy(s->mosq);
+
+		while(s->count > 0)
+		{
+			buf_release(s->queue[s->head].buf);
+			s->head = (s->head + 1) % s->queue_size;
+			s->count--;
+		}
+		free(s->queue);
+	}
+	S.count = 0;
+}
+
+
+int mqtt_sink_count(void)
+{
+	return S.count;
+}
+
+
+/* ----- 发布 ----- */
+
+//按路由规则计算目标汇点；没有规则匹配时只发往 primary
+static uint32_t route_mask(const char *topic)
+{
+	uint32_t	mask = 0;
+	bool		match;
+	int			i;
+
+	if(!S.cfg || !S.cfg->route_count)
+		return 1;
+
+	for(i = 0; i < S.cfg->route_count && i < MQTT_SINK_ROUTE_MAX; i++)
+	{
+		if(mosquitto_topic_matches_sub(S.cfg->routes[i].topic, topic, &match) == MOSQ_ERR_SUCCESS && match)
+			mask |= S.route_masks[i];
+	}
+
+	return mask ? mask : 1;
+}
+
+
+static void sink_enqueue(sink_t *s, sink_buf_t *buf, int qos)
+{
+	sink_msg_t	*msg;
+
+	pthread_mutex_lock(&s->lock);
+	if(s->count == s->queue_size)
+	{
+		//队列已满：丢弃最旧的消息
+		buf_release(s->queue[s->head].buf);
+		s->head = (s->head + 1) % s->queue_size;
+		s->count--;
+		s->stats.dropped++;
+	}
+
+	msg = &s->queue[(s->head + s->count) % s->queue_size];
+	msg->buf = buf;
+	msg->qos = qos;
+	s->count++;
+	s->stats.queued++;
+	pthread_mutex_unlock(&s->lock);
+}
+
+
+/* 按路由发布一条消息
+ * primary 在目标中时返回放入 primary 发送队列的结果（调用者据此决定是否写入 spool），否则返回成功
+ */
+int mqtt_sink_publish(const char *topic, const void *payload, int payloadlen, int qos, int traffic_class)
+{
+	uint32_t	mask = route_mask(topic);
+	sink_buf_t	*buf;
+	size_t		topic_len;
+	int			rc = MOSQ_ERR_SUCCESS;
+	int			i;
+
+	if(mask & 1)
+		rc = mqtt_connected_flag ? publish_lane_submit(traffic_class, topic, payload, payloadlen, qos) : MOSQ_ERR_NO_CONN;
+
+	if(!(mask >> 1) || !S.count)
+		return rc;
+
+	//附加汇点共享同一份负载
+	topic_len = strlen(topic);
+	buf = malloc(sizeof(*buf) + topic_len + 1 + payloadlen);
+	if(!buf)
+		return rc;
+	buf->refs = 1;
+	buf->len = payloadlen;
+	memcpy(buf->topic, topic, topic_len + 1);
+	buf->payload = buf->topic + topic_len + 1;
+	memcpy(buf->payload, payload, payloadlen);
+
+	for(i = 0; i < S.count; i++)
+	{
+		if(mask & (1u << (i + 1)))
+		{
+			__sync_add_and_fetch(&buf->refs, 1);
+			sink_enqueue(&S.sinks[i], buf, qos);
+		}
+	}
+	buf_release(buf);
+
+	pthread_cond_signal(&S.cond);
+	return rc;
+}
+
+
+/* 发布失败时把消息放回队首
+ * 发布期间 sink_enqueue 可能已把队列填满，此时按队列满的策略丢弃这条最旧的消息
+ */
+static void requeue_head(sink_t *s, sink_msg_t *msg)
+{
+	pthread_mutex_lock(&s->lock);
+	if(s->count < s->queue_size)
+	{
+		s->head = (s->head + s->queue_size - 1) % s->queue_size;
+		s->queue[s->head] = *msg;
+		s->count++;
+		msg->buf = NULL;
+	}
+	else
+	{
+		s->stats.dropped++;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	if(msg->buf)
+		buf_release(msg->buf);
+}
+
+
+/* 出队发布，在途数量达到上限时停止
+ * 消息在持锁时出队，发布期间 sink_enqueue 的丢弃最旧不会再碰到这条消息
+ */
+static void sink_drain(sink_t *s)
+{
+	sink_msg_t	msg;
+	uint64_t	sent_ms;
+	int			mid;
+	int			rc;
+	int			i;
+
+	while(s->connected)
+	{
+		pthread_mutex_lock(&s->lock);
+		if(!s->count || s->inflight_count >= SINK_INFLIGHT_MAX ||
+		   (s->cfg->max_inflight > 0 && s->inflight_count >= s->cfg->max_inflight))
+		{
+			pthread_mutex_unlock(&s->lock);
+			return ;
+		}
+		msg = s->queue[s->head];
+		s->head = (s->head + 1) % s->queue_size;
+		s->count--;
+		pthread_mutex_unlock(&s->lock);
+
+		sent_ms = now_ms();
+		rc = mosquitto_publish(s->mosq, &mid, msg.buf->topic, msg.buf->len, msg.buf->payload, msg.qos, false);
+		if(rc != MOSQ_ERR_SUCCESS)
+		{
+			log_debug("Sink[%s]: Publish deferred: %s\n", s->cfg->name, mosquitto_strerror(rc));
+			requeue_head(s, &msg);
+			return ;
+		}
+
+		pthread_mutex_lock(&s->lock);
+		s->stats.published++;
+
+		if(msg.qos > 0)
+		{
+			//只匹配本次发布开始之后到达、且未过期的提前确认
+			for(i = 0; i < SINK_EARLY_ACKS; i++)
+			{
+				if(s->early_acks[i].mid == mid && s->early_acks[i].ack_ms >= sent_ms &&
+				   now_ms() - s->early_acks[i].ack_ms <= SINK_EARLY_ACK_TTL_MS)
+					break;
+			}
+			if(i < SINK_EARLY_ACKS)
+			{
+				s->early_acks[i].mid = -1;
+				s->stats.acked++;
+			}
+			else
+			{
+				s->inflight[s->inflight_count].mid = mid;
+				s->inflight[s->inflight_count].sent_ms = sent_ms;
+				s->inflight_count++;
+			}
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		buf_release(msg.buf);
+	}
+}
+
+
+static void switch_endpoint(sink_t *s, int next, const char *reason)
+{
+	const mqtt_endpoint_t	*from = &s->cfg->endpoints[s->endpoint];
+	const mqtt_endpoint_t	*to = &s->cfg->endpoints[next];
+
+	log_warn("Sink[%s]: Failing over %s:%d -> %s:%d (%s).\n", s->cfg->name, from->host, from->port, to->host, to->port, reason);
+
+	mosquitto_disconnect(s->mosq);
+	mosquitto_loop_stop(s->mosq, true);
+	s->connected = 0;
+
+	//未确认的消息由 libmosquitto 在新连接上重发；旧连接的 mid 不再用于时延统计和在途计数
+	pthread_mutex_lock(&s->lock);
+	clear_inflight(s);
+	s->endpoint = next;
+	s->stats.failovers++;
+	s->stats.latency_ewma_ms = s->ewma_ms[next];
+	pthread_mutex_unlock(&s->lock);
+
+	s->switched_ms = now_ms();
+	sink_connect(s);
+}
+
+
+/* 切换条件：
+ * 1. 连续断开超过 failover_after_sec，切到下一个 endpoint；
+ * 2. 当前 endpoint 的 PUBACK 平均时延超过 failover_latency_ms，切到时延最低的 endpoint
+ *    （尚未测量过的 endpoint 视为值得一试）。
+ */
+static void check_failover(sink_t *s, uint64_t now)
+{
+	uint32_t	best_ewma;
+	int			best = -1;
+	int			i;
+
+	if(s->cfg->endpoint_count < 2 || now - s->switched_ms < SINK_MIN_DWELL_MS)
+		return ;
+
+	if(!s->connected)
+	{
+		if(s->cfg->failover_after_sec > 0 && now - s->state_since_ms > (uint64_t)s->cfg->failover_after_sec * 1000)
+			switch_endpoint(s, (s->endpoint + 1) % s->cfg->endpoint_count, "unreachable");
+		return ;
+	}
+
+	if(s->cfg->failover_latency_ms <= 0 || s->ewma_ms[s->endpoint] <= (uint32_t)s->cfg->failover_latency_ms)
+		return ;
+
+	best_ewma = s->ewma_ms[s->endpoint];
+	for(i = 0; i < s->cfg->endpoint_count; i++)
+	{
+		if(i != s->endpoint && s->ewma_ms[i] < best_ewma)
+		{
+			best = i;
+			best_ewma = s->ewma_ms[i];
+		}
+	}
+
+	if(best >= 0)
+		switch_endpoint(s, best, "PUBACK latency");
+}
+
+
+//汇点线程：出队发布并检查 endpoint 健康状况
+void *sink_thread_func(void *arg)
+{
+	struct timespec	ts;
+	uint64_t		now;
+	int				i;
+
+	log_info("Sink Thread: Serving %d additional broker(s).\n", S.count);
+
+	while(keep_running)
+	{
+		for(i = 0; i < S.count; i++)
+			sink_drain(&S.sinks[i]);
+
+		now = now_ms();
+		for(i = 0; i < S.count; i++)
+			check_failover(&S.sinks[i], now);
+
+		//有新消息、连上或收到 PUBACK 时被唤醒，否则 100ms 后检查一次
+		pthread_mutex_lock(&S.lock);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100 * 1000000;
+		if(ts.tv_nsec >= 1000000000)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&S.cond, &S.lock, &ts);
+		pthread_mutex_unlock(&S.lock);
+	}
+
+	log_info("Sink Thread: Exiting...\n");
+	return NULL;
+}
+
+
+void mqtt_sink_log_stats(void)
+{
+	mqtt_sink_stats_t	st;
+	sink_t				*s;
+	int					i;
+
+	for(i = 0; i < S.count; i++)
+	{
+		s = &S.sinks[i];
+		pthread_mutex_lock(&s->lock);
+		st = s->stats;
+		st.pending = s->count;
+		st.connected = s->connected;
+		st.endpoint = s->endpoint;
+		pthread_mutex_unlock(&s->lock);
+
+		log_info("Sink[%s]: %s %s:%d queued=%llu published=%llu acked=%llu dropped=%llu pending=%u failovers=%llu puback_ewma=%ums max=%ums\n",
+				s->cfg->name, st.connected ? "up" : "down",
+				s->cfg->endpoints[st.endpoint].host, s->cfg->endpoints[st.endpoint].port,
+				(unsigned long long)st.queued, (unsigned long long)st.published,
+				(unsigned long long)st.acked, (unsigned long long)st.dropped, st.pending,
+				(unsigned long long)st.failovers, st.latency_ewma_ms, st.latency_max_ms);
+	}
+}
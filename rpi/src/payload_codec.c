@@ -0,0 +1,483 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  payload_codec.c
+ *    Description:  This file implements the telemetry payload encoders.
+ *
+ *                  编码分两步：payload_encode() 只根据已提交的上一帧生成负载，
+ *                  负载被发布或写入 spool 之后再调用 payload_encode_commit() 推进增量状态，
+ *                  这样丢弃的帧不会让接收方的增量基准失步。
+ *
+ *        Version:  1.0.0(2025年08月27日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月27日 10时12分48秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "payload_codec.h"
+#include "log.h"
+
+
+//开启增量编码时默认每 30 帧发送一次完整帧
+#define DEFAULT_DELTA_KEYFRAME	30
+
+struct payload_encoder_s {
+	const char				*topic;       // NULL 表示默认编码器
+	const payload_codec_t	*codec;
+	int						delta;
+	int						keyframe_interval;
+
+	//已提交的上一帧
+	telemetry_record_t		last;
+	int						has_last;
+	int						since_keyframe;
+	uint32_t				seq;
+	int						pending_keyframe;
+
+	//统计
+	uint64_t				frames;
+	uint64_t				keyframes;
+	uint64_t				skipped;      //与上一帧完全相同、未发送的增量帧
+	uint64_t				bytes;
+};
+
+
+//属性的云端名称和缩放系数
+static const struct {
+	const char	*key;
+	size_t		len;
+	int32_t		scale;
+} props[TELEMETRY_PROP_COUNT] = {
+#define X(name, key, ble_key, scale, min, max) { key, sizeof(key) - 1, scale },
+	TELEMETRY_PROPERTIES(X)
+#undef X
+};
+
+static int32_t prop_value(const telemetry_record_t *rec, int i)
+{
+	switch(i)
+	{
+#define X(name, key, ble_key, scale, min, max) case TELEMETRY_PROP_##name: return rec->name;
+		TELEMETRY_PROPERTIES(X)
+#undef X
+	}
+	return 0;
+}
+
+//scale 是 10 的幂，返回小数位数
+static int scale_digits(int32_t scale)
+{
+	int		n = 0;
+
+	while(scale >= 10)
+	{
+		scale /= 10;
+		n++;
+	}
+	return n;
+}
+
+
+/* ----- JSON：华为云 IoTDA 属性上报格式 ----- */
+
+static int json_encode(const telemetry_record_t *rec, const payload_frame_t *frame, uint8_t *buf, size_t size)
+{
+	return telemetry_serialize_json(rec, frame->with_event_time, (char *)buf, size);
+}
+
+
+/* ----- CBOR (RFC 8949) -----
+ * {"ts": 采样时间(秒), "seq": 帧序号, "<属性名>": 取值, ...}
+ * scale 为 1 的属性编码为整数，其余编码为十进制小数 (tag 4) [-小数位数, 缩放后的整数]
+ */
+
+static uint8_t *cbor_head(uint8_t *p, uint8_t major, uint64_t v)
+{
+	int		shift;
+
+	major <<= 5;
+	if(v < 24)
+	{
+		*p++ = major | (uint8_t)v;
+	}
+	else if(v <= 0xFF)
+	{
+		*p++ = major | 24;
+		*p++ = (uint8_t)v;
+	}
+	else if(v <= 0xFFFF)
+	{
+		*p++ = major | 25;
+		*p++ = (uint8_t)(v >> 8);
+		*p++ = (uint8_t)v;
+	}
+	else if(v <= 0xFFFFFFFFULL)
+	{
+		*p++ = major | 26;
+		*p++ = (uint8_t)(v >> 24);
+		*p++ = (uint8_t)(v >> 16);
+		*p++ = (uint8_t)(v >> 8);
+		*p++ = (uint8_t)v;
+	}
+	else
+	{
+		*p++ = major | 27;
+		for(shift = 56; shift >= 0; shift -= 8)
+			*p++ = (uint8_t)(v >> shift);
+	}
+	return p;
+}
+
+static uint8_t *cbor_int(uint8_t *p, int64_t v)
+{
+	return v >= 0 ? cbor_head(p, 0, (uint64_t)v) : cbor_head(p, 1, (uint64_t)(-1 - v));
+}
+
+static uint8_t *cbor_text(uint8_t *p, const char *s, size_t len)
+{
+	p = cbor_head(p, 3, len);
+	memcpy(p, s, len);
+	return p + len;
+}
+
+static int cbor_encode(const telemetry_record_t *rec, const payload_frame_t *frame, uint8_t *buf, size_t size)
+{
+	uint8_t		*p = buf;
+	int			count = 2;
+	int			i;
+
+	if(size < PAYLOAD_CODEC_MAX)
+		return TELEMETRY_ERR_BUFFER;
+
+	for(i = 0; i < TELEMETRY_PROP_COUNT; i++)
+		count += (rec->present >> i) & 1;
+
+	p = cbor_head(p, 5, count);
+	p = cbor_text(p, "ts", 2);
+	p = cbor_int(p, (int64_t)rec->timestamp);
+	p = cbor_text(p, "seq", 3);
+	p = cbor_int(p, frame->seq);
+
+	for(i = 0; i < TELEMETRY_PROP_COUNT; i++)
+	{
+		if(!(rec->present & (1u << i)))
+			continue;
+
+		p = cbor_text(p, props[i].key, props[i].len);
+		if(props[i].scale <= 1)
+		{
+			p = cbor_int(p, prop_value(rec, i));
+		}
+		else
+		{
+			*p++ = 0xC4;  // tag 4
+			*p++ = 0x82;  // array(2)
+			p = cbor_int(p, -scale_digits(props[i].scale));
+			p = cbor_int(p, prop_value(rec, i));
+		}
+	}
+
+	return (int)(p - buf);
+}
+
+
+/* ----- Sparkplug B 风格的 protobuf -----
+ * Payload { uint64 timestamp = 1; repeated Metric metrics = 2; uint64 seq = 3; }
+ * Metric  { string name = 1; uint64 alias = 2; uint32 datatype = 4;
+ *           uint32 int_value = 10; double double_value = 13; }
+ * 属性序号作为 alias，属性名只在完整帧中发送；时间戳为毫秒。
+ */
+
+#define PB_VARINT	0
+#define PB_FIXED64	1
+#define PB_BYTES	2
+
+#define SPB_INT32	3    // Sparkplug B DataType
+#define SPB_DOUBLE	10
+
+static uint8_t *pb_varint(uint8_t *p, uint64_t v)
+{
+	while(v >= 0x80)
+	{
+		*p++ = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (uint8_t)v;
+	return p;
+}
+
+static inline uint8_t *pb_tag(uint8_t *p, int field, int wire_type)
+{
+	return pb_varint(p, (uint64_t)(field << 3 | wire_type));
+}
+
+static uint8_t *pb_metric(uint8_t *p, const telemetry_record_t *rec, int i, int with_name)
+{
+	uint8_t		metric[64];
+	uint8_t		*m = metric;
+	double		d;
+	uint64_t	bits;
+	int			k;
+
+	if(with_name)
+	{
+		m = pb_tag(m, 1, PB_BYTES);
+		m = pb_varint(m, props[i].len);
+		memcpy(m, props[i].key, props[i].len);
+		m += props[i].len;
+	}
+	m = pb_tag(m, 2, PB_VARINT);
+	m = pb_varint(m, (uint64_t)i);
+
+	if(props[i].scale <= 1)
+	{
+		m = pb_tag(m, 4, PB_VARINT);
+		m = pb_varint(m, SPB_INT32);
+		m = pb_tag(m, 10, PB_VARINT);
+		m = pb_varint(m, (uint32_t)prop_value(rec, i));   // Int32 按补码存入 uint32
+	}
+	else
+	{
+		d = (double)prop_value(rec, i) / props[i].scale;
+		memcpy(&bits, &d, sizeof(bits));
+		m = pb_tag(m, 4, PB_VARINT);
+		m = pb_varint(m, SPB_DOUBLE);
+		m = pb_tag(m, 13, PB_FIXED64);
+		for(k = 0; k < 8; k++)
+			*m++ = (uint8_t)(bits >> (8 * k));
+	}
+
+	p = pb_tag(p, 2, PB_BYTES);
+	p = pb_varint(p, (uint64_t)(m - metric));
+	memcpy(p, metric, m - metric);
+	return p + (m - metric);
+}
+
+static int proto_encode(const telemetry_record_t *rec, const payload_frame_t *frame, uint8_t *buf, size_t size)
+{
+	uint8_t		*p = buf;
+	int			i;
+
+	if(size < PAYLOAD_CODEC_MAX)
+		return TELEMETRY_ERR_BUFFER;
+
+	p = pb_tag(p, 1, PB_VARINT);
+	p = pb_varint(p, (uint64_t)rec->timestamp * 1000);
+
+	for(i = 0; i < TELEMETRY_PROP_COUNT; i++)
+	{
+		if(rec->present & (1u << i))
+			p = pb_metric(p, rec, i, frame->keyframe);
+	}
+
+	p = pb_tag(p, 3, PB_VARINT);
+	p = pb_varint(p, frame->seq);
+
+	return (int)(p - buf);
+}
+
+
+/* ----- 编码器表 ----- */
+
+static const payload_codec_t codecs[] = {
+	{ "json",  1, json_encode  },
+	{ "cbor",  0, cbor_encode  },
+	{ "proto", 0, proto_encode },
+};
+
+static struct payload_encoder_s	encoders[PAYLOAD_CODEC_MAX_TOPICS];
+static int						encoder_count;
+static struct payload_encoder_s	default_encoder = { .codec = &codecs[0], .keyframe_interval = 1 };
+static pthread_mutex_t			stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+const payload_codec_t *payload_codec_find(const char *name)
+{
+	size_t	i;
+
+	for(i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++)
+	{
+		if(strcmp(codecs[i].name, name) == 0)
+			return &codecs[i];
+	}
+	return NULL;
+}
+
+
+//按配置建立各主题的编码器，未配置的主题使用 JSON
+int payload_codec_init(const payload_codec_config_t *config)
+{
+	const payload_codec_rule_t	*rule;
+	payload_encoder_t			*enc;
+	int							rv = 0;
+	int							i;
+
+	memset(encoders, 0, sizeof(encoders));
+	encoder_count = 0;
+
+	for(i = 0; config && i < config->count && i < PAYLOAD_CODEC_MAX_TOPICS; i++)
+	{
+		rule = &config->rules[i];
+		if(!rule->topic || !rule->codec)
+			continue;
+
+		enc = &encoders[encoder_count];
+		enc->topic = rule->topic;
+		enc->codec = payload_codec_find(rule->codec);
+		if(!enc->codec)
+		{
+			log_error("Codec: Unknown codec '%s' for topic %s, using json.\n", rule->codec, rule->topic);
+			enc->codec = &codecs[0];
+			rv = -1;
+		}
+		enc->delta = rule->delta;
+		enc->keyframe_interval = rule->keyframe_interval > 0 ? rule->keyframe_interval :
+								 (rule->delta ? DEFAULT_DELTA_KEYFRAME : 1);
+		encoder_count++;
+
+		log_info("Codec: %s -> %s%s, keyframe every %d frame(s).\n", enc->topic, enc->codec->name,
+				enc->delta ? " (delta)" : "", enc->keyframe_interval);
+	}
+
+	return rv;
+}
+
+
+//查找主题对应的编码器，未配置的主题返回默认的 JSON 编码器
+payload_encoder_t *payload_encoder_get(const char *topic)
+{
+	int		i;
+
+	for(i = 0; i < encoder_count; i++)
+	{
+		if(strcmp(encoders[i].topic, topic) == 0)
+			return &encoders[i];
+	}
+	return &default_encoder;
+}
+
+
+const char *payload_encoder_name(const payload_encoder_t *enc)
+{
+	return enc->codec->name;
+}
+
+
+int payload_encoder_is_text(const payload_encoder_t *enc)
+{
+	return enc->codec->is_text;
+}
+
+
+/* 编码一帧，返回负载长度；不修改编码器状态
+ * 增量模式下非完整帧只包含与上一帧取值不同的属性，没有任何变化时返回 0，
+ * 调用者不发送该帧，仍调用 payload_encode_commit(enc, rec, 0) 计入统计
+ */
+int payload_encode(payload_encoder_t *enc, const telemetry_record_t *rec, int flags, uint8_t *buf, size_t size)
+{
+	telemetry_record_t	frame_rec = *rec;
+	payload_frame_t		frame;
+	int					i;
+
+	frame.with_event_time = (flags & PAYLOAD_ENCODE_EVENT_TIME) != 0;
+	frame.seq = enc->seq;
+	frame.keyframe = !enc->has_last || enc->since_keyframe + 1 >= enc->keyframe_interval ||
+					 (enc->delta && (flags & PAYLOAD_ENCODE_KEYFRAME));
+
+	if(enc->delta && !frame.keyframe)
+	{
+		for(i = 0; i < TELEMETRY_PROP_COUNT; i++)
+		{
+			if((enc->last.present & (1u << i)) && prop_value(&enc->last, i) == prop_value(rec, i))
+				frame_rec.present &= ~(1u << i);
+		}
+
+		//全部属性都未变化：空的增量帧没有信息，不发送
+		if(!frame_rec.present)
+		{
+			enc->pending_keyframe = 0;
+			return 0;
+		}
+	}
+
+	enc->pending_keyframe = frame.keyframe;
+	return enc->codec->encode(&frame_rec, &frame, buf, size);
+}
+
+
+//负载已被发布或暂存，推进增量基准和帧序号；len 为 0 表示该帧被折叠，未发送
+void payload_encode_commit(payload_encoder_t *enc, const telemetry_record_t *rec, int len)
+{
+	int		i;
+
+	if(len == 0)
+	{
+		enc->last.timestamp = rec->timestamp;
+		pthread_mutex_lock(&stats_lock);
+		enc->skipped++;
+		pthread_mutex_unlock(&stats_lock);
+		return ;
+	}
+
+	for(i = 0; i < TELEMETRY_PROP_COUNT; i++)
+	{
+		if(!(rec->present & (1u << i)))
+			continue;
+		switch(i)
+		{
+#define X(name, key, ble_key, scale, min, max) case TELEMETRY_PROP_##name: enc->last.name = rec->name; break;
+			TELEMETRY_PROPERTIES(X)
+#undef X
+		}
+		enc->last.present |= 1u << i;
+	}
+	enc->last.timestamp = rec->timestamp;
+	enc->has_last = 1;
+	enc->since_keyframe = enc->pending_keyframe ? 0 : enc->since_keyframe + 1;
+	enc->seq++;
+
+	pthread_mutex_lock(&stats_lock);
+	enc->frames++;
+	enc->keyframes += enc->pending_keyframe;
+	enc->bytes += len;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+
+static void log_encoder_stats(const payload_encoder_t *enc)
+{
+	uint64_t	frames;
+	uint64_t	keyframes;
+	uint64_t	skipped;
+	uint64_t	bytes;
+
+	pthread_mutex_lock(&stats_lock);
+	frames = enc->frames;
+	keyframes = enc->keyframes;
+	skipped = enc->skipped;
+	bytes = enc->bytes;
+	pthread_mutex_unlock(&stats_lock);
+
+	if(!frames)
+		return ;
+
+	log_info("Codec: %s [%s%s] frames=%llu keyframes=%llu skipped=%llu bytes=%llu avg=%llu bytes/frame\n",
+			enc->topic ? enc->topic : "(default)", enc->codec->name, enc->delta ? ",delta" : "",
+			(unsigned long long)frames, (unsigned long long)keyframes, (unsigned long long)skipped,
+			(unsigned long long)bytes, (unsigned long long)(bytes / frames));
+}
+
+
+void payload_codec_log_stats(void)
+{
+	int		i;
+
+	log_encoder_stats(&default_encoder);
+	for(i = 0; i < encoder_count; i++)
+		log_encoder_stats(&encoders[i]);
+}
@@ -0,0 +1,446 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  pipeline.c
+ *    Description:  This file implements the uplink processing stages.
+ *
+ *                  intake  : 上行线程（D-Bus）复制通知内容后入队，立即返回继续收信号
+ *                  decode  : 按属性表解析、校验
+ *                  告警采样在每个队列中都以优先元素入队（intake 入队前先粗解析一次），
+ *                  抽稀和 drop-newest 不会丢弃它们，队列满时挤掉最旧的元素
+ *                  analytics: 阈值判断，告警时向 BLE 设备写入警告命令
+ *                  encode  : 死区过滤、编码，交给 uplink_publish（默认 mqtt_sink / publish_lane），失败写入 spool
+ *
+ *        Version:  1.0.0(2025年09月01日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月01日 16时20分44秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "pipeline.h"
+#include "mqtt_gateway.h"
+#include "ble_gateway.h"
+#include "spool.h"
+#include "telemetry.h"
+#include "payload_codec.h"
+#include "report_filter.h"
+#include "subdev.h"
+#include "mqtt_mux.h"
+#include "shadow.h"
+#include "rate_ctl.h"
+#include "uplink_sink.h"
+#include "log.h"
+
+
+extern mqtt_device_config_t device_config;
+
+//出队等待时间，encode 阶段借此定期发出子设备批量上报
+#define STAGE_POLL_MS		200
+
+//intake 队列元素：原始通知
+typedef struct {
+	uint32_t	device_key;
+	int			subdev;        //网关子设备或本地节点的序号，-1 表示网关自己的 BLE 设备
+	int			identity;      //直连模式下设备自己的 MQTT 连接序号，-1 表示没有
+	int			shadow;        //设备影子序号
+	time_t		rx_time;
+	int			len;
+	char		raw[PIPELINE_RAW_MAX];
+} intake_item_t;
+
+//analytics / encode 队列元素：解码后的采样
+typedef struct {
+	uint32_t			device_key;
+	int					subdev;
+	int					identity;
+	int					traffic_class;
+	telemetry_record_t	rec;
+} sample_item_t;
+
+
+static const char *queue_names[PIPELINE_Q_COUNT] = {
+	"intake",
+	"analytics",
+	"encode",
+};
+
+static stage_queue_t	*queues[PIPELINE_Q_COUNT];
+static pthread_t		stage_tids[PIPELINE_Q_COUNT];
+static int				stage_running[PIPELINE_Q_COUNT];
+
+
+const char *pipeline_queue_name(int queue)
+{
+	return (queue >= 0 && queue < PIPELINE_Q_COUNT) ? queue_names[queue] : "unknown";
+}
+
+
+//按 D-Bus 对象路径区分设备（FNV-1a）
+static uint32_t device_key_of(const char *path)
+{
+	uint32_t	h = 2166136261u;
+
+	while(path && *path)
+	{
+		h ^= (uint8_t)*path++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+int pipeline_init(const pipeline_config_t *config)
+{
+	static const size_t	item_size[PIPELINE_Q_COUNT] = {
+		sizeof(intake_item_t),
+		sizeof(sample_item_t),
+		sizeof(sample_item_t),
+	};
+	int					i;
+
+	for(i = 0; i < PIPELINE_Q_COUNT; i++)
+	{
+		queues[i] = stage_queue_create(queue_names[i], item_size[i], &config->queues[i]);
+		if(!queues[i])
+		{
+			log_error("Pipeline: Failed to create %s queue.\n", queue_names[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+//采样是否落在告警区间
+static int sample_is_alert(const telemetry_record_t *rec)
+{
+	return telemetry_alert_band(rec, HR_THRESHOLD, SPO2_THRESHOLD);
+}
+
+
+/* 上行线程调用：复制通知内容后入队
+ * 告警由 analytics 判断，但 intake 和 analytics 队列在它之前，这里先解析一次决定优先级，
+ * 否则队列积压时告警采样会和普通采样一样被抽稀或丢弃；无法解析的通知按普通采样入队，由 decode 报错
+ * 返回 0 表示已入队，1 表示按过载策略被丢弃
+ */
+int pipeline_submit(const char *path, const char *raw, size_t len)
+{
+	intake_item_t		item;
+	telemetry_record_t	rec;
+	const char			*node;
+	int					index;
+	int					priority;
+
+	if(len >= sizeof(item.raw))
+	{
+		log_error("Pipeline: Notification of %zu bytes too long, dropped.\n", len);
+		return -1;
+	}
+
+	item.device_key = device_key_of(path);
+	item.subdev = subdev_find_path(path);
+	//非 D-Bus 路径（CoAP 的 "coap/{node}"）：第一个 / 之后是已登记的本地节点
+	if(item.subdev < 0 && path[0] != '/' && (node = strchr(path, '/')) &&
+	   subdev_is_node(index = subdev_find_id(node + 1)))
+		item.subdev = index;
+	item.identity = mqtt_mux_find_path(path);
+	item.shadow = shadow_find(path);
+	item.rx_time = time(NULL);
+	item.len = (int)len;
+	memcpy(item.raw, raw, len);
+	item.raw[len] = '\0';
+
+	priority = telemetry_parse_ble(raw, len, &rec) == TELEMETRY_OK && sample_is_alert(&rec);
+
+	return stage_queue_push(queues[PIPELINE_Q_INTAKE], &item, item.device_key, priority) == STAGE_OK ? 0 : 1;
+}
+
+
+//decode：解析并校验通知内容，例如 "HR:72,SpO2:98"
+static void *decode_thread_func(void *arg)
+{
+	intake_item_t	in;
+	sample_item_t	out;
+	int				rv;
+
+	for( ;; )
+	{
+		//pipeline_stop 关闭队列，取空后结束（不看 keep_running：上游阶段可能还在入队）
+		rv = stage_queue_pop(queues[PIPELINE_Q_INTAKE], &in, STAGE_POLL_MS);
+		if(rv == STAGE_CLOSED)
+			break;
+		if(rv != STAGE_OK)
+			continue;
+
+		if(telemetry_parse_ble(in.raw, in.len, &out.rec) != TELEMETRY_OK ||
+		   telemetry_validate(&out.rec) != TELEMETRY_OK)
+		{
+			log_error("Failed to parse or validate telemetry from notification string: \"%s\"\n", in.raw);
+			continue;
+		}
+
+		//采样时间取通知到达的时间，而不是处理的时间
+		out.rec.timestamp = in.rx_time;
+		out.device_key = in.device_key;
+		out.subdev = in.subdev;
+		out.identity = in.identity;
+		out.traffic_class = sample_is_alert(&out.rec) ? MQTT_TRAFFIC_ALERT : MQTT_TRAFFIC_TELEMETRY;
+		log_info("Parsed HR: %d, Spo2: %d\n", out.rec.hr, out.rec.spo2);
+
+		//设备影子保存最新值，properties/get 直接用它回答
+		shadow_update(in.shadow, &out.rec);
+
+		stage_queue_push(queues[PIPELINE_Q_ANALYTICS], &out, out.device_key, out.traffic_class == MQTT_TRAFFIC_ALERT);
+	}
+
+	return NULL;
+}
+
+
+//analytics：告警采样（decode 已标记为 alert 类别）写回警告命令并提高采样频率
+static void *analytics_thread_func(void *arg)
+{
+	sample_item_t	s;
+	const char		*char_path;
+	int				hr, spo2;
+	int				rv;
+
+	for( ;; )
+	{
+		rv = stage_queue_pop(queues[PIPELINE_Q_ANALYTICS], &s, STAGE_POLL_MS);
+		if(rv == STAGE_CLOSED)
+			break;
+		if(rv != STAGE_OK)
+			continue;
+
+		hr = s.rec.hr;
+		spo2 = s.rec.spo2;
+		//本地节点没有 BLE 链路：告警不写回、不调整采样频率，只随批量上报立即发出
+		if(s.traffic_class == MQTT_TRAFFIC_ALERT && !subdev_is_node(s.subdev))
+		{
+			//触发告警的采样走严格优先的 alert 队列
+			log_info("ALERT: HR(%d) > %d or Spo2 (%d) < %d. Sending warning command to BLE device.\n", hr, HR_THRESHOLD, spo2, SPO2_THRESHOLD);
+			//发送Waring，写入设置超时，BLE 无应答时本阶段不会无限期停住
+			//子设备的告警写回产生采样的那个设备
+			char_path = s.subdev >= 0 ? subdev_write_path(s.subdev) : WRITABLE_CHARACTERISTIC_PATH;
+			if(write_characteristic_value_timeout(global_dbus_conn, char_path, WARNING_CMD, device_config.command_timeout_ms) < 0)
+			{
+				log_error("Failed to send WARING command to BLE device.\n");
+			}
+
+			//告警期间提高该设备的采样频率
+			rate_ctl_alert(s.subdev >= 0 ? subdev_path(s.subdev) : DEVICE_PATH);
+		}
+
+		stage_queue_push(queues[PIPELINE_Q_ENCODE], &s, s.device_key, s.traffic_class == MQTT_TRAFFIC_ALERT);
+	}
+
+	return NULL;
+}
+
+
+//将未能发布的采样按主题的编码方式连同采样时间写入spool，等待重连后回放
+//回放可能丢弃或与实时帧交错，写入 spool 的总是完整帧；写入成功后提交编码器的增量状态
+static int spool_sample(payload_encoder_t *enc, const telemetry_record_t *rec)
+{
+	uint8_t	payload[PAYLOAD_CODEC_MAX];
+	int		len;
+
+	if(!spool_is_open())
+		return -1;
+
+	len = payload_encode(enc, rec, PAYLOAD_ENCODE_EVENT_TIME | PAYLOAD_ENCODE_KEYFRAME, payload, sizeof(payload));
+	if(len < 0 || spool_append(SPOOL_CHANNEL_GATEWAY, rec->timestamp, payload, len) != SPOOL_OK)
+	{
+		log_error("Spool: Failed to store sample HR=%d SpO2=%d.\n", rec->hr, rec->spo2);
+		return -1;
+	}
+	payload_encode_commit(enc, rec, len);
+	log_info("Spool: MQTT unavailable, sample stored for later replay.\n");
+	return 0;
+}
+
+
+//spool 中还有待回放的记录：接收方的增量基准不确定，实时帧也发送完整帧
+static int spool_replaying(void)
+{
+	spool_stats_t	st;
+
+	if(!spool_is_open())
+		return 0;
+	spool_get_stats(&st);
+	return st.pending != 0;
+}
+
+
+//encode：死区过滤、编码和发布，MQTT断开时数据写入spool，重连后回放
+static void *encode_thread_func(void *arg)
+{
+	sample_item_t		s;
+	payload_encoder_t	*encoder;
+	uint8_t				payload_buffer[PAYLOAD_CODEC_MAX];
+	int					payload_len;
+	int					flags;
+	int					decision;
+	int					alert;
+	int					rc_pub;
+	int					rv;
+
+	for( ;; )
+	{
+		//发出等待已超过 batch_interval_ms 的子设备批量上报（没有子设备时直接返回）
+		subdev_flush(0);
+
+		rv = stage_queue_pop(queues[PIPELINE_Q_ENCODE], &s, STAGE_POLL_MS);
+		if(rv == STAGE_CLOSED)
+			break;
+		if(rv != STAGE_OK)
+			continue;
+		alert = (s.traffic_class == MQTT_TRAFFIC_ALERT);
+
+		//直连模式：设备以自己的 IoTDA 身份上报，未连接时写入 spool，该设备重连后回放（连接由 mqtt_mux 线程恢复）
+		if(s.identity >= 0)
+		{
+			mqtt_mux_report(s.identity, &s.rec);
+			continue;
+		}
+
+		//网关子设备：只保留最新采样，与其他子设备合并成一条批量上报，告警立即发出
+		//批量上报本身限制了每个设备的上报频率，不经过单设备的死区过滤和 spool
+		if(s.subdev >= 0)
+		{
+			subdev_report(s.subdev, &s.rec, alert);
+			subdev_flush(alert);
+			continue;
+		}
+
+		//没有任何输出（mqtt 汇点：未连接、无 spool、无附加代理）时丢弃
+		if(!uplink_sink_ready())
+			continue;
+
+		//取值在死区内且未到心跳时间的采样不上报，告警采样总是上报
+		decision = report_filter_check(&s.rec, alert);
+		if(decision == REPORT_SUPPRESS)
+		{
+			log_debug("Sample within deadband, report suppressed.\n");
+			continue;
+		}
+
+		// 按主题配置的编码方式生成负载，默认为华为云 IoTDA 格式的 JSON
+		// 心跳和告警携带完整状态，spool 回放期间不发送增量帧
+		encoder = payload_encoder_get(device_config.publish_topic);
+		flags = (decision == REPORT_HEARTBEAT || decision == REPORT_ALERT || spool_replaying()) ? PAYLOAD_ENCODE_KEYFRAME : 0;
+
+		payload_len = payload_encode(encoder, &s.rec, flags, payload_buffer, sizeof(payload_buffer));
+		if(payload_len == 0)
+		{
+			//增量帧中没有变化的属性，不发送
+			payload_encode_commit(encoder, &s.rec, 0);
+			report_filter_commit(&s.rec, alert);
+			continue;
+		}
+		if(payload_encoder_is_text(encoder))
+			log_info("Publishing MQTT payload: %.*s\n", payload_len, (char *)payload_buffer);
+		else
+			log_info("Publishing MQTT payload: %d bytes (%s)\n", payload_len, payload_encoder_name(encoder));
+
+		//交给配置的上行汇点，负载只编码一次；mqtt 汇点按路由发往 primary 和附加代理
+		//返回 primary 的结果：未连接或发送队列已满（MQTT_PUBLISH_WINDOW_FULL）时数据转入spool
+		rc_pub = uplink_publish(device_config.publish_topic, payload_buffer, payload_len, 1, s.traffic_class);
+
+		//file / unix 汇点写入失败：已由汇点计数和限速记录，不转入 spool（spool 回放只发往 MQTT）
+		if(rc_pub == UPLINK_DROPPED)
+			continue;
+
+		if(rc_pub != MOSQ_ERR_SUCCESS) // 检查发布结果
+		{
+			log_error("Failed to publish MQTT message, return code %d\n", rc_pub);
+			if(spool_sample(encoder, &s.rec) == 0)
+				report_filter_commit(&s.rec, alert);
+		}
+		else
+		{
+			payload_encode_commit(encoder, &s.rec, payload_len);
+			report_filter_commit(&s.rec, alert);
+			log_info("MQTT message published successfully.\n");
+		}
+	}
+
+	return NULL;
+}
+
+
+int pipeline_start(void)
+{
+	static void *(*const stage_funcs[PIPELINE_Q_COUNT])(void *) = {
+		decode_thread_func,
+		analytics_thread_func,
+		encode_thread_func,
+	};
+	int		i;
+
+	for(i = 0; i < PIPELINE_Q_COUNT; i++)
+	{
+		if(pthread_create(&stage_tids[i], NULL, stage_funcs[i], NULL) != 0)
+		{
+			log_error("Pipeline: Failed to create %s stage thread.\n", queue_names[i]);
+			pipeline_stop();
+			return -1;
+		}
+		stage_running[i] = 1;
+	}
+	log_debug("Pipeline: %d stage threads created.\n", PIPELINE_Q_COUNT);
+	return 0;
+}
+
+
+//按上游到下游的顺序关闭队列并等待各阶段处理完已入队的数据
+void pipeline_stop(void)
+{
+	int		i;
+
+	for(i = 0; i < PIPELINE_Q_COUNT; i++)
+	{
+		if(queues[i])
+			stage_queue_close(queues[i]);
+		if(stage_running[i])
+		{
+			pthread_join(stage_tids[i], NULL);
+			stage_running[i] = 0;
+		}
+	}
+}
+
+
+//各阶段队列中等待处理的采样总数
+int pipeline_backlog(void)
+{
+	stage_queue_stats_t	st;
+	int					backlog = 0;
+	int					i;
+
+	for(i = 0; i < PIPELINE_Q_COUNT; i++)
+	{
+		if(!queues[i])
+			continue;
+		stage_queue_get_stats(queues[i], &st);
+		backlog += st.depth;
+	}
+	return backlog;
+}
+
+
+void pipeline_log_stats(void)
+{
+	int		i;
+
+	for(i = 0; i < PIPELINE_Q_COUNT; i++)
+		stage_queue_log_stats(queues[i]);
+}
@@ -0,0 +1,545 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  publish_lane.c
+ *    Description:  This file implements the priority lanes and token buckets.
+ *
+ *                  调度顺序：先看设备令牌桶，再依次检查严格优先的告警、命令响应队列，
+ *                  最后在属性上报和回放队列之间按权重轮转（deficit round robin）。
+ *                  在途窗口已满或未连接时停止调度，消息留在队首等待下一轮。
+ *
+ *                  生产者（上行线程、命令线程、回调）把消息复制到预分配的槽位，经无锁队列
+ *                  交给下行线程；只有下行线程访问 mosquitto 实例和各发送队列，发布路径上没有锁。
+ *
+ *        Version:  1.0.0(2025年08月30日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月30日 14时26分52秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "publish_lane.h"
+#include "log.h"
+
+
+//令牌以千分之一条为单位累积
+typedef struct {
+	int64_t		tokens;
+	int64_t		rate;      // 条/秒，0 表示不限
+	int64_t		burst;
+	uint64_t	last_ms;
+} token_bucket_t;
+
+//预分配的消息槽位
+typedef struct {
+	int			traffic_class;
+	int			qos;
+	int			len;
+	int			throttled;    //已计入 throttled 统计
+	uint64_t	enqueue_ms;
+	time_t		submit_time;  //提交时的墙上时间，退出时写入 spool 用
+	char		topic[PUBLISH_LANE_TOPIC_MAX];
+	char		payload[PUBLISH_LANE_PAYLOAD_MAX];
+} lane_msg_t;
+
+/* 有界无锁队列（Vyukov），保存槽位序号
+ * 每个单元带序号：生产者用 CAS 抢占写位置，写完后发布序号，消费者按序号判断单元是否可读
+ */
+typedef struct {
+	uint32_t	seq;
+	int			idx;
+} ring_cell_t;
+
+typedef struct {
+	ring_cell_t	*cells;
+	uint32_t	mask;
+	uint32_t	enqueue_pos;
+	uint32_t	dequeue_pos;
+} index_ring_t;
+
+//发送队列，只由下行线程访问
+typedef struct {
+	int						*ring;      //槽位序号
+	int						depth;
+	int						head;
+	int						count;
+	int						weight;
+	int						deficit;
+	token_bucket_t			bucket;
+
+	uint32_t				pending;    //已接纳未发送的消息数（生产者原子递增，下行线程发送后递减）
+	publish_lane_stats_t	stats;      //submitted/rejected 原子更新，其余在 stats_lock 下更新
+} lane_t;
+
+
+//严格优先的队列，按优先级从高到低
+static const int strict_lanes[] = { MQTT_TRAFFIC_ALERT, MQTT_TRAFFIC_RESPONSE };
+//按权重分享的队列
+static const int weighted_lanes[] = { MQTT_TRAFFIC_TELEMETRY, MQTT_TRAFFIC_BULK };
+
+#define STRICT_COUNT	(int)(sizeof(strict_lanes) / sizeof(strict_lanes[0]))
+#define WEIGHTED_COUNT	(int)(sizeof(weighted_lanes) / sizeof(weighted_lanes[0]))
+
+
+static struct {
+	lane_t			lanes[MQTT_TRAFFIC_CLASS_COUNT];
+	token_bucket_t	device;
+	int				rr;         //加权轮转的当前位置
+
+	lane_msg_t		*pool;
+	index_ring_t	free_slots; //空闲槽位
+	index_ring_t	submitted;  //生产者提交、等待下行线程分拣的槽位
+	pthread_mutex_t	stats_lock;
+} L = { .stats_lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+static uint64_t now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static void bucket_init(token_bucket_t *b, int rate, int burst)
+{
+	b->rate = rate > 0 ? rate : 0;
+	b->burst = (int64_t)(burst > 0 ? burst : (rate > 0 ? rate : 1)) * 1000;
+	b->tokens = b->burst;
+	b->last_ms = now_ms();
+}
+
+static void bucket_refill(token_bucket_t *b, uint64_t now)
+{
+	if(!b->rate)
+		return ;
+
+	b->tokens += (int64_t)(now - b->last_ms) * b->rate;
+	if(b->tokens > b->burst)
+		b->tokens = b->burst;
+	b->last_ms = now;
+}
+
+static inline int bucket_ready(const token_bucket_t *b)
+{
+	return !b->rate || b->tokens >= 1000;
+}
+
+static inline void bucket_take(token_bucket_t *b)
+{
+	if(b->rate)
+		b->tokens -= 1000;
+}
+
+
+static int ring_init(index_ring_t *r, int capacity)
+{
+	uint32_t	size = 1;
+	uint32_t	i;
+
+	while(size < (uint32_t)capacity)
+		size <<= 1;
+
+	r->cells = calloc(size, sizeof(ring_cell_t));
+	if(!r->cells)
+		return -1;
+	for(i = 0; i < size; i++)
+		r->cells[i].seq = i;
+	r->mask = size - 1;
+	r->enqueue_pos = 0;
+	r->dequeue_pos = 0;
+	return 0;
+}
+
+//入队，队列已满时返回 -1
+static int ring_push(index_ring_t *r, int idx)
+{
+	ring_cell_t	*cell;
+	uint32_t	pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+	int32_t		dif;
+
+	for( ;; )
+	{
+		cell = &r->cells[pos & r->mask];
+		dif = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+		if(dif == 0)
+		{
+			if(__atomic_compare_exchange_n(&r->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if(dif < 0)
+		{
+			return -1;
+		}
+		else
+		{
+			pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->idx = idx;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+//出队，队列为空时返回 -1
+static int ring_pop(index_ring_t *r)
+{
+	ring_cell_t	*cell;
+	uint32_t	pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+	int32_t		dif;
+	int			idx;
+
+	for( ;; )
+	{
+		cell = &r->cells[pos & r->mask];
+		dif = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+		if(dif == 0)
+		{
+			if(__atomic_compare_exchange_n(&r->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if(dif < 0)
+		{
+			return -1;
+		}
+		else
+		{
+			pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	idx = cell->idx;
+	__atomic_store_n(&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+	return idx;
+}
+
+
+int publish_lanes_init(const publish_lanes_config_t *config)
+{
+	const publish_lane_config_t	*lc;
+	lane_t						*lane;
+	int							pool_size = 0;
+	int							i;
+
+	bucket_init(&L.device, config->device_rate, config->device_burst);
+
+	for(i = 0; i < MQTT_TRAFFIC_CLASS_COUNT; i++)
+	{
+		lc = &config->lanes[i];
+		lane = &L.lanes[i];
+		memset(lane, 0, sizeof(*lane));
+
+		lane->depth = lc->depth > 0 ? lc->depth : 64;
+		lane->weight = lc->weight > 0 ? lc->weight : 1;
+		lane->ring = calloc(lane->depth, sizeof(int));
+		if(!lane->ring)
+			return -1;
+		bucket_init(&lane->bucket, lc->rate, lc->burst);
+		pool_size += lane->depth;
+
+		log_info("Lane: %-9s depth=%d rate=%d/s burst=%d weight=%d\n", mqtt_traffic_class_name(i),
+				lane->depth, lc->rate, lc->burst, lane->weight);
+	}
+	L.rr = 0;
+
+	//槽位总数等于各队列长度之和：被接纳的消息一定能拿到槽位
+	L.pool = calloc(pool_size, sizeof(lane_msg_t));
+	if(!L.pool || ring_init(&L.free_slots, pool_size) < 0 || ring_init(&L.submitted, pool_size) < 0)
+		return -1;
+	for(i = 0; i < pool_size; i++)
+		ring_push(&L.free_slots, i);
+
+	log_info("Lane: %d message slots preallocated (%zu KiB).\n", pool_size, pool_size * sizeof(lane_msg_t) / 1024);
+	if(config->device_rate > 0)
+		log_info("Lane: device quota %d msg/s, burst %d.\n", config->device_rate, config->device_burst);
+	return 0;
+}
+
+
+/* 提交一条待发布的消息（复制到预分配的槽位），任意线程均可调用，不加锁、不等待下行线程
+ * 队列已满时返回 MQTT_PUBLISH_WINDOW_FULL，调用者可转入 spool 或稍后重试
+ */
+int publish_lane_submit(int traffic_class, const char *topic, const void *payload, int payloadlen, int qos)
+{
+	lane_t		*lane;
+	lane_msg_t	*msg;
+	size_t		topic_len = strlen(topic);
+	int			idx;
+
+	if(traffic_class < 0 || traffic_class >= MQTT_TRAFFIC_CLASS_COUNT)
+		traffic_class = MQTT_TRAFFIC_TELEMETRY;
+	lane = &L.lanes[traffic_class];
+
+	if(topic_len >= PUBLISH_LANE_TOPIC_MAX || payloadlen < 0 || payloadlen > PUBLISH_LANE_PAYLOAD_MAX)
+		return MOSQ_ERR_PAYLOAD_SIZE;
+
+	//按队列长度接纳
+	if(__atomic_add_fetch(&lane->pending, 1, __ATOMIC_ACQ_REL) > (uint32_t)lane->depth)
+	{
+		__atomic_sub_fetch(&lane->pending, 1, __ATOMIC_ACQ_REL);
+		__atomic_add_fetch(&lane->stats.rejected, 1, __ATOMIC_RELAXED);
+		return MQTT_PUBLISH_WINDOW_FULL;
+	}
+
+	idx = ring_pop(&L.free_slots);
+	if(idx < 0)
+	{
+		__atomic_sub_fetch(&lane->pending, 1, __ATOMIC_ACQ_REL);
+		__atomic_add_fetch(&lane->stats.rejected, 1, __ATOMIC_RELAXED);
+		return MQTT_PUBLISH_WINDOW_FULL;
+	}
+
+	msg = &L.pool[idx];
+	msg->traffic_class = traffic_class;
+	msg->qos = qos;
+	msg->len = payloadlen;
+	msg->throttled = 0;
+	msg->enqueue_ms = now_ms();
+	msg->submit_time = time(NULL);
+	memcpy(msg->topic, topic, topic_len + 1);
+	memcpy(msg->payload, payload, payloadlen);
+
+	//submitted 与 free_slots 容量相同，不会失败
+	ring_push(&L.submitted, idx);
+	__atomic_add_fetch(&lane->stats.submitted, 1, __ATOMIC_RELAXED);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int publish_lane_room(int traffic_class)
+{
+	lane_t	*lane = &L.lanes[traffic_class];
+
+	return lane->depth - (int)__atomic_load_n(&lane->pending, __ATOMIC_ACQUIRE);
+}
+
+
+//把生产者提交的消息分拣到各自的发送队列
+static void sort_submitted(void)
+{
+	lane_t	*lane;
+	int		idx;
+
+	while((idx = ring_pop(&L.submitted)) >= 0)
+	{
+		lane = &L.lanes[L.pool[idx].traffic_class];
+		lane->ring[(lane->head + lane->count) % lane->depth] = idx;
+		lane->count++;
+	}
+}
+
+
+//队首消息因令牌不足被推迟：每条消息只计一次，而不是每次调度检查都计
+static void note_throttled(lane_t *lane)
+{
+	lane_msg_t	*msg = &L.pool[lane->ring[lane->head]];
+
+	if(!msg->throttled)
+	{
+		msg->throttled = 1;
+		lane->stats.throttled++;
+	}
+}
+
+
+static inline int lane_ready(lane_t *lane)
+{
+	if(!lane->count)
+		return 0;
+	if(!bucket_ready(&lane->bucket))
+	{
+		note_throttled(lane);
+		return 0;
+	}
+	return 1;
+}
+
+
+//选出下一条要发送的队列，没有可发送的返回 -1
+static int pick_lane(void)
+{
+	lane_t	*lane;
+	int		i;
+
+	for(i = 0; i < STRICT_COUNT; i++)
+	{
+		if(lane_ready(&L.lanes[strict_lanes[i]]))
+			return strict_lanes[i];
+	}
+
+	for(i = 0; i < WEIGHTED_COUNT; i++)
+	{
+		lane = &L.lanes[weighted_lanes[L.rr]];
+		if(lane_ready(lane))
+		{
+			if(lane->deficit <= 0)
+				lane->deficit = lane->weight;
+			return weighted_lanes[L.rr];
+		}
+
+		lane->deficit = 0;
+		L.rr = (L.rr + 1) % WEIGHTED_COUNT;
+	}
+
+	return -1;
+}
+
+
+/* 按优先级和令牌调度发送，返回本轮发送的消息数
+ * 只由拥有 mosquitto 实例的下行线程在连接正常时调用，发送队列不需要加锁
+ */
+int publish_lanes_drain(void)
+{
+	lane_t		*lane;
+	lane_msg_t	*msg;
+	uint64_t	now = now_ms();
+	uint64_t	wait;
+	int			sent = 0;
+	int			idx;
+	int			slot;
+	int			i;
+	int			rc;
+
+	sort_submitted();
+
+	bucket_refill(&L.device, now);
+	for(i = 0; i < MQTT_TRAFFIC_CLASS_COUNT; i++)
+		bucket_refill(&L.lanes[i].bucket, now);
+
+	pthread_mutex_lock(&L.stats_lock);
+	while(mqtt_connected_flag && keep_running)
+	{
+		if(!bucket_ready(&L.device))
+		{
+			for(i = 0; i < MQTT_TRAFFIC_CLASS_COUNT; i++)
+			{
+				if(L.lanes[i].count)
+					note_throttled(&L.lanes[i]);
+			}
+			break;
+		}
+
+		idx = pick_lane();
+		if(idx < 0)
+			break;
+		lane = &L.lanes[idx];
+		slot = lane->ring[lane->head];
+		msg = &L.pool[slot];
+
+		rc = mqtt_publish_tracked(msg->topic, msg->payload, msg->len, msg->qos, idx);
+		if(rc != MOSQ_ERR_SUCCESS)
+		{
+			//在途窗口已满或连接断开：留在队首，下一轮再发
+			if(rc != MQTT_PUBLISH_WINDOW_FULL)
+				log_error("Lane: Failed to publish %s message: %s\n", mqtt_traffic_class_name(idx), mosquitto_strerror(rc));
+			break;
+		}
+
+		lane->head = (lane->head + 1) % lane->depth;
+		lane->count--;
+
+		wait = now - msg->enqueue_ms;
+		lane->stats.sent++;
+		lane->stats.wait_sum_ms += wait;
+		if(wait > lane->stats.wait_max_ms)
+			lane->stats.wait_max_ms = (uint32_t)wait;
+
+		bucket_take(&L.device);
+		bucket_take(&lane->bucket);
+		if(idx == weighted_lanes[L.rr] && --lane->deficit <= 0)
+			L.rr = (L.rr + 1) % WEIGHTED_COUNT;
+
+		//先归还槽位再释放配额，被接纳的生产者总能拿到槽位
+		ring_push(&L.free_slots, slot);
+		__atomic_sub_fetch(&lane->pending, 1, __ATOMIC_ACQ_REL);
+		sent++;
+	}
+	pthread_mutex_unlock(&L.stats_lock);
+
+	return sent;
+}
+
+
+/* 退出时把仍在发送队列中的消息逐条交给 flush（例如写入 spool），返回被接管的条数
+ * 只能在下行线程结束后调用
+ */
+int publish_lanes_flush(publish_lane_flush_t flush)
+{
+	lane_t		*lane;
+	lane_msg_t	*msg;
+	int			slot;
+	int			kept = 0;
+	int			lost = 0;
+	int			i;
+
+	if(!L.pool)
+		return 0;
+
+	sort_submitted();
+
+	pthread_mutex_lock(&L.stats_lock);
+	for(i = 0; i < MQTT_TRAFFIC_CLASS_COUNT; i++)
+	{
+		lane = &L.lanes[i];
+		while(lane->count)
+		{
+			slot = lane->ring[lane->head];
+			msg = &L.pool[slot];
+			if(flush && flush(i, msg->topic, msg->payload, msg->len, msg->submit_time) == 0)
+				kept++;
+			else
+				lost++;
+
+			lane->head = (lane->head + 1) % lane->depth;
+			lane->count--;
+			ring_push(&L.free_slots, slot);
+			__atomic_sub_fetch(&lane->pending, 1, __ATOMIC_ACQ_REL);
+		}
+	}
+	pthread_mutex_unlock(&L.stats_lock);
+
+	if(kept || lost)
+		log_info("Lane: %d queued message(s) kept at shutdown, %d discarded.\n", kept, lost);
+	return kept;
+}
+
+
+void publish_lane_get_stats(int traffic_class, publish_lane_stats_t *stats)
+{
+	lane_t	*lane = &L.lanes[traffic_class];
+
+	pthread_mutex_lock(&L.stats_lock);
+	*stats = lane->stats;
+	stats->submitted = __atomic_load_n(&lane->stats.submitted, __ATOMIC_RELAXED);
+	stats->rejected = __atomic_load_n(&lane->stats.rejected, __ATOMIC_RELAXED);
+	stats->depth = __atomic_load_n(&lane->pending, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&L.stats_lock);
+}
+
+
+void publish_lanes_log_stats(void)
+{
+	publish_lane_stats_t	st;
+	int						i;
+
+	for(i = 0; i < MQTT_TRAFFIC_CLASS_COUNT; i++)
+	{
+		publish_lane_get_stats(i, &st);
+		if(!st.submitted)
+			continue;
+
+		log_info("Lane: %-9s submitted=%llu sent=%llu rejected=%llu throttled=%llu depth=%u wait_avg=%llums wait_max=%ums\n",
+				mqtt_traffic_class_name(i), (unsigned long long)st.submitted, (unsigned long long)st.sent,
+				(unsigned long long)st.rejected, (unsigned long long)st.throttled, st.depth,
+				(unsigned long long)(st.sent ? st.wait_sum_ms / st.sent : 0), st.wait_max_ms);
+	}
+}
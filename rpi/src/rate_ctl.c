@@ -0,0 +1,373 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  rate_ctl.c
+ *    Description:  This file implements adaptive sampling rate control.
+ *
+ *                  主线程每秒调用一次 rate_ctl_tick：积压达到 high_water 或 MQTT 断开超过
+ *                  disconnect_sec 进入压力状态，积压回落到 low_water 且已连接后退出，两次切换
+ *                  之间至少间隔 hold_sec。每个设备的目标间隔：告警后 alert_hold_sec 内为
+ *                  alert_sec，压力状态为 slow_sec，否则为 normal_sec。提速立即下发，降速要等
+ *                  上次改变超过 hold_sec；告警由 analytics 阶段通知，立即提速。
+ *                  命令写入成功后设备的间隔才改变，等待结果期间不再下发；失败时下个周期重试。
+ *                  BLE 链路断开后设备的间隔视为未知（设备可能已经重启），重新连接后重新下发。
+ *
+ *        Version:  1.0.0(2025年09月04日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月04日 10时21分37秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "rate_ctl.h"
+#include "cmd_job.h"
+#include "link_watch.h"
+#include "log.h"
+
+
+typedef struct {
+	char		path[256];         //D-Bus 设备路径
+	int			interval;          //设备当前的采样间隔（已确认写入的值），0 表示未知
+	int			pending;           //已提交、等待写入结果的间隔，0 表示没有
+	int			link_up;
+	uint64_t	changed_ms;        //最近一次改变速率的时间
+	uint64_t	alert_ms;          //最近一次告警的时间，0 表示没有告警
+} rate_device_t;
+
+
+static struct {
+	rate_ctl_config_t	config;
+	rate_device_t		devs[RATE_CTL_DEVICE_MAX];
+	int					count;
+	int					state;
+	uint64_t			state_ms;           //进入当前状态的时间
+	uint64_t			disconnected_ms;    //MQTT 断开的时间，0 表示已连接
+	uint64_t			last_tick_ms;
+	uint64_t			slow_ms;
+	uint64_t			alert_ms;
+	rate_ctl_stats_t	stats;
+	pthread_mutex_t		lock;
+} R = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+static uint64_t now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+//速率命令格式只允许一个 %d
+static int check_format(const char *fmt)
+{
+	const char	*p = strchr(fmt, '%');
+
+	return p && p[1] == 'd' && !strchr(p + 2, '%') ? 0 : -1;
+}
+
+
+int rate_ctl_init(const rate_ctl_config_t *config)
+{
+	rate_ctl_config_t	*c = &R.config;
+
+	pthread_mutex_lock(&R.lock);
+	*c = *config;
+	if(c->normal_sec <= 0)
+		c->normal_sec = 1;
+	if(c->slow_sec < c->normal_sec)
+		c->slow_sec = c->normal_sec;
+	if(c->alert_sec <= 0 || c->alert_sec > c->normal_sec)
+		c->alert_sec = c->normal_sec;
+	if(c->low_water >= c->high_water)
+		c->low_water = c->high_water / 2;
+
+	if(c->enabled && check_format(c->cmd_format) < 0)
+	{
+		log_error("RateCtl: Invalid cmd_format \"%s\", need exactly one %%d. Rate control disabled.\n", c->cmd_format);
+		c->enabled = 0;
+	}
+
+	memset(R.devs, 0, sizeof(R.devs));
+	R.count = 0;
+	R.state = RATE_CTL_NORMAL;
+	R.state_ms = 0;
+	R.disconnected_ms = 0;
+	R.last_tick_ms = 0;
+	R.slow_ms = 0;
+	R.alert_ms = 0;
+	memset(&R.stats, 0, sizeof(R.stats));
+	pthread_mutex_unlock(&R.lock);
+
+	if(c->enabled)
+		log_info("RateCtl: interval normal %ds, slow %ds, alert %ds; backlog %d/%d, hold %ds.\n",
+				c->normal_sec, c->slow_sec, c->alert_sec, c->high_water, c->low_water, c->hold_sec);
+	return 0;
+}
+
+
+//登记设备：设备的间隔未知（可能还保持着网关上次运行时下发的速率），链路建立后下发当前目标
+int rate_ctl_add_device(const char *device_path)
+{
+	int		i;
+
+	pthread_mutex_lock(&R.lock);
+	if(R.count == RATE_CTL_DEVICE_MAX)
+	{
+		pthread_mutex_unlock(&R.lock);
+		return -1;
+	}
+	i = R.count++;
+	snprintf(R.devs[i].path, sizeof(R.devs[i].path), "%s", device_path);
+	R.devs[i].interval = 0;
+	R.devs[i].link_up = 0;
+	pthread_mutex_unlock(&R.lock);
+
+	return i;
+}
+
+
+//设备路径及其下的特征值路径都能匹配（设备表在启动后不再变化）
+static int find_device(const char *path)
+{
+	size_t	len;
+	int		i;
+
+	for(i = 0; path && i < R.count; i++)
+	{
+		len = strlen(R.devs[i].path);
+		if(strncmp(path, R.devs[i].path, len) == 0 && (path[len] == '\0' || path[len] == '/'))
+			return i;
+	}
+	return -1;
+}
+
+
+//调用时持有锁
+static int alert_active(const rate_device_t *dev, uint64_t now)
+{
+	return dev->alert_ms && now - dev->alert_ms < (uint64_t)R.config.alert_hold_sec * 1000;
+}
+
+
+//按设备状态和网关状态下发速率命令（调用时持有锁）
+static void apply_locked(rate_device_t *dev, uint64_t now)
+{
+	char	cmd[RATE_CTL_CMD_MAX + 16];
+	int		target;
+	int		len;
+
+	if(alert_active(dev, now))
+		target = R.config.alert_sec;
+	else if(R.state == RATE_CTL_PRESSURE)
+		target = R.config.slow_sec;
+	else
+		target = R.config.normal_sec;
+
+	//链路断开时不下发；上一条命令还没有结果时等它完成，之后按当时的目标重新判断
+	if(!dev->link_up || dev->pending || target == dev->interval)
+		return ;
+
+	//降速要等上次改变保持够 hold_sec，提速（告警、压力解除）和间隔未知时立即执行
+	if(dev->interval && target > dev->interval && now - dev->changed_ms < (uint64_t)R.config.hold_sec * 1000)
+		return ;
+
+	len = snprintf(cmd, sizeof(cmd), R.config.cmd_format, target);
+	if(cmd_job_submit_property(dev->path, CMD_JOB_RATE, NULL, cmd, len, (uint32_t)target, 0) != 0)
+	{
+		//命令队列已满，下个周期重试
+		R.stats.failed++;
+		return ;
+	}
+
+	log_info("RateCtl: %s sampling interval %ds -> %ds requested.\n", dev->path, dev->interval, target);
+	dev->pending = target;
+	R.stats.commands++;
+}
+
+
+//命令线程在速率命令执行结束后调用，ok 为 0 表示写入失败或过期，下个周期重新下发
+void rate_ctl_done(const char *device_path, int interval, int ok)
+{
+	rate_device_t	*dev;
+	int				i;
+
+	if((i = find_device(device_path)) < 0)
+		return ;
+
+	pthread_mutex_lock(&R.lock);
+	dev = &R.devs[i];
+	if(dev->pending == interval)
+		dev->pending = 0;
+
+	if(!ok)
+	{
+		R.stats.failed++;
+		log_warn("RateCtl: %s failed to apply sampling interval %ds.\n", dev->path, interval);
+		pthread_mutex_unlock(&R.lock);
+		return ;
+	}
+
+	dev->interval = interval;
+	dev->changed_ms = now_ms();
+	R.stats.acked++;
+	pthread_mutex_unlock(&R.lock);
+
+	//通知间隔随之改变，静默检测按新间隔判断
+	link_watch_set_interval(device_path, interval * 1000);
+}
+
+
+/* BLE 链路状态变化（上行线程调用）
+ * 断开后设备的间隔未知，重新连接后立即下发当前目标，不受 hold_sec 限制
+ */
+void rate_ctl_set_link(const char *device_path, int up)
+{
+	rate_device_t	*dev;
+	int				i;
+
+	if(!R.config.enabled || (i = find_device(device_path)) < 0)
+		return ;
+
+	pthread_mutex_lock(&R.lock);
+	dev = &R.devs[i];
+	dev->link_up = up;
+	if(!up)
+		dev->interval = 0;
+	else
+		apply_locked(dev, now_ms());
+	pthread_mutex_unlock(&R.lock);
+}
+
+
+//由 analytics 阶段在采样触发告警时调用
+void rate_ctl_alert(const char *device_path)
+{
+	rate_device_t	*dev;
+	uint64_t		now = now_ms();
+	int				i;
+
+	if(!R.config.enabled || (i = find_device(device_path)) < 0)
+		return ;
+
+	pthread_mutex_lock(&R.lock);
+	dev = &R.devs[i];
+	if(!alert_active(dev, now))
+		R.stats.alerts++;
+	dev->alert_ms = now;
+	apply_locked(dev, now);
+	pthread_mutex_unlock(&R.lock);
+}
+
+
+static void tick_at(const rate_ctl_input_t *in, uint64_t now)
+{
+	uint64_t	hold = (uint64_t)R.config.hold_sec * 1000;
+	uint64_t	dt;
+	int			overloaded;
+	int			relieved;
+	int			i;
+
+	pthread_mutex_lock(&R.lock);
+	R.stats.ticks++;
+	R.stats.backlog = in->backlog;
+
+	if(!in->connected && !R.disconnected_ms)
+		R.disconnected_ms = now;
+	else if(in->connected)
+		R.disconnected_ms = 0;
+
+	//高低水位之间保持原状态
+	overloaded = in->backlog >= R.config.high_water ||
+		(R.disconnected_ms && now - R.disconnected_ms >= (uint64_t)R.config.disconnect_sec * 1000);
+	relieved = in->backlog <= R.config.low_water && in->connected;
+
+	if(R.state == RATE_CTL_NORMAL && overloaded && now - R.state_ms >= hold)
+	{
+		R.state = RATE_CTL_PRESSURE;
+		R.state_ms = now;
+		R.stats.pressure_enter++;
+		log_warn("RateCtl: Gateway under pressure (backlog %d, MQTT %s), slowing stable devices.\n",
+				in->backlog, in->connected ? "connected" : "disconnected");
+	}
+	else if(R.state == RATE_CTL_PRESSURE && relieved && now - R.state_ms >= hold)
+	{
+		R.state = RATE_CTL_NORMAL;
+		R.state_ms = now;
+		R.stats.pressure_exit++;
+		log_info("RateCtl: Backlog drained to %d, restoring normal sampling.\n", in->backlog);
+	}
+
+	//统计各设备以非默认速率运行的时间
+	dt = R.last_tick_ms ? now - R.last_tick_ms : 0;
+	R.last_tick_ms = now;
+	for(i = 0; i < R.count; i++)
+	{
+		if(R.devs[i].interval > R.config.normal_sec)
+			R.slow_ms += dt;
+		else if(R.devs[i].interval && R.devs[i].interval < R.config.normal_sec)
+			R.alert_ms += dt;
+
+		apply_locked(&R.devs[i], now);
+	}
+	pthread_mutex_unlock(&R.lock);
+}
+
+
+//主线程每秒调用一次
+void rate_ctl_tick(const rate_ctl_input_t *input)
+{
+	if(!R.config.enabled)
+		return ;
+
+	tick_at(input, now_ms());
+}
+
+
+//设备当前的采样间隔（秒），0 表示未知
+int rate_ctl_interval(int device)
+{
+	int		interval;
+
+	if(device < 0 || device >= R.count)
+		return -1;
+
+	pthread_mutex_lock(&R.lock);
+	interval = R.devs[device].interval;
+	pthread_mutex_unlock(&R.lock);
+	return interval;
+}
+
+
+void rate_ctl_get_stats(rate_ctl_stats_t *stats)
+{
+	pthread_mutex_lock(&R.lock);
+	*stats = R.stats;
+	stats->state = R.state;
+	stats->slow_sec = R.slow_ms / 1000;
+	stats->alert_sec = R.alert_ms / 1000;
+	pthread_mutex_unlock(&R.lock);
+}
+
+
+void rate_ctl_log_stats(void)
+{
+	rate_ctl_stats_t	st;
+
+	if(!R.config.enabled)
+		return ;
+
+	rate_ctl_get_stats(&st);
+	log_info("RateCtl: state=%s backlog=%u pressure_enter=%llu pressure_exit=%llu alerts=%llu commands=%llu acked=%llu failed=%llu slowed=%llus alert=%llus\n",
+			st.state == RATE_CTL_PRESSURE ? "pressure" : "normal", st.backlog,
+			(unsigned long long)st.pressure_enter, (unsigned long long)st.pressure_exit,
+			(unsigned long long)st.alerts, (unsigned long long)st.commands,
+			(unsigned long long)st.acked, (unsigned long long)st.failed, (unsigned long long)st.slow_sec,
+			(unsigned long long)st.alert_sec);
+}
@@ -0,0 +1,197 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  report_filter.c
+ *    Description:  This file implements the deadband and heartbeat report filter.
+ *
+ *                  report_filter_check() 只做判断，采样被发布或写入 spool 之后再调用
+ *                  report_filter_commit() 更新比较基准，发送失败的采样不会让后续变化被吞掉。
+ *                  过滤器只由上行线程调用，统计由主线程读取，用锁保护。
+ *
+ *        Version:  1.0.0(2025年08月31日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月31日 10时05分19秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "report_filter.h"
+#include "log.h"
+
+
+static struct {
+	report_filter_config_t	cfg;
+
+	//上次上报的采样
+	int32_t					last[TELEMETRY_PROP_COUNT];
+	int						has_last;
+	int						last_alert;
+	time_t					last_report;   //单调时钟，秒
+	int						pending;       //最近一次 check 的上报原因
+
+	report_filter_stats_t	stats;
+	pthread_mutex_t			lock;
+} F = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+static time_t now_sec(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+
+static int32_t prop_value(const telemetry_record_t *rec, int i)
+{
+	switch(i)
+	{
+#define X(name, key, ble_key, scale, min, max) case TELEMETRY_PROP_##name: return rec->name;
+		TELEMETRY_PROPERTIES(X)
+#undef X
+	}
+	return 0;
+}
+
+
+int report_filter_init(const report_filter_config_t *config)
+{
+	static const char	*names[TELEMETRY_PROP_COUNT] = {
+#define X(name, key, ble_key, scale, min, max) #name,
+		TELEMETRY_PROPERTIES(X)
+#undef X
+	};
+	int					i;
+
+	F.cfg = *config;
+	F.has_last = 0;
+	F.last_alert = 0;
+	memset(&F.stats, 0, sizeof(F.stats));
+
+	if(F.cfg.heartbeat_sec <= 0)
+	{
+		log_info("Filter: Deadband reporting disabled, every sample is published.\n");
+		return 0;
+	}
+
+	log_info("Filter: Heartbeat every %d s.\n", F.cfg.heartbeat_sec);
+	for(i = 0; i < TELEMETRY_PROP_COUNT; i++)
+	{
+		log_info("Filter: %-5s deadband abs=%d rel=%d%%\n", names[i],
+				F.cfg.deadband[i].abs, F.cfg.deadband[i].rel_pct);
+	}
+	return 0;
+}
+
+
+//任一属性的变化超过绝对死区或相对死区时返回 1
+static int outside_deadband(const telemetry_record_t *rec)
+{
+	const report_deadband_t	*db;
+	int32_t					v, base, diff;
+	int						i;
+
+	for(i = 0; i < TELEMETRY_PROP_COUNT; i++)
+	{
+		if(!(rec->present & (1u << i)))
+			continue;
+
+		db = &F.cfg.deadband[i];
+		v = prop_value(rec, i);
+		base = F.last[i];
+		diff = v > base ? v - base : base - v;
+
+		if(diff > db->abs)
+			return 1;
+		if(db->rel_pct > 0 && (int64_t)diff * 100 > (int64_t)db->rel_pct * (base < 0 ? -base : base))
+			return 1;
+	}
+	return 0;
+}
+
+
+/* 判断采样是否需要上报，返回上报原因，REPORT_SUPPRESS 表示丢弃
+ * alert 为 1 表示该采样触发了告警
+ */
+int report_filter_check(const telemetry_record_t *rec, int alert)
+{
+	int		reason;
+
+	if(F.cfg.heartbeat_sec <= 0)
+		reason = REPORT_UNFILTERED;
+	else if(!F.has_last)
+		reason = REPORT_FIRST;
+	else if(alert || F.last_alert)
+		reason = REPORT_ALERT;      //告警期间每个采样都上报，解除后的第一个采样也上报
+	else if(outside_deadband(rec))
+		reason = REPORT_DEADBAND;
+	else if(now_sec() - F.last_report >= F.cfg.heartbeat_sec)
+		reason = REPORT_HEARTBEAT;
+	else
+		reason = REPORT_SUPPRESS;
+
+	pthread_mutex_lock(&F.lock);
+	F.stats.samples++;
+	if(reason == REPORT_SUPPRESS)
+		F.stats.suppressed++;
+	pthread_mutex_unlock(&F.lock);
+
+	F.pending = reason;
+	return reason;
+}
+
+
+//采样已发布或写入 spool，更新比较基准
+void report_filter_commit(const telemetry_record_t *rec, int alert)
+{
+	int		i;
+
+	for(i = 0; i < TELEMETRY_PROP_COUNT; i++)
+	{
+		if(rec->present & (1u << i))
+			F.last[i] = prop_value(rec, i);
+	}
+	F.has_last = 1;
+	F.last_alert = alert;
+	F.last_report = now_sec();
+
+	pthread_mutex_lock(&F.lock);
+	F.stats.reported++;
+	if(F.pending == REPORT_DEADBAND)
+		F.stats.deadband++;
+	else if(F.pending == REPORT_HEARTBEAT)
+		F.stats.heartbeat++;
+	else if(F.pending == REPORT_ALERT)
+		F.stats.alert++;
+	pthread_mutex_unlock(&F.lock);
+}
+
+
+void report_filter_get_stats(report_filter_stats_t *stats)
+{
+	pthread_mutex_lock(&F.lock);
+	*stats = F.stats;
+	pthread_mutex_unlock(&F.lock);
+}
+
+
+void report_filter_log_stats(void)
+{
+	report_filter_stats_t	st;
+
+	report_filter_get_stats(&st);
+	if(!st.samples)
+		return ;
+
+	log_info("Filter: samples=%llu reported=%llu (deadband=%llu heartbeat=%llu alert=%llu) suppressed=%llu ratio=%.1f%%\n",
+			(unsigned long long)st.samples, (unsigned long long)st.reported, (unsigned long long)st.deadband,
+			(unsigned long long)st.heartbeat, (unsigned long long)st.alert, (unsigned long long)st.suppressed,
+			100.0 * st.suppressed / st.samples);
+}
@@ -0,0 +1,369 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  shadow.c
+ *    Description:  This file implements the local device shadow.
+ *
+ *                  reported 由 decode 阶段在每条通知解码后更新，每个属性单独记录更新时间；
+ *                  desired 只保存正在写入 BLE 的属性（pending 位图），写入成功后转入 written。
+ *                  properties/set 与 written（最近一次成功写入设备的值）比较，而不是与 reported：
+ *                  reported 可能早于写入或已过期，据此跳过写入会漏掉设备仍需要的设置；
+ *                  BLE 链路断开后 written 作废，设备可能已经重启。
+ *                  各线程通过一把锁访问，临界区只有内存复制。
+ *
+ *        Version:  1.0.0(2025年09月03日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月03日 14时12分09秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <json-c/json.h>
+
+#include "shadow.h"
+#include "log.h"
+
+
+typedef struct {
+	char				path[256];                          //D-Bus 设备路径
+	telemetry_record_t	reported;
+	uint64_t			updated_ms[TELEMETRY_PROP_COUNT];   //各属性最近一次更新的时间
+	telemetry_record_t	desired;
+	uint32_t			pending;                            //正在写入 BLE 的属性
+	telemetry_record_t	written;                            //最近一次成功写入设备的值，present 为有效的属性
+} shadow_device_t;
+
+
+static struct {
+	shadow_device_t	devs[SHADOW_DEVICE_MAX];
+	int				count;
+	int				max_age_ms;
+	shadow_stats_t	stats;
+	pthread_mutex_t	lock;
+} SH = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+static uint64_t now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+//取 rec 中第 i 个属性的值
+static int32_t prop_value(const telemetry_record_t *rec, int i)
+{
+	switch(i)
+	{
+#define X(name, key, ble_key, scale, min, max) case TELEMETRY_PROP_##name: return rec->name;
+		TELEMETRY_PROPERTIES(X)
+#undef X
+	}
+	return 0;
+}
+
+static void prop_set(telemetry_record_t *rec, int i, int32_t value)
+{
+	switch(i)
+	{
+#define X(name, key, ble_key, scale, min, max) case TELEMETRY_PROP_##name: rec->name = value; break;
+		TELEMETRY_PROPERTIES(X)
+#undef X
+	}
+	rec->present |= 1u << i;
+}
+
+
+int shadow_init(const shadow_config_t *config)
+{
+	pthread_mutex_lock(&SH.lock);
+	memset(SH.devs, 0, sizeof(SH.devs));
+	SH.count = 0;
+	SH.max_age_ms = config->max_age_ms > 0 ? config->max_age_ms : 5000;
+	memset(&SH.stats, 0, sizeof(SH.stats));
+	pthread_mutex_unlock(&SH.lock);
+
+	log_info("Shadow: properties/get answered from cache when younger than %d ms.\n", SH.max_age_ms);
+	return 0;
+}
+
+
+int shadow_add_device(const char *device_path)
+{
+	int		i;
+
+	pthread_mutex_lock(&SH.lock);
+	if(SH.count == SHADOW_DEVICE_MAX)
+	{
+		pthread_mutex_unlock(&SH.lock);
+		return -1;
+	}
+	i = SH.count++;
+	snprintf(SH.devs[i].path, sizeof(SH.devs[i].path), "%s", device_path);
+	pthread_mutex_unlock(&SH.lock);
+
+	return i;
+}
+
+
+//按 D-Bus 路径查找设备，设备路径及其下的特征值路径都能匹配（设备表在启动后不再变化）
+int shadow_find(const char *path)
+{
+	size_t	len;
+	int		i;
+
+	for(i = 0; path && i < SH.count; i++)
+	{
+		len = strlen(SH.devs[i].path);
+		if(strncmp(path, SH.devs[i].path, len) == 0 && (path[len] == '\0' || path[len] == '/'))
+			return i;
+	}
+	return -1;
+}
+
+
+//用解码后的通知更新 reported，只更新通知中出现的属性
+void shadow_update(int device, const telemetry_record_t *rec)
+{
+	shadow_device_t	*dev;
+	uint64_t		now = now_ms();
+	int				i;
+
+	if(device < 0 || device >= SH.count)
+		return ;
+
+	pthread_mutex_lock(&SH.lock);
+	dev = &SH.devs[device];
+	for(i = 0; i < TELEMETRY_PROP_COUNT; i++)
+	{
+		if(rec->present & (1u << i))
+		{
+			prop_set(&dev->reported, i, prop_value(rec, i));
+			dev->updated_ms[i] = now;
+		}
+	}
+	dev->reported.timestamp = rec->timestamp;
+	SH.stats.updates++;
+	pthread_mutex_unlock(&SH.lock);
+}
+
+
+//调用时持有锁
+static int get_locked(int device, telemetry_record_t *rec)
+{
+	shadow_device_t	*dev = &SH.devs[device];
+	uint64_t		now = now_ms();
+	int				i;
+
+	*rec = dev->reported;
+	if(!rec->present)
+		return SHADOW_EMPTY;
+
+	for(i = 0; i < TELEMETRY_PROP_COUNT; i++)
+	{
+		if(!(rec->present & (1u << i)) || now - dev->updated_ms[i] > (uint64_t)SH.max_age_ms)
+			return SHADOW_STALE;
+	}
+	return SHADOW_FRESH;
+}
+
+
+//取缓存的属性值，返回 SHADOW_FRESH / SHADOW_STALE / SHADOW_EMPTY
+int shadow_get(int device, telemetry_record_t *rec)
+{
+	int		rv;
+
+	if(device < 0 || device >= SH.count)
+	{
+		memset(rec, 0, sizeof(*rec));
+		return SHADOW_EMPTY;
+	}
+
+	pthread_mutex_lock(&SH.lock);
+	rv = get_locked(device, rec);
+	pthread_mutex_unlock(&SH.lock);
+	return rv;
+}
+
+
+//处理云端 properties/get：同 shadow_get，并统计缓存命中
+int shadow_query(int device, telemetry_record_t *rec)
+{
+	int		rv;
+
+	rv = shadow_get(device, rec);
+
+	pthread_mutex_lock(&SH.lock);
+	if(rv == SHADOW_FRESH)
+		SH.stats.get_hits++;
+	else
+		SH.stats.get_misses++;
+	pthread_mutex_unlock(&SH.lock);
+	return rv;
+}
+
+
+/* 解析 IoTDA properties/set 请求中本服务的属性，例如
+ * {"object_device_id":"xxx","services":[{"service_id":"mqtt","properties":{"HR":80}}]}
+ * 取值按属性表的缩放系数转为定点整数，返回解析出的属性数
+ */
+int shadow_parse_set(const void *payload, int payloadlen, telemetry_record_t *desired)
+{
+	json_object		*root;
+	json_object		*services;
+	json_object		*svc;
+	json_object		*props;
+	json_object		*sid;
+	json_object		*val;
+	double			d;
+	int				n = 0;
+	int				i;
+
+	memset(desired, 0, sizeof(*desired));
+
+	//libmosquitto 收到的负载总是以 '\0' 结尾
+	root = json_tokener_parse((const char *)payload);
+	if(!root)
+		return -1;
+
+	if(json_object_object_get_ex(root, "services", &services) && json_object_is_type(services, json_type_array))
+	{
+		for(i = 0; i < (int)json_object_array_length(services); i++)
+		{
+			svc = json_object_array_get_idx(services, i);
+			if(!json_object_object_get_ex(svc, "service_id", &sid) ||
+			   !json_object_is_type(sid, json_type_string) ||
+			   strcmp(json_object_get_string(sid), TELEMETRY_SERVICE_ID) != 0 ||
+			   !json_object_object_get_ex(svc, "properties", &props))
+				continue;
+
+#define X(name, key, ble_key, scale, min, max) \
+			if(json_object_object_get_ex(props, key, &val)) \
+			{ \
+				d = json_object_get_double(val) * (scale); \
+				prop_set(desired, TELEMETRY_PROP_##name, (int32_t)(d < 0 ? d - 0.5 : d + 0.5)); \
+				n++; \
+			}
+			TELEMETRY_PROPERTIES(X)
+#undef X
+		}
+	}
+
+	json_object_put(root);
+	return n;
+}
+
+
+/* 计算需要写入 BLE 的属性：与正在写入的值相同、或没有正在写入且与上次成功写入的值相同的属性不写
+ * 返回需要写入的属性位图，这些属性标记为正在写入，写入完成后调用 shadow_set_done
+ */
+uint32_t shadow_set_desired(int device, const telemetry_record_t *desired)
+{
+	shadow_device_t	*dev;
+	uint32_t		mask = 0;
+	uint32_t		bit;
+	int32_t			value;
+	int				i;
+
+	if(device < 0 || device >= SH.count)
+		return desired->present;
+
+	pthread_mutex_lock(&SH.lock);
+	dev = &SH.devs[device];
+	SH.stats.set_requests++;
+
+	for(i = 0; i < TELEMETRY_PROP_COUNT; i++)
+	{
+		bit = 1u << i;
+		if(!(desired->present & bit))
+			continue;
+
+		SH.stats.set_props++;
+		value = prop_value(desired, i);
+		if(dev->pending & bit)
+		{
+			if(prop_value(&dev->desired, i) == value)
+			{
+				SH.stats.set_collapsed++;
+				continue;
+			}
+		}
+		else if((dev->written.present & bit) && prop_value(&dev->written, i) == value)
+		{
+			SH.stats.set_collapsed++;
+			continue;
+		}
+
+		prop_set(&dev->desired, i, value);
+		dev->pending |= bit;
+		mask |= bit;
+	}
+	SH.stats.set_written += __builtin_popcount(mask);
+	pthread_mutex_unlock(&SH.lock);
+
+	return mask;
+}
+
+
+//写入结束，ok 非 0 时记录为设备的已写入值，失败时这些属性的设备状态未知，下次总是写入
+void shadow_set_done(int device, uint32_t mask, int ok)
+{
+	shadow_device_t	*dev;
+	int				i;
+
+	if(device < 0 || device >= SH.count)
+		return ;
+
+	pthread_mutex_lock(&SH.lock);
+	dev = &SH.devs[device];
+	for(i = 0; i < TELEMETRY_PROP_COUNT; i++)
+	{
+		if(!(mask & (1u << i)))
+			continue;
+		if(ok)
+			prop_set(&dev->written, i, prop_value(&dev->desired, i));
+		else
+			dev->written.present &= ~(1u << i);
+	}
+	dev->pending &= ~mask;
+	pthread_mutex_unlock(&SH.lock);
+}
+
+
+//BLE 链路断开：设备可能重启并丢失设置，之后的 set 请求全部写入
+void shadow_link_down(int device)
+{
+	if(device < 0 || device >= SH.count)
+		return ;
+
+	pthread_mutex_lock(&SH.lock);
+	SH.devs[device].written.present = 0;
+	pthread_mutex_unlock(&SH.lock);
+}
+
+
+void shadow_get_stats(shadow_stats_t *stats)
+{
+	pthread_mutex_lock(&SH.lock);
+	*stats = SH.stats;
+	pthread_mutex_unlock(&SH.lock);
+}
+
+
+void shadow_log_stats(void)
+{
+	shadow_stats_t	st;
+
+	shadow_get_stats(&st);
+	log_info("Shadow: updates=%llu get_hits=%llu get_misses=%llu set_requests=%llu set_props=%llu written=%llu collapsed=%llu\n",
+			(unsigned long long)st.updates, (unsigned long long)st.get_hits,
+			(unsigned long long)st.get_misses, (unsigned long long)st.set_requests,
+			(unsigned long long)st.set_props, (unsigned long long)st.set_written,
+			(unsigned long long)st.set_collapsed);
+}
@@ -0,0 +1,596 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  spool.c
+ *    Description:  This file implements a crash-safe store-and-forward spool.
+ *
+ *                  文件布局：[4K 文件头][段0][段1]...[段N-1]
+ *                  每个段内顺序存放记录，记录头带序号和 CRC32，段尾写 0 作为结束标记。
+ *                  写满预算后覆盖最旧的整段。崩溃后从文件头保存的读位置开始
+ *                  按序号连续、CRC 正确的原则扫描恢复写位置，因此文件头只需在
+ *                  跨段时更新，减少对 SD 卡同一扇区的反复擦写。
+ *
+ *        Version:  1.0.0(2025年08月12日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月12日 10时12分40秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "spool.h"
+#include "log.h"
+
+
+#define SPOOL_FILE_MAGIC	0x4c4f5053 // "SPOL"
+#define SPOOL_REC_MAGIC		0x31434552 // "REC1"
+#define SPOOL_VERSION		1
+#define SPOOL_HDR_SIZE		4096
+#define SPOOL_MIN_SEGMENTS	2
+
+#define SPOOL_ALIGN(x)		(((x) + 7) & ~((size_t)7))
+
+
+//文件头，位于文件开头的第一页
+typedef struct {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	segment_size;
+	uint32_t	segment_count;
+	uint64_t	tail_seq;      //下一条待回放记录的序号
+	uint32_t	tail_seg;      //读位置所在段
+	uint32_t	tail_off;      //读位置段内偏移
+	uint32_t	crc;           //以上字段的CRC
+} spool_file_hdr_t;
+
+//记录头，后面紧跟负载，整体按8字节对齐
+typedef struct {
+	uint32_t	magic;
+	uint32_t	len;
+	uint64_t	seq;
+	int64_t		timestamp;
+	uint32_t	crc;           //seq、timestamp、len、非 0 的 channel 和负载的CRC
+	uint32_t	channel;       //SPOOL_CHANNEL_*，原为保留字段（0）
+} spool_rec_hdr_t;
+
+
+static struct {
+	int					ready;
+	int					fd;
+	uint8_t				*map;
+	size_t				map_size;
+	spool_file_hdr_t	*hdr;
+	uint32_t			seg_size;
+	uint32_t			seg_count;
+
+	uint32_t			head_seg;   //写位置
+	uint32_t			head_off;
+	uint64_t			head_seq;
+
+	uint32_t			tail_seg;   //读位置
+	uint32_t			tail_off;
+	uint64_t			tail_seq;
+
+	uint64_t			peeked_seq; //最近一次 spool_peek 返回的记录序号
+	spool_stats_t		stats;
+	pthread_mutex_t		lock;
+} S = { .fd = -1 };
+
+
+static uint32_t crc_table[256];
+
+static void crc32_init(void)
+{
+	uint32_t	c;
+	int			i, k;
+
+	for(i = 0; i < 256; i++)
+	{
+		c = (uint32_t)i;
+		for(k = 0; k < 8; k++)
+			c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t	*p = (const uint8_t *)data;
+
+	crc = ~crc;
+	while(len--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static uint32_t record_crc(const spool_rec_hdr_t *rec, const void *payload)
+{
+	uint32_t	crc;
+
+	crc = crc32_update(0, &rec->seq, sizeof(rec->seq));
+	crc = crc32_update(crc, &rec->timestamp, sizeof(rec->timestamp));
+	crc = crc32_update(crc, &rec->len, sizeof(rec->len));
+	//channel 为 0 时不参与计算，升级前写入的记录仍然有效
+	if(rec->channel)
+		crc = crc32_update(crc, &rec->channel, sizeof(rec->channel));
+	return crc32_update(crc, payload, rec->len);
+}
+
+static uint32_t header_crc(const spool_file_hdr_t *hdr)
+{
+	return crc32_update(0, hdr, offsetof(spool_file_hdr_t, crc));
+}
+
+
+static inline uint8_t *seg_base(uint32_t seg)
+{
+	return S.map + SPOOL_HDR_SIZE + (size_t)seg * S.seg_size;
+}
+
+
+//读取并校验指定位置的记录，返回记录头指针，无效则返回NULL
+static spool_rec_hdr_t *record_at(uint32_t seg, uint32_t off)
+{
+	spool_rec_hdr_t	*rec;
+
+	if(off + sizeof(spool_rec_hdr_t) > S.seg_size)
+		return NULL;
+
+	rec = (spool_rec_hdr_t *)(seg_base(seg) + off);
+	if(rec->magic != SPOOL_REC_MAGIC)
+		return NULL;
+
+	if(rec->len > SPOOL_MAX_PAYLOAD || off + SPOOL_ALIGN(sizeof(*rec) + rec->len) > S.seg_size)
+		return NULL;
+
+	if(record_crc(rec, rec + 1) != rec->crc)
+	{
+		S.stats.crc_errors++;
+		return NULL;
+	}
+
+	return rec;
+}
+
+
+//将读位置持久化到文件头（只在跨段或关闭时调用）
+static void persist_tail(void)
+{
+	S.hdr->tail_seq = S.tail_seq;
+	S.hdr->tail_seg = S.tail_seg;
+	S.hdr->tail_off = S.tail_off;
+	S.hdr->crc = header_crc(S.hdr);
+	msync(S.map, SPOOL_HDR_SIZE, MS_ASYNC);
+}
+
+
+//当写位置进入最旧数据所在的段时，丢弃该段中尚未回放的全部记录
+static void drop_segment(uint32_t seg)
+{
+	spool_rec_hdr_t	*rec;
+
+	while(S.tail_seq != S.head_seq && S.tail_seg == seg)
+	{
+		rec = record_at(S.tail_seg, S.tail_off);
+		if(rec && rec->seq == S.tail_seq)
+		{
+			S.stats.dropped++;
+			S.stats.pending--;
+			S.stats.pending_bytes -= SPOOL_ALIGN(sizeof(*rec) + rec->len);
+			S.tail_off += SPOOL_ALIGN(sizeof(*rec) + rec->len);
+			S.tail_seq++;
+			continue;
+		}
+
+		//到达段尾，读位置移到下一段
+		S.tail_seg = (S.tail_seg + 1) % S.seg_count;
+		S.tail_off = 0;
+	}
+
+	if(S.tail_seq == S.head_seq)
+	{
+		S.stats.pending = 0;
+		S.stats.pending_bytes = 0;
+	}
+}
+
+
+//封闭当前段并将写位置移到下一段
+static void seal_segment(void)
+{
+	uint32_t	next;
+
+	if(S.head_off + sizeof(uint32_t) <= S.seg_size)
+		memset(seg_base(S.head_seg) + S.head_off, 0, sizeof(uint32_t));
+
+	//整段写满后异步刷盘，避免每条记录都触发一次闪存写入
+	msync(seg_base(S.head_seg), S.seg_size, MS_ASYNC);
+
+	next = (S.head_seg + 1) % S.seg_count;
+	if(S.tail_seq != S.head_seq && S.tail_seg == next)
+	{
+		drop_segment(next);
+		log_warn("Spool: Byte budget exhausted, oldest segment dropped (total dropped %llu).\n",
+				(unsigned long long)S.stats.dropped);
+	}
+
+	S.head_seg = next;
+	S.head_off = 0;
+
+	if(S.tail_seq == S.head_seq)
+	{
+		S.tail_seg = S.head_seg;
+		S.tail_off = S.head_off;
+	}
+	persist_tail();
+}
+
+
+//从读位置开始扫描，恢复写位置和待回放记录数
+static void recover(void)
+{
+	spool_rec_hdr_t	*rec;
+	uint32_t		seg = S.tail_seg;
+	uint32_t		off = S.tail_off;
+	uint32_t		visited = 0;
+	uint32_t		hop;
+	int				first = 1;
+
+	S.head_seq = S.tail_seq;
+
+	while(visited < S.seg_count)
+	{
+		rec = record_at(seg, off);
+		//第一条记录允许序号跳跃：读位置是延迟持久化的，其间可能有段被覆盖
+		if(rec && (first ? rec->seq >= S.head_seq : rec->seq == S.head_seq))
+		{
+			if(first)
+			{
+				S.tail_seq = rec->seq;
+				S.tail_seg = seg;
+				S.tail_off = off;
+				first = 0;
+			}
+			S.head_seq = rec->seq + 1;
+			S.stats.pending++;
+			S.stats.pending_bytes += SPOOL_ALIGN(sizeof(*rec) + rec->len);
+			off += SPOOL_ALIGN(sizeof(*rec) + rec->len);
+			continue;
+		}
+
+		//段尾标记或损坏的记录：与 spool_peek 一样在后续段的开头重新同步，
+		//序号不小于 head_seq 的才是本轮写入的数据（更早一轮的段序号更小），跳过的记录由回放计入 corrupt
+		for(hop = 1; visited + hop < S.seg_count; hop++)
+		{
+			rec = record_at((seg + hop) % S.seg_count, 0);
+			if(rec && rec->seq >= S.head_seq)
+				break;
+		}
+		if(visited + hop >= S.seg_count)
+			break;
+
+		if(rec->seq != S.head_seq || (off + sizeof(uint32_t) <= S.seg_size && *(uint32_t *)(seg_base(seg) + off) != 0))
+			log_warn("Spool: Corrupt data in segment %u at offset %u, resuming at segment %u.\n",
+					seg, off, (seg + hop) % S.seg_count);
+		S.head_seq = rec->seq;
+		seg = (seg + hop) % S.seg_count;
+		off = 0;
+		visited += hop;
+	}
+
+	S.head_seg = seg;
+	S.head_off = off;
+	if(first)
+	{
+		//没有有效数据：从读位置重新开始
+		S.tail_seq = S.head_seq;
+		S.head_seg = S.tail_seg;
+		S.head_off = S.tail_off;
+	}
+}
+
+
+int spool_open(const spool_config_t *cfg)
+{
+	struct stat		st;
+	uint32_t		seg_size;
+	uint32_t		seg_count;
+	size_t			map_size;
+	int				fresh = 0;
+
+	if(!cfg || !cfg->enable || !cfg->path)
+		return SPOOL_ERR_DISABLED;
+
+	seg_size = (uint32_t)(cfg->segment_size ? cfg->segment_size : 65536);
+	seg_size = (seg_size + SPOOL_HDR_SIZE - 1) & ~(SPOOL_HDR_SIZE - 1); //按页对齐
+	seg_count = (uint32_t)(cfg->max_bytes / seg_size);
+	if(seg_count < SPOOL_MIN_SEGMENTS)
+		seg_count = SPOOL_MIN_SEGMENTS;
+	map_size = SPOOL_HDR_SIZE + (size_t)seg_size * seg_count;
+
+	crc32_init();
+	pthread_mutex_init(&S.lock, NULL);
+
+	S.fd = open(cfg->path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if(S.fd < 0)
+	{
+		log_error("Spool: Failed to open '%s': %s\n", cfg->path, strerror(errno));
+		return SPOOL_ERR_IO;
+	}
+
+	if(fstat(S.fd, &st) < 0 || (size_t)st.st_size != map_size)
+	{
+		//新文件或段配置发生变化，重建文件
+		if(ftruncate(S.fd, 0) < 0 || ftruncate(S.fd, map_size) < 0)
+		{
+			log_error("Spool: Failed to size '%s' to %zu bytes: %s\n", cfg->path, map_size, strerror(errno));
+			close(S.fd);
+			S.fd = -1;
+			return SPOOL_ERR_IO;
+		}
+		fresh = 1;
+	}
+
+	S.map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, S.fd, 0);
+	if(S.map == MAP_FAILED)
+	{
+		log_error("Spool: mmap failed: %s\n", strerror(errno));
+		close(S.fd);
+		S.fd = -1;
+		S.map = NULL;
+		return SPOOL_ERR_IO;
+	}
+
+	S.map_size = map_size;
+	S.hdr = (spool_file_hdr_t *)S.map;
+	S.seg_size = seg_size;
+	S.seg_count = seg_count;
+	memset(&S.stats, 0, sizeof(S.stats));
+
+	if(fresh || S.hdr->magic != SPOOL_FILE_MAGIC || S.hdr->version != SPOOL_VERSION ||
+	   S.hdr->segment_size != seg_size || S.hdr->segment_count != seg_count ||
+	   S.hdr->crc != header_crc(S.hdr) || S.hdr->tail_seg >= seg_count || S.hdr->tail_off >= seg_size)
+	{
+		memset(S.hdr, 0, SPOOL_HDR_SIZE);
+		S.hdr->magic = SPOOL_FILE_MAGIC;
+		S.hdr->version = SPOOL_VERSION;
+		S.hdr->segment_size = seg_size;
+		S.hdr->segment_count = seg_count;
+		S.tail_seq = 1;
+		S.tail_seg = 0;
+		S.tail_off = 0;
+		memset(seg_base(0), 0, sizeof(uint32_t));
+		persist_tail();
+	}
+	else
+	{
+		S.tail_seq = S.hdr->tail_seq;
+		S.tail_seg = S.hdr->tail_seg;
+		S.tail_off = S.hdr->tail_off;
+	}
+
+	recover();
+	S.ready = 1;
+
+	log_info("Spool: Opened '%s' (%u x %u bytes), %llu record(s) pending replay.\n",
+			cfg->path, seg_count, seg_size, (unsigned long long)S.stats.pending);
+	return SPOOL_OK;
+}
+
+
+void spool_close(void)
+{
+	if(!S.ready)
+		return ;
+
+	pthread_mutex_lock(&S.lock);
+	persist_tail();
+	msync(S.map, S.map_size, MS_SYNC);
+	munmap(S.map, S.map_size);
+	close(S.fd);
+	S.map = NULL;
+	S.fd = -1;
+	S.ready = 0;
+	pthread_mutex_unlock(&S.lock);
+
+	pthread_mutex_destroy(&S.lock);
+}
+
+
+int spool_is_open(void)
+{
+	return S.ready;
+}
+
+
+//追加一条记录，预算用尽时覆盖最旧的段
+int spool_append(int channel, time_t timestamp, const void *payload, size_t len)
+{
+	spool_rec_hdr_t	*rec;
+	size_t			need;
+
+	if(!S.ready)
+		return SPOOL_ERR_DISABLED;
+
+	need = SPOOL_ALIGN(sizeof(spool_rec_hdr_t) + len);
+	if(len > SPOOL_MAX_PAYLOAD || need > S.seg_size)
+		return SPOOL_ERR_TOOBIG;
+
+	pthread_mutex_lock(&S.lock);
+
+	if(S.head_off + need > S.seg_size)
+		seal_segment();
+
+	rec = (spool_rec_hdr_t *)(seg_base(S.head_seg) + S.head_off);
+	memcpy(rec + 1, payload, len);
+	rec->len = (uint32_t)len;
+	rec->seq = S.head_seq;
+	rec->timestamp = (int64_t)timestamp;
+	rec->channel = (uint32_t)channel;
+	rec->crc = record_crc(rec, rec + 1);
+	rec->magic = SPOOL_REC_MAGIC;
+
+	S.head_off += need;
+	S.head_seq++;
+	S.stats.appended++;
+	S.stats.pending++;
+	S.stats.pending_bytes += need;
+
+	pthread_mutex_unlock(&S.lock);
+	return SPOOL_OK;
+}
+
+
+//回放时跳过损坏的记录后重新统计待回放字节数（只在发现损坏时调用）
+static size_t pending_bytes_from_tail(void)
+{
+	spool_rec_hdr_t	*rec;
+	uint32_t		seg = S.tail_seg;
+	uint32_t		off = S.tail_off;
+	uint64_t		seq = S.tail_seq;
+	uint32_t		hops = 0;
+	size_t			bytes = 0;
+
+	while(seq != S.head_seq && hops <= S.seg_count)
+	{
+		rec = record_at(seg, off);
+		if(rec && rec->seq >= seq && rec->seq < S.head_seq)
+		{
+			bytes += SPOOL_ALIGN(sizeof(*rec) + rec->len);
+			off += SPOOL_ALIGN(sizeof(*rec) + rec->len);
+			seq = rec->seq + 1;
+			continue;
+		}
+		seg = (seg + 1) % S.seg_count;
+		off = 0;
+		hops++;
+	}
+	return bytes;
+}
+
+
+//跳过 skipped 条损坏的记录：从待回放中扣除并计入 corrupt
+static void skip_corrupt(uint64_t skipped)
+{
+	if(!skipped)
+		return ;
+
+	S.stats.corrupt += skipped;
+	S.stats.pending = S.head_seq - S.tail_seq;
+	S.stats.pending_bytes = pending_bytes_from_tail();
+	log_warn("Spool: Skipped %llu corrupt record(s) during replay (total %llu).\n",
+			(unsigned long long)skipped, (unsigned long long)S.stats.corrupt);
+}
+
+
+//读取最旧的一条待回放记录（不移动读位置，成功发布后再调用 spool_consume）
+int spool_peek(void *buf, size_t size, size_t *len, time_t *timestamp, int *channel)
+{
+	spool_rec_hdr_t	*rec;
+	uint64_t		skipped;
+	int				rv = SPOOL_EMPTY;
+	int				hops = 0;
+
+	if(!S.ready)
+		return SPOOL_ERR_DISABLED;
+
+	pthread_mutex_lock(&S.lock);
+	while(S.tail_seq != S.head_seq)
+	{
+		rec = record_at(S.tail_seg, S.tail_off);
+		if(rec && rec->seq >= S.tail_seq && rec->seq < S.head_seq)
+		{
+			//跳过了损坏的记录
+			skipped = rec->seq - S.tail_seq;
+			S.tail_seq = rec->seq;
+			skip_corrupt(skipped);
+
+			//放不下的记录也记为已读取，调用者随后 spool_consume 跳过它
+			S.peeked_seq = rec->seq;
+			if(rec->len > size)
+			{
+				rv = SPOOL_ERR_BUFFER;
+				break;
+			}
+			memcpy(buf, rec + 1, rec->len);
+			*len = rec->len;
+			if(timestamp)
+				*timestamp = (time_t)rec->timestamp;
+			if(channel)
+				*channel = (int)rec->channel;
+			rv = SPOOL_OK;
+			break;
+		}
+
+		//段尾或损坏记录：跳到下一段，绕回写位置所在段仍找不到则清空
+		if(S.tail_seg == S.head_seg && S.tail_off <= S.head_off && ++hops > 1)
+		{
+			skipped = S.head_seq - S.tail_seq;
+			S.tail_seq = S.head_seq;
+			S.tail_off = S.head_off;
+			skip_corrupt(skipped);
+			persist_tail();
+			break;
+		}
+		S.tail_seg = (S.tail_seg + 1) % S.seg_count;
+		S.tail_off = 0;
+		persist_tail();
+	}
+	pthread_mutex_unlock(&S.lock);
+
+	return rv;
+}
+
+
+//确认最近一次 spool_peek 返回的记录已经发出，移动读位置
+void spool_consume(void)
+{
+	spool_rec_hdr_t	*rec;
+
+	if(!S.ready)
+		return ;
+
+	pthread_mutex_lock(&S.lock);
+	//peek 之后该记录可能已被写线程覆盖丢弃，此时读位置已经前移
+	if(S.tail_seq == S.peeked_seq && S.tail_seq != S.head_seq)
+	{
+		rec = (spool_rec_hdr_t *)(seg_base(S.tail_seg) + S.tail_off);
+		S.tail_off += SPOOL_ALIGN(sizeof(*rec) + rec->len);
+		S.tail_seq++;
+		S.stats.replayed++;
+		S.stats.pending--;
+		S.stats.pending_bytes -= SPOOL_ALIGN(sizeof(*rec) + rec->len);
+
+		if(S.tail_seq == S.head_seq)
+		{
+			S.tail_seg = S.head_seg;
+			S.tail_off = S.head_off;
+			persist_tail();
+		}
+	}
+	pthread_mutex_unlock(&S.lock);
+}
+
+
+void spool_get_stats(spool_stats_t *stats)
+{
+	if(!S.ready)
+	{
+		memset(stats, 0, sizeof(*stats));
+		return ;
+	}
+
+	pthread_mutex_lock(&S.lock);
+	*stats = S.stats;
+	pthread_mutex_unlock(&S.lock);
+}
@@ -0,0 +1,328 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  stage_queue.c
+ *    Description:  This file implements the bounded queue between pipeline stages.
+ *
+ *                  元素按值复制进预分配的环形缓冲区，队列只在入队、出队时短暂持锁；
+ *                  BLOCK 策略下生产者在 not_full 上等待，队列关闭后立即返回。
+ *
+ *        Version:  1.0.0(2025年09月01日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月01日 16时20分44秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "stage_queue.h"
+#include "log.h"
+
+
+//按设备抽稀时记录的设备数
+#define DECIMATE_KEYS		16
+
+struct stage_queue_s {
+	char				name[16];
+	size_t				item_size;
+	int					capacity;
+	int					policy;
+	int					decimate;
+
+	uint8_t				*items;
+	uint64_t			*enqueue_ms;
+	int					head;
+	int					count;
+	int					closed;
+
+	struct {
+		uint32_t	key;
+		uint32_t	seen;
+	}					keys[DECIMATE_KEYS];
+	int					key_next;
+
+	stage_queue_stats_t	stats;
+	pthread_mutex_t		lock;
+	pthread_cond_t		not_empty;
+	pthread_cond_t		not_full;
+};
+
+
+static const char *policy_names[] = {
+	"block",
+	"drop-oldest",
+	"drop-newest",
+	"decimate",
+};
+
+
+static uint64_t now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+//条件变量使用单调时钟，不受系统时间调整影响
+static void deadline_after(struct timespec *ts, int timeout_ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += timeout_ms / 1000;
+	ts->tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if(ts->tv_nsec >= 1000000000)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+
+int stage_queue_policy_parse(const char *name)
+{
+	int		i;
+
+	for(i = 0; name && i < (int)(sizeof(policy_names) / sizeof(policy_names[0])); i++)
+	{
+		if(strcmp(name, policy_names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+
+const char *stage_queue_policy_name(int policy)
+{
+	if(policy < 0 || policy >= (int)(sizeof(policy_names) / sizeof(policy_names[0])))
+		return "unknown";
+	return policy_names[policy];
+}
+
+
+stage_queue_t *stage_queue_create(const char *name, size_t item_size, const stage_queue_config_t *config)
+{
+	stage_queue_t		*q;
+	pthread_condattr_t	attr;
+
+	q = calloc(1, sizeof(*q));
+	if(!q)
+		return NULL;
+
+	snprintf(q->name, sizeof(q->name), "%s", name);
+	q->item_size = item_size;
+	q->capacity = config->capacity > 0 ? config->capacity : 64;
+	q->policy = (config->policy >= STAGE_POLICY_BLOCK && config->policy <= STAGE_POLICY_DECIMATE) ? config->policy : STAGE_POLICY_DROP_OLDEST;
+	q->decimate = config->decimate > 1 ? config->decimate : 4;
+
+	q->items = malloc(q->capacity * item_size);
+	q->enqueue_ms = malloc(q->capacity * sizeof(uint64_t));
+	if(!q->items || !q->enqueue_ms)
+	{
+		stage_queue_destroy(q);
+		return NULL;
+	}
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&q->not_empty, &attr);
+	pthread_cond_init(&q->not_full, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if(q->policy == STAGE_POLICY_DECIMATE)
+		log_info("Pipeline: queue %-9s capacity=%d policy=decimate 1/%d\n", q->name, q->capacity, q->decimate);
+	else
+		log_info("Pipeline: queue %-9s capacity=%d policy=%s\n", q->name, q->capacity, policy_names[q->policy]);
+	return q;
+}
+
+
+void stage_queue_destroy(stage_queue_t *q)
+{
+	if(!q)
+		return ;
+
+	if(q->items && q->enqueue_ms)
+	{
+		pthread_mutex_destroy(&q->lock);
+		pthread_cond_destroy(&q->not_empty);
+		pthread_cond_destroy(&q->not_full);
+	}
+	free(q->items);
+	free(q->enqueue_ms);
+	free(q);
+}
+
+
+//关闭队列：唤醒所有等待者，之后的入队被丢弃，出队在取空后返回 STAGE_CLOSED
+void stage_queue_close(stage_queue_t *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_cond_broadcast(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+}
+
+
+//抽稀：返回 1 表示保留该设备的这个采样（调用时持有锁）
+static int decimate_keep(stage_queue_t *q, uint32_t key)
+{
+	int		i;
+
+	for(i = 0; i < DECIMATE_KEYS; i++)
+	{
+		if(q->keys[i].key == key && q->keys[i].seen)
+			break;
+	}
+	if(i == DECIMATE_KEYS)
+	{
+		i = q->key_next;
+		q->key_next = (q->key_next + 1) % DECIMATE_KEYS;
+		q->keys[i].key = key;
+		q->keys[i].seen = 0;
+	}
+
+	return q->keys[i].seen++ % q->decimate == 0;
+}
+
+
+//丢弃队首元素（调用时持有锁）
+static void drop_head(stage_queue_t *q)
+{
+	q->head = (q->head + 1) % q->capacity;
+	q->count--;
+	q->stats.dropped_oldest++;
+}
+
+
+/* 入队，device_key 用于按设备抽稀，priority 为 1 的元素不被抽稀，队列满时挤掉最旧的元素
+ * 返回 STAGE_OK 或 STAGE_DROPPED（新元素被丢弃）
+ */
+int stage_queue_push(stage_queue_t *q, const void *item, uint32_t device_key, int priority)
+{
+	struct timespec	deadline;
+	int				tail;
+
+	pthread_mutex_lock(&q->lock);
+
+	if(q->policy == STAGE_POLICY_DECIMATE && !priority && q->count >= q->capacity / 2 && !decimate_keep(q, device_key))
+	{
+		q->stats.decimated++;
+		pthread_mutex_unlock(&q->lock);
+		return STAGE_DROPPED;
+	}
+
+	while(q->count == q->capacity && !q->closed)
+	{
+		if(priority || q->policy == STAGE_POLICY_DROP_OLDEST)
+		{
+			drop_head(q);
+			break;
+		}
+
+		if(q->policy != STAGE_POLICY_BLOCK)
+		{
+			q->stats.dropped_newest++;
+			pthread_mutex_unlock(&q->lock);
+			return STAGE_DROPPED;
+		}
+
+		q->stats.blocked++;
+		deadline_after(&deadline, 100);
+		pthread_cond_timedwait(&q->not_full, &q->lock, &deadline);
+	}
+
+	if(q->closed)
+	{
+		q->stats.dropped_newest++;
+		pthread_mutex_unlock(&q->lock);
+		return STAGE_DROPPED;
+	}
+
+	tail = (q->head + q->count) % q->capacity;
+	memcpy(q->items + tail * q->item_size, item, q->item_size);
+	q->enqueue_ms[tail] = now_ms();
+	q->count++;
+
+	q->stats.enqueued++;
+	if((uint32_t)q->count > q->stats.high_water)
+		q->stats.high_water = q->count;
+
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+	return STAGE_OK;
+}
+
+
+//出队，队列为空时最多等待 timeout_ms，超时返回 STAGE_EMPTY，队列已关闭且取空时返回 STAGE_CLOSED
+int stage_queue_pop(stage_queue_t *q, void *item, int timeout_ms)
+{
+	struct timespec	deadline;
+	uint64_t		wait;
+
+	pthread_mutex_lock(&q->lock);
+
+	if(!q->count && !q->closed && timeout_ms > 0)
+	{
+		deadline_after(&deadline, timeout_ms);
+		while(!q->count && !q->closed)
+		{
+			if(pthread_cond_timedwait(&q->not_empty, &q->lock, &deadline) == ETIMEDOUT)
+				break;
+		}
+	}
+
+	if(!q->count)
+	{
+		pthread_mutex_unlock(&q->lock);
+		return q->closed ? STAGE_CLOSED : STAGE_EMPTY;
+	}
+
+	memcpy(item, q->items + q->head * q->item_size, q->item_size);
+	wait = now_ms() - q->enqueue_ms[q->head];
+	q->head = (q->head + 1) % q->capacity;
+	q->count--;
+
+	q->stats.dequeued++;
+	q->stats.wait_sum_ms += wait;
+	if(wait > q->stats.wait_max_ms)
+		q->stats.wait_max_ms = (uint32_t)wait;
+
+	pthread_cond_signal(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+	return STAGE_OK;
+}
+
+
+void stage_queue_get_stats(stage_queue_t *q, stage_queue_stats_t *stats)
+{
+	pthread_mutex_lock(&q->lock);
+	*stats = q->stats;
+	stats->depth = q->count;
+	pthread_mutex_unlock(&q->lock);
+}
+
+
+void stage_queue_log_stats(stage_queue_t *q)
+{
+	stage_queue_stats_t	st;
+
+	if(!q)
+		return ;
+
+	stage_queue_get_stats(q, &st);
+	log_info("Pipeline: %-9s depth=%u/%d hwm=%u in=%llu out=%llu drop_oldest=%llu drop_newest=%llu decimated=%llu blocked=%llu wait_avg=%llums wait_max=%ums\n",
+			q->name, st.depth, q->capacity, st.high_water,
+			(unsigned long long)st.enqueued, (unsigned long long)st.dequeued,
+			(unsigned long long)st.dropped_oldest, (unsigned long long)st.dropped_newest,
+			(unsigned long long)st.decimated, (unsigned long long)st.blocked,
+			(unsigned long long)(st.dequeued ? st.wait_sum_ms / st.dequeued : 0), st.wait_max_ms);
+}
@@ -0,0 +1,487 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  subdev.c
+ *    Description:  This file implements IoTDA gateway sub-device batching.
+ *
+ *                  每个子设备只保留最新一条未上报的采样。第一条采样到达后最多等待
+ *                  batch_interval_ms，或所有子设备都有新采样时立即发布；一条消息装不下时
+ *                  （受 publish_lane 负载长度和 batch_max 限制）拆成多条。发布失败的批次
+ *                  写入 spool（SPOOL_CHANNEL_SUBDEV），重连后回放；断线期间新采样到达前
+ *                  先把同一设备未上报的采样写入 spool，不被覆盖。spool 未启用时保留到下一批。
+ *                  采样和发布都在 encode 阶段线程中进行。
+ *                  本地节点由 local_broker 线程登记和上报，条目内容是节点上报的 services
+ *                  数组；登记只追加，条目写完后才增加 count，按序号和路径查找不需要加锁。
+ *
+ *        Version:  1.0.0(2025年09月03日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月03日 09时48分31秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "subdev.h"
+#include "ble_gateway.h"
+#include "mqtt_gateway.h"
+#include "uplink_sink.h"
+#include "publish_lane.h"
+#include "spool.h"
+#include "log.h"
+
+
+#define BATCH_PREFIX		"{\"devices\":["
+#define BATCH_SUFFIX		"]}"
+
+typedef struct {
+	char				device_id[SUBDEV_ID_MAX];
+	char				path[256];          //D-Bus 设备路径
+	char				notify_path[512];
+	char				write_path[512];
+	int					pending;            //有尚未上报的采样
+	int					node;               //本地代理或 CoAP 接入的节点，没有 BLE 路径
+	telemetry_record_t	rec;
+	int					services_len;       //节点：最近一次上报的 services 数组
+	char				services[SUBDEV_SERVICES_MAX];
+} subdev_t;
+
+
+static struct {
+	subdev_t		devs[SUBDEV_TABLE_MAX];
+	int				count;              //表中的条目数，BLE 子设备在前、本地节点在后
+	int				ble_count;          //配置的 BLE 子设备数
+	int				nodes;
+	int				batch_interval_ms;
+	int				batch_max;
+	char			topic[256];
+	int				pending_count;
+	int				alert;              //待上报的采样中有告警
+	int				offline;            //最近一次发布失败，直到下一次发布成功
+	uint64_t		first_pending_ms;
+	subdev_stats_t	stats;
+	pthread_mutex_t	lock;
+} G = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+static uint64_t now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* 子设备的 D-Bus 路径按主设备的方式构造，特征值路径沿用主设备的后缀（同型号手环的 GATT 布局相同）
+ * 在 DEVICE_PATH 等路径构建完成后调用
+ */
+int subdev_init(const subdev_config_t *config, const char *gateway_id)
+{
+	const char	*notify_suffix = NOTIFY_CHARACTERISTIC_PATH + strlen(DEVICE_PATH);
+	const char	*write_suffix = WRITABLE_CHARACTERISTIC_PATH + strlen(DEVICE_PATH);
+	subdev_t	*dev;
+	int			i;
+
+	memset(G.devs, 0, sizeof(G.devs));
+	G.count = 0;
+	G.ble_count = 0;
+	G.nodes = 0;
+	G.pending_count = 0;
+	G.alert = 0;
+	G.offline = 0;
+	G.batch_interval_ms = config->batch_interval_ms > 0 ? config->batch_interval_ms : 1000;
+	G.batch_max = config->batch_max > 0 ? config->batch_max : SUBDEV_TABLE_MAX;
+	snprintf(G.topic, sizeof(G.topic), "$oc/devices/%s/sys/gateway/sub_devices/properties/report", gateway_id);
+	memset(&G.stats, 0, sizeof(G.stats));
+
+	for(i = 0; i < config->count && i < SUBDEV_MAX; i++)
+	{
+		dev = &G.devs[G.count++];
+		snprintf(dev->device_id, sizeof(dev->device_id), "%s", config->devices[i].device_id);
+		snprintf(dev->path, sizeof(dev->path), "%s/dev_%s", ADAPTER_PATH, config->devices[i].mac);
+		snprintf(dev->notify_path, sizeof(dev->notify_path), "%s/dev_%s%s", ADAPTER_PATH, config->devices[i].mac, notify_suffix);
+		snprintf(dev->write_path, sizeof(dev->write_path), "%s/dev_%s%s", ADAPTER_PATH, config->devices[i].mac, write_suffix);
+		log_info("Gateway: Sub-device %s -> %s\n", dev->device_id, dev->path);
+	}
+	G.ble_count = G.count;
+
+	if(G.count)
+		log_info("Gateway: %d sub-devices, batch interval %d ms, up to %d devices per report.\n",
+				G.count, G.batch_interval_ms, G.batch_max);
+	return G.count;
+}
+
+
+//配置的 BLE 子设备数，序号 0 ~ subdev_count()-1 都是 BLE 子设备；运行时登记的本地节点不计在内
+int subdev_count(void)
+{
+	return G.ble_count;
+}
+
+
+/* 登记本地节点（local_broker 和 coap_server 线程在节点上报时调用），已登记的返回原序号
+ * 节点需要先在云端添加为网关的子设备，否则批量上报中它的条目会被云端忽略
+ */
+int subdev_add_node(const char *device_id)
+{
+	subdev_t	*dev;
+	int			i;
+
+	if(!device_id || !*device_id || strlen(device_id) >= SUBDEV_ID_MAX)
+		return -1;
+
+	pthread_mutex_lock(&G.lock);
+	i = subdev_find_id(device_id);
+	if(i < 0 && G.count < SUBDEV_TABLE_MAX && G.nodes < SUBDEV_NODE_MAX)
+	{
+		i = G.count;
+		dev = &G.devs[i];
+		memset(dev, 0, sizeof(*dev));
+		snprintf(dev->device_id, sizeof(dev->device_id), "%s", device_id);
+		dev->node = 1;
+		G.nodes++;
+		__atomic_store_n(&G.count, i + 1, __ATOMIC_RELEASE);
+		log_info("Gateway: Local node %s registered as sub-device.\n", device_id);
+	}
+	pthread_mutex_unlock(&G.lock);
+
+	return i;
+}
+
+
+int subdev_is_node(int index)
+{
+	return index >= 0 && index < G.count && G.devs[index].node;
+}
+
+
+//按 D-Bus 路径查找子设备，设备路径及其下的特征值路径都能匹配
+int subdev_find_path(const char *path)
+{
+	size_t	len;
+	int		i;
+
+	for(i = 0; path && i < G.count; i++)
+	{
+		if(G.devs[i].node)
+			continue;
+		len = strlen(G.devs[i].path);
+		if(strncmp(path, G.devs[i].path, len) == 0 && (path[len] == '\0' || path[len] == '/'))
+			return i;
+	}
+	return -1;
+}
+
+
+int subdev_find_id(const char *device_id)
+{
+	int		i;
+
+	for(i = 0; device_id && i < G.count; i++)
+	{
+		if(strcmp(device_id, G.devs[i].device_id) == 0)
+			return i;
+	}
+	return -1;
+}
+
+
+const char *subdev_device_id(int index)
+{
+	return (index >= 0 && index < G.count) ? G.devs[index].device_id : NULL;
+}
+
+const char *subdev_path(int index)
+{
+	return (index >= 0 && index < G.ble_count) ? G.devs[index].path : NULL;
+}
+
+const char *subdev_notify_path(int index)
+{
+	return (index >= 0 && index < G.ble_count) ? G.devs[index].notify_path : NULL;
+}
+
+const char *subdev_write_path(int index)
+{
+	return (index >= 0 && index < G.ble_count) ? G.devs[index].write_path : NULL;
+}
+
+//批量上报的主题，spool 回放 SPOOL_CHANNEL_SUBDEV 的记录时使用
+const char *subdev_topic(void)
+{
+	return G.topic;
+}
+
+
+//批量消息中的一个子设备条目：{"device_id":"xxx","services":[...]}
+static int format_entry(const subdev_t *dev, char *buf, size_t size)
+{
+	char	json[TELEMETRY_JSON_MAX];
+
+	//代理接入的节点带原样的 services；CoAP 节点和 BLE 子设备一样上报采样
+	if(dev->node && dev->services_len)
+		return snprintf(buf, size, "{\"device_id\":\"%s\",\"services\":%.*s}",
+				dev->device_id, dev->services_len, dev->services);
+
+	//BLE 子设备复用单设备的属性 JSON 并附带采样时间
+	if(telemetry_serialize_json(&dev->rec, 1, json, sizeof(json)) < 0)
+		return -1;
+	return snprintf(buf, size, "{\"device_id\":\"%s\",%s", dev->device_id, json + 1);
+}
+
+
+//整条批量消息写入 spool，重连后回放（调用时持有锁）
+static int spool_batch(const char *buf, int len, int n)
+{
+	if(!spool_is_open() || spool_append(SPOOL_CHANNEL_SUBDEV, time(NULL), buf, len) != SPOOL_OK)
+		return -1;
+
+	G.stats.spooled += n;
+	return 0;
+}
+
+
+//清除设备的待上报标志（调用时持有锁）
+static void clear_pending(subdev_t *dev)
+{
+	dev->pending = 0;
+	G.pending_count--;
+}
+
+
+//断线期间同一设备的新采样到达：未上报的采样单独写入 spool，不被覆盖（调用时持有锁）
+static void spool_pending(subdev_t *dev)
+{
+	char	buf[PUBLISH_LANE_PAYLOAD_MAX];
+	int		len;
+
+	len = sizeof(BATCH_PREFIX) - 1;
+	memcpy(buf, BATCH_PREFIX, len);
+	len += format_entry(dev, buf + len, sizeof(buf) - len - (sizeof(BATCH_SUFFIX) - 1));
+	if(len <= (int)(sizeof(BATCH_PREFIX) - 1) || len + (int)sizeof(BATCH_SUFFIX) - 1 >= (int)sizeof(buf))
+		return ;
+	memcpy(buf + len, BATCH_SUFFIX, sizeof(BATCH_SUFFIX) - 1);
+	len += sizeof(BATCH_SUFFIX) - 1;
+
+	if(spool_batch(buf, len, 1) == 0)
+		clear_pending(dev);
+}
+
+
+//标记设备有待上报的采样（调用时持有锁）
+static void mark_pending(subdev_t *dev)
+{
+	G.stats.samples++;
+	if(dev->pending)
+	{
+		G.stats.merged++;
+		return ;
+	}
+
+	if(!G.pending_count)
+		G.first_pending_ms = now_ms();
+	G.pending_count++;
+	dev->pending = 1;
+}
+
+
+//记录子设备的最新采样，未上报的旧采样被覆盖；断线期间旧采样先写入 spool
+void subdev_report(int index, const telemetry_record_t *rec, int alert)
+{
+	subdev_t	*dev;
+
+	if(index < 0 || index >= G.count)
+		return ;
+
+	pthread_mutex_lock(&G.lock);
+	dev = &G.devs[index];
+	if(G.offline && dev->pending)
+		spool_pending(dev);
+	mark_pending(dev);
+	dev->rec = *rec;
+	G.alert |= alert;
+	pthread_mutex_unlock(&G.lock);
+}
+
+
+/* 记录本地节点上报的 services 数组（"[...]"，由调用者检查过语法），未上报的旧内容被覆盖（断线期间先写入 spool）
+ * 批量上报按 batch_interval_ms 发出，由 encode 阶段的 subdev_flush 完成
+ */
+int subdev_report_services(int index, const char *services, int len)
+{
+	subdev_t	*dev;
+
+	if(!subdev_is_node(index) || len <= 0 || len > SUBDEV_SERVICES_MAX)
+		return -1;
+
+	pthread_mutex_lock(&G.lock);
+	dev = &G.devs[index];
+	if(G.offline && dev->pending)
+		spool_pending(dev);
+	mark_pending(dev);
+	memcpy(dev->services, services, len);
+	dev->services_len = len;
+	pthread_mutex_unlock(&G.lock);
+
+	return 0;
+}
+
+
+/* 发布一条批量消息，发布失败时整批写入 spool（调用时持有锁）
+ * 发布或写入 spool 后清除其中设备的待上报标志返回 0，都失败时保留到下一批返回 -1
+ */
+static int publish_batch(char *buf, int len, const int *members, int n)
+{
+	int		rc;
+	int		i;
+
+	memcpy(buf + len, BATCH_SUFFIX, sizeof(BATCH_SUFFIX) - 1);
+	len += sizeof(BATCH_SUFFIX) - 1;
+
+	rc = uplink_publish(G.topic, buf, len, 1, G.alert ? MQTT_TRAFFIC_ALERT : MQTT_TRAFFIC_TELEMETRY);
+	if(rc != MOSQ_ERR_SUCCESS && rc != UPLINK_DROPPED)
+	{
+		G.stats.failed++;
+		G.offline = 1;
+		if(spool_batch(buf, len, n) < 0)
+		{
+			log_warn("Gateway: Failed to publish sub-device report (%d devices): %d\n", n, rc);
+			return -1;
+		}
+		log_info("Gateway: MQTT unavailable, sub-device report (%d devices) stored for later replay.\n", n);
+	}
+
+	//file / unix 汇点写入失败时这批采样丢弃（已由汇点计数和限速记录），不再重试
+	for(i = 0; i < n; i++)
+		clear_pending(&G.devs[members[i]]);
+	if(rc == UPLINK_DROPPED)
+	{
+		G.stats.failed++;
+		return -1;
+	}
+	if(rc != MOSQ_ERR_SUCCESS)
+		return 0;
+
+	G.offline = 0;
+	G.stats.batches++;
+	G.stats.reported += n;
+	log_info("Gateway: Sub-device report published, %d devices, %d bytes.\n", n, len);
+	return 0;
+}
+
+
+/* 合并待上报的采样并发布
+ * force 为 0 时只有等待超过 batch_interval_ms 或凑满一批才发布；force 为 1 时立即发布（告警）
+ * 返回发布的设备数，发布失败返回 -1
+ */
+int subdev_flush(int force)
+{
+	char		buf[PUBLISH_LANE_PAYLOAD_MAX];
+	char		entry[SUBDEV_ID_MAX + SUBDEV_SERVICES_MAX + TELEMETRY_JSON_MAX];
+	int			members[SUBDEV_TABLE_MAX];
+	uint64_t	now = now_ms();
+	int			sent = 0;
+	int			len;
+	int			entry_len;
+	int			n = 0;
+	int			i;
+
+	pthread_mutex_lock(&G.lock);
+
+	if(!G.pending_count || (!force && now - G.first_pending_ms < (uint64_t)G.batch_interval_ms &&
+	   G.pending_count < G.count && G.pending_count < G.batch_max))
+	{
+		pthread_mutex_unlock(&G.lock);
+		return 0;
+	}
+
+	len = sizeof(BATCH_PREFIX) - 1;
+	memcpy(buf, BATCH_PREFIX, len);
+
+	for(i = 0; i < G.count; i++)
+	{
+		if(!G.devs[i].pending)
+			continue;
+
+		//无法生成条目的采样丢弃，否则 pending_count 不会归零，告警标志一直保留
+		entry_len = format_entry(&G.devs[i], entry, sizeof(entry));
+		if(entry_len < 0 || entry_len >= (int)sizeof(entry))
+		{
+			log_warn("Gateway: Failed to format report of %s, dropped.\n", G.devs[i].device_id);
+			clear_pending(&G.devs[i]);
+			continue;
+		}
+
+		//单独一条也装不下的条目丢弃，否则会一直阻塞后面的批次
+		if((int)(sizeof(BATCH_PREFIX) + sizeof(BATCH_SUFFIX)) + entry_len > (int)sizeof(buf))
+		{
+			log_warn("Gateway: Report of %s too long (%d bytes), dropped.\n", G.devs[i].device_id, entry_len);
+			clear_pending(&G.devs[i]);
+			continue;
+		}
+
+		//装不下或已达到 batch_max 时先发出当前这一批
+		if(n > 0 && (len + 1 + entry_len + (int)sizeof(BATCH_SUFFIX) > (int)sizeof(buf) || n == G.batch_max))
+		{
+			if(publish_batch(buf, len, members, n) < 0)
+				break;
+			sent += n;
+			len = sizeof(BATCH_PREFIX) - 1;
+			n = 0;
+		}
+
+		if(n > 0)
+			buf[len++] = ',';
+		memcpy(buf + len, entry, entry_len);
+		len += entry_len;
+		members[n++] = i;
+	}
+
+	if(n > 0 && i == G.count)
+	{
+		if(publish_batch(buf, len, members, n) == 0)
+			sent += n;
+	}
+
+	if(G.pending_count)
+	{
+		//发布失败且未能写入 spool：剩余采样等下一个周期再发
+		G.first_pending_ms = now;
+		pthread_mutex_unlock(&G.lock);
+		return -1;
+	}
+
+	G.alert = 0;
+	pthread_mutex_unlock(&G.lock);
+	return sent;
+}
+
+
+void subdev_get_stats(subdev_stats_t *stats)
+{
+	pthread_mutex_lock(&G.lock);
+	*stats = G.stats;
+	stats->pending = G.pending_count;
+	stats->nodes = G.nodes;
+	pthread_mutex_unlock(&G.lock);
+}
+
+
+void subdev_log_stats(void)
+{
+	subdev_stats_t	st;
+
+	if(!G.count)
+		return ;
+
+	subdev_get_stats(&st);
+	log_info("Gateway: sub-devices=%d nodes=%u samples=%llu merged=%llu batches=%llu reported=%llu avg_per_batch=%.1f failed=%llu spooled=%llu pending=%u\n",
+			G.ble_count, st.nodes, (unsigned long long)st.samples, (unsigned long long)st.merged,
+			(unsigned long long)st.batches, (unsigned long long)st.reported,
+			st.batches ? (double)st.reported / st.batches : 0.0,
+			(unsigned long long)st.failed, (unsigned long long)st.spooled, st.pending);
+}
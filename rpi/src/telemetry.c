@@ -0,0 +1,360 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  telemetry.c
+ *    Description:  This file implements the parser, validator and JSON serializer
+ *                  generated from TELEMETRY_PROPERTIES.
+ *
+ *                  序列化不使用 snprintf：属性键片段在编译期拼接成字符串常量，
+ *                  整数用两位查表法转换，调用者提供可重复使用的缓冲区。
+ *
+ *        Version:  1.0.0(2025年08月18日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月18日 15时02分51秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "telemetry.h"
+#include "log.h"
+
+
+#define JSON_PREFIX		"{\"services\":[{\"service_id\":\"" TELEMETRY_SERVICE_ID "\",\"properties\":{"
+#define JSON_SUFFIX		"}]}"
+#define JSON_EVENT_TIME	"},\"event_time\":\""
+
+//追加字符串常量，长度在编译期确定
+#define PUT_LIT(p, lit)	(memcpy((p), (lit), sizeof(lit) - 1), (p) + sizeof(lit) - 1)
+
+
+//BLE 通知键名表，用于解析
+static const struct {
+	const char	*key;
+	size_t		len;
+	int32_t		scale;
+} ble_keys[TELEMETRY_PROP_COUNT] = {
+#define X(name, key, ble_key, scale, min, max) { ble_key, sizeof(ble_key) - 1, scale },
+	TELEMETRY_PROPERTIES(X)
+#undef X
+};
+
+
+static const char digits2[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+
+//无符号整数转十进制字符串，每次处理两位
+static char *put_u32(char *p, uint32_t v)
+{
+	char	tmp[10];
+	char	*t = tmp + sizeof(tmp);
+	size_t	n;
+
+	while(v >= 100)
+	{
+		t -= 2;
+		memcpy(t, &digits2[(v % 100) * 2], 2);
+		v /= 100;
+	}
+	if(v >= 10)
+	{
+		t -= 2;
+		memcpy(t, &digits2[v * 2], 2);
+	}
+	else
+	{
+		*--t = (char)('0' + v);
+	}
+
+	n = tmp + sizeof(tmp) - t;
+	memcpy(p, t, n);
+	return p + n;
+}
+
+
+//定点数输出：scale 为 10 的幂，输出 value/scale 并保留对应的小数位
+static char *put_scaled(char *p, int32_t value, int32_t scale)
+{
+	uint32_t	v;
+	uint32_t	frac;
+	int32_t		s;
+
+	if(value < 0)
+	{
+		*p++ = '-';
+		v = (uint32_t)0 - (uint32_t)value;
+	}
+	else
+	{
+		v = (uint32_t)value;
+	}
+
+	if(scale <= 1)
+		return put_u32(p, v);
+
+	p = put_u32(p, v / (uint32_t)scale);
+	*p++ = '.';
+	frac = v % (uint32_t)scale;
+	for(s = scale / 10; s > 0; s /= 10)
+	{
+		*p++ = (char)('0' + frac / (uint32_t)s);
+		frac %= (uint32_t)s;
+	}
+	return p;
+}
+
+
+static inline char *put_2digits(char *p, unsigned v)
+{
+	memcpy(p, &digits2[v * 2], 2);
+	return p + 2;
+}
+
+
+//UTC 时间格式化为 IoTDA 的 yyyyMMddTHHmmssZ，不依赖 gmtime/strftime
+static char *put_event_time(char *p, time_t t)
+{
+	int64_t		days = (int64_t)t / 86400;
+	int64_t		secs = (int64_t)t % 86400;
+	int64_t		era, yoe, doy, mp, y;
+	unsigned	d, m;
+
+	if(secs < 0)
+	{
+		secs += 86400;
+		days--;
+	}
+
+	//公历日期换算（days from civil 的逆运算）
+	days += 719468;
+	era = (days >= 0 ? days : days - 146096) / 146097;
+	yoe = days - era * 146097;
+	yoe = (yoe - yoe / 1460 + yoe / 36524 - yoe / 146096) / 365;
+	y = yoe + era * 400;
+	doy = (days - era * 146097) - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	d = (unsigned)(doy - (153 * mp + 2) / 5 + 1);
+	m = (unsigned)(mp < 10 ? mp + 3 : mp - 9);
+	if(m <= 2)
+		y++;
+
+	p = put_2digits(p, (unsigned)(y / 100));
+	p = put_2digits(p, (unsigned)(y % 100));
+	p = put_2digits(p, m);
+	p = put_2digits(p, d);
+	*p++ = 'T';
+	p = put_2digits(p, (unsigned)(secs / 3600));
+	p = put_2digits(p, (unsigned)(secs / 60 % 60));
+	p = put_2digits(p, (unsigned)(secs % 60));
+	*p++ = 'Z';
+	return p;
+}
+
+
+//解析十进制数（可带小数），按 scale 转为定点整数
+static const char *parse_scaled(const char *s, const char *end, int32_t scale, int32_t *out)
+{
+	int64_t		v = 0;
+	int32_t		s_left;
+	int			neg = 0;
+	int			digits = 0;
+
+	if(s < end && (*s == '-' || *s == '+'))
+		neg = (*s++ == '-');
+
+	while(s < end && *s >= '0' && *s <= '9')
+	{
+		v = v * 10 + (*s++ - '0');
+		if(v > INT32_MAX)
+			return NULL;
+		digits++;
+	}
+
+	v *= scale;
+	if(s < end && *s == '.')
+	{
+		s++;
+		for(s_left = scale / 10; s < end && *s >= '0' && *s <= '9'; s++)
+		{
+			v += (*s - '0') * s_left;
+			s_left /= 10;
+			digits++;
+		}
+	}
+
+	if(!digits || v > INT32_MAX)
+		return NULL;
+
+	*out = (int32_t)(neg ? -v : v);
+	return s;
+}
+
+
+/* 解析 BLE 通知字符串，例如 "HR:72,SpO2:98"
+ * 键值对以逗号或空白分隔，未知的键被忽略，已解析的属性记录在 present 位图中
+ */
+int telemetry_parse_ble(const char *str, size_t len, telemetry_record_t *rec)
+{
+	const char	*p = str;
+	const char	*end = str + len;
+	const char	*key;
+	size_t		key_len;
+	int			i;
+	int32_t		value;
+
+	memset(rec, 0, sizeof(*rec));
+
+	while(p < end)
+	{
+		while(p < end && (*p == ',' || *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+			p++;
+		if(p >= end || *p == '\0')
+			break;
+
+		key = p;
+		while(p < end && *p != ':')
+			p++;
+		if(p >= end)
+			return TELEMETRY_ERR_PARSE;
+		key_len = p - key;
+		p++;
+
+		for(i = 0; i < TELEMETRY_PROP_COUNT; i++)
+		{
+			if(ble_keys[i].len == key_len && memcmp(ble_keys[i].key, key, key_len) == 0)
+				break;
+		}
+
+		if(i == TELEMETRY_PROP_COUNT)
+		{
+			//未知属性，跳过取值
+			while(p < end && *p != ',')
+				p++;
+			continue;
+		}
+
+		p = parse_scaled(p, end, ble_keys[i].scale, &value);
+		if(!p)
+			return TELEMETRY_ERR_PARSE;
+
+		switch(i)
+		{
+#define X(name, key, ble_key, scale, min, max) case TELEMETRY_PROP_##name: rec->name = value; break;
+			TELEMETRY_PROPERTIES(X)
+#undef X
+		}
+		rec->present |= 1u << i;
+	}
+
+	return rec->present ? TELEMETRY_OK : TELEMETRY_ERR_PARSE;
+}
+
+
+//校验：所有属性都必须存在且在 [min, max] 范围内（min/max 为未缩放的物理值）
+int telemetry_validate(const telemetry_record_t *rec)
+{
+	if((rec->present & TELEMETRY_ALL_PRESENT) != TELEMETRY_ALL_PRESENT)
+		return TELEMETRY_ERR_MISSING;
+
+#define X(name, key, ble_key, scale, min, max) \
+	if(rec->name < (int32_t)(min) * (scale) || rec->name > (int32_t)(max) * (scale)) \
+	{ \
+		log_warn("Telemetry: %s=%d out of range [%d, %d].\n", key, rec->name, (int)(min) * (scale), (int)(max) * (scale)); \
+		return TELEMETRY_ERR_RANGE; \
+	}
+	TELEMETRY_PROPERTIES(X)
+#undef X
+
+	return TELEMETRY_OK;
+}
+
+
+/* 告警判断：心率高于 hr_threshold 或低于 60，或血氧低于 spo2_threshold
+ * 全零的读数是设备未佩戴时的占位值，不算告警
+ */
+int telemetry_alert_band(const telemetry_record_t *rec, int hr_threshold, int spo2_threshold)
+{
+	if(rec->hr == 0 && rec->spo2 == 0)
+		return 0;
+	return rec->hr > hr_threshold || rec->spo2 < spo2_threshold || rec->hr < 60;
+}
+
+
+/* 生成华为云 IoTDA 属性上报 JSON，返回写入长度（不含结尾 '\0'）
+ * with_event_time 非 0 时附带采样时间，用于断线回放保留原始时间戳
+ */
+int telemetry_serialize_json(const telemetry_record_t *rec, int with_event_time, char *buf, size_t size)
+{
+	char	*p = buf;
+	int		first = 1;
+
+	if(size < TELEMETRY_JSON_MAX)
+		return TELEMETRY_ERR_BUFFER;
+
+	p = PUT_LIT(p, JSON_PREFIX);
+
+#define X(name, key, ble_key, scale, min, max) \
+	if(rec->present & (1u << TELEMETRY_PROP_##name)) \
+	{ \
+		if(!first) \
+			*p++ = ','; \
+		p = PUT_LIT(p, "\"" key "\":"); \
+		p = put_scaled(p, rec->name, scale); \
+		first = 0; \
+	}
+	TELEMETRY_PROPERTIES(X)
+#undef X
+
+	if(with_event_time)
+	{
+		p = PUT_LIT(p, JSON_EVENT_TIME);
+		p = put_event_time(p, rec->timestamp);
+		*p++ = '"';
+		p = PUT_LIT(p, JSON_SUFFIX);
+	}
+	else
+	{
+		p = PUT_LIT(p, "}" JSON_SUFFIX);
+	}
+
+	*p = '\0';
+	return (int)(p - buf);
+}
+
+
+/* 按 BLE 通知的格式输出 mask 中的属性，例如 "HR:72,SpO2:98"，用于向设备写入属性设置
+ * 返回写入长度（不含结尾 '\0'）
+ */
+int telemetry_serialize_ble(const telemetry_record_t *rec, uint32_t mask, char *buf, size_t size)
+{
+	char	*p = buf;
+
+	if(size < TELEMETRY_BLE_MAX)
+		return TELEMETRY_ERR_BUFFER;
+
+#define X(name, key, ble_key, scale, min, max) \
+	if(mask & rec->present & (1u << TELEMETRY_PROP_##name)) \
+	{ \
+		if(p != buf) \
+			*p++ = ','; \
+		p = PUT_LIT(p, ble_key ":"); \
+		p = put_scaled(p, rec->name, scale); \
+	}
+	TELEMETRY_PROPERTIES(X)
+#undef X
+
+	*p = '\0';
+	return (int)(p - buf);
+}
@@ -0,0 +1,177 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  topic_router.c
+ *    Description:  This file implements the MQTT topic routing trie.
+ *
+ *                  节点从路由器内部的静态数组中分配，子节点用“第一个孩子+兄弟”链表表示。
+ *                  分发时按 MQTT 规则匹配，所有匹配的模式都会被调用。
+ *
+ *        Version:  1.0.0(2025年08月21日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年08月21日 16时40分05秒"
+ *
+ ********************************************************************************/
+
+#include <string.h>
+
+#include "topic_router.h"
+#include "log.h"
+
+
+void topic_router_init(topic_router_t *router)
+{
+	memset(router, 0, sizeof(*router));
+
+	//0 号节点为根节点
+	router->nodes[0].child = -1;
+	router->nodes[0].sibling = -1;
+	router->count = 1;
+}
+
+
+//在 parent 下查找或创建层级为 level 的子节点
+static int get_child(topic_router_t *router, int parent, const char *level, size_t len)
+{
+	topic_node_t	*node;
+	int				idx;
+
+	for(idx = router->nodes[parent].child; idx >= 0; idx = router->nodes[idx].sibling)
+	{
+		node = &router->nodes[idx];
+		if(node->len == len && memcmp(node->level, level, len) == 0)
+			return idx;
+	}
+
+	if(router->count >= TOPIC_ROUTER_MAX_NODES || len >= TOPIC_ROUTER_LEVEL_MAX)
+		return -1;
+
+	idx = router->count++;
+	node = &router->nodes[idx];
+	memcpy(node->level, level, len);
+	node->level[len] = '\0';
+	node->len = (uint8_t)len;
+	node->child = -1;
+	node->handler = NULL;
+	node->arg = NULL;
+
+	//插入到兄弟链表头部
+	node->sibling = router->nodes[parent].child;
+	router->nodes[parent].child = (int16_t)idx;
+
+	return idx;
+}
+
+
+/* 注册主题模式，例如 "$oc/devices/+/sys/commands/#" */
+int topic_router_add(topic_router_t *router, const char *pattern, topic_handler_t handler, void *arg)
+{
+	const char	*p = pattern;
+	size_t		len;
+	int			node = 0;
+
+	while(1)
+	{
+		len = strcspn(p, "/");
+		node = get_child(router, node, p, len);
+		if(node < 0)
+		{
+			log_error("Router: No room for topic pattern '%s'.\n", pattern);
+			return -1;
+		}
+
+		if(p[len] == '\0')
+			break;
+		p += len + 1;
+	}
+
+	router->nodes[node].handler = handler;
+	router->nodes[node].arg = arg;
+	return 0;
+}
+
+
+static int match_level(const topic_router_t *router, int parent, const char *level, topic_match_t *match,
+		const void *payload, int payloadlen)
+{
+	const topic_node_t	*node;
+	const char			*next;
+	size_t				len;
+	int					idx;
+	int					c;
+	int					hits = 0;
+
+	len = strcspn(level, "/");
+	next = level[len] == '/' ? level + len + 1 : NULL;
+
+	for(idx = router->nodes[parent].child; idx >= 0; idx = node->sibling)
+	{
+		node = &router->nodes[idx];
+
+		//'#' 匹配剩余的所有层级（包括零个）
+		if(node->len == 1 && node->level[0] == '#')
+		{
+			if(node->handler)
+			{
+				node->handler(match, payload, payloadlen, node->arg);
+				hits++;
+			}
+			continue;
+		}
+
+		if(node->len == 1 && node->level[0] == '+')
+		{
+			if(match->count < TOPIC_ROUTER_MAX_CAPTURES)
+			{
+				match->level[match->count] = level;
+				match->len[match->count] = (int)len;
+			}
+			match->count++;
+		}
+		else if(node->len != len || memcmp(node->level, level, len) != 0)
+		{
+			continue;
+		}
+
+		if(next)
+		{
+			hits += match_level(router, idx, next, match, payload, payloadlen);
+		}
+		else
+		{
+			if(node->handler)
+			{
+				node->handler(match, payload, payloadlen, node->arg);
+				hits++;
+			}
+
+			//"a/b" 也匹配 "a/b/#"
+			for(c = node->child; c >= 0; c = router->nodes[c].sibling)
+			{
+				if(router->nodes[c].len == 1 && router->nodes[c].level[0] == '#' && router->nodes[c].handler)
+				{
+					router->nodes[c].handler(match, payload, payloadlen, router->nodes[c].arg);
+					hits++;
+				}
+			}
+		}
+
+		if(node->len == 1 && node->level[0] == '+')
+			match->count--;
+	}
+
+	return hits;
+}
+
+
+/* 分发一条消息，返回被调用的处理函数个数，0 表示没有匹配的路由 */
+int topic_router_dispatch(const topic_router_t *router, const char *topic, const void *payload, int payloadlen)
+{
+	topic_match_t	match;
+
+	memset(&match, 0, sizeof(match));
+	match.topic = topic;
+
+	return match_level(router, 0, topic, &match, payload, payloadlen);
+}
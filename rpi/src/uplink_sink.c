@@ -0,0 +1,420 @@
+/*********************************************************************************
+ *      Copyright:  (C) 2025 LingYun IoT System Studio
+ *                  All rights reserved.
+ *
+ *       Filename:  uplink_sink.c
+ *    Description:  This file implements the uplink sinks.
+ *
+ *                  file 记录格式：一行头部 "<unix 毫秒> <主题> <负载长度>\n"，随后是原始负载
+ *                  和一个换行，二进制编码（cbor / proto）的负载也能按长度读出。
+ *                  unix 数据报格式："<主题>\0<负载>"，接收方不存在或接收缓冲区已满时不阻塞。
+ *                  汇点在 encode 阶段线程中调用，统计和文件轮转由一把锁保护。
+ *                  只有 mqtt 汇点的失败会让采样转入 spool（spool 回放只发往 MQTT），
+ *                  file / unix 汇点的失败只计数，日志每 SINK_WARN_INTERVAL_SEC 秒最多一条。
+ *
+ *        Version:  1.0.0(2025年09月04日)
+ *         Author:  Li Jiahui <2199250859@qq.com>
+ *      ChangeLog:  1, Release initial version on "2025年09月04日 15时36分52秒"
+ *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "uplink_sink.h"
+#include "mqtt_sink.h"
+#include "spool.h"
+#include "log.h"
+
+
+//file / unix 汇点失败日志的最小间隔
+#define SINK_WARN_INTERVAL_SEC	60
+
+static struct {
+	const uplink_sink_t		*sink;
+	uplink_sink_config_t	config;
+	uplink_sink_stats_t		stats;
+	int						fd;             //file / unix
+	size_t					file_bytes;     //file：当前文件长度
+	struct sockaddr_un		addr;           //unix：接收方地址
+	int						last_errno;     //file / unix：最近一次失败的原因
+	time_t					warned_at;
+	pthread_mutex_t			lock;
+} U = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+/* ----- mqtt：经 mqtt_sink 路由到 primary 和附加代理 ----- */
+
+static int mqtt_publish(const char *topic, const void *payload, int payloadlen, int qos, int traffic_class)
+{
+	return mqtt_sink_publish(topic, payload, payloadlen, qos, traffic_class);
+}
+
+//未连接、无 spool、无附加代理时没有任何输出
+static int mqtt_ready(void)
+{
+	return mqtt_connected_flag || spool_is_open() || mqtt_sink_count() > 0;
+}
+
+
+/* ----- null / memory ----- */
+
+static int noop_open(const uplink_sink_config_t *config)
+{
+	return 0;
+}
+
+static int always_ready(void)
+{
+	return 1;
+}
+
+static int null_publish(const char *topic, const void *payload, int payloadlen, int qos, int traffic_class)
+{
+	return UPLINK_OK;
+}
+
+static uint32_t fnv1a(uint32_t h, const void *data, size_t len)
+{
+	const uint8_t	*p = data;
+	size_t			i;
+
+	for(i = 0; i < len; i++)
+	{
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static int memory_open(const uplink_sink_config_t *config)
+{
+	U.stats.checksum = 2166136261u;
+	return 0;
+}
+
+static int memory_publish(const char *topic, const void *payload, int payloadlen, int qos, int traffic_class)
+{
+	pthread_mutex_lock(&U.lock);
+	U.stats.checksum = fnv1a(U.stats.checksum, topic, strlen(topic));
+	U.stats.checksum = fnv1a(U.stats.checksum, payload, payloadlen);
+	pthread_mutex_unlock(&U.lock);
+	return UPLINK_OK;
+}
+
+
+/* ----- file：追加写入，按长度轮转 ----- */
+
+static int file_reopen(void)
+{
+	struct stat	st;
+
+	U.fd = open(U.config.path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if(U.fd < 0)
+	{
+		log_error("Uplink: Failed to open %s: %s\n", U.config.path, strerror(errno));
+		return -1;
+	}
+	U.file_bytes = fstat(U.fd, &st) == 0 ? (size_t)st.st_size : 0;
+	return 0;
+}
+
+//path -> path.1 -> ... -> path.max_files，最旧的被覆盖（调用时持有锁）
+static void file_rotate(void)
+{
+	char	from[PATH_MAX];
+	char	to[PATH_MAX];
+	int		i;
+
+	close(U.fd);
+	U.fd = -1;
+
+	if(U.config.max_files > 0)
+	{
+		for(i = U.config.max_files - 1; i >= 1; i--)
+		{
+			snprintf(from, sizeof(from), "%s.%d", U.config.path, i);
+			snprintf(to, sizeof(to), "%s.%d", U.config.path, i + 1);
+			rename(from, to);
+		}
+		snprintf(to, sizeof(to), "%s.1", U.config.path);
+		rename(U.config.path, to);
+	}
+	else
+	{
+		unlink(U.config.path);
+	}
+
+	U.stats.rotations++;
+	file_reopen();
+}
+
+static int file_open(const uplink_sink_config_t *config)
+{
+	if(!config->path)
+	{
+		log_error("Uplink: file sink needs 'path'.\n");
+		return -1;
+	}
+	return file_reopen();
+}
+
+static int file_publish(const char *topic, const void *payload, int payloadlen, int qos, int traffic_class)
+{
+	struct timespec	ts;
+	struct iovec	iov[3];
+	char			head[320];
+	int				head_len;
+	ssize_t			total;
+	ssize_t			rv;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	head_len = snprintf(head, sizeof(head), "%lld %s %d\n",
+			(long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000, topic, payloadlen);
+	if(head_len >= (int)sizeof(head))
+		return UPLINK_ERR;
+
+	iov[0].iov_base = head;
+	iov[0].iov_len = head_len;
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = payloadlen;
+	iov[2].iov_base = "\n";
+	iov[2].iov_len = 1;
+	total = head_len + payloadlen + 1;
+
+	pthread_mutex_lock(&U.lock);
+	if(U.config.max_bytes > 0 && U.file_bytes > 0 && U.file_bytes + total > (size_t)U.config.max_bytes)
+		file_rotate();
+
+	if(U.fd < 0 && file_reopen() < 0)
+	{
+		pthread_mutex_unlock(&U.lock);
+		return UPLINK_ERR;
+	}
+
+	rv = writev(U.fd, iov, 3);
+	if(rv > 0)
+		U.file_bytes += rv;
+	if(rv != total)
+		U.last_errno = rv < 0 ? errno : EIO;
+	pthread_mutex_unlock(&U.lock);
+
+	return rv == total ? UPLINK_OK : UPLINK_ERR;
+}
+
+static void fd_close(void)
+{
+	if(U.fd >= 0)
+		close(U.fd);
+	U.fd = -1;
+}
+
+
+/* ----- unix：数据报套接字，不阻塞 ----- */
+
+static int unix_open(const uplink_sink_config_t *config)
+{
+	if(!config->path || strlen(config->path) >= sizeof(U.addr.sun_path))
+	{
+		log_error("Uplink: unix sink needs a 'path' shorter than %zu bytes.\n", sizeof(U.addr.sun_path));
+		return -1;
+	}
+
+	U.fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(U.fd < 0)
+	{
+		log_error("Uplink: Failed to create unix socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&U.addr, 0, sizeof(U.addr));
+	U.addr.sun_family = AF_UNIX;
+	strcpy(U.addr.sun_path, config->path);
+	return 0;
+}
+
+static int unix_publish(const char *topic, const void *payload, int payloadlen, int qos, int traffic_class)
+{
+	struct msghdr	msg;
+	struct iovec	iov[2];
+
+	iov[0].iov_base = (void *)topic;
+	iov[0].iov_len = strlen(topic) + 1;
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = payloadlen;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &U.addr;
+	msg.msg_namelen = sizeof(U.addr);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	if(sendmsg(U.fd, &msg, MSG_NOSIGNAL) < 0)
+	{
+		U.last_errno = errno;
+		if(errno == ENOENT || errno == ECONNREFUSED)
+			return UPLINK_NO_READER;
+		return UPLINK_ERR;
+	}
+	return UPLINK_OK;
+}
+
+
+static const uplink_sink_t sinks[] = {
+	{ "mqtt",   noop_open,   mqtt_publish,   mqtt_ready,   NULL     },
+	{ "null",   noop_open,   null_publish,   always_ready, NULL     },
+	{ "memory", memory_open, memory_publish, always_ready, NULL     },
+	{ "file",   file_open,   file_publish,   always_ready, fd_close },
+	{ "unix",   unix_open,   unix_publish,   always_ready, fd_close },
+};
+
+
+int uplink_sink_init(const uplink_sink_config_t *config)
+{
+	const char	*type = config->type ? config->type : "mqtt";
+	size_t		i;
+
+	memset(&U.stats, 0, sizeof(U.stats));
+	U.config = *config;
+	U.sink = NULL;
+	for(i = 0; i < sizeof(sinks) / sizeof(sinks[0]); i++)
+	{
+		if(strcmp(type, sinks[i].name) == 0)
+			U.sink = &sinks[i];
+	}
+
+	if(!U.sink || U.sink->open(config) < 0)
+	{
+		log_error("Uplink: Unable to use sink \"%s\", falling back to mqtt.\n", type);
+		U.sink = &sinks[0];
+		U.config.tee = 0;
+	}
+	if(U.sink == &sinks[0])
+		U.config.tee = 0;
+
+	if(U.sink->close)
+		log_info("Uplink: Publishing through %s sink %s%s.\n", U.sink->name, U.config.path,
+				U.config.tee ? " (tee, mqtt still used)" : "");
+	else
+		log_info("Uplink: Publishing through %s sink.\n", U.sink->name);
+	return 0;
+}
+
+
+void uplink_sink_close(void)
+{
+	pthread_mutex_lock(&U.lock);
+	if(U.sink && U.sink->close)
+		U.sink->close();
+	pthread_mutex_unlock(&U.lock);
+}
+
+
+const char *uplink_sink_name(void)
+{
+	return U.sink ? U.sink->name : "mqtt";
+}
+
+
+//汇点当前能否接收消息，不能时 encode 阶段直接丢弃采样
+int uplink_sink_ready(void)
+{
+	if(!U.sink || U.config.tee)
+		return mqtt_ready();
+	return U.sink->ready();
+}
+
+
+//file / unix 汇点失败：限速记录日志，失败次数在统计中
+static void warn_sink_failure(const char *name, int rc)
+{
+	time_t		now = time(NULL);
+	uint64_t	failed;
+	int			err;
+
+	pthread_mutex_lock(&U.lock);
+	if(U.warned_at && now - U.warned_at < SINK_WARN_INTERVAL_SEC)
+	{
+		pthread_mutex_unlock(&U.lock);
+		return ;
+	}
+	U.warned_at = now;
+	failed = U.stats.failed;
+	err = U.last_errno;
+	pthread_mutex_unlock(&U.lock);
+
+	log_warn("Uplink: %s sink %s: %s, samples dropped (%llu failed so far).\n", name, U.config.path,
+			rc == UPLINK_NO_READER ? "no reader" : strerror(err), (unsigned long long)failed);
+}
+
+
+/* 发布一条编码好的消息，返回 UPLINK_OK 或错误码
+ * mqtt 汇点返回其错误码，调用方把采样写入 spool；file / unix 汇点失败时返回 UPLINK_DROPPED
+ * tee 模式下返回 mqtt 汇点的结果
+ */
+int uplink_publish(const char *topic, const void *payload, int payloadlen, int qos, int traffic_class)
+{
+	const uplink_sink_t	*sink = U.sink ? U.sink : &sinks[0];
+	int					rc_mqtt = UPLINK_OK;
+	int					rc;
+
+	if(U.config.tee)
+		rc_mqtt = mqtt_publish(topic, payload, payloadlen, qos, traffic_class);
+
+	rc = sink->publish(topic, payload, payloadlen, qos, traffic_class);
+
+	pthread_mutex_lock(&U.lock);
+	if(rc == UPLINK_OK)
+	{
+		U.stats.messages++;
+		U.stats.bytes += payloadlen;
+		if(traffic_class >= 0 && traffic_class < MQTT_TRAFFIC_CLASS_COUNT)
+			U.stats.by_class[traffic_class]++;
+	}
+	else
+	{
+		U.stats.failed++;
+		if(rc == UPLINK_NO_READER)
+			U.stats.no_reader++;
+	}
+	pthread_mutex_unlock(&U.lock);
+
+	if(rc != UPLINK_OK && sink != &sinks[0])
+		warn_sink_failure(sink->name, rc);
+
+	if(U.config.tee)
+		return rc_mqtt;
+	return (rc != UPLINK_OK && sink != &sinks[0]) ? UPLINK_DROPPED : rc;
+}
+
+
+void uplink_sink_get_stats(uplink_sink_stats_t *stats)
+{
+	pthread_mutex_lock(&U.lock);
+	*stats = U.stats;
+	pthread_mutex_unlock(&U.lock);
+}
+
+
+void uplink_sink_log_stats(void)
+{
+	uplink_sink_stats_t	st;
+
+	uplink_sink_get_stats(&st);
+	log_info("Uplink: sink=%s messages=%llu bytes=%llu failed=%llu no_reader=%llu telemetry=%llu alert=%llu rotations=%llu checksum=%08x\n",
+			uplink_sink_name(), (unsigned long long)st.messages, (unsigned long long)st.bytes,
+			(unsigned long long)st.failed, (unsigned long long)st.no_reader, (unsigned long long)st.by_class[MQTT_TRAFFIC_TELEMETRY],
+			(unsigned long long)st.by_class[MQTT_TRAFFIC_ALERT], (unsigned long long)st.rotations,
+			st.checksum);
+}